@@ -6,6 +6,9 @@
 #include <motioncam/RawBufferManager.h>
 #include <motioncam/RawContainer.h>
 #include <motioncam/Util.h>
+#include <motioncam/ThreadPool.h>
+#include <motioncam/MemoryArena.h>
+#include <motioncam/Logger.h>
 
 #include "ImageProcessorListener.h"
 #include "DngConverterListener.h"
@@ -17,6 +20,26 @@
 
 static std::string gLastError;
 
+extern "C" JNIEXPORT
+jint JNICALL JNI_OnLoad(JavaVM* vm, void* reserved) {
+    // Write the log from a thread of normal priority
+    motioncam::logger::start();
+
+    // Share one pool between the Halide pipelines and the library's own loops
+    motioncam::ThreadPool::installHalide();
+
+    // Keep the buffers of the pipelines between captures
+    motioncam::MemoryArena::install(motioncam::DEFAULT_ARENA_MAX_CACHED_BYTES);
+
+    return JNI_VERSION_1_6;
+}
+
+extern "C" JNIEXPORT
+void JNICALL JNI_OnUnload(JavaVM* vm, void* reserved) {
+    motioncam::MemoryArena::uninstall();
+    motioncam::ThreadPool::uninstallHalide();
+}
+
 extern "C" JNIEXPORT
 jboolean JNICALL Java_com_motioncam_processor_NativeProcessor_ProcessInMemory(
         JNIEnv *env,
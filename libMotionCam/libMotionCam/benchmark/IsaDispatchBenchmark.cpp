@@ -0,0 +1,223 @@
+//
+// Times the SSE4.1, AVX2 and AVX-512 variants of the host pipelines on a synthetic RAW16 frame. Only the levels the
+// CPU supports are run. The generated pipelines are called directly so the benchmark only links them and the
+// Halide runtime. Usage: isa-dispatch-benchmark [width] [height] [iterations]
+//
+
+#include "motioncam/CpuFeatures.h"
+
+#include "deinterleave_raw.h"
+#include "measure_noise.h"
+#include "fuse_denoise_3x3.h"
+#include "forward_transform_raw.h"
+#include "inverse_transform.h"
+#include "postprocess.h"
+
+#include <HalideBuffer.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace motioncam;
+
+namespace {
+    // Same as the processing library
+    const int EXPANDED_RANGE        = 16384;
+    const int WAVELET_LEVELS        = 4;
+    const int PIXEL_FORMAT_RAW16    = 2;
+    const int SENSOR_RGGB           = 0;
+
+    const float BLACK_LEVEL         = 64.0f;
+    const float WHITE_LEVEL         = 1023.0f;
+    const int NOISE_PATCH_SIZE      = 8;
+
+    struct Pipeline {
+        std::string name;
+        std::function<void()> run;
+    };
+
+    double timeMs(const std::function<void()>& f, int iterations) {
+        // Warm up so the variant selection and first allocations aren't timed
+        f();
+
+        auto start = std::chrono::steady_clock::now();
+
+        for(int i = 0; i < iterations; i++)
+            f();
+
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+    }
+
+    template<typename T>
+    void fillNoise(Halide::Runtime::Buffer<T>& buffer, std::mt19937& rng, float mean, float sigma, float maxValue) {
+        std::normal_distribution<float> dist(mean, sigma);
+
+        buffer.for_each_value([&](T& v) {
+            v = static_cast<T>((std::min)((std::max)(dist(rng), 0.0f), maxValue));
+        });
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    const int width = argc > 1 ? std::stoi(argv[1]) : 4000;
+    const int height = argc > 2 ? std::stoi(argv[2]) : 3000;
+    const int iterations = argc > 3 ? std::stoi(argv[3]) : 10;
+
+    const int halfWidth = width / 2;
+    const int halfHeight = height / 2;
+
+    std::mt19937 rng(0x5eed);
+
+    // Noisy mid grey frame
+    Halide::Runtime::Buffer<uint16_t> rawFrame(width, height);
+    fillNoise(rawFrame, rng, 512.0f, 16.0f, WHITE_LEVEL);
+
+    Halide::Runtime::Buffer<uint8_t> rawBytes(
+        reinterpret_cast<uint8_t*>(rawFrame.data()), static_cast<int>(rawFrame.size_in_bytes()));
+
+    // Deinterleaved channels of the frame and of a second frame to fuse with it
+    Halide::Runtime::Buffer<uint16_t> reference(halfWidth, halfHeight, 4);
+    Halide::Runtime::Buffer<uint16_t> current(halfWidth, halfHeight, 4);
+    Halide::Runtime::Buffer<uint8_t> preview(halfWidth, halfHeight);
+
+    fillNoise(reference, rng, 512.0f, 16.0f, WHITE_LEVEL);
+    fillNoise(current, rng, 512.0f, 16.0f, WHITE_LEVEL);
+
+    Halide::Runtime::Buffer<float> noiseOutput(halfWidth / NOISE_PATCH_SIZE, halfHeight / NOISE_PATCH_SIZE, 4);
+    Halide::Runtime::Buffer<float> signalOutput(halfWidth / NOISE_PATCH_SIZE, halfHeight / NOISE_PATCH_SIZE, 4);
+
+    auto flow = Halide::Runtime::Buffer<float>::make_interleaved(halfWidth, halfHeight, 2);
+    flow.fill(0.0f);
+
+    std::vector<float> threshold = { 4.0f, 4.0f, 4.0f, 4.0f };
+    Halide::Runtime::Buffer<float> thresholdBuffer(threshold.data(), 4);
+
+    Halide::Runtime::Buffer<float> fuseOutput(halfWidth, halfHeight, 4);
+
+    std::vector<Halide::Runtime::Buffer<float>> wavelet;
+
+    for(int level = 0, w = halfWidth, h = halfHeight; level < WAVELET_LEVELS; level++) {
+        w = w / 2;
+        h = h / 2;
+
+        wavelet.emplace_back(w, h, 4, 4);
+    }
+
+    std::vector<float> weights = { 1.0f, 1.0f, 1.0f, 1.0f };
+    Halide::Runtime::Buffer<float> weightsBuffer(weights.data(), WAVELET_LEVELS);
+
+    std::vector<Halide::Runtime::Buffer<uint16_t>> denoised;
+
+    for(int c = 0; c < 4; c++) {
+        denoised.emplace_back(halfWidth, halfHeight);
+        fillNoise(denoised.back(), rng, 4096.0f, 64.0f, EXPANDED_RANGE - 1);
+    }
+
+    // Neutral inputs for the post processing, no HDR and a flat shading map
+    auto blueNoise = Halide::Runtime::Buffer<uint8_t>::make_interleaved(64, 64, 4);
+    fillNoise(blueNoise, rng, 128.0f, 64.0f, 255.0f);
+
+    Halide::Runtime::Buffer<uint16_t> hdrInput(32, 32, 3);
+    Halide::Runtime::Buffer<uint8_t> hdrMask(32, 32);
+
+    hdrInput.fill(0);
+    hdrMask.fill(0);
+
+    Halide::Runtime::Buffer<float> cameraToSrgb(3, 3);
+    cameraToSrgb.for_each_element([&](int x, int y) { cameraToSrgb(x, y) = x == y ? 1.0f : 0.0f; });
+
+    std::vector<Halide::Runtime::Buffer<float>> shadingMap;
+
+    for(int c = 0; c < 4; c++) {
+        shadingMap.emplace_back(17, 13);
+        shadingMap.back().fill(1.0f);
+    }
+
+    auto output = Halide::Runtime::Buffer<uint8_t>::make_interleaved(halfWidth * 2, halfHeight * 2, 3);
+
+    const std::vector<Pipeline> pipelines = {
+        { "deinterleave_raw", [&]() {
+            deinterleave_raw(rawBytes, width * 2, PIXEL_FORMAT_RAW16, SENSOR_RGGB, width, height, 0, 0,
+                             WHITE_LEVEL, BLACK_LEVEL, BLACK_LEVEL, BLACK_LEVEL, BLACK_LEVEL, 1.0f,
+                             reference, preview);
+        }},
+
+        { "measure_noise", [&]() {
+            measure_noise(rawBytes, width, height, width * 2, PIXEL_FORMAT_RAW16, SENSOR_RGGB, NOISE_PATCH_SIZE,
+                          noiseOutput, signalOutput);
+        }},
+
+        { "fuse_denoise_3x3", [&]() {
+            fuseOutput.fill(0.0f);
+
+            fuse_denoise_3x3(reference, current, fuseOutput, flow, thresholdBuffer, halfWidth, halfHeight,
+                             1.0f / (2.0f*std::sqrt(2.0f)), 4.0f, 0.0f, 0.0f, fuseOutput);
+        }},
+
+        { "forward_transform_raw", [&]() {
+            forward_transform_raw(reference, halfWidth, halfHeight, 0,
+                                  BLACK_LEVEL, BLACK_LEVEL, BLACK_LEVEL, BLACK_LEVEL, WHITE_LEVEL, 1.0f, EXPANDED_RANGE,
+                                  wavelet[0], wavelet[1], wavelet[2], wavelet[3]);
+        }},
+
+        { "inverse_transform", [&]() {
+            inverse_transform(wavelet[0], wavelet[1], wavelet[2], wavelet[3], 4.0f, false, weightsBuffer, denoised[0]);
+        }},
+
+        { "postprocess", [&]() {
+            // Default post processing settings
+            postprocess(denoised[0], denoised[1], denoised[2], denoised[3],
+                        blueNoise, hdrInput, hdrMask, false,
+                        1.0f, 1.0f, 1.0f,
+                        cameraToSrgb,
+                        shadingMap[0], shadingMap[1], shadingMap[2], shadingMap[3],
+                        EXPANDED_RANGE, SENSOR_RGGB,
+                        1.0f, 1.0f, 1.0f, 0.25f,
+                        0.0f, 0.0f, 1.0f, 0.5f, 1.0f, 8.0f, 8.0f, 1.05f,
+                        2.0f, 2.0f, 1.25f,
+                        128.0f, 7.0f, 0.01f,
+                        output);
+        }}
+    };
+
+    const auto detected = cpu::detectIsaLevel();
+
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "frame " << width << "x" << height << ", " << iterations << " iterations, detected " << cpu::toString(detected) << std::endl;
+
+    double baselineMs = 0;
+
+    for(auto level : { cpu::IsaLevel::SSE41, cpu::IsaLevel::AVX2, cpu::IsaLevel::AVX512 }) {
+        if(level > detected)
+            break;
+
+        cpu::setMaxIsaLevel(level);
+
+        std::cout << cpu::toString(level);
+
+        double totalMs = 0;
+
+        for(const auto& pipeline : pipelines) {
+            const double ms = timeMs(pipeline.run, iterations);
+
+            std::cout << " " << pipeline.name << "=" << ms << " ms";
+            totalMs += ms;
+        }
+
+        if(baselineMs <= 0)
+            baselineMs = totalMs;
+
+        std::cout << " total=" << totalMs << " ms speedup=" << baselineMs / totalMs << "x" << std::endl;
+    }
+
+    return 0;
+}
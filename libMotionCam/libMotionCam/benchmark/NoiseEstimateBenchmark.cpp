@@ -0,0 +1,70 @@
+//
+// Compares the histogram based estimateNoise() against the exact median implementation on synthetic wavelet
+// subbands with known noise. Usage: noise-estimate-benchmark [width] [height] [iterations]
+//
+
+#include "motioncam/ImageOps.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+using namespace motioncam;
+
+namespace {
+    typedef float (*EstimateFunc)(cv::Mat&, float);
+
+    double timeEstimate(EstimateFunc f, cv::Mat& input, int iterations, float& outSigma) {
+        auto start = std::chrono::steady_clock::now();
+
+        for(int i = 0; i < iterations; i++)
+            outSigma = f(input, 0.5f);
+
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    const int width = argc > 1 ? std::stoi(argv[1]) : 2000;
+    const int height = argc > 2 ? std::stoi(argv[2]) : 1500;
+    const int iterations = argc > 3 ? std::stoi(argv[3]) : 10;
+
+    const float sigmas[] = { 0.5f, 4.0f, 32.0f, 256.0f };
+
+    cv::RNG rng(0x5eed);
+
+    std::cout << std::fixed << std::setprecision(4);
+    std::cout << "subband " << width << "x" << height << ", " << iterations << " iterations" << std::endl;
+
+    for(float sigma : sigmas) {
+        cv::Mat hh(height, width, CV_32F);
+
+        rng.fill(hh, cv::RNG::NORMAL, 0, sigma);
+
+        // Sprinkle in some edge responses so the tails look like a real HH subband
+        for(int i = 0; i < (width * height) / 1000; i++)
+            hh.at<float>(rng.uniform(0, height), rng.uniform(0, width)) = rng.uniform(-100.0f, 100.0f) * sigma;
+
+        float exactSigma = 0, fastSigma = 0;
+
+        double exactMs = timeEstimate(&estimateNoiseExact, hh, iterations, exactSigma);
+        double fastMs = timeEstimate(&estimateNoise, hh, iterations, fastSigma);
+
+        double relError = std::abs(fastSigma - exactSigma) / (std::max)(1e-9f, exactSigma);
+
+        std::cout
+            << "sigma=" << sigma
+            << " exact=" << exactSigma << " (" << exactMs << " ms)"
+            << " histogram=" << fastSigma << " (" << fastMs << " ms)"
+            << " error=" << relError * 100.0 << "%"
+            << " speedup=" << exactMs / fastMs << "x"
+            << std::endl;
+    }
+
+    return 0;
+}
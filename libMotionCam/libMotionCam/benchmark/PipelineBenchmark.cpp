@@ -0,0 +1,769 @@
+//
+// End to end benchmarks of the hot paths on a synthetic burst. Every benchmark is run until it has taken at least
+// --min-time seconds and the results are written as JSON, in the same layout as Google Benchmark, so they can be
+// compared across commits.
+//
+// Usage: pipeline-benchmark [--filter substring] [--min-time seconds] [--width N] [--height N] [--frames N]
+//                           [--dir scratch directory] [--label commit] [--json results.json] [--trace trace.json]
+//
+
+#include "motioncam/CpuFeatures.h"
+#include "motioncam/DngProcessorProgress.h"
+#include "motioncam/ImageProcessor.h"
+#include "motioncam/ImageProcessorProgress.h"
+#include "motioncam/Measure.h"
+#include "motioncam/MemoryArena.h"
+#include "motioncam/MotionCam.h"
+#include "motioncam/RawCameraMetadata.h"
+#include "motioncam/RawContainer.h"
+#include "motioncam/RawEncoder.h"
+#include "motioncam/RawImageBuffer.h"
+#include "motioncam/Settings.h"
+#include "motioncam/SyntheticRaw.h"
+#include "motioncam/ThreadPool.h"
+#include "motioncam/Util.h"
+
+#include "forward_transform_raw.h"
+#include "inverse_transform.h"
+#include "fuse_denoise_3x3.h"
+#include "fuse_denoise_5x5.h"
+#include "fuse_denoise_7x7.h"
+
+#include <json11/json11.hpp>
+#include <opencv2/opencv.hpp>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <limits>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace motioncam;
+
+namespace {
+    typedef std::chrono::steady_clock Clock;
+
+    //
+    // Timing state passed to each benchmark. Setup done inside the benchmark can be excluded with pause()/resume().
+    //
+
+    class State {
+    public:
+        State() : mBytesProcessed(0), mItemsProcessed(0), mPaused(false) {
+        }
+
+        void start() {
+            mPaused = false;
+            mPausedTime = Clock::duration::zero();
+            mStart = Clock::now();
+        }
+
+        double stopMs() {
+            auto elapsed = Clock::now() - mStart - mPausedTime;
+            return std::chrono::duration<double, std::milli>(elapsed).count();
+        }
+
+        void pause() {
+            mPauseStart = Clock::now();
+            mPaused = true;
+        }
+
+        void resume() {
+            if(mPaused)
+                mPausedTime += Clock::now() - mPauseStart;
+            mPaused = false;
+        }
+
+        // Bytes and items handled by a single iteration
+        void setBytesProcessed(int64_t bytes) { mBytesProcessed = bytes; }
+        void setItemsProcessed(int64_t items) { mItemsProcessed = items; }
+
+        int64_t bytesProcessed() const { return mBytesProcessed; }
+        int64_t itemsProcessed() const { return mItemsProcessed; }
+
+    private:
+        Clock::time_point mStart;
+        Clock::time_point mPauseStart;
+        Clock::duration mPausedTime;
+        int64_t mBytesProcessed;
+        int64_t mItemsProcessed;
+        bool mPaused;
+    };
+
+    struct Benchmark {
+        std::string name;
+        std::function<void(State&)> run;
+    };
+
+    struct Result {
+        std::string name;
+        int iterations;
+        double meanMs;
+        double medianMs;
+        double minMs;
+        double stddevMs;
+        int64_t bytesProcessed;
+        int64_t itemsProcessed;
+        std::string error;
+    };
+
+    //
+    // Inputs shared by the benchmarks, created once
+    //
+
+    struct Fixture {
+        SyntheticRawSettings settings;
+        RawCameraMetadata cameraMetadata;
+        PostProcessSettings postProcessSettings;
+
+        std::vector<std::shared_ptr<RawImageBuffer>> frames;
+        std::shared_ptr<RawImageBuffer> raw16Frame;
+
+        std::string dir;
+        std::string containerPath;
+        std::string unindexedContainerPath;
+    };
+
+    class NullProgress : public ImageProcessorProgress {
+    public:
+        std::string onPreviewSaved(const std::string& outputPath) const override { return outputPath; }
+        bool onProgressUpdate(int progress) const override { return true; }
+        void onCompleted() const override {}
+        void onError(const std::string& error) const override { mError = error; }
+
+        mutable std::string mError;
+    };
+
+    class DngProgress : public DngProcessorProgress {
+    public:
+        DngProgress(const std::string& dir) : mDir(dir) {
+        }
+
+        int onNeedFd(int frameNumber) override {
+            const std::string path = mDir + "/frame" + std::to_string(frameNumber) + ".dng";
+            return open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        }
+
+        bool onProgressUpdate(int progress) override { return true; }
+        void onAttemptingRecovery() override {}
+        void onCompleted() override {}
+        void onError(const std::string& error) override { mError = error; }
+
+        std::string mError;
+
+    private:
+        const std::string mDir;
+    };
+
+    size_t frameBytes(const RawImageBuffer& frame) {
+        return static_cast<size_t>(frame.rowStride) * frame.height;
+    }
+
+    void writeContainer(const Fixture& fixture, const std::string& outputPath) {
+        json11::Json::object postProcessSettings;
+        fixture.postProcessSettings.toJson(postProcessSettings);
+
+        json11::Json::object extraData = {
+            { "referenceTimestamp", std::to_string(fixture.frames[fixture.frames.size() / 2]->metadata.timestampNs) },
+            { "isHdr",  false },
+            { "postProcessSettings", postProcessSettings }
+        };
+
+        auto container = RawContainer::Create(fixture.cameraMetadata, 1, extraData);
+
+        container->add(fixture.frames, false);
+        container->commit(outputPath);
+    }
+
+    // Frames written as they arrive, without the index at the end, like a recording that was interrupted
+    void writeUnindexedContainer(const Fixture& fixture, const std::string& outputPath) {
+        int fd = open(outputPath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if(fd < 0)
+            throw std::runtime_error("Failed to create " + outputPath);
+
+        auto container = RawContainer::Create(fd, fixture.cameraMetadata);
+
+        for(const auto& frame : fixture.frames)
+            container->add(*frame, true);
+    }
+
+    cv::Mat calcFlow(const RawData& reference, const RawData& current) {
+        const int patchSize = 16;
+
+        cv::Mat referenceFlowImage(reference.previewBuffer.height(), reference.previewBuffer.width(), CV_8U, const_cast<uint8_t*>(reference.previewBuffer.data()));
+        cv::Mat currentFlowImage(current.previewBuffer.height(), current.previewBuffer.width(), CV_8U, const_cast<uint8_t*>(current.previewBuffer.data()));
+
+        // Same parameters as the burst denoise
+        cv::Ptr<cv::DISOpticalFlow> opticalFlow = cv::DISOpticalFlow::create(cv::DISOpticalFlow::PRESET_ULTRAFAST);
+
+        opticalFlow->setPatchSize(patchSize);
+        opticalFlow->setPatchStride(patchSize/2);
+        opticalFlow->setGradientDescentIterations(16);
+        opticalFlow->setUseMeanNormalization(true);
+        opticalFlow->setUseSpatialPropagation(true);
+
+        cv::Mat flow;
+        opticalFlow->calc(referenceFlowImage, currentFlowImage, flow);
+
+        return flow;
+    }
+
+    typedef int (*FuseDenoiseFunc)(halide_buffer_t*, halide_buffer_t*, halide_buffer_t*, halide_buffer_t*, halide_buffer_t*,
+                                   int32_t, int32_t, float, float, float, float, halide_buffer_t*);
+
+    std::function<void(State&)> fuseDenoise(Fixture& fixture, FuseDenoiseFunc method) {
+        return [&fixture, method](State& state) {
+            state.pause();
+
+            auto reference = ImageProcessor::loadRawImage(*fixture.frames[0], fixture.cameraMetadata);
+            auto current = ImageProcessor::loadRawImage(*fixture.frames[1], fixture.cameraMetadata);
+
+            cv::Mat flow = calcFlow(*reference, *current);
+            auto flowMean = cv::mean(flow);
+
+            Halide::Runtime::Buffer<float> flowBuffer =
+                Halide::Runtime::Buffer<float>::make_interleaved((float*) flow.data, flow.cols, flow.rows, 2);
+
+            std::vector<float> noise = { 4.0f, 4.0f, 4.0f, 4.0f };
+            Halide::Runtime::Buffer<float> thresholdBuffer(noise.data(), 4);
+
+            Halide::Runtime::Buffer<float> fuseOutput(reference->rawBuffer.width(), reference->rawBuffer.height(), 4);
+            fuseOutput.fill(0);
+
+            state.resume();
+
+            method(reference->rawBuffer,
+                   current->rawBuffer,
+                   fuseOutput,
+                   flowBuffer,
+                   thresholdBuffer,
+                   reference->rawBuffer.width(),
+                   reference->rawBuffer.height(),
+                   1.0f / (2.0f*std::sqrt(2.0f)),
+                   4.0f,
+                   static_cast<float>(flowMean[0]),
+                   static_cast<float>(flowMean[1]),
+                   fuseOutput);
+
+            state.setBytesProcessed(frameBytes(*fixture.frames[1]));
+        };
+    }
+
+    std::vector<Benchmark> createBenchmarks(Fixture& fixture) {
+        std::vector<Benchmark> benchmarks;
+
+        benchmarks.push_back({ "encoder/encode", [&fixture](State& state) {
+            const auto& frame = *fixture.frames[0];
+            state.pause();
+
+            std::vector<uint8_t> data(frame.data->hostData());
+
+            state.resume();
+
+            encoder::encode(data.data(), encoder::ANDROID_RAW10, 0, frame.width, 0, frame.height, frame.rowStride);
+
+            state.setBytesProcessed(frameBytes(frame));
+        }});
+
+        benchmarks.push_back({ "encoder/decode", [&fixture](State& state) {
+            const auto& frame = *fixture.frames[0];
+            state.pause();
+
+            std::vector<uint8_t> data(frame.data->hostData());
+            size_t len = encoder::encode(data.data(), encoder::ANDROID_RAW10, 0, frame.width, 0, frame.height, frame.rowStride);
+
+            std::vector<uint16_t> output(static_cast<size_t>(frame.width) * frame.height);
+
+            state.resume();
+
+            encoder::decode(output.data(), frame.width, frame.height, data.data(), len);
+
+            state.setBytesProcessed(output.size() * sizeof(uint16_t));
+        }});
+
+        benchmarks.push_back({ "container/write", [&fixture](State& state) {
+            writeContainer(fixture, fixture.dir + "/write.container");
+
+            state.setItemsProcessed(fixture.frames.size());
+        }});
+
+        benchmarks.push_back({ "container/read", [&fixture](State& state) {
+            auto container = RawContainer::Open(fixture.containerPath);
+
+            for(const auto& name : container->getFrames())
+                container->loadFrame(name);
+
+            state.setItemsProcessed(fixture.frames.size());
+        }});
+
+        benchmarks.push_back({ "container/recover", [&fixture](State& state) {
+            auto container = RawContainer::Open(fixture.unindexedContainerPath);
+
+            container->recover();
+
+            if(container->getFrames().size() != fixture.frames.size())
+                throw std::runtime_error("Recovered " + std::to_string(container->getFrames().size()) + " frames");
+
+            state.setItemsProcessed(fixture.frames.size());
+        }});
+
+        benchmarks.push_back({ "loadRawImage", [&fixture](State& state) {
+            const auto& frame = *fixture.frames[0];
+            ImageProcessor::loadRawImage(frame, fixture.cameraMetadata);
+
+            state.setBytesProcessed(frameBytes(frame));
+        }});
+
+        benchmarks.push_back({ "measureNoise", [&fixture](State& state) {
+            const auto& frame = *fixture.frames[0];
+            std::vector<float> noise, signal;
+
+            ImageProcessor::measureNoise(fixture.cameraMetadata, frame, noise, signal);
+
+            state.setBytesProcessed(frameBytes(frame));
+        }});
+
+        benchmarks.push_back({ "opticalFlow", [&fixture](State& state) {
+            state.pause();
+
+            auto reference = ImageProcessor::loadRawImage(*fixture.frames[0], fixture.cameraMetadata);
+            auto current = ImageProcessor::loadRawImage(*fixture.frames[1], fixture.cameraMetadata);
+
+            state.resume();
+
+            calcFlow(*reference, *current);
+        }});
+
+        benchmarks.push_back({ "fuse_denoise_3x3", fuseDenoise(fixture, &fuse_denoise_3x3) });
+        benchmarks.push_back({ "fuse_denoise_5x5", fuseDenoise(fixture, &fuse_denoise_5x5) });
+        benchmarks.push_back({ "fuse_denoise_7x7", fuseDenoise(fixture, &fuse_denoise_7x7) });
+
+        benchmarks.push_back({ "wavelet/forward", [&fixture](State& state) {
+            const auto& frame = *fixture.frames[0];
+            state.pause();
+
+            auto reference = ImageProcessor::loadRawImage(frame, fixture.cameraMetadata);
+            const auto& blackLevel = fixture.cameraMetadata.getBlackLevel();
+
+            DenoiseContext context;
+            context.prepare(reference->rawBuffer.width(), reference->rawBuffer.height());
+
+            state.resume();
+
+            for(int c = 0; c < 4; c++) {
+                auto& wavelet = context.wavelet(c);
+
+                forward_transform_raw(reference->rawBuffer,
+                                      reference->rawBuffer.width(),
+                                      reference->rawBuffer.height(),
+                                      c,
+                                      blackLevel[0],
+                                      blackLevel[1],
+                                      blackLevel[2],
+                                      blackLevel[3],
+                                      fixture.cameraMetadata.getWhiteLevel(),
+                                      1.0f,
+                                      EXPANDED_RANGE,
+                                      wavelet[0],
+                                      wavelet[1],
+                                      wavelet[2],
+                                      wavelet[3]);
+            }
+
+            state.setBytesProcessed(frameBytes(frame));
+        }});
+
+        benchmarks.push_back({ "wavelet/inverse", [&fixture](State& state) {
+            const auto& frame = *fixture.frames[0];
+            state.pause();
+
+            auto reference = ImageProcessor::loadRawImage(frame, fixture.cameraMetadata);
+            const auto& blackLevel = fixture.cameraMetadata.getBlackLevel();
+
+            const int width = reference->rawBuffer.width();
+            const int height = reference->rawBuffer.height();
+
+            DenoiseContext context;
+            context.prepare(width, height);
+
+            std::vector<float> weights = { 1.0f, 1.0f, 1.0f, 1.0f };
+            Halide::Runtime::Buffer<float> weightsBuffer(weights.data(), WAVELET_LEVELS);
+
+            std::vector<Halide::Runtime::Buffer<uint16_t>> output;
+
+            for(int c = 0; c < 4; c++) {
+                auto& wavelet = context.wavelet(c);
+
+                forward_transform_raw(reference->rawBuffer, width, height, c,
+                                      blackLevel[0], blackLevel[1], blackLevel[2], blackLevel[3],
+                                      fixture.cameraMetadata.getWhiteLevel(), 1.0f, EXPANDED_RANGE,
+                                      wavelet[0], wavelet[1], wavelet[2], wavelet[3]);
+
+                output.emplace_back(width, height);
+            }
+
+            state.resume();
+
+            for(int c = 0; c < 4; c++) {
+                auto& wavelet = context.wavelet(c);
+
+                inverse_transform(wavelet[0], wavelet[1], wavelet[2], wavelet[3], 4.0f, false, weightsBuffer, output[c]);
+            }
+
+            state.setBytesProcessed(frameBytes(frame));
+        }});
+
+        benchmarks.push_back({ "denoise", [&fixture](State& state) {
+            std::vector<std::shared_ptr<RawImageBuffer>> buffers(fixture.frames.begin() + 1, fixture.frames.end());
+            DenoiseContext context;
+
+            ImageProcessor::denoise(fixture.frames[0], buffers, { 1.0f, 1.0f, 1.0f, 1.0f }, fixture.cameraMetadata, context);
+
+            state.setItemsProcessed(fixture.frames.size());
+        }});
+
+        auto postProcess = [&fixture](State& state, size_t tiledMinPixels) {
+            const auto& frame = *fixture.frames[0];
+            state.pause();
+
+            std::vector<std::shared_ptr<RawImageBuffer>> buffers(fixture.frames.begin() + 1, fixture.frames.end());
+            DenoiseContext context;
+
+            auto denoiseOutput =
+                ImageProcessor::denoise(fixture.frames[0], buffers, NO_DENOISE_WEIGHTS, fixture.cameraMetadata, context);
+
+            const int rawWidth  = frame.width / 2;
+            const int rawHeight = frame.height / 2;
+
+            const int T = static_cast<int>(std::pow(2, EXTEND_EDGE_AMOUNT));
+
+            const int offsetX = static_cast<int>(T * std::ceil(rawWidth / (double) T) - rawWidth);
+            const int offsetY = static_cast<int>(T * std::ceil(rawHeight / (double) T) - rawHeight);
+
+            state.resume();
+
+            auto output = ImageProcessor::postProcess(denoiseOutput, nullptr, offsetX, offsetY, 0.01f,
+                                                      frame.metadata, fixture.cameraMetadata, fixture.postProcessSettings,
+                                                      tiledMinPixels);
+
+            state.setBytesProcessed(frameBytes(frame));
+
+            return output;
+        };
+
+        benchmarks.push_back({ "postProcess", [postProcess](State& state) {
+            postProcess(state, std::numeric_limits<size_t>::max());
+        }});
+
+        // The tiled path must give the same image as the whole image pipeline
+        benchmarks.push_back({ "postProcess/tiled", [postProcess](State& state) {
+            auto output = postProcess(state, 0);
+
+            state.pause();
+
+            State referenceState;
+            auto reference = postProcess(referenceState, std::numeric_limits<size_t>::max());
+
+            cv::Mat diff;
+            double maxDiff = 0;
+
+            cv::absdiff(output, reference, diff);
+            cv::minMaxLoc(diff.reshape(1), nullptr, &maxDiff);
+
+            if(maxDiff > 1)
+                throw std::runtime_error("Tiled output differs from the whole image by up to " + std::to_string(maxDiff));
+
+            state.resume();
+        }});
+
+        benchmarks.push_back({ "createPreview", [&fixture](State& state) {
+            ImageProcessor::createPreview(*fixture.frames[0], 4, fixture.cameraMetadata, fixture.postProcessSettings);
+        }});
+
+        benchmarks.push_back({ "createFastPreview", [&fixture](State& state) {
+            ImageProcessor::createFastPreview(*fixture.frames[0], 4, 4, fixture.cameraMetadata);
+        }});
+
+        auto writeDng = [&fixture](State& state, bool enableCompression) {
+            const auto& raw16 = *fixture.raw16Frame;
+
+            cv::Mat rawImage(raw16.height, raw16.width, CV_16U, raw16.data->lock(false));
+
+            util::WriteDng(rawImage,
+                           fixture.cameraMetadata,
+                           raw16.metadata,
+                           raw16.metadata.screenOrientation,
+                           enableCompression,
+                           true,
+                           fixture.dir + "/frame.dng");
+
+            raw16.data->unlock();
+
+            state.setBytesProcessed(rawImage.total() * rawImage.elemSize());
+        };
+
+        benchmarks.push_back({ "WriteDng/uncompressed", [writeDng](State& state) { writeDng(state, false); }});
+        benchmarks.push_back({ "WriteDng/compressed", [writeDng](State& state) { writeDng(state, true); }});
+
+        benchmarks.push_back({ "convertVideoToDNG", [&fixture](State& state) {
+            DngProgress progress(fixture.dir);
+            MotionCam motionCam;
+
+            motionCam.convertVideoToDNG(std::vector<std::string>{ fixture.containerPath },
+                                        progress,
+                                        NO_DENOISE_WEIGHTS,
+                                        4,
+                                        0,
+                                        true,
+                                        true,
+                                        true,
+                                        -1,
+                                        -1,
+                                        false);
+
+            if(!progress.mError.empty())
+                throw std::runtime_error(progress.mError);
+
+            state.setItemsProcessed(fixture.frames.size());
+        }});
+
+        benchmarks.push_back({ "process", [&fixture](State& state) {
+            NullProgress progress;
+
+            ImageProcessor::process(fixture.containerPath, fixture.dir + "/output.jpg", progress);
+
+            if(!progress.mError.empty())
+                throw std::runtime_error(progress.mError);
+        }});
+
+        return benchmarks;
+    }
+
+    Result runBenchmark(const Benchmark& benchmark, double minTimeMs) {
+        const int MIN_ITERATIONS = 3;
+        const int MAX_ITERATIONS = 1000;
+
+        Result result{ benchmark.name, 0, 0, 0, 0, 0, 0, 0, "" };
+        std::vector<double> timings;
+        State state;
+
+        try {
+            // Warm up
+            state.start();
+            benchmark.run(state);
+
+            double totalMs = 0;
+
+            while(timings.size() < MIN_ITERATIONS || (totalMs < minTimeMs && timings.size() < MAX_ITERATIONS)) {
+                state.start();
+                benchmark.run(state);
+
+                timings.push_back(state.stopMs());
+                totalMs += timings.back();
+            }
+        }
+        catch(const std::exception& e) {
+            result.error = e.what();
+            return result;
+        }
+
+        std::sort(timings.begin(), timings.end());
+
+        const double mean = std::accumulate(timings.begin(), timings.end(), 0.0) / timings.size();
+        double variance = 0;
+
+        for(auto t : timings)
+            variance += (t - mean) * (t - mean);
+
+        result.iterations = static_cast<int>(timings.size());
+        result.meanMs = mean;
+        result.medianMs = timings[timings.size() / 2];
+        result.minMs = timings.front();
+        result.stddevMs = timings.size() > 1 ? std::sqrt(variance / (timings.size() - 1)) : 0.0;
+        result.bytesProcessed = state.bytesProcessed();
+        result.itemsProcessed = state.itemsProcessed();
+
+        return result;
+    }
+
+    json11::Json toJson(const Fixture& fixture, const std::string& label, const std::vector<Result>& results) {
+        char date[64];
+        std::time_t now = std::time(nullptr);
+        std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+
+        char hostName[256] = { 0 };
+        gethostname(hostName, sizeof(hostName) - 1);
+
+        json11::Json::object context = {
+            { "date", date },
+            { "host_name", hostName },
+            { "label", label },
+            { "num_cpus", static_cast<int>(std::thread::hardware_concurrency()) },
+            { "isa", cpu::toString(cpu::getIsaLevel()) },
+            { "width", fixture.settings.width },
+            { "height", fixture.settings.height },
+            { "frames", fixture.settings.numFrames },
+            { "pixel_format", util::toString(fixture.settings.pixelFormat) }
+        };
+
+        json11::Json::array benchmarks;
+
+        for(const auto& result : results) {
+            json11::Json::object entry = {
+                { "name", result.name },
+                { "run_type", "iteration" },
+                { "iterations", result.iterations },
+                { "real_time", result.meanMs },
+                { "median_time", result.medianMs },
+                { "min_time", result.minMs },
+                { "stddev_time", result.stddevMs },
+                { "time_unit", "ms" }
+            };
+
+            if(!result.error.empty()) {
+                entry["error_occurred"] = true;
+                entry["error_message"] = result.error;
+            }
+
+            if(result.bytesProcessed > 0 && result.meanMs > 0)
+                entry["bytes_per_second"] = result.bytesProcessed / (result.meanMs / 1000.0);
+
+            if(result.itemsProcessed > 0 && result.meanMs > 0)
+                entry["items_per_second"] = result.itemsProcessed / (result.meanMs / 1000.0);
+
+            benchmarks.push_back(entry);
+        }
+
+        return json11::Json::object {
+            { "context", context },
+            { "benchmarks", benchmarks }
+        };
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    std::string filter;
+    std::string jsonPath;
+    std::string label;
+    std::string tracePath;
+    double minTime = 2.0;
+
+    Fixture fixture;
+
+    fixture.dir = "/tmp/motioncam-benchmark";
+
+    ThreadPool::installHalide();
+
+    // Keep the buffers of the pipelines between runs, like the app does
+    MemoryArena::install(DEFAULT_ARENA_MAX_CACHED_BYTES);
+
+    for(int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+
+        if(i + 1 >= argc) {
+            std::cerr << "Missing value for option " << arg << std::endl;
+            return 1;
+        }
+
+        const std::string value = argv[++i];
+
+        if(arg == "--filter")
+            filter = value;
+        else if(arg == "--min-time")
+            minTime = std::stod(value);
+        else if(arg == "--width")
+            fixture.settings.width = std::stoi(value);
+        else if(arg == "--height")
+            fixture.settings.height = std::stoi(value);
+        else if(arg == "--frames")
+            fixture.settings.numFrames = std::stoi(value);
+        else if(arg == "--dir")
+            fixture.dir = value;
+        else if(arg == "--label")
+            label = value;
+        else if(arg == "--json")
+            jsonPath = value;
+        else if(arg == "--trace")
+            tracePath = value;
+        else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    mkdir(fixture.dir.c_str(), 0755);
+
+    // Inputs
+    SyntheticRaw synthetic(fixture.settings);
+
+    fixture.cameraMetadata = synthetic.cameraMetadata();
+
+    for(int i = 0; i < fixture.settings.numFrames; i++)
+        fixture.frames.push_back(synthetic.createFrame(i));
+
+    SyntheticRawSettings raw16Settings = fixture.settings;
+    raw16Settings.pixelFormat = PixelFormat::RAW16;
+
+    fixture.raw16Frame = SyntheticRaw(raw16Settings).createFrame(0);
+
+    ImageProcessor::estimateSettings(*fixture.frames[0], fixture.cameraMetadata, fixture.postProcessSettings);
+
+    fixture.containerPath = fixture.dir + "/burst.container";
+    fixture.unindexedContainerPath = fixture.dir + "/unindexed.container";
+
+    writeContainer(fixture, fixture.containerPath);
+    writeUnindexedContainer(fixture, fixture.unindexedContainerPath);
+
+    // Run
+    std::vector<Result> results;
+
+    trace::setEnabled(!tracePath.empty());
+
+    std::cout << std::fixed << std::setprecision(3);
+
+    for(const auto& benchmark : createBenchmarks(fixture)) {
+        if(!filter.empty() && benchmark.name.find(filter) == std::string::npos)
+            continue;
+
+        auto result = runBenchmark(benchmark, minTime * 1000.0);
+
+        std::cout << std::left << std::setw(28) << result.name << std::right;
+
+        if(!result.error.empty())
+            std::cout << "  failed: " << result.error << std::endl;
+        else
+            std::cout
+                << std::setw(12) << result.meanMs << " ms"
+                << std::setw(12) << result.medianMs << " ms (median)"
+                << std::setw(8) << result.iterations << " iterations" << std::endl;
+
+        results.push_back(result);
+    }
+
+    if(!tracePath.empty())
+        trace::write(tracePath);
+
+    const std::string json = toJson(fixture, label, results).dump();
+
+    if(jsonPath.empty()) {
+        std::cout << json << std::endl;
+    }
+    else {
+        std::ofstream out(jsonPath);
+        out << json << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,172 @@
+//
+// Compares the hand schedules of the guided filter and tonemap generators against the Adams2019 and Mullapudi2016
+// autoschedulers at several resolutions and thread counts. The pipelines are built with
+// MOTIONCAM_SCHEDULE_BENCHMARK=1 ./generate.sh. Usage: schedule-comparison-benchmark [iterations]
+//
+
+#include <HalideBuffer.h>
+#include <HalideRuntime.h>
+
+#include "guided_filter_hand.h"
+#include "guided_filter_adams2019.h"
+#include "guided_filter_mullapudi2016.h"
+#include "tonemap_hand.h"
+#include "tonemap_adams2019.h"
+#include "tonemap_mullapudi2016.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+    typedef int (*GuidedFilterFunc)(halide_buffer_t*, halide_buffer_t*, uint16_t, uint16_t, uint16_t, halide_buffer_t*);
+    typedef int (*TonemapFunc)(halide_buffer_t*, halide_buffer_t*, int32_t, int32_t, float, float, halide_buffer_t*);
+
+    struct Schedule {
+        const char* name;
+        GuidedFilterFunc guidedFilter;
+        TonemapFunc tonemap;
+    };
+
+    const Schedule SCHEDULES[] = {
+        { "hand",           &guided_filter_hand,            &tonemap_hand },
+        { "Adams2019",      &guided_filter_adams2019,       &tonemap_adams2019 },
+        { "Mullapudi2016",  &guided_filter_mullapudi2016,   &tonemap_mullapudi2016 }
+    };
+
+    const int NUM_SCHEDULES = sizeof(SCHEDULES) / sizeof(SCHEDULES[0]);
+
+    // Returns the average time of a run or a negative value if the pipeline failed
+    double timeMs(const std::function<int()>& f, int iterations) {
+        // Warm up so thread pool startup and first allocations aren't timed
+        if(f() != 0)
+            return -1;
+
+        auto start = std::chrono::steady_clock::now();
+
+        for(int i = 0; i < iterations; i++) {
+            if(f() != 0)
+                return -1;
+        }
+
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+    }
+
+    // The pipelines read outside of the output region, so the size of the inputs comes from a bounds query
+    template<typename T>
+    void allocateNoise(Halide::Runtime::Buffer<T>& buffer, float mean, float sigma) {
+        std::mt19937 rng(0x5eed);
+        std::normal_distribution<float> noise(mean, sigma);
+
+        buffer.allocate();
+        buffer.for_each_value([&](T& v) {
+            v = static_cast<T>(std::max(0.0f, std::min(65535.0f, noise(rng))));
+        });
+    }
+
+    double runGuidedFilter(GuidedFilterFunc f, int width, int height, int iterations) {
+        Halide::Runtime::Buffer<uint16_t> input(static_cast<uint16_t*>(nullptr), 0, 0, 0);
+        Halide::Runtime::Buffer<float> eps(static_cast<float*>(nullptr), 0, 0);
+        Halide::Runtime::Buffer<uint16_t> output(width, height);
+
+        if(f(input, eps, width, height, 1, output) != 0)
+            return -1;
+
+        allocateNoise(input, 16384, 2048);
+
+        eps.allocate();
+        eps.fill(0.01f * 65535.0f * 65535.0f);
+
+        return timeMs([&]() { return f(input, eps, width, height, 1, output); }, iterations);
+    }
+
+    double runTonemap(TonemapFunc f, int width, int height, int iterations) {
+        Halide::Runtime::Buffer<uint16_t> input0(static_cast<uint16_t*>(nullptr), 0, 0, 0);
+        Halide::Runtime::Buffer<uint16_t> input1(static_cast<uint16_t*>(nullptr), 0, 0, 0);
+        Halide::Runtime::Buffer<uint16_t> output(width, height, 3);
+
+        if(f(input0, input1, width, height, 0.25f, 4.0f, output) != 0)
+            return -1;
+
+        allocateNoise(input0, 8192, 1024);
+        allocateNoise(input1, 32768, 4096);
+
+        return timeMs([&]() { return f(input0, input1, width, height, 0.25f, 4.0f, output); }, iterations);
+    }
+
+    void printRow(const std::string& pipeline, int width, int height, int threads, const std::vector<double>& timings) {
+        std::cout
+            << std::left << std::setw(16) << pipeline
+            << std::setw(12) << (std::to_string(width) + "x" + std::to_string(height))
+            << std::right << std::setw(8) << threads;
+
+        int best = -1;
+
+        for(int i = 0; i < NUM_SCHEDULES; i++) {
+            if(timings[i] < 0) {
+                std::cout << std::setw(16) << "failed";
+                continue;
+            }
+
+            std::cout << std::setw(16) << timings[i];
+
+            if(best < 0 || timings[i] < timings[best])
+                best = i;
+        }
+
+        std::cout << "  " << (best < 0 ? "-" : SCHEDULES[best].name) << std::endl;
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    const int iterations = argc > 1 ? std::stoi(argv[1]) : 5;
+
+    const std::vector<std::pair<int, int>> resolutions = { { 1024, 768 }, { 2048, 1536 }, { 4096, 3072 } };
+
+    std::vector<int> threadCounts = { 1, 4 };
+    const int hardwareThreads = static_cast<int>(std::thread::hardware_concurrency());
+
+    if(hardwareThreads > 4)
+        threadCounts.push_back(hardwareThreads);
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout
+        << std::left << std::setw(16) << "pipeline"
+        << std::setw(12) << "size"
+        << std::right << std::setw(8) << "threads";
+
+    for(const auto& schedule : SCHEDULES)
+        std::cout << std::setw(16) << (std::string(schedule.name) + " ms");
+
+    std::cout << "  fastest" << std::endl;
+
+    for(const auto& resolution : resolutions) {
+        for(int threads : threadCounts) {
+            halide_set_num_threads(threads);
+
+            std::vector<double> timings;
+
+            for(const auto& schedule : SCHEDULES)
+                timings.push_back(runGuidedFilter(schedule.guidedFilter, resolution.first, resolution.second, iterations));
+
+            printRow("guided_filter", resolution.first, resolution.second, threads, timings);
+
+            timings.clear();
+
+            for(const auto& schedule : SCHEDULES)
+                timings.push_back(runTonemap(schedule.tonemap, resolution.first, resolution.second, iterations));
+
+            printRow("tonemap", resolution.first, resolution.second, threads, timings);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,372 @@
+//
+// Replays RAW frames through RawBufferManager and RawBufferStreamer at a fixed frame rate, like the camera does while
+// recording, and reports the sustained frame rate, queue depths, dropped frames and write latency. Used to size the
+// buffer pool and thread counts for a resolution before trying them on a device.
+//
+// A frame is dropped when no unused buffer is available when it arrives, which is what the camera does.
+//
+// Usage: streamer-replay [options]
+//
+
+#include "motioncam/AudioInterface.h"
+#include "motioncam/NativeBuffer.h"
+#include "motioncam/RawBufferManager.h"
+#include "motioncam/RawCameraMetadata.h"
+#include "motioncam/RawContainer.h"
+#include "motioncam/RawImageBuffer.h"
+#include "motioncam/SyntheticRaw.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace motioncam;
+
+namespace {
+    typedef std::chrono::steady_clock Clock;
+
+    //
+    // Generates a tone for as long as it has been running, in place of the microphone
+    //
+
+    class FakeAudioInterface : public AudioInterface {
+    public:
+        FakeAudioInterface() : mSampleRateHz(0), mChannels(0), mNumFrames(0) {
+        }
+
+        bool start(const int sampleRateHz, const int channels) override {
+            mSampleRateHz = sampleRateHz;
+            mChannels = channels;
+            mStartTime = Clock::now();
+
+            return true;
+        }
+
+        void stop() override {
+            const double durationSecs = std::chrono::duration<double>(Clock::now() - mStartTime).count();
+            const float PI = 3.14159265358979f;
+
+            mNumFrames = static_cast<uint32_t>(durationSecs * mSampleRateHz);
+            mAudioData.resize(static_cast<size_t>(mNumFrames) * mChannels);
+
+            for(uint32_t i = 0; i < mNumFrames; i++) {
+                auto v = static_cast<int16_t>(8192 * std::sin(2.0f * PI * 440.0f * i / mSampleRateHz));
+
+                for(int c = 0; c < mChannels; c++)
+                    mAudioData[i*mChannels + c] = v;
+            }
+        }
+
+        const std::vector<int16_t>& getAudioData(uint32_t& outNumFrames) const override {
+            outNumFrames = mNumFrames;
+            return mAudioData;
+        }
+
+        int getSampleRate() const override { return mSampleRateHz; }
+        int getChannels() const override { return mChannels; }
+
+    private:
+        int mSampleRateHz;
+        int mChannels;
+        uint32_t mNumFrames;
+        Clock::time_point mStartTime;
+        std::vector<int16_t> mAudioData;
+    };
+
+    struct ReplaySettings {
+        ReplaySettings() :
+            fps(30),
+            durationSecs(10),
+            numBuffers(16),
+            numThreads(2),
+            numOutputs(1),
+            horizontalCrop(0),
+            verticalCrop(0),
+            bin(false),
+            audio(true),
+            outputDir("/tmp")
+        {
+            synthetic.numFrames = 4;
+        }
+
+        SyntheticRawSettings synthetic;
+        std::string inputPath;
+
+        float fps;
+        float durationSecs;
+        int numBuffers;
+        int numThreads;
+        int numOutputs;
+        int horizontalCrop;
+        int verticalCrop;
+        bool bin;
+        bool audio;
+        std::string outputDir;
+    };
+
+    void usage() {
+        std::cerr
+            << "Usage: streamer-replay [options]" << std::endl
+            << "  --input PATH           replay the frames of a container instead of synthetic frames" << std::endl
+            << "  --width N              synthetic frame width (4000)" << std::endl
+            << "  --height N             synthetic frame height (3000)" << std::endl
+            << "  --format raw10|raw12|raw16" << std::endl
+            << "  --fps N                frame rate (30)" << std::endl
+            << "  --duration SECS        length of the recording (10)" << std::endl
+            << "  --buffers N            size of the buffer pool (16)" << std::endl
+            << "  --threads N            compression threads (2)" << std::endl
+            << "  --outputs N            number of output files (1)" << std::endl
+            << "  --crop H,V             crop in percent (0,0)" << std::endl
+            << "  --bin 0|1              bin the frames (0)" << std::endl
+            << "  --audio 0|1            record audio (1)" << std::endl
+            << "  --dir PATH             output directory, e.g. a tmpfs (/tmp)" << std::endl;
+    }
+
+    std::vector<int> parseList(const std::string& value) {
+        std::vector<int> result;
+        std::stringstream ss(value);
+        std::string item;
+
+        while(std::getline(ss, item, ','))
+            result.push_back(std::stoi(item));
+
+        return result;
+    }
+
+    void loadFrames(const ReplaySettings& settings,
+                    RawCameraMetadata& outCameraMetadata,
+                    std::vector<std::shared_ptr<RawImageBuffer>>& outFrames)
+    {
+        if(settings.inputPath.empty()) {
+            SyntheticRaw synthetic(settings.synthetic);
+
+            outCameraMetadata = synthetic.cameraMetadata();
+
+            for(int i = 0; i < settings.synthetic.numFrames; i++)
+                outFrames.push_back(synthetic.createFrame(i));
+
+            return;
+        }
+
+        auto container = RawContainer::Open(settings.inputPath);
+
+        outCameraMetadata = container->getCameraMetadata();
+
+        for(const auto& frame : container->getFrames())
+            outFrames.push_back(container->loadFrame(frame));
+
+        if(outFrames.empty())
+            throw std::runtime_error("No frames in " + settings.inputPath);
+    }
+
+    int openOutput(const std::string& path) {
+        int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if(fd < 0)
+            throw std::runtime_error("Failed to create " + path);
+
+        return fd;
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    ReplaySettings settings;
+
+    try {
+        for(int i = 1; i < argc; i++) {
+            const std::string arg = argv[i];
+
+            if(i + 1 >= argc) {
+                usage();
+                return 1;
+            }
+
+            const std::string value = argv[++i];
+
+            if(arg == "--input")
+                settings.inputPath = value;
+            else if(arg == "--width")
+                settings.synthetic.width = std::stoi(value);
+            else if(arg == "--height")
+                settings.synthetic.height = std::stoi(value);
+            else if(arg == "--format")
+                settings.synthetic.pixelFormat = SyntheticRaw::parsePixelFormat(value);
+            else if(arg == "--fps")
+                settings.fps = std::stof(value);
+            else if(arg == "--duration")
+                settings.durationSecs = std::stof(value);
+            else if(arg == "--buffers")
+                settings.numBuffers = std::stoi(value);
+            else if(arg == "--threads")
+                settings.numThreads = std::stoi(value);
+            else if(arg == "--outputs")
+                settings.numOutputs = std::stoi(value);
+            else if(arg == "--crop") {
+                auto crop = parseList(value);
+
+                settings.horizontalCrop = crop.size() > 0 ? crop[0] : 0;
+                settings.verticalCrop = crop.size() > 1 ? crop[1] : 0;
+            }
+            else if(arg == "--bin")
+                settings.bin = std::stoi(value) != 0;
+            else if(arg == "--audio")
+                settings.audio = std::stoi(value) != 0;
+            else if(arg == "--dir")
+                settings.outputDir = value;
+            else {
+                usage();
+                return 1;
+            }
+        }
+    }
+    catch(const std::exception& e) {
+        std::cerr << "Invalid option: " << e.what() << std::endl;
+        usage();
+        return 1;
+    }
+
+    RawCameraMetadata cameraMetadata;
+    std::vector<std::shared_ptr<RawImageBuffer>> frames;
+
+    try {
+        loadFrames(settings, cameraMetadata, frames);
+    }
+    catch(const std::exception& e) {
+        std::cerr << "Failed to load frames: " << e.what() << std::endl;
+        return 1;
+    }
+
+    auto& manager = RawBufferManager::get();
+
+    // Buffer pool, large enough for any of the frames
+    size_t bufferSize = 0;
+
+    for(const auto& frame : frames)
+        bufferSize = std::max(bufferSize, frame->data->len());
+
+    for(int i = 0; i < settings.numBuffers; i++) {
+        auto buffer = std::make_shared<RawImageBuffer>(std::unique_ptr<NativeBuffer>(new NativeHostBuffer(bufferSize)));
+        manager.addBuffer(buffer);
+    }
+
+    // Outputs
+    std::vector<int> fds;
+    int audioFd = -1;
+
+    try {
+        for(int i = 0; i < settings.numOutputs; i++)
+            fds.push_back(openOutput(settings.outputDir + "/replay" + std::to_string(i) + ".container"));
+
+        if(settings.audio)
+            audioFd = openOutput(settings.outputDir + "/replay.wav");
+    }
+    catch(const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    auto audioInterface = settings.audio ? std::make_shared<FakeAudioInterface>() : nullptr;
+
+    manager.setCropAmount(settings.horizontalCrop, settings.verticalCrop);
+    manager.setVideoBin(settings.bin);
+    manager.enableStreaming(fds, audioFd, audioInterface, settings.numThreads, cameraMetadata);
+
+    std::cout
+        << "Replaying " << frames.size() << " frames of " << frames[0]->width << "x" << frames[0]->height
+        << " at " << settings.fps << " fps with " << settings.numBuffers << " buffers, "
+        << settings.numThreads << " threads and " << settings.numOutputs << " outputs" << std::endl;
+
+    std::cout << std::fixed << std::setprecision(1);
+
+    //
+    // Deliver frames at the requested rate
+    //
+
+    const auto frameInterval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / settings.fps));
+    const int totalFrames = static_cast<int>(std::lround(settings.durationSecs * settings.fps));
+
+    const auto startTime = Clock::now();
+    auto nextReport = startTime + std::chrono::seconds(1);
+
+    size_t maxUnprocessedQueueDepth = 0;
+    size_t maxReadyQueueDepth = 0;
+    float maxBufferSpaceUse = 0;
+
+    for(int i = 0; i < totalFrames; i++) {
+        std::this_thread::sleep_until(startTime + i*frameInterval);
+
+        auto buffer = manager.dequeueUnusedBuffer();
+
+        if(buffer) {
+            const auto& frame = *frames[i % frames.size()];
+            const auto& data = frame.data->hostData();
+
+            // The camera writes the new frame into the buffer
+            std::memcpy(buffer->data->lock(true), data.data(), data.size());
+            buffer->data->unlock();
+            buffer->data->setValidRange(0, 0);
+
+            buffer->shallowCopy(frame);
+            buffer->metadata.timestampNs = std::chrono::duration_cast<std::chrono::nanoseconds>(i*frameInterval).count();
+
+            manager.enqueueReadyBuffer(buffer);
+        }
+
+        auto stats = manager.streamingStats();
+
+        maxUnprocessedQueueDepth = std::max(maxUnprocessedQueueDepth, stats.unprocessedQueueDepth);
+        maxReadyQueueDepth = std::max(maxReadyQueueDepth, stats.readyQueueDepth);
+        maxBufferSpaceUse = std::max(maxBufferSpaceUse, manager.bufferSpaceUse());
+
+        if(Clock::now() >= nextReport) {
+            std::cout
+                << "fps " << stats.fps
+                << "  written " << stats.writtenFrames
+                << "  dropped " << stats.droppedFrames
+                << "  queued " << stats.unprocessedQueueDepth << "/" << stats.readyQueueDepth
+                << "  buffers in use " << 100.0f * manager.bufferSpaceUse() << "%"
+                << "  write " << stats.averageWriteTimeMs << " ms (max " << stats.maxWriteTimeMs << " ms)"
+                << std::endl;
+
+            nextReport += std::chrono::seconds(1);
+        }
+    }
+
+    const double captureSecs = std::chrono::duration<double>(Clock::now() - startTime).count();
+
+    // Waits for the queued frames to be written
+    manager.endStreaming();
+
+    const double totalSecs = std::chrono::duration<double>(Clock::now() - startTime).count();
+
+    // Stats of the whole recording, including the frames flushed at the end
+    const auto stats = manager.streamingStats();
+    const int droppedFrames = stats.droppedFrames;
+
+    std::cout
+        << std::endl
+        << "Requested fps:          " << settings.fps << std::endl
+        << "Delivered fps:          " << (totalFrames - droppedFrames) / captureSecs << std::endl
+        << "Sustained write fps:    " << stats.writtenFrames / totalSecs << std::endl
+        << "Dropped frames:         " << droppedFrames << " of " << totalFrames
+        << " (" << 100.0 * droppedFrames / std::max(totalFrames, 1) << "%)" << std::endl
+        << "Max queue depth:        " << maxUnprocessedQueueDepth << " unprocessed, " << maxReadyQueueDepth << " ready" << std::endl
+        << "Max buffers in use:     " << 100.0f * maxBufferSpaceUse << "%" << std::endl
+        << "Write latency:          " << stats.averageWriteTimeMs << " ms avg, " << stats.maxWriteTimeMs << " ms max" << std::endl
+        << "Write throughput:       " << stats.writtenBytes / (1024.0 * 1024.0) / totalSecs << " MB/s" << std::endl
+        << "Time to flush:          " << totalSecs - captureSecs << " s" << std::endl;
+
+    manager.reset();
+
+    return 0;
+}
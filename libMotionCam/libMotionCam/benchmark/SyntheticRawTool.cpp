@@ -0,0 +1,136 @@
+//
+// Writes a container of synthetic RAW frames for benchmarking the pipelines without device captures.
+// Usage: synthetic-raw [options] output.container
+//
+
+#include "motioncam/SyntheticRaw.h"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace motioncam;
+
+namespace {
+    void usage() {
+        std::cerr
+            << "Usage: synthetic-raw [options] output.container" << std::endl
+            << "  --width N              frame width (4000)" << std::endl
+            << "  --height N             frame height (3000)" << std::endl
+            << "  --frames N             number of frames (8)" << std::endl
+            << "  --cfa rggb|grbg|gbrg|bggr" << std::endl
+            << "  --format raw10|raw12|raw16" << std::endl
+            << "  --black L[,L,L,L]      black level (64)" << std::endl
+            << "  --white L              white level (1023)" << std::endl
+            << "  --noise S,O[,S,O...]   noise profile (0.0004,0.000004)" << std::endl
+            << "  --motion DX,DY[,DEG]   motion between frames (3,2,0.05)" << std::endl
+            << "  --vignetting G         lens shading gain in the corners (2)" << std::endl
+            << "  --iso N                ISO written to the frames (400)" << std::endl
+            << "  --exposure NS          exposure time written to the frames (10000000)" << std::endl
+            << "  --seed N               noise seed" << std::endl;
+    }
+
+    std::vector<double> parseList(const std::string& value) {
+        std::vector<double> result;
+        std::stringstream ss(value);
+        std::string item;
+
+        while(std::getline(ss, item, ','))
+            result.push_back(std::stod(item));
+
+        return result;
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    SyntheticRawSettings settings;
+    std::string outputPath;
+
+    try {
+        for(int i = 1; i < argc; i++) {
+            const std::string arg = argv[i];
+
+            if(arg.compare(0, 2, "--") != 0) {
+                outputPath = arg;
+                continue;
+            }
+
+            if(i + 1 >= argc) {
+                usage();
+                return 1;
+            }
+
+            const std::string value = argv[++i];
+
+            if(arg == "--width") {
+                settings.width = std::stoi(value);
+            }
+            else if(arg == "--height") {
+                settings.height = std::stoi(value);
+            }
+            else if(arg == "--frames") {
+                settings.numFrames = std::stoi(value);
+            }
+            else if(arg == "--cfa") {
+                settings.sensorArrangment = SyntheticRaw::parseSensorArrangment(value);
+            }
+            else if(arg == "--format") {
+                settings.pixelFormat = SyntheticRaw::parsePixelFormat(value);
+            }
+            else if(arg == "--black") {
+                auto levels = parseList(value);
+                settings.blackLevel.assign(4, levels.empty() ? 0.0f : static_cast<float>(levels[0]));
+
+                if(levels.size() == 4)
+                    settings.blackLevel.assign(levels.begin(), levels.end());
+            }
+            else if(arg == "--white") {
+                settings.whiteLevel = std::stof(value);
+            }
+            else if(arg == "--noise") {
+                settings.noiseProfile = parseList(value);
+            }
+            else if(arg == "--motion") {
+                auto motion = parseList(value);
+
+                settings.motionX = motion.size() > 0 ? static_cast<float>(motion[0]) : 0.0f;
+                settings.motionY = motion.size() > 1 ? static_cast<float>(motion[1]) : 0.0f;
+                settings.rotation = motion.size() > 2 ? static_cast<float>(motion[2]) : 0.0f;
+            }
+            else if(arg == "--vignetting") {
+                settings.vignetting = std::stof(value);
+            }
+            else if(arg == "--iso") {
+                settings.iso = std::stoi(value);
+            }
+            else if(arg == "--exposure") {
+                settings.exposureTime = std::stoll(value);
+            }
+            else if(arg == "--seed") {
+                settings.seed = static_cast<uint32_t>(std::stoul(value));
+            }
+            else {
+                usage();
+                return 1;
+            }
+        }
+
+        if(outputPath.empty()) {
+            usage();
+            return 1;
+        }
+
+        SyntheticRaw(settings).writeContainer(outputPath);
+    }
+    catch(const std::exception& e) {
+        std::cerr << "Failed to write " << outputPath << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::cout
+        << "Wrote " << settings.numFrames << " frames of " << settings.width << "x" << settings.height
+        << " to " << outputPath << std::endl;
+
+    return 0;
+}
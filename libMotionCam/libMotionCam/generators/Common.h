@@ -21,4 +21,7 @@ const float YUV_B = 0.114f;
 
 const int TONEMAP_LEVELS = 11;
 
+// Level of the tonemap pyramid stored between the passes of the tiled post process
+const int TONEMAP_COARSE_LEVEL = 4;
+
 #endif // _COMMON_H_
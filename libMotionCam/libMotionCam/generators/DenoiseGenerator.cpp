@@ -559,6 +559,70 @@ void ForwardTransformGenerator::schedule_for_cpu() {
 
 //
 
+class NormalizedForwardTransformGenerator : public Generator<NormalizedForwardTransformGenerator> {
+public:
+    GeneratorParam<int> levels{"levels", 6};
+
+    Input<Func> input{"input", 3};
+
+    Input<int32_t> width{"width"};
+    Input<int32_t> height{"height"};
+    Input<int32_t> channel{"channel"};
+
+    Input<float[4]> blackLevel{"blackLevel"};
+    Input<float> whiteLevel{"whiteLevel"};
+    Input<float> scale{"scale"};
+    Input<float> range{"range"};
+
+    Output<Func[]> output{"output", 4};
+
+    void generate();
+
+    Var v_x{"x"};
+    Var v_y{"y"};
+    Var v_c{"c"};
+
+    Func normalized{"normalized"};
+    std::unique_ptr<ForwardTransformGenerator> forwardTransform;
+};
+
+void NormalizedForwardTransformGenerator::generate() {
+    Func bl{"bl"};
+
+    bl(v_c) = mux(v_c, { blackLevel[0], blackLevel[1], blackLevel[2], blackLevel[3] });
+
+    // Scale the input (a single RAW image or the sum of fused images) to the expanded range. This is
+    // inlined into the first level of the transform so the normalised image is never stored.
+    Expr p = cast<float>(input(v_x, v_y, v_c)) * scale - bl(v_c);
+    Expr s = range / (whiteLevel - bl(v_c));
+
+    normalized(v_x, v_y, v_c) = cast<uint16_t>(clamp(p * s + 0.5f, 0.0f, range));
+
+    forwardTransform = create<ForwardTransformGenerator>();
+
+    forwardTransform->levels.set(levels);
+    forwardTransform->apply(normalized, width, height, channel);
+
+    output.resize(levels);
+
+    for(int level = 0; level < levels; level++) {
+        output[level] = forwardTransform->output[level];
+    }
+
+    width.set_estimate(2000);
+    height.set_estimate(1500);
+    channel.set_estimate(0);
+    blackLevel.set_estimate(0, 64);
+    blackLevel.set_estimate(1, 64);
+    blackLevel.set_estimate(2, 64);
+    blackLevel.set_estimate(3, 64);
+    whiteLevel.set_estimate(1023);
+    scale.set_estimate(1.0f);
+    range.set_estimate(16384);
+}
+
+//
+
 class InverseTransformGenerator : public Generator<InverseTransformGenerator> {
 public:
     Input<Buffer<float>[]> input{"input", 4};
@@ -1113,5 +1177,6 @@ void FuseImageGenerator::schedule_for_cpu() {
 
 HALIDE_REGISTER_GENERATOR(DenoiseGenerator, denoise_generator)
 HALIDE_REGISTER_GENERATOR(ForwardTransformGenerator, forward_transform_generator)
+HALIDE_REGISTER_GENERATOR(NormalizedForwardTransformGenerator, normalized_forward_transform_generator)
 HALIDE_REGISTER_GENERATOR(FuseImageGenerator, fuse_image_generator)
 HALIDE_REGISTER_GENERATOR(InverseTransformGenerator, inverse_transform_generator)
@@ -20,6 +20,13 @@ protected:
     void deinterleave(Func& result, Func in, Expr stride, Expr rawFormat, Expr width, Expr height);
     void toRGGB(Func& result, Func in, Expr sensorArrangement);
     void toSensorPattern(Func& result, Func in, Expr sensorArrangement);
+
+    // Compile a separate version of a Func for each RAW format and/or sensor arrangement. The inputs become
+    // constants in each version, which removes the selects in deinterleave() and toRGGB() from the inner loops.
+    // Call after the Func has been scheduled, the versions copy its schedule.
+    void specializeRawFormat(Func f, Expr rawFormat);
+    void specializeSensorArrangement(Func f, Expr sensorArrangement);
+    void specializeRaw(Func f, Expr rawFormat, Expr sensorArrangement);
     void transform(Func& output, Func input, Func matrixSrgb);
 
     void blur(Func& output, Func& outputTmp, Func input);
@@ -44,6 +51,43 @@ protected:
 
     void warp(Func& output, const Func& in, const Func& m, const Expr width, const Expr height);
 
+    // Exposure fusion of the tonemap. A pyramid can start from any level of the image, so the fine levels can be
+    // computed in strips and only the coarse levels need the whole image.
+    void pyramidUp(Func& output, Type outputType, Func& intermediate, Func input);
+    void pyramidDown(Func& output, Type outputType, Func& intermediate, Func input);
+
+    vector<pair<Func, Func>> buildPyramid(Func input, Type outputType, Expr width, Expr height, int firstLevel, int levels);
+
+    void tonemapLuts(Func& gammaLut, Func& inverseGammaLut, Type outputType, bool schedule);
+    void tonemapWeights(Func& exposures, Func& weightsNormalized, Func input0, Func input1, Func gammaLut,
+                        Type outputType, Expr variance, Expr gain, bool schedule);
+    void scheduleTonemapPyramids(vector<pair<Func, Func>>& tonemapPyramid,
+                                 vector<pair<Func, Func>>& weightsPyramid,
+                                 int firstLevel,
+                                 int levels);
+
+    vector<Func> fusePyramids(const vector<pair<Func, Func>>& tonemapPyramid,
+                              const vector<pair<Func, Func>>& weightsPyramid,
+                              int firstLevel,
+                              bool includeTop,
+                              bool schedule);
+
+    Func collapsePyramid(const vector<Func>& combinedPyramid, Func top, int firstLevel, bool schedule);
+
+    // Stages shared by the post process pipelines
+    void createChromaEpsMap(Func& output, Func input, bool schedule);
+    void calcChromaEps(Func& output, Func epsMap, Expr eps0, Expr eps1, Expr eps3);
+    void tonemapInputs(Func& tonemapInput,
+                       Func& hdrTonemapInput,
+                       Func input,
+                       Func hdrInput,
+                       Func hdrMask,
+                       Expr useHdr,
+                       Expr exposure,
+                       Expr hdrInputGain,
+                       Expr hdrScale);
+    Func dither(Func input, Func blueNoise, Func& gammaLut);
+
 private:
     Func deinterleaveRaw16(Func in, Expr stride);
     Func deinterleaveRaw12(Func in, Expr stride);
@@ -153,6 +197,25 @@ void PostProcessBase::toSensorPattern(Func& result, Func in, Expr sensorArrangem
                                                                                 bggr); // BGGR
 }
 
+void PostProcessBase::specializeRawFormat(Func f, Expr rawFormat) {
+    for(auto format : { RawFormat::RAW10, RawFormat::RAW12, RawFormat::RAW16 })
+        f.specialize(rawFormat == static_cast<int>(format));
+}
+
+void PostProcessBase::specializeSensorArrangement(Func f, Expr sensorArrangement) {
+    for(auto arrangement : { SensorArrangement::RGGB, SensorArrangement::GRBG, SensorArrangement::GBRG, SensorArrangement::BGGR })
+        f.specialize(sensorArrangement == static_cast<int>(arrangement));
+}
+
+void PostProcessBase::specializeRaw(Func f, Expr rawFormat, Expr sensorArrangement) {
+    for(auto format : { RawFormat::RAW10, RawFormat::RAW12, RawFormat::RAW16 }) {
+        Stage stage = f.specialize(rawFormat == static_cast<int>(format));
+
+        for(auto arrangement : { SensorArrangement::RGGB, SensorArrangement::GRBG, SensorArrangement::GBRG, SensorArrangement::BGGR })
+            stage.specialize(sensorArrangement == static_cast<int>(arrangement));
+    }
+}
+
 void PostProcessBase::deinterleave(Func& result, Func in, Expr stride, Expr rawFormat, Expr width, Expr height) {
     Func bayer{"bayer"};
     Func interleaved{"clamped"};
@@ -479,422 +542,835 @@ void PostProcessBase::shiftHues(
                          hsvInput(v_x, v_y, v_c));
 }
 
-//
-//
-// Guided Image Filtering, by Kaiming He, Jian Sun, and Xiaoou Tang
-//
+void PostProcessBase::pyramidUp(Func& output, Type outputType, Func& intermediate, Func input) {
+    using Halide::_;
 
-class GuidedFilter : public Halide::Generator<GuidedFilter> {
-public:
-    GeneratorParam<int> radius{"radius", 51};
+    Func blurX("blurX");
+    Func blurY("blurY");
 
-    Input<Func> input{"input", 3};
-    Input<Func> eps {"eps", 2};
+    // Insert zeros and expand by factor of 2 in both dims
+    Func expandedX{"expandedX"};
+    Func expanded("expanded");
 
-    Output<Func> output{"output", 2};
-    
-    GeneratorParam<Type> output_type{"output_type", UInt(16)};
-    Input<uint16_t> width {"width"};
-    Input<uint16_t> height {"height"};
-    Input<uint16_t> channel {"channel"};
-    
-    Var v_i{"i"};
-    Var v_x{"x"};
-    Var v_y{"y"};
-    Var v_c{"c"};
-    
-    Var v_xo{"xo"};
-    Var v_xi{"xi"};
-    Var v_yo{"yo"};
-    Var v_yi{"yi"};
+    Func pyramidUpInput{"pyramidUpInput"};
 
-    Var v_xio{"xio"};
-    Var v_xii{"xii"};
-    Var v_yio{"yio"};
-    Var v_yii{"yii"};
+    pyramidUpInput(v_x, v_y, v_c, _) = cast<int32_t>(input(v_x, v_y, v_c, _));
 
-    Var subtile_idx{"subtile_idx"};
-    Var tile_idx{"tile_idx"};
+    expandedX(v_x, v_y, v_c, _) = select((v_x % 2)==0, pyramidUpInput(v_x/2, v_y, v_c, _), 0);
+    expanded(v_x, v_y, v_c, _)  = select((v_y % 2)==0, expandedX(v_x, v_y/2, v_c, _), 0);
 
-    void generate();
+    blurX(v_x, v_y, v_c, _) =
+         (
+          1 * expanded(v_x - 2, v_y, v_c, _) +
+          4 * expanded(v_x - 1, v_y, v_c, _) +
+          6 * expanded(v_x    , v_y, v_c, _) +
+          4 * expanded(v_x + 1, v_y, v_c, _) +
+          1 * expanded(v_x + 2, v_y, v_c, _)
+          ) >> 4;
 
-    void schedule();
-    void schedule_for_cpu();
-    void schedule_for_gpu();
-    void apply_auto_schedule();
+    blurY(v_x, v_y, v_c, _) =
+         (
+          1 * blurX(v_x, v_y - 2, v_c, _) +
+          4 * blurX(v_x, v_y - 1, v_c, _) +
+          6 * blurX(v_x, v_y   ,  v_c, _) +
+          4 * blurX(v_x, v_y + 1, v_c, _) +
+          1 * blurX(v_x, v_y + 2, v_c, _)
+          ) >> 4;
 
-    Func I{"I"}, I2{"I2"};
-    Func mean_I{"mean_I"}, mean_temp_I{"mean_temp_I"};
-    Func mean_II{"mean_II"}, mean_temp_II{"mean_temp_II"};
-    Func var_I{"var_I"};
-    
-    Func mean0{"mean0"}, mean1{"mean1"}, var{"var"};
-    
-    Func a{"a"}, b{"b"};
-    Func mean_a{"mean_a"}, mean_temp_a{"mean_temp_a"};
-    Func mean_b{"mean_b"}, mean_temp_b{"mean_temp_b"};
+    intermediate = blurX;
+    output(v_x, v_y, v_c, _) = cast(outputType, 4 * blurY(v_x, v_y, v_c, _));
+}
 
-private:
-    void boxFilter(Func& result, Func& intermediate, Func in);
-};
+void PostProcessBase::pyramidDown(Func& output, Type outputType, Func& intermediate, Func input) {
+    using Halide::_;
 
-void GuidedFilter::apply_auto_schedule() {
-    using ::Halide::Func;
-    using ::Halide::MemoryType;
-    using ::Halide::RVar;
-    using ::Halide::TailStrategy;
-    using ::Halide::Var;
+    Func blurX{"pyramidDownBlurX"}, blurY{"pyramidDownBlurY"};
 
-    Var x = v_x;
-    Var xi("xi");
-    Var xii("xii");
-    Var xiii("xiii");
-    Var y = v_y;
-    Var yi("yi");
-    output
-        .split(x, x, xi, 256, TailStrategy::ShiftInwards)
-        .split(y, y, yi, 384, TailStrategy::ShiftInwards)
-        .split(xi, xi, xii, 32, TailStrategy::ShiftInwards)
-        .split(xii, xii, xiii, 16, TailStrategy::ShiftInwards)
-        .vectorize(xiii)
-        .compute_root()
-        .reorder({xiii, xii, yi, xi, x, y})
-        .fuse(x, y, x)
-        .parallel(x);
-    mean_temp_b
-        .store_in(MemoryType::Stack)
-        .split(x, x, xi, 8, TailStrategy::RoundUp)
-        .unroll(x)
-        .vectorize(xi)
-        .compute_at(output, xi)
-        .reorder({xi, x, y});
-    b
-        .store_in(MemoryType::Stack)
-        .split(x, x, xi, 8, TailStrategy::RoundUp)
-        .unroll(x)
-        .vectorize(xi)
-        .compute_at(mean_temp_b, y)
-        .reorder({xi, x, y});
-    mean_temp_a
-        .store_in(MemoryType::Stack)
-        .split(x, x, xi, 8, TailStrategy::RoundUp)
-        .vectorize(xi)
-        .compute_at(output, xi)
-        .reorder({xi, x, y});
-    a
-        .split(x, x, xi, 32, TailStrategy::RoundUp)
-        .split(y, y, yi, 3, TailStrategy::RoundUp)
-        .split(xi, xi, xii, 8, TailStrategy::RoundUp)
-        .unroll(xi)
-        .unroll(yi)
-        .vectorize(xii)
-        .compute_at(output, x)
-        .reorder({xii, xi, yi, y, x});
-    var_I
-        .store_in(MemoryType::Stack)
-        .split(x, x, xi, 8, TailStrategy::RoundUp)
-        .unroll(x)
-        .unroll(y)
-        .vectorize(xi)
-        .compute_at(a, y)
-        .reorder({xi, x, y});
-    mean_temp_II
-        .store_in(MemoryType::Stack)
-        .split(y, y, yi, 3, TailStrategy::RoundUp)
-        .split(x, x, xi, 8, TailStrategy::RoundUp)
-        .unroll(x)
-        .unroll(yi)
-        .vectorize(xi)
-        .compute_at(a, x)
-        .reorder({xi, x, yi, y});
-    I2
-        .store_in(MemoryType::Stack)
-        .split(x, x, xi, 8, TailStrategy::RoundUp)
-        .vectorize(xi)
-        .compute_at(mean_temp_II, y)
-        .reorder({xi, x, y});
-    mean_I
-        .split(x, x, xi, 31, TailStrategy::RoundUp)
-        .split(y, y, yi, 8, TailStrategy::RoundUp)
-        .vectorize(yi)
-        .compute_at(output, x)
-        .reorder({yi, y, xi, x})
-        .reorder_storage(y, x);
-    mean_temp_I
-        .store_in(MemoryType::Stack)
-        .split(y, y, yi, 8, TailStrategy::RoundUp)
-        .vectorize(yi)
-        .compute_at(mean_I, x)
-        .reorder({yi, y, x})
-        .reorder_storage(y, x);
-    I
-        .split(y, y, yi, 16, TailStrategy::ShiftInwards)
-        .vectorize(yi)
-        .compute_at(output, x)
-        .reorder({yi, y, x})
-        .reorder_storage(y, x);
-}
+    blurX(v_x, v_y, v_c, _) =
+         (
+          1 * cast<int32_t>(input(v_x - 2, v_y, v_c, _)) +
+          4 * cast<int32_t>(input(v_x - 1, v_y, v_c, _)) +
+          6 * cast<int32_t>(input(v_x,     v_y, v_c, _)) +
+          4 * cast<int32_t>(input(v_x + 1, v_y, v_c, _)) +
+          1 * cast<int32_t>(input(v_x + 2, v_y, v_c, _))
+          ) >> 4;
 
-void GuidedFilter::boxFilter(Func& result, Func& intermediate, Func in) {
-   const int R = radius;
-   RDom r(-R/2, R);
+    blurY(v_x, v_y, v_c, _) =
+         (
+          1 * blurX(v_x, v_y - 2, v_c, _) +
+          4 * blurX(v_x, v_y - 1, v_c, _) +
+          6 * blurX(v_x, v_y,     v_c, _) +
+          4 * blurX(v_x, v_y + 1, v_c, _) +
+          1 * blurX(v_x, v_y + 2, v_c, _)
+          ) >> 4;
 
-   intermediate(v_x, v_y) = sum(in(v_x + r.x, v_y)) / R;
-   result(v_x, v_y) = sum(intermediate(v_x, v_y + r.x)) / R;
-        
-    // Expr s = 0.0f;
-    // Expr t = 0.0f;
-    
-    // for(int i = -R/2; i <= R/2; i++)
-    //     s += in(v_x+i, v_y);
-    
-    // intermediate(v_x, v_y) = s/R;
-    
-    // for(int i = -R/2; i <= R/2; i++)
-    //     t += intermediate(v_x, v_y+i);
-    
-    // result(v_x, v_y) = t/R;
+    intermediate = blurX;
+    output(v_x, v_y, v_c, _) = cast(outputType, blurY(v_x * 2, v_y * 2, v_c, _));
 }
 
-void GuidedFilter::generate() {        
-    I(v_x, v_y) = cast<float>(input(v_x, v_y, channel));
-    I2(v_x, v_y) = I(v_x, v_y) * I(v_x, v_y);
-    
-    boxFilter(mean_I, mean_temp_I, I);
-    boxFilter(mean_II, mean_temp_II, I2);
-    
-    var_I(v_x, v_y) = mean_II(v_x, v_y) - (mean_I(v_x, v_y) * mean_I(v_x, v_y));
-    
-    a(v_x, v_y) = var_I(v_x, v_y) / (var_I(v_x, v_y) + eps(v_x, v_y));
-    b(v_x, v_y) = mean_I(v_x, v_y) - (a(v_x, v_y) * mean_I(v_x, v_y));
-    
-    boxFilter(mean_a, mean_temp_a, a);
-    boxFilter(mean_b, mean_temp_b, b);
-    
-    output(v_x, v_y) = cast(output_type, clamp((mean_a(v_x, v_y) * I(v_x, v_y)) + mean_b(v_x, v_y), 0, ((Type)output_type).max()));
+//
+// Builds the levels firstLevel + 1 to firstLevel + levels of a pyramid on top of the given level. Each level is
+// clamped to its size before it is downsampled. The full resolution input is clamped as well, the input of any other
+// level is used as it is, so a pyramid built from a stored level matches the one built from the image.
+//
 
-    if(!auto_schedule) {
-        if(get_target().has_gpu_feature())
-            schedule_for_gpu();
-        else
-            apply_auto_schedule();
-    }
+vector<pair<Func, Func>> PostProcessBase::buildPyramid(Func input, Type outputType, Expr width, Expr height, int firstLevel, int levels) {
+    vector<pair<Func, Func>> pyramid;
 
-    input.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
-    output.set_estimates({{0, 4096}, {0, 3072}});
-    width.set_estimate(4096);
-    height.set_estimate(3072);
-    channel.set_estimate(1);
-}
+    for(int level = 1; level <= levels; level++) {
+        const int pyramidLevel = firstLevel + level;
 
-void GuidedFilter::schedule() {    
-}
+        Func pyramidDownOutput(input.name() + std::string("PyramidDownLvl") + std::to_string(pyramidLevel));
+        Func pyramidDownIntermediate(input.name() + std::string("PyramidDownIntermediateLvl") + std::to_string(pyramidLevel));
 
-void GuidedFilter::schedule_for_cpu() {
-   output
-        .compute_root()
-        .reorder(v_x, v_y)
-        .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, 128, 128)
-        .fuse(v_xo, v_yo, tile_idx)
-        .tile(v_xi, v_yi, v_xio, v_yio, v_xii, v_yii, 64, 64)
-        .fuse(v_xio, v_yio, subtile_idx)
-        .parallel(tile_idx)
-        .vectorize(v_xii, 8);
-    
-    mean_temp_I
-        .compute_at(output, subtile_idx)
-        .store_at(output, tile_idx)
-        .vectorize(v_x, 8);
+        Func inClamped;
 
-    mean_temp_II
-        .compute_at(output, subtile_idx)
-        .store_at(output, tile_idx)
-        .vectorize(v_x, 8);
+        if(level == 1) {
+            inClamped = BoundaryConditions::repeat_edge(input, { {0, width >> firstLevel}, {0, height >> firstLevel} } );
 
-    var_I
-        .compute_at(output, subtile_idx)
-        .store_at(output, tile_idx)
-        .vectorize(v_x, 8);
+            if(firstLevel == 0)
+                pyramid.push_back(std::make_pair(inClamped, inClamped));
+            else
+                pyramid.push_back(std::make_pair(input, input));
+        }
+        else {
+            inClamped = BoundaryConditions::repeat_edge(
+                pyramid[level - 1].second, { {0, width >> (pyramidLevel - 1)}, {0, height >> (pyramidLevel - 1)} } );
+        }
 
-    mean_I
-        .compute_at(output, subtile_idx)
-        .store_at(output, tile_idx)
-        .vectorize(v_x, 8);
-    
-    mean_II
-        .compute_at(output, subtile_idx)
-        .store_at(output, tile_idx)
-        .vectorize(v_x, 8);
+        pyramidDown(pyramidDownOutput, outputType, pyramidDownIntermediate, inClamped);
 
-    a
-        .compute_at(output, subtile_idx)
-        .store_at(output, tile_idx)
-        .vectorize(v_x, 8);
+        pyramid.push_back(std::make_pair(pyramidDownIntermediate, pyramidDownOutput));
+    }
 
-    b
-        .compute_at(output, subtile_idx)
-        .store_at(output, tile_idx)
-        .vectorize(v_x, 8);
+    return pyramid;
+}
 
-    mean_temp_a
-        .compute_at(output, subtile_idx)
-        .store_at(output, tile_idx)
-        .vectorize(v_x, 8);
+void PostProcessBase::tonemapLuts(Func& gammaLut, Func& inverseGammaLut, Type outputType, bool schedule) {
+    Expr type_max = outputType.max();
 
-    mean_temp_b
-        .compute_at(output, subtile_idx)
-        .store_at(output, tile_idx)
-        .vectorize(v_x, 8);
+    Expr h = v_x / 65535.0f;
 
-    mean_a
-        .compute_at(output, subtile_idx)
-        .store_at(output, tile_idx)
-        .vectorize(v_x, 8);
+    gammaLut(v_x) = saturating_cast(outputType, select(h < 0.0031308f, h * 12.92f, pow(h, 1.0f / 2.4f) * 1.055f - 0.055f) * type_max);
+    inverseGammaLut(v_x) = saturating_cast(outputType, select(h < 0.04045f, h / 12.92f, pow((h + 0.055f) / 1.055f, 2.4f)) * type_max);
 
-    mean_b
-        .compute_at(output, subtile_idx)
-        .store_at(output, tile_idx)
-        .vectorize(v_x, 8);    
+    if(schedule) {
+        gammaLut.compute_root().vectorize(v_x, 16);
+        inverseGammaLut.compute_root().vectorize(v_x, 16);
+    }
 }
 
-void GuidedFilter::schedule_for_gpu() {
-    output
-        .compute_root()
-        .reorder(v_x, v_y)
-        .gpu_tile(v_x, v_y, v_xi, v_yi, 16, 32);
-    
-    mean_temp_I
-        .compute_at(mean_I, v_x)
-        .gpu_threads(v_x, v_y);
+void PostProcessBase::tonemapWeights(Func& exposures, Func& weightsNormalized, Func input0, Func input1, Func gammaLut,
+                                     Type outputType, Expr variance, Expr gain, bool schedule)
+{
+    Expr type_max = outputType.max();
 
-    mean_temp_II
-        .compute_at(mean_II, v_x)
-        .gpu_threads(v_x, v_y);
+    // Create exposures
+    Func weightsLut{"weightsLut"};
+    Func weights{"weights"};
+    Func Yinput{"Yinput"};
 
+    Expr ia = input0(v_x, v_y, v_c);
+    Expr ib = cast(outputType, clamp(cast<float>(input0(v_x, v_y, v_c)) * gain, 0.0f, type_max));
+    Expr ic = input1(v_x, v_y, v_c);
 
-    mean_I
-        .compute_root()
-        .reorder(v_x, v_y)
-        .gpu_tile(v_x, v_y, v_xi, v_yi, 16, 32);
-    
-    mean_II
-        .compute_root()
-        .reorder(v_x, v_y)
-        .gpu_tile(v_x, v_y, v_xi, v_yi, 16, 32);
+    exposures(v_x, v_y, v_c, v_i) = gammaLut(select(v_i == 0, ia,
+                                                    v_i == 1, ib,
+                                                              ic));
 
-    mean_temp_a
-        .compute_at(mean_a, v_x)
-        .gpu_threads(v_x, v_y);
+    // Create weights LUT based on well exposed pixels
+    Expr wa = v_i / cast<float>(type_max) - 0.5f;
+    Expr wb = -pow(wa, 2) / (2 * variance * variance);
 
-    mean_temp_b
-        .compute_at(mean_b, v_x)
-        .gpu_threads(v_x, v_y);
+    weightsLut(v_i) = cast<int16_t>(clamp(exp(wb) * 32767, -32767, 32767));
 
-    mean_a
-        .compute_root()
-        .reorder(v_x, v_y)
-        .gpu_tile(v_x, v_y, v_xi, v_yi, 16, 32);
+    if(schedule) {
+        weightsLut.compute_root().vectorize(v_i, 8);
+    }
 
-    mean_b
-        .compute_root()
-        .reorder(v_x, v_y)
-        .gpu_tile(v_x, v_y, v_xi, v_yi, 16, 32);    
+    Yinput(v_x, v_y, v_i) = saturating_cast<uint16_t>(0.299f*exposures(v_x, v_y, 0, v_i) + 0.587f*exposures(v_x, v_y, 1, v_i) + 0.114f*exposures(v_x, v_y, 2, v_i));
+
+    weights(v_x, v_y, v_i) = weightsLut(cast<uint16_t>(Yinput(v_x, v_y, v_i))) / 32767.0f;
+    weightsNormalized(v_x, v_y, v_i) = cast<uint16_t>(16384.0f * weights(v_x, v_y, v_i) / (1e-12f + weights(v_x, v_y, 0) + weights(v_x, v_y, 1) + weights(v_x, v_y, 2)));
+
+    if(schedule) {
+        weightsNormalized
+            .compute_root()
+            .reorder(v_i, v_x, v_y)
+            .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, 64, 16)
+            .fuse(v_xo, v_yo, tile_idx)
+            .parallel(tile_idx)
+            .unroll(v_i)
+            .vectorize(v_xi, 8);
+
+        exposures.in(Yinput)
+            .compute_at(weightsNormalized, tile_idx)
+            .vectorize(v_x, 8);
+    }
 }
 
-//
+void PostProcessBase::scheduleTonemapPyramids(vector<pair<Func, Func>>& tonemapPyramid,
+                                              vector<pair<Func, Func>>& weightsPyramid,
+                                              int firstLevel,
+                                              int levels)
+{
+    for(int level = 0; level < levels; level++) {
+        if(level == 0) {
+            // A stored level is read as it is
+            if(firstLevel > 0)
+                continue;
+
+            tonemapPyramid[0].second.in(tonemapPyramid[1].first)
+                .compute_at(tonemapPyramid[1].second, v_y)
+                .vectorize(v_x, 8)
+                .unroll(v_i)
+                .unroll(v_c);
+        }
+        else {
+            tonemapPyramid[level].first
+                .compute_at(tonemapPyramid[level].second, v_y)
+                .unroll(v_c)
+                .unroll(_0)
+                .vectorize(v_x, 8);
+
+            tonemapPyramid[level].second
+                .compute_root()
+                .vectorize(v_x, 8)
+                .unroll(v_c)
+                .unroll(_0)
+                .parallel(v_y);
+
+            weightsPyramid[level].first
+                .compute_at(weightsPyramid[level].second, v_y)
+                .unroll(v_c)
+                .vectorize(v_x, 8);
+
+            weightsPyramid[level].second
+                .compute_root()
+                .vectorize(v_x, 8)
+                .unroll(v_c)
+                .parallel(v_y);
+        }
+    }
+}
 
 //
-// Color filter array demosaicking: new method and performance measures
-// W Lu, YP Tan - IEEE transactions on image processing, 2003 - ieeexplore.ieee.org
-//
-// Directional LMMSE Image Demosaicking, Image Processing On Line, 1 (2011), pp. 117–126.
-// Pascal Getreuer, Zhang-Wu
+// Blends the laplacian pyramids of the exposures by their weights. The top level of the pyramids is only included
+// when it is the top of the whole pyramid, otherwise the level above the last one comes from collapsePyramid().
 //
 
-class Demosaic : public Halide::Generator<Demosaic>, public PostProcessBase {
-public:
-    Input<Func> in0{"in0", UInt(16), 2 };
-    Input<Func> in1{"in1", UInt(16), 2 };
-    Input<Func> in2{"in2", UInt(16), 2 };
-    Input<Func> in3{"in3", UInt(16), 2 };
+vector<Func> PostProcessBase::fusePyramids(const vector<pair<Func, Func>>& tonemapPyramid,
+                                           const vector<pair<Func, Func>>& weightsPyramid,
+                                           int firstLevel,
+                                           bool includeTop,
+                                           bool schedule)
+{
+    const int levels = static_cast<int>(tonemapPyramid.size()) - 1;
 
-    Input<Func> inShadingMap0{"inShadingMap0", Float(32), 2 };
-    Input<Func> inShadingMap1{"inShadingMap1", Float(32), 2 };
-    Input<Func> inShadingMap2{"inShadingMap2", Float(32), 2 };
-    Input<Func> inShadingMap3{"inShadingMap3", Float(32), 2 };
+    vector<Func> laplacianPyramid, combinedPyramid;
 
-    Input<int> width{"width"};
-    Input<int> height{"height"};
+    for(int level = 0; level < levels; level++) {
+        const int pyramidLevel = firstLevel + level;
 
-    Input<int> shadingMapWidth{"shadingMapWidth"};
-    Input<int> shadingMapHeight{"shadingMapHeight"};
-    Input<float> range{"range"};
-    Input<int> sensorArrangement{"sensorArrangement"};
+        Func up("laplacianUpLvl" + std::to_string(pyramidLevel));
+        Func upIntermediate("laplacianUpIntermediateLvl" + std::to_string(pyramidLevel));
+        Func laplacian("laplacianLvl" + std::to_string(pyramidLevel));
 
-    Input<float[3]> asShot{"asShot"};
+        pyramidUp(up, Int(32), upIntermediate, tonemapPyramid[level + 1].second);
 
-    Input<Func> cameraToSrgb{"cameraToSrgb", Float(32), 2 };
+        laplacian(v_x, v_y, v_c, v_i) = cast<int32_t>(tonemapPyramid[level].second(v_x, v_y, v_c, v_i)) - up(v_x, v_y, v_c, v_i);
 
-    Output<Func> output{ "output", UInt(16), 3 };
+        if(schedule && pyramidLevel > 2) {
+            upIntermediate
+                .compute_at(laplacian, tile_idx)
+                .vectorize(v_x, 8);
 
-    //
+            laplacian
+                .compute_root()
+                .reorder(v_i, v_c, v_x, v_y)
+                .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, 64, 16)
+                .fuse(v_xo, v_yo, tile_idx)
+                .parallel(tile_idx)
+                .unroll(v_c)
+                .unroll(v_i)
+                .vectorize(v_xi, 8);
+        }
 
-    Func combinedInput{"combinedInput"};
-    Func bayerInput{"bayerInput"};
-    
-    Func shaded{"shaded"};
-    Func shadingMap0{"shadingMap0"}, shadingMap1{"shadingMap1"}, shadingMap2{"shadingMap2"}, shadingMap3{"shadingMap3"};
-    Func shadingMapArranged{"shadingMapArranged"};
+        laplacianPyramid.push_back(laplacian);
+    }
 
-    Func blueI{"blueI"}, blueBlurX{"blueBlurX"};
-    Func blueFiltered{"blueFiltered"};
+    if(includeTop)
+        laplacianPyramid.push_back(tonemapPyramid[levels].second);
 
-    Func redI{"redI"}, redBlurX{"redBlurX"};
-    Func redFiltered{"redFiltered"};
+    for(size_t level = 0; level < laplacianPyramid.size(); level++) {
+        Func result("resultLvl" + std::to_string(firstLevel + level));
 
-    Func redIntermediate{"redIntermediate"};
-    Func red{"red"};
-    Func greenIntermediate{"greenIntermediate"};
-    Func green{"green"};
-    Func blueIntermediate{"blueIntermediate"};
-    Func blue{"blue"};
-    Func demosaicOutput{"demosaicOutput"};
+        result(v_x, v_y, v_c) = cast<int32_t>(0.5f +
+            (laplacianPyramid[level](v_x, v_y, v_c, 0) * 1.0f/16384.0f*weightsPyramid[level].second(v_x, v_y, 0)) +
+            (laplacianPyramid[level](v_x, v_y, v_c, 1) * 1.0f/16384.0f*weightsPyramid[level].second(v_x, v_y, 1)) +
+            (laplacianPyramid[level](v_x, v_y, v_c, 2) * 1.0f/16384.0f*weightsPyramid[level].second(v_x, v_y, 2)));
 
-    Func linear{"linear"};
-    Func colorCorrectInput{"colorCorrectInput"};
-    Func colorCorrected{"colorCorrected"};
-    Func rggb{"rggb"};
+        combinedPyramid.push_back(result);
+    }
 
-    void generate();
-    void schedule();
+    return combinedPyramid;
+}
 
-    void cmpSwap(Expr& a, Expr& b);
+//
+// Adds the levels of the combined pyramid to the upsampled level above them, starting from top. Returns the
+// collapsed image at firstLevel.
+//
 
-    void calculateGreen(Func& output, Func input);
-    void calculateGreen2(Func& output, Func input);
-    void calculateGreen3(Func& output, Func input);
+Func PostProcessBase::collapsePyramid(const vector<Func>& combinedPyramid, Func top, int firstLevel, bool schedule) {
+    Func previous = top;
 
-    void calculateRed(Func& output, Func input, Func green);
-    void calculateBlue(Func& output, Func input, Func green);
+    for(int level = static_cast<int>(combinedPyramid.size()); level > 0; level--) {
+        const int pyramidLevel = firstLevel + level;
 
-    void medianFilter(Func& output, Func input);
-    void weightedMedianFilter(Func& output, Func input);
-};
+        Func up("outputUpLvl" + std::to_string(pyramidLevel));
+        Func upIntermediate("outputUpIntermediateLvl" + std::to_string(pyramidLevel));
+        Func outputLvl("outputLvl" + std::to_string(pyramidLevel));
 
-void Demosaic::medianFilter(Func& output, Func input) {
-    Expr p0 = input(v_x, v_y);
-    Expr p1 = input(v_x, v_y-1);
-    Expr p2 = input(v_x, v_y+1);
-    Expr p3 = input(v_x-1, v_y);
-    Expr p4 = input(v_x+1, v_y);    
-    Expr p5 = input(v_x-1, v_y-1);
-    Expr p6 = input(v_x-1, v_y+1);
-    Expr p7 = input(v_x+1, v_y-1);
-    Expr p8 = input(v_x+1, v_y+1);
+        pyramidUp(up, Int(32), upIntermediate, previous);
 
-    cmpSwap(p0, p1);
-    cmpSwap(p2, p3);
-    cmpSwap(p0, p2);
+        outputLvl(v_x, v_y, v_c) = saturating_cast<uint16_t>(combinedPyramid[level - 1](v_x, v_y, v_c) + up(v_x, v_y, v_c));
+
+        if(schedule) {
+            combinedPyramid[level - 1].compute_at(outputLvl, tile_idx)
+                .vectorize(v_x, 8);
+
+            upIntermediate.compute_at(outputLvl, tile_idx)
+                .vectorize(v_x, 8);
+
+            outputLvl
+                .compute_root()
+                .reorder(v_c, v_x, v_y)
+                .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, 64, 16)
+                .fuse(v_xo, v_yo, tile_idx)
+                .parallel(tile_idx)
+                .unroll(v_c)
+                .vectorize(v_xi, 8);
+        }
+
+        previous = outputLvl;
+    }
+
+    return previous;
+}
+
+void PostProcessBase::createChromaEpsMap(Func& output, Func input, bool schedule) {
+    Func Lmap{"Lmap"};
+    Func LmapTmp0{"LmapTmp0"}, LmapTmp1{"LmapTmp1"}, LmapTmp2{"LmapTmp2"}, LmapTmp3{"LmapTmp3"};
+
+    Lmap(v_x, v_y) = cast<uint8_t>(0.5f + 255.0f*pow(input(v_x, v_y, 1)/65535.0f, 1.0f/2.2f));
+    output(v_x, v_y) = cast<uint8_t>(upsample(upsample(downsample(downsample(Lmap, LmapTmp0), LmapTmp1), LmapTmp2), LmapTmp3)(v_x, v_y));
+
+    if(schedule) {
+        Lmap
+            .compute_at(output, v_y)
+            .vectorize(v_x, 8);
+
+        LmapTmp0
+            .compute_at(output, v_y)
+            .vectorize(v_x, 8);
+
+        LmapTmp1
+            .compute_at(output, v_y)
+            .vectorize(v_x, 8);
+
+        LmapTmp2
+            .compute_at(output, v_y)
+            .vectorize(v_x, 8);
+
+        LmapTmp3
+            .compute_at(output, v_y)
+            .vectorize(v_x, 8);
+
+        output
+            .compute_root()
+            .vectorize(v_y, 12)
+            .parallel(v_y);
+    }
+}
+
+void PostProcessBase::calcChromaEps(Func& output, Func epsMap, Expr eps0, Expr eps1, Expr eps3) {
+    Expr X = epsMap(v_x, v_y)/255.0f;
+    Expr W = eps1*exp(-eps0*(X*X)) + 1.0f;
+    Expr eps = W*eps3;
+
+    output(v_x, v_y) = 65535.0f*65535.0f*eps*eps;
+}
+
+void PostProcessBase::tonemapInputs(Func& tonemapInput,
+                                    Func& hdrTonemapInput,
+                                    Func input,
+                                    Func hdrInput,
+                                    Func hdrMask,
+                                    Expr useHdr,
+                                    Expr exposure,
+                                    Expr hdrInputGain,
+                                    Expr hdrScale)
+{
+    // Blend HDR images based on provided mask
+    tonemapInput(v_x, v_y, v_c) = saturating_cast<uint16_t>(0.5f + pow(2.0f, exposure) * input(v_x, v_y, v_c));
+
+    Func hdrInputRepeated{"hdrInputRepeated"};
+    Func baseInput{"baseInput"};
+    Func hdrMaskInput{"hdrMaskInput"};
+    Func highlights{"highlights"};
+
+    baseInput(v_x, v_y, v_c) = input(v_x, v_y, v_c) / 65535.0f;
+    hdrInputRepeated(v_x, v_y, v_c) = hdrInput(v_x, v_y, v_c)/65535.0f;
+    hdrMaskInput(v_x, v_y) = hdrMask(v_x, v_y)/255.0f;
+
+    highlights(v_x, v_y, v_c) = (hdrMaskInput(v_x, v_y)*hdrInputRepeated(v_x, v_y, v_c)) + ((1.0f - hdrMaskInput(v_x, v_y))*hdrScale*baseInput(v_x, v_y, v_c));
+
+    hdrTonemapInput(v_x, v_y, v_c) = select(useHdr,
+        saturating_cast<uint16_t>(hdrInputGain * highlights(v_x, v_y, v_c) * 65535.0f),
+        tonemapInput(v_x, v_y, v_c));
+}
+
+//
+// Converts the 16 bit linear output to 8 bit sRGB, dithered with blue noise
+//
+
+Func PostProcessBase::dither(Func input, Func blueNoise, Func& gammaLut) {
+    Func noiseInput{"noiseInput"};
+    Func noise{"noise"};
+    Func dithered{"dithered"};
+
+    Expr h = v_i / 255.0f;
+
+    gammaLut(v_i) = saturating_cast<uint8_t>(select(h < 0.0031308f, h * 12.92f, pow(h, 1.0f / 2.4f) * 1.055f - 0.055f) * 255.0f + 0.5f);
+
+    // Dither using blue noise
+    noiseInput(v_x, v_y, v_c) = blueNoise(v_x, v_y, v_c) * 2.0f/255.0f - 1.0f;
+
+    Expr S = select(noiseInput(v_x, v_y, v_c) < 0.0f, -1.0f, 1.0f);
+    noise(v_x, v_y, v_c) = S*(1.0f - sqrt(max(0.0f, 1.0f - abs(noiseInput(v_x, v_y, v_c)))));
+
+    dithered(v_x, v_y, v_c) = gammaLut(saturating_cast<uint8_t>(0.5f + input(v_x, v_y, v_c) * 255.0f / 65535.0f + noise(v_x, v_y, v_c)));
+
+    return dithered;
+}
+
+//
+//
+// Guided Image Filtering, by Kaiming He, Jian Sun, and Xiaoou Tang
+//
+
+class GuidedFilter : public Halide::Generator<GuidedFilter> {
+public:
+    GeneratorParam<int> radius{"radius", 51};
+
+    Input<Func> input{"input", 3};
+    Input<Func> eps {"eps", 2};
+
+    Output<Func> output{"output", 2};
+    
+    GeneratorParam<Type> output_type{"output_type", UInt(16)};
+    Input<uint16_t> width {"width"};
+    Input<uint16_t> height {"height"};
+    Input<uint16_t> channel {"channel"};
+    
+    Var v_i{"i"};
+    Var v_x{"x"};
+    Var v_y{"y"};
+    Var v_c{"c"};
+    
+    Var v_xo{"xo"};
+    Var v_xi{"xi"};
+    Var v_yo{"yo"};
+    Var v_yi{"yi"};
+
+    Var v_xio{"xio"};
+    Var v_xii{"xii"};
+    Var v_yio{"yio"};
+    Var v_yii{"yii"};
+
+    Var subtile_idx{"subtile_idx"};
+    Var tile_idx{"tile_idx"};
+
+    void generate();
+
+    void schedule();
+    void schedule_for_cpu();
+    void schedule_for_gpu();
+    void apply_auto_schedule();
+
+    Func I{"I"}, I2{"I2"};
+    Func mean_I{"mean_I"}, mean_temp_I{"mean_temp_I"};
+    Func mean_II{"mean_II"}, mean_temp_II{"mean_temp_II"};
+    Func var_I{"var_I"};
+    
+    Func mean0{"mean0"}, mean1{"mean1"}, var{"var"};
+    
+    Func a{"a"}, b{"b"};
+    Func mean_a{"mean_a"}, mean_temp_a{"mean_temp_a"};
+    Func mean_b{"mean_b"}, mean_temp_b{"mean_temp_b"};
+
+private:
+    void boxFilter(Func& result, Func& intermediate, Func in);
+};
+
+void GuidedFilter::apply_auto_schedule() {
+    using ::Halide::Func;
+    using ::Halide::MemoryType;
+    using ::Halide::RVar;
+    using ::Halide::TailStrategy;
+    using ::Halide::Var;
+
+    Var x = v_x;
+    Var xi("xi");
+    Var xii("xii");
+    Var xiii("xiii");
+    Var y = v_y;
+    Var yi("yi");
+    output
+        .split(x, x, xi, 256, TailStrategy::ShiftInwards)
+        .split(y, y, yi, 384, TailStrategy::ShiftInwards)
+        .split(xi, xi, xii, 32, TailStrategy::ShiftInwards)
+        .split(xii, xii, xiii, 16, TailStrategy::ShiftInwards)
+        .vectorize(xiii)
+        .compute_root()
+        .reorder({xiii, xii, yi, xi, x, y})
+        .fuse(x, y, x)
+        .parallel(x);
+    mean_temp_b
+        .store_in(MemoryType::Stack)
+        .split(x, x, xi, 8, TailStrategy::RoundUp)
+        .unroll(x)
+        .vectorize(xi)
+        .compute_at(output, xi)
+        .reorder({xi, x, y});
+    b
+        .store_in(MemoryType::Stack)
+        .split(x, x, xi, 8, TailStrategy::RoundUp)
+        .unroll(x)
+        .vectorize(xi)
+        .compute_at(mean_temp_b, y)
+        .reorder({xi, x, y});
+    mean_temp_a
+        .store_in(MemoryType::Stack)
+        .split(x, x, xi, 8, TailStrategy::RoundUp)
+        .vectorize(xi)
+        .compute_at(output, xi)
+        .reorder({xi, x, y});
+    a
+        .split(x, x, xi, 32, TailStrategy::RoundUp)
+        .split(y, y, yi, 3, TailStrategy::RoundUp)
+        .split(xi, xi, xii, 8, TailStrategy::RoundUp)
+        .unroll(xi)
+        .unroll(yi)
+        .vectorize(xii)
+        .compute_at(output, x)
+        .reorder({xii, xi, yi, y, x});
+    var_I
+        .store_in(MemoryType::Stack)
+        .split(x, x, xi, 8, TailStrategy::RoundUp)
+        .unroll(x)
+        .unroll(y)
+        .vectorize(xi)
+        .compute_at(a, y)
+        .reorder({xi, x, y});
+    mean_temp_II
+        .store_in(MemoryType::Stack)
+        .split(y, y, yi, 3, TailStrategy::RoundUp)
+        .split(x, x, xi, 8, TailStrategy::RoundUp)
+        .unroll(x)
+        .unroll(yi)
+        .vectorize(xi)
+        .compute_at(a, x)
+        .reorder({xi, x, yi, y});
+    I2
+        .store_in(MemoryType::Stack)
+        .split(x, x, xi, 8, TailStrategy::RoundUp)
+        .vectorize(xi)
+        .compute_at(mean_temp_II, y)
+        .reorder({xi, x, y});
+    mean_I
+        .split(x, x, xi, 31, TailStrategy::RoundUp)
+        .split(y, y, yi, 8, TailStrategy::RoundUp)
+        .vectorize(yi)
+        .compute_at(output, x)
+        .reorder({yi, y, xi, x})
+        .reorder_storage(y, x);
+    mean_temp_I
+        .store_in(MemoryType::Stack)
+        .split(y, y, yi, 8, TailStrategy::RoundUp)
+        .vectorize(yi)
+        .compute_at(mean_I, x)
+        .reorder({yi, y, x})
+        .reorder_storage(y, x);
+    I
+        .split(y, y, yi, 16, TailStrategy::ShiftInwards)
+        .vectorize(yi)
+        .compute_at(output, x)
+        .reorder({yi, y, x})
+        .reorder_storage(y, x);
+}
+
+void GuidedFilter::boxFilter(Func& result, Func& intermediate, Func in) {
+   const int R = radius;
+   RDom r(-R/2, R);
+
+   intermediate(v_x, v_y) = sum(in(v_x + r.x, v_y)) / R;
+   result(v_x, v_y) = sum(intermediate(v_x, v_y + r.x)) / R;
+        
+    // Expr s = 0.0f;
+    // Expr t = 0.0f;
+    
+    // for(int i = -R/2; i <= R/2; i++)
+    //     s += in(v_x+i, v_y);
+    
+    // intermediate(v_x, v_y) = s/R;
+    
+    // for(int i = -R/2; i <= R/2; i++)
+    //     t += intermediate(v_x, v_y+i);
+    
+    // result(v_x, v_y) = t/R;
+}
+
+void GuidedFilter::generate() {        
+    I(v_x, v_y) = cast<float>(input(v_x, v_y, channel));
+    I2(v_x, v_y) = I(v_x, v_y) * I(v_x, v_y);
+    
+    boxFilter(mean_I, mean_temp_I, I);
+    boxFilter(mean_II, mean_temp_II, I2);
+    
+    var_I(v_x, v_y) = mean_II(v_x, v_y) - (mean_I(v_x, v_y) * mean_I(v_x, v_y));
+    
+    a(v_x, v_y) = var_I(v_x, v_y) / (var_I(v_x, v_y) + eps(v_x, v_y));
+    b(v_x, v_y) = mean_I(v_x, v_y) - (a(v_x, v_y) * mean_I(v_x, v_y));
+    
+    boxFilter(mean_a, mean_temp_a, a);
+    boxFilter(mean_b, mean_temp_b, b);
+    
+    output(v_x, v_y) = cast(output_type, clamp((mean_a(v_x, v_y) * I(v_x, v_y)) + mean_b(v_x, v_y), 0, ((Type)output_type).max()));
+
+    if(!auto_schedule) {
+        if(get_target().has_gpu_feature())
+            schedule_for_gpu();
+        else
+            apply_auto_schedule();
+    }
+
+    input.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
+    eps.set_estimates({{0, 4096}, {0, 3072}});
+    output.set_estimates({{0, 4096}, {0, 3072}});
+    width.set_estimate(4096);
+    height.set_estimate(3072);
+    channel.set_estimate(1);
+}
+
+void GuidedFilter::schedule() {    
+}
+
+void GuidedFilter::schedule_for_cpu() {
+   output
+        .compute_root()
+        .reorder(v_x, v_y)
+        .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, 128, 128)
+        .fuse(v_xo, v_yo, tile_idx)
+        .tile(v_xi, v_yi, v_xio, v_yio, v_xii, v_yii, 64, 64)
+        .fuse(v_xio, v_yio, subtile_idx)
+        .parallel(tile_idx)
+        .vectorize(v_xii, 8);
+    
+    mean_temp_I
+        .compute_at(output, subtile_idx)
+        .store_at(output, tile_idx)
+        .vectorize(v_x, 8);
+
+    mean_temp_II
+        .compute_at(output, subtile_idx)
+        .store_at(output, tile_idx)
+        .vectorize(v_x, 8);
+
+    var_I
+        .compute_at(output, subtile_idx)
+        .store_at(output, tile_idx)
+        .vectorize(v_x, 8);
+
+    mean_I
+        .compute_at(output, subtile_idx)
+        .store_at(output, tile_idx)
+        .vectorize(v_x, 8);
+    
+    mean_II
+        .compute_at(output, subtile_idx)
+        .store_at(output, tile_idx)
+        .vectorize(v_x, 8);
+
+    a
+        .compute_at(output, subtile_idx)
+        .store_at(output, tile_idx)
+        .vectorize(v_x, 8);
+
+    b
+        .compute_at(output, subtile_idx)
+        .store_at(output, tile_idx)
+        .vectorize(v_x, 8);
+
+    mean_temp_a
+        .compute_at(output, subtile_idx)
+        .store_at(output, tile_idx)
+        .vectorize(v_x, 8);
+
+    mean_temp_b
+        .compute_at(output, subtile_idx)
+        .store_at(output, tile_idx)
+        .vectorize(v_x, 8);
+
+    mean_a
+        .compute_at(output, subtile_idx)
+        .store_at(output, tile_idx)
+        .vectorize(v_x, 8);
+
+    mean_b
+        .compute_at(output, subtile_idx)
+        .store_at(output, tile_idx)
+        .vectorize(v_x, 8);    
+}
+
+void GuidedFilter::schedule_for_gpu() {
+    output
+        .compute_root()
+        .reorder(v_x, v_y)
+        .gpu_tile(v_x, v_y, v_xi, v_yi, 16, 32);
+    
+    mean_temp_I
+        .compute_at(mean_I, v_x)
+        .gpu_threads(v_x, v_y);
+
+    mean_temp_II
+        .compute_at(mean_II, v_x)
+        .gpu_threads(v_x, v_y);
+
+
+    mean_I
+        .compute_root()
+        .reorder(v_x, v_y)
+        .gpu_tile(v_x, v_y, v_xi, v_yi, 16, 32);
+    
+    mean_II
+        .compute_root()
+        .reorder(v_x, v_y)
+        .gpu_tile(v_x, v_y, v_xi, v_yi, 16, 32);
+
+    mean_temp_a
+        .compute_at(mean_a, v_x)
+        .gpu_threads(v_x, v_y);
+
+    mean_temp_b
+        .compute_at(mean_b, v_x)
+        .gpu_threads(v_x, v_y);
+
+    mean_a
+        .compute_root()
+        .reorder(v_x, v_y)
+        .gpu_tile(v_x, v_y, v_xi, v_yi, 16, 32);
+
+    mean_b
+        .compute_root()
+        .reorder(v_x, v_y)
+        .gpu_tile(v_x, v_y, v_xi, v_yi, 16, 32);    
+}
+
+//
+
+//
+// Color filter array demosaicking: new method and performance measures
+// W Lu, YP Tan - IEEE transactions on image processing, 2003 - ieeexplore.ieee.org
+//
+// Directional LMMSE Image Demosaicking, Image Processing On Line, 1 (2011), pp. 117–126.
+// Pascal Getreuer, Zhang-Wu
+//
+
+class Demosaic : public Halide::Generator<Demosaic>, public PostProcessBase {
+public:
+    Input<Func> in0{"in0", UInt(16), 2 };
+    Input<Func> in1{"in1", UInt(16), 2 };
+    Input<Func> in2{"in2", UInt(16), 2 };
+    Input<Func> in3{"in3", UInt(16), 2 };
+
+    Input<Func> inShadingMap0{"inShadingMap0", Float(32), 2 };
+    Input<Func> inShadingMap1{"inShadingMap1", Float(32), 2 };
+    Input<Func> inShadingMap2{"inShadingMap2", Float(32), 2 };
+    Input<Func> inShadingMap3{"inShadingMap3", Float(32), 2 };
+
+    Input<int> width{"width"};
+    Input<int> height{"height"};
+
+    Input<int> shadingMapWidth{"shadingMapWidth"};
+    Input<int> shadingMapHeight{"shadingMapHeight"};
+    Input<float> range{"range"};
+    Input<int> sensorArrangement{"sensorArrangement"};
+
+    Input<float[3]> asShot{"asShot"};
+
+    Input<Func> cameraToSrgb{"cameraToSrgb", Float(32), 2 };
+
+    Output<Func> output{ "output", UInt(16), 3 };
+
+    //
+
+    Func combinedInput{"combinedInput"};
+    Func bayerInput{"bayerInput"};
+    
+    Func shaded{"shaded"};
+    Func shadingMap0{"shadingMap0"}, shadingMap1{"shadingMap1"}, shadingMap2{"shadingMap2"}, shadingMap3{"shadingMap3"};
+    Func shadingMapArranged{"shadingMapArranged"};
+
+    Func blueI{"blueI"}, blueBlurX{"blueBlurX"};
+    Func blueFiltered{"blueFiltered"};
+
+    Func redI{"redI"}, redBlurX{"redBlurX"};
+    Func redFiltered{"redFiltered"};
+
+    Func redIntermediate{"redIntermediate"};
+    Func red{"red"};
+    Func greenIntermediate{"greenIntermediate"};
+    Func green{"green"};
+    Func blueIntermediate{"blueIntermediate"};
+    Func blue{"blue"};
+    Func demosaicOutput{"demosaicOutput"};
+
+    Func linear{"linear"};
+    Func colorCorrectInput{"colorCorrectInput"};
+    Func colorCorrected{"colorCorrected"};
+    Func rggb{"rggb"};
+
+    void generate();
+    void schedule();
+
+    void cmpSwap(Expr& a, Expr& b);
+
+    void calculateGreen(Func& output, Func input);
+    void calculateGreen2(Func& output, Func input);
+    void calculateGreen3(Func& output, Func input);
+
+    void calculateRed(Func& output, Func input, Func green);
+    void calculateBlue(Func& output, Func input, Func green);
+
+    void medianFilter(Func& output, Func input);
+    void weightedMedianFilter(Func& output, Func input);
+};
+
+void Demosaic::medianFilter(Func& output, Func input) {
+    Expr p0 = input(v_x, v_y);
+    Expr p1 = input(v_x, v_y-1);
+    Expr p2 = input(v_x, v_y+1);
+    Expr p3 = input(v_x-1, v_y);
+    Expr p4 = input(v_x+1, v_y);    
+    Expr p5 = input(v_x-1, v_y-1);
+    Expr p6 = input(v_x-1, v_y+1);
+    Expr p7 = input(v_x+1, v_y-1);
+    Expr p8 = input(v_x+1, v_y+1);
+
+    cmpSwap(p0, p1);
+    cmpSwap(p2, p3);
+    cmpSwap(p0, p2);
     cmpSwap(p1, p3);
     cmpSwap(p1, p2);
     cmpSwap(p4, p5);
@@ -1432,6 +1908,8 @@ void Demosaic::schedule() {
         .parallel(v_y)
         .vectorize(v_x, 8);
 
+    specializeSensorArrangement(combinedInput, sensorArrangement);
+
     green.compute_root()
         .parallel(v_y)
         .vectorize(v_x, 8);
@@ -1445,7 +1923,7 @@ void Demosaic::schedule() {
 
 //
 
-class TonemapGenerator : public Halide::Generator<TonemapGenerator> {
+class TonemapGenerator : public Halide::Generator<TonemapGenerator>, public PostProcessBase {
 public:
     // Inputs and outputs
     GeneratorParam<int> tonemap_levels {"tonemap_levels", 9};
@@ -1461,365 +1939,449 @@ public:
 
     Input<float> variance {"variance"};
     Input<float> gain {"gain"};
-    
-    // //
 
-    Var v_i{"i"};
-    Var v_x{"x"};
-    Var v_y{"y"};
-    Var v_c{"c"};
-    
-    Var v_xo{"xo"};
-    Var v_xi{"xi"};
-    Var v_yo{"yo"};
-    Var v_yi{"yi"};
+    void generate();
+    void schedule();
 
-    Var v_xio{"xio"};
-    Var v_xii{"xii"};
-    Var v_yio{"yio"};
-    Var v_yii{"yii"};
+    vector<pair<Func, Func>> tonemapPyramid;
+    vector<pair<Func, Func>> weightsPyramid;
+};
 
-    Var subtile_idx{"subtile_idx"};
-    Var tile_idx{"tile_idx"};
+void TonemapGenerator::generate() {
+    Func gammaLut{"gammaLut"}, inverseGammaLut{"inverseGammaLut"};
+    Func exposures{"exposures"};
+    Func weightsNormalized{"weightsNormalized"};
 
-    void pyramidUp(Func& output, Type outputType, Func& intermediate, Func input);
-    void pyramidDown(Func& output, Type outputType, Func& intermediate, Func input);
-    
-    vector<pair<Func, Func>> buildPyramid(Func input, Type outputType, int maxlevel);
+    Expr type_max = ((Type)output_type).max();
+
+    tonemapLuts(gammaLut, inverseGammaLut, output_type, !auto_schedule);
+    tonemapWeights(exposures, weightsNormalized, input0, input1, gammaLut, output_type, variance, gain, !auto_schedule);
+
+    // Create pyramid input
+    tonemapPyramid = buildPyramid(exposures, UInt(16), width, height, 0, tonemap_levels);
+    weightsPyramid = buildPyramid(weightsNormalized, UInt(16), width, height, 0, tonemap_levels);
+
+    if(!auto_schedule)
+        scheduleTonemapPyramids(tonemapPyramid, weightsPyramid, 0, tonemap_levels);
+
+    // Combine the pyramids and collapse them into the output
+    vector<Func> combinedPyramid = fusePyramids(tonemapPyramid, weightsPyramid, 0, true, !auto_schedule);
+
+    Func top = combinedPyramid.back();
+    combinedPyramid.pop_back();
+
+    Func fused = collapsePyramid(combinedPyramid, top, 0, !auto_schedule);
+
+    // Inverse gamma correct tonemapped result
+    output(v_x, v_y, v_c) = inverseGammaLut(cast(output_type, clamp(fused(v_x, v_y, v_c), 0, type_max)));
+
+    if(!auto_schedule) {
+        output
+            .compute_root()
+            .bound(v_c, 0, 3)
+            .parallel(v_y)
+            .unroll(v_c)
+            .vectorize(v_x, 8);
+    }
+
+    width.set_estimate(4096);
+    height.set_estimate(3072);
+    variance.set_estimate(0.25f);
+    gain.set_estimate(8.0f);
+
+    input0.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
+    input1.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
+    output.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
+}
+
+void TonemapGenerator::schedule() {    
+}
+
+class EnhanceGenerator : public Halide::Generator<EnhanceGenerator>, public PostProcessBase {
+public:
+    Input<Func> input{"input", 3 };
+    Input<Func> chromaDenoiseEps{"chromaDenoiseEps", 2 };
+
+    Output<Func> output{ "enhanceOutput", 3 };
+
+    GeneratorParam<int> popRadius{"popRadius", 25};
+
+    GeneratorParam<bool> denoiseChroma{"denoiseChroma", true};
+    GeneratorParam<bool> enableSharpen{"enableSharpen", true};
+
+    Input<int> width{"width"};
+    Input<int> height{"height"};
+
+    Input<float> blackPoint{"blackPoint"};
+    Input<float> whitePoint{"whitePoint"};
+    Input<float> contrast{"contrast"};
+    Input<float> brightness{"brightness"};
+    Input<float> blues{"blues"};
+    Input<float> greens{"greens"};
+    Input<float> saturation{"saturation"};
+    Input<float> sharpen0{"sharpen0"};
+    Input<float> sharpen1{"sharpen1"};
+    Input<float> pop{"pop"};
+
+    Func linearRgb{"linearRgb"};
+    Func sharpenInput{"sharpenInput"};
+    Func gammaCorrected{"gammaCorrected"};
+    Func gammaCorrectedLut{"gammaCorrectedLut"};
+    Func contrastCurve{"contrastCurve"};
+    Func sharpened{"sharpened"};
+    Func finalTonemap{"finalTonemap"};
+    Func bgrInput{"bgrInput"};
+    Func hsvInput{"hsvInput"};
+    Func hsvOutput{"hsvOutput"};
+    Func hsv{"hsv"};
+    Func estimateInput{"estimateInput"};    
+    Func saturationApplied{"saturationApplied"};
+    Func finalRgb{"finalRgb"};
+    Func contrastLut{"contrastLut"};
+    Func gaussianDiff0{"gaussianDiff0"}, gaussianDiff1{"gaussianDiff1"}, gaussianDiff2{"gaussianDiff2"};
+    Func m{"m"};
+    Func M{"M"};
+    Func N{"N"};
+    Func S{"S"};
+    Func blurOutput{"blurOutput"};
+    Func blurOutputTmp{"blurOutputTmp"};
+    Func blurOutput2{"blurOutput2"};
+    Func blurOutput2Tmp{"blurOutput2Tmp"};    
+    Func finalOutput{"finalOutput"};
+    Func blackPointAdjusted{"blackPointAdjusted"};
+    Func blackPointLut{"blackPointLut"};
+    Func estimates{"estimates"};
+    Func presetBlackPoint{"presetBlackPoint"};
+    Func presetWhitePoint{"presetWhitePoint"};
+    Func downsampledTmp{"downsampledTmp"};
+    Func downsampled{"downsampled"};
+    Func upsampleTmp{"upsampleTmp"};
+    Func upsampled{"upsampled"};
+    Func localContrast{"localContrast"};
+    Func inverseGammaLut{"inverseGammaLut"};
 
     void generate();
-    void schedule();
+    void schedule_for_cpu();
 
-    vector<pair<Func, Func>> tonemapPyramid;
-    vector<pair<Func, Func>> weightsPyramid;
+private:
+    void sharpen(Func& output, Func input);
 };
 
-void TonemapGenerator::pyramidUp(Func& output, Type outputType, Func& intermediate, Func input) {
-    using Halide::_;
+void EnhanceGenerator::sharpen(Func& output, Func input) {
+    if(popRadius < 11) {
+        blur(blurOutput, blurOutputTmp, input);
+        blur(blurOutput2, blurOutput2Tmp, blurOutput);
+    }
+    else {
+        blur2(blurOutput, blurOutputTmp, input);
+        blur3(blurOutput2, blurOutput2Tmp, blurOutput);
+    }
+
+    gaussianDiff0(v_x, v_y) = cast<int32_t>(input(v_x, v_y)) - blurOutput(v_x, v_y);
+    gaussianDiff1(v_x, v_y) = cast<int32_t>(blurOutput(v_x, v_y))  - blurOutput2(v_x, v_y);
+
+    output(v_x, v_y) = saturating_cast<uint16_t>(
+        blurOutput2(v_x, v_y) + sharpen0*gaussianDiff0(v_x, v_y) + sharpen1*gaussianDiff1(v_x, v_y) + 0.5f);
+}
+
+void EnhanceGenerator::generate() {
+
+    // Apply black/white point + contrast curve
+    {
+
+        // Gamma
+        Expr i = v_i / 65535.0f;
+        Expr j = select(i < 0.0031308f, i * 12.92f, pow(i, 1.0f / 2.4f) * 1.055f - 0.055f);
+
+        // Midtones
+        Expr k = clamp(pow(j, 1.0f/brightness), 0.0f, 1.0f);
+
+        // Contrast
+        Expr c = clamp(contrast, 0.0f, 1.0f) + 1.0f;
+        Expr s = k / max(1e-5f, 1.0f - k);
+        Expr t = 1.0f / (1 + pow(max(1e-5f, s), -c));
+
+        // Black/white point
+        Expr u = clamp(t - blackPoint, 0.0f, 1.0f) * (1.0f / (1.0f - blackPoint + 1e-5f));
+        Expr v = u / whitePoint;
+
+        contrastLut(v_i) = saturating_cast<uint16_t>(v*65535.0f+0.5f);
+        if(!auto_schedule)
+            contrastLut.compute_root().vectorize(v_i, 8);
+    }
+
+    gammaCorrected(v_x, v_y, v_c) = contrastLut(input(v_x, v_y, v_c));
+
+    // Denoise chroma
+    if(denoiseChroma) {
+        Func RGBInput{"RGBInput"};
+        Func YCbCrOutput{"YCbCrOutput"};
+        Func chromaInput{"chromaInput"};
+        Func chromaDenoised{"chromaDenoised"};
+
+        RGBInput(v_x, v_y, v_c) = gammaCorrected(v_x, v_y, v_c) / 65535.0f;
 
-    Func blurX("blurX");
-    Func blurY("blurY");
+        RGBToYCbCr(YCbCrOutput, RGBInput);
 
-    // Insert zeros and expand by factor of 2 in both dims
-    Func expandedX{"expandedX"};
-    Func expanded("expanded");
+        chromaInput(v_x, v_y, v_c) = saturating_cast<uint16_t>(
+            select( v_c == 0, YCbCrOutput(v_x, v_y, v_c) * 65535.0f + 0.5f,
+                    v_c == 1, (YCbCrOutput(v_x, v_y, v_c) + 0.5f) * 65535.0f + 0.5f,
+                              (YCbCrOutput(v_x, v_y, v_c) + 0.5f) * 65535.0f + 0.5f));
 
-    Func pyramidUpInput{"pyramidUpInput"};
+        chromaInput
+            .compute_root()
+            .parallel(v_y)
+            .vectorize(v_x, 8)
+            .unroll(v_c);
 
-    pyramidUpInput(v_x, v_y, v_c, _) = cast<int32_t>(input(v_x, v_y, v_c, _));
+        auto gf0 = create<GuidedFilter>();
+        auto gf1 = create<GuidedFilter>();
 
-    expandedX(v_x, v_y, v_c, _) = select((v_x % 2)==0, pyramidUpInput(v_x/2, v_y, v_c, _), 0);
-    expanded(v_x, v_y, v_c, _)  = select((v_y % 2)==0, expandedX(v_x, v_y/2, v_c, _), 0);
+        gf0->radius.set(15);
+        gf0->output_type.set(UInt(16));
+        gf0->apply(chromaInput, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(1));
 
-    blurX(v_x, v_y, v_c, _) =
-         (
-          1 * expanded(v_x - 2, v_y, v_c, _) +
-          4 * expanded(v_x - 1, v_y, v_c, _) +
-          6 * expanded(v_x    , v_y, v_c, _) +
-          4 * expanded(v_x + 1, v_y, v_c, _) +
-          1 * expanded(v_x + 2, v_y, v_c, _)
-          ) >> 4;
+        gf1->radius.set(15);
+        gf1->output_type.set(UInt(16));
+        gf1->apply(chromaInput, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(2));
 
-    blurY(v_x, v_y, v_c, _) =
-         (
-          1 * blurX(v_x, v_y - 2, v_c, _) +
-          4 * blurX(v_x, v_y - 1, v_c, _) +
-          6 * blurX(v_x, v_y   ,  v_c, _) +
-          4 * blurX(v_x, v_y + 1, v_c, _) +
-          1 * blurX(v_x, v_y + 2, v_c, _)
-          ) >> 4;
+        auto gf2 = create<GuidedFilter>();
+        auto gf3 = create<GuidedFilter>();
 
-    intermediate = blurX;
-    output(v_x, v_y, v_c, _) = cast(outputType, 4 * blurY(v_x, v_y, v_c, _));
-}
+        Func secondPass{"secondPass"};
 
-void TonemapGenerator::pyramidDown(Func& output, Type outputType, Func& intermediate, Func input) {
-    using Halide::_;
+        secondPass(v_x, v_y, v_c) = select(v_c == 0, gf0->output(v_x, v_y), gf1->output(v_x, v_y));
 
-    Func blurX{"pyramidDownBlurX"}, blurY{"pyramidDownBlurY"};
+        gf2->radius.set(15);
+        gf2->output_type.set(UInt(16));
+        gf2->apply(secondPass, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(0));
 
-    blurX(v_x, v_y, v_c, _) =
-         (
-          1 * cast<int32_t>(input(v_x - 2, v_y, v_c, _)) +
-          4 * cast<int32_t>(input(v_x - 1, v_y, v_c, _)) +
-          6 * cast<int32_t>(input(v_x,     v_y, v_c, _)) +
-          4 * cast<int32_t>(input(v_x + 1, v_y, v_c, _)) +
-          1 * cast<int32_t>(input(v_x + 2, v_y, v_c, _))
-          ) >> 4;
+        gf3->radius.set(15);
+        gf3->output_type.set(UInt(16));
+        gf3->apply(secondPass, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(1));
 
-    blurY(v_x, v_y, v_c, _) = 
-         (
-          1 * blurX(v_x, v_y - 2, v_c, _) +
-          4 * blurX(v_x, v_y - 1, v_c, _) +
-          6 * blurX(v_x, v_y,     v_c, _) +
-          4 * blurX(v_x, v_y + 1, v_c, _) +
-          1 * blurX(v_x, v_y + 2, v_c, _)
-          ) >> 4;
+        auto gf4 = create<GuidedFilter>();
+        auto gf5 = create<GuidedFilter>();
 
-    intermediate = blurX;
-    output(v_x, v_y, v_c, _) = cast(outputType, blurY(v_x * 2, v_y * 2, v_c, _));
-}
+        Func thirdPass{"thirdPass"};
 
-vector<pair<Func, Func>> TonemapGenerator::buildPyramid(Func input, Type outputType, int maxlevel) {
-    vector<pair<Func, Func>> pyramid;
+        thirdPass(v_x, v_y, v_c) = select(v_c == 0, gf2->output(v_x, v_y), gf3->output(v_x, v_y));
 
-    for(int level = 1; level <= maxlevel; level++) {
-        Func pyramidDownOutput(input.name() + std::string("PyramidDownLvl") + std::to_string(level));
-        Func pyramidDownIntermediate(input.name() + std::string("PyramidDownIntermediateLvl") + std::to_string(level));
-        
-        Func inClamped;
+        gf4->radius.set(25);
+        gf4->output_type.set(UInt(16));
+        gf4->apply(thirdPass, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(0));
 
-        if(level == 1) {
-            inClamped = BoundaryConditions::repeat_edge(input, { {0, width}, {0, height} } );
+        gf5->radius.set(25);
+        gf5->output_type.set(UInt(16));
+        gf5->apply(thirdPass, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(1));
 
-            pyramid.push_back(std::make_pair(inClamped, inClamped));
-        }
-        else {
-            inClamped = BoundaryConditions::repeat_edge(pyramid[level - 1].second, { {0, width >> (level-1)}, {0, height >> (level-1)} } );
-        }
+        chromaDenoised(v_x, v_y, v_c) = select(
+            v_c == 0, YCbCrOutput(v_x, v_y, v_c),
+            v_c == 1, gf4->output(v_x, v_y) / 65535.0f - 0.5f,
+                      gf5->output(v_x, v_y) / 65535.0f - 0.5f);
 
-        pyramidDown(pyramidDownOutput, outputType, pyramidDownIntermediate, inClamped);
-        
-        pyramid.push_back(std::make_pair(pyramidDownIntermediate, pyramidDownOutput));
+        YCbCrToRGB(hsvInput, chromaDenoised);
+    }
+    else {
+        hsvInput(v_x, v_y, v_c) = gammaCorrected(v_x, v_y, v_c) / 65535.0f;
     }
 
-    return pyramid;
-}
-
-void TonemapGenerator::generate() {
-    Func gammaLut{"gammaLut"}, inverseGammaLut{"inverseGammaLut"};
-    Expr type_max = ((Type)output_type).max();
+    RGBToHSV(hsvOutput, hsvInput);
 
-    Expr h = v_x / 65535.0f;
+    //
+    // Saturation/hue
+    //
 
-    gammaLut(v_x) = saturating_cast(output_type, select(h < 0.0031308f, h * 12.92f, pow(h, 1.0f / 2.4f) * 1.055f - 0.055f) * type_max);
-    inverseGammaLut(v_x) = saturating_cast(output_type, select(h < 0.04045f, h / 12.92f, pow((h + 0.055f) / 1.055f, 2.4f)) * type_max);
+    shiftHues(saturationApplied, hsvOutput, blues, greens, saturation);
 
-    if(!auto_schedule) {
-        gammaLut.compute_root().vectorize(v_x, 16);
-        inverseGammaLut.compute_root().vectorize(v_x, 16);
-    }
+    //
+    // Sharpen/Local contrast
+    //
 
-    // Create exposures
-    Func exposures{"exposures"};
-    Func weightsLut{"weightsLut"};
-    Func weights{"weights"};
-    Func weightsNormalized{"weightsNormalized"};
-    Func Yinput{"Yinput"};
+    if(enableSharpen) {
+        sharpenInput(v_x, v_y) = saturating_cast<uint16_t>(hsvOutput(v_x, v_y, 2) * 65535.0f);
 
-    Expr ia = input0(v_x, v_y, v_c);
-    Expr ib = cast(output_type, clamp(cast<float>(input0(v_x, v_y, v_c)) * gain, 0.0f, type_max));
-    Expr ic = input1(v_x, v_y, v_c);
+        sharpen(sharpened, sharpenInput);
+        
+        downsampled(v_x, v_y, v_c) = select(v_c == 0, downsample(sharpened, downsampledTmp)(v_x, v_y), 0);
 
-    exposures(v_x, v_y, v_c, v_i) = gammaLut(select(v_i == 0, ia,
-                                                    v_i == 1, ib,
-                                                              ic));
+        auto gf = create<GuidedFilter>();
+        Func eps{"eps"};
 
-    // Create weights LUT based on well exposed pixels
-    Expr wa = v_i / cast<float>(type_max) - 0.5f;
-    Expr wb = -pow(wa, 2) / (2 * variance * variance);
-    
-    weightsLut(v_i) = cast<int16_t>(clamp(exp(wb) * 32767, -32767, 32767));
-    
-    if(!auto_schedule) {
-        weightsLut.compute_root().vectorize(v_i, 8);
-    }
+        eps(v_x, v_y) = 0.2f*0.2f*65535.0f*65535.0f;
 
-    Yinput(v_x, v_y, v_i) = saturating_cast<uint16_t>(0.299f*exposures(v_x, v_y, 0, v_i) + 0.587f*exposures(v_x, v_y, 1, v_i) + 0.114f*exposures(v_x, v_y, 2, v_i));
+        gf->radius.set(popRadius);
+        gf->output_type.set(UInt(16));
+        gf->apply(downsampled, eps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(0));
 
-    weights(v_x, v_y, v_i) = weightsLut(cast<uint16_t>(Yinput(v_x, v_y, v_i))) / 32767.0f;
-    weightsNormalized(v_x, v_y, v_i) = cast<uint16_t>(16384.0f * weights(v_x, v_y, v_i) / (1e-12f + weights(v_x, v_y, 0) + weights(v_x, v_y, 1) + weights(v_x, v_y, 2)));
+        upsampled = upsample(gf->output, upsampleTmp);
 
-    if(!auto_schedule) {
-        weightsNormalized
-            .compute_root()
-            .reorder(v_i, v_x, v_y)
-            .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, 64, 16)
-            .fuse(v_xo, v_yo, tile_idx)
-            .parallel(tile_idx)
-            .unroll(v_i)
-            .vectorize(v_xi, 8);
+        localContrast(v_x, v_y) = saturating_cast<uint16_t>(0.5f + cast<float>(upsampled(v_x, v_y)) + pop*(cast<float>(sharpened(v_x, v_y)) - upsampled(v_x, v_y)));
 
-        exposures.in(Yinput)
-            .compute_at(weightsNormalized, tile_idx)
-            .vectorize(v_x, 8);
+        bgrInput(v_x, v_y, v_c) = select(
+            v_c == 0, saturationApplied(v_x, v_y, v_c),
+            v_c == 1, saturationApplied(v_x, v_y, v_c),
+                      localContrast(v_x, v_y) / 65535.0f);
     }
-
-    // Create pyramid input
-    tonemapPyramid = buildPyramid(exposures, UInt(16), tonemap_levels);
-    weightsPyramid = buildPyramid(weightsNormalized, UInt(16), tonemap_levels);
-
-    if(!auto_schedule) {
-        for(int level = 0; level < tonemap_levels; level++) {
-
-            if(level == 0) {
-                tonemapPyramid[0].second.in(tonemapPyramid[1].first)
-                    .compute_at(tonemapPyramid[1].second, v_y)
-                    .vectorize(v_x, 8)
-                    .unroll(v_i)
-                    .unroll(v_c);
-            }
-            else {
-                tonemapPyramid[level].first
-                    .compute_at(tonemapPyramid[level].second, v_y)
-                    .unroll(v_c)
-                    .unroll(_0)
-                    .vectorize(v_x, 8);
-            
-                tonemapPyramid[level].second
-                    .compute_root()
-                    .vectorize(v_x, 8)
-                    .unroll(v_c)
-                    .unroll(_0)
-                    .parallel(v_y);
-
-                weightsPyramid[level].first
-                    .compute_at(weightsPyramid[level].second, v_y)
-                    .unroll(v_c)
-                    .vectorize(v_x, 8);
-    
-                weightsPyramid[level].second
-                    .compute_root()
-                    .vectorize(v_x, 8)
-                    .unroll(v_c)
-                    .parallel(v_y);
-            }
-        }
+    else {
+        bgrInput(v_x, v_y, v_c) = saturationApplied(v_x, v_y, v_c);
     }
 
-    //
-    // Create laplacian pyramid
-    //
+    HSVToBGR(finalRgb, bgrInput);
 
-    vector<Func> laplacianPyramid, combinedPyramid;
+    {
+        // Invert gamma
+        Expr a = v_i / 65535.0f;
+        Expr b = select(a < 0.04045f, a / 12.92f, pow((a + 0.055f) / 1.055f, 2.4f));
     
-    for(int level = 0; level < tonemap_levels; level++) {
-        Func up("laplacianUpLvl" + std::to_string(level));
-        Func upIntermediate("laplacianUpIntermediateLvl" + std::to_string(level));
-        Func laplacian("laplacianLvl" + std::to_string(level));
-
-        pyramidUp(up, Int(32), upIntermediate, tonemapPyramid[level + 1].second);
+        inverseGammaLut(v_i) = saturating_cast<uint16_t>(b*65535.0f+0.5f);
         
-        laplacian(v_x, v_y, v_c, v_i) = cast<int32_t>(tonemapPyramid[level].second(v_x, v_y, v_c, v_i)) - up(v_x, v_y, v_c, v_i);
+        if(!auto_schedule)
+            inverseGammaLut.compute_root().vectorize(v_i, 8);
+    }
 
-        if(level > 2) {
-            upIntermediate
-                .compute_at(laplacian, tile_idx)
-                .vectorize(v_x, 8);
+    output(v_x, v_y, v_c) = inverseGammaLut(saturating_cast<uint16_t>(finalRgb(v_x, v_y, v_c) * 65535.0f + 0.5f));
 
-            laplacian
-                .compute_root()
-                .reorder(v_i, v_c, v_x, v_y)
-                .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, 64, 16)
-                .fuse(v_xo, v_yo, tile_idx)
-                .parallel(tile_idx)
-                .unroll(v_c)
-                .unroll(v_i)
-                .vectorize(v_xi, 8);
-        }
+    contrast.set_estimate(1.5f);
+    blackPoint.set_estimate(0.01f);
+    whitePoint.set_estimate(0.95f);
+    blues.set_estimate(1.0f);
+    saturation.set_estimate(1.0f);
+    greens.set_estimate(1.0f);
+    sharpen0.set_estimate(2.0f);
+    width.set_estimate(4000);
+    height.set_estimate(3000);
 
-        laplacianPyramid.push_back(laplacian);
-    }
+    input.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
+    output.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
 
-    laplacianPyramid.push_back(tonemapPyramid[tonemap_levels].second);
+    if(!auto_schedule)
+        schedule_for_cpu();
+}
 
-    //
-    // Combine pyramids
-    //
+void EnhanceGenerator::schedule_for_cpu() {
+    gammaCorrected
+        .compute_root()
+        .unroll(v_c)
+        .vectorize(v_x, 8)
+        .parallel(v_y);
 
-    for(int level = 0; level <= tonemap_levels; level++) {
-        Func result("resultLvl" + std::to_string(level));
+    if(enableSharpen) {
+        blurOutputTmp
+            .compute_at(sharpened, tile_idx)
+            .vectorize(v_x, 8);
 
-        result(v_x, v_y, v_c) = cast<int32_t>(0.5f + 
-            (laplacianPyramid[level](v_x, v_y, v_c, 0) * 1.0f/16384.0f*weightsPyramid[level].second(v_x, v_y, 0)) +
-            (laplacianPyramid[level](v_x, v_y, v_c, 1) * 1.0f/16384.0f*weightsPyramid[level].second(v_x, v_y, 1)) +
-            (laplacianPyramid[level](v_x, v_y, v_c, 2) * 1.0f/16384.0f*weightsPyramid[level].second(v_x, v_y, 2)));
+        blurOutput
+            .compute_at(sharpened, tile_idx)
+            .vectorize(v_x, 8);
 
-        combinedPyramid.push_back(result);
-    }
+        blurOutput2Tmp
+            .compute_at(sharpened, tile_idx)
+            .vectorize(v_x, 8);
 
-    //
-    // Create output pyramid
-    //
-    
-    vector<Func> outputPyramid;
+        blurOutput2
+            .compute_at(sharpened, tile_idx)
+            .vectorize(v_x, 8);
 
-    for(int level = tonemap_levels; level > 0; level--) {
-        Func up("outputUpLvl" + std::to_string(level));
-        Func upIntermediate("outputUpIntermediateLvl" + std::to_string(level));
-        Func outputLvl("outputLvl" + std::to_string(level));
+        gaussianDiff0
+            .compute_at(sharpened, tile_idx)
+            .vectorize(v_x, 8);
 
-        if(level == tonemap_levels) {
-            pyramidUp(up, Int(32), upIntermediate, combinedPyramid[level]);
-        }
-        else {
-            pyramidUp(up, Int(32), upIntermediate, outputPyramid[outputPyramid.size() - 1]);
-            
-        }
+        gaussianDiff1
+            .compute_at(sharpened, tile_idx)
+            .vectorize(v_x, 8);
 
-        outputLvl(v_x, v_y, v_c) = saturating_cast<uint16_t>(combinedPyramid[level - 1](v_x, v_y, v_c) + up(v_x, v_y, v_c));
+        sharpenInput
+            .compute_at(sharpened, tile_idx)
+            .vectorize(v_x, 8);
 
-        if(!auto_schedule) {
-            combinedPyramid[level - 1].compute_at(outputLvl, tile_idx)
-                .vectorize(v_x, 8);
+        sharpened
+            .compute_root()
+            .reorder(v_x, v_y)
+            .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, 128, 128)
+            .fuse(v_xo, v_yo, tile_idx)
+            .parallel(tile_idx)
+            .vectorize(v_xi, 8);
 
-            upIntermediate.compute_at(outputLvl, tile_idx)
-                .vectorize(v_x, 8);
+        downsampledTmp
+            .compute_at(downsampled, v_x)
+            .vectorize(v_x, 8);
 
-            outputLvl
-                .compute_root()
-                .reorder(v_c, v_x, v_y)
-                .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, 64, 16)
-                .fuse(v_xo, v_yo, tile_idx)
-                .parallel(tile_idx)
-                .unroll(v_c)
-                .vectorize(v_xi, 8);
-        }
+        downsampled
+            .compute_root()
+            .split(v_y, v_yo, v_yi, 64)
+            .vectorize(v_x, 8)
+            .parallel(v_yo);
 
-        outputPyramid.push_back(outputLvl);
-    }
+        upsampleTmp
+            .compute_at(localContrast, v_x)
+            .vectorize(v_x, 8);
 
-    // Inverse gamma correct tonemapped result
-    output(v_x, v_y, v_c) = inverseGammaLut(cast(output_type, clamp(outputPyramid[tonemap_levels - 1](v_x, v_y, v_c), 0, type_max)));
+        upsampled
+            .compute_at(localContrast, v_x)
+            .vectorize(v_x, 8);
 
-    if(!auto_schedule) {
-        output
+        localContrast
             .compute_root()
-            .bound(v_c, 0, 3)
-            .parallel(v_y)
-            .unroll(v_c)
-            .vectorize(v_x, 8);
+            .vectorize(v_x, 8)
+            .parallel(v_y);
     }
 
-    width.set_estimate(4096);
-    height.set_estimate(3072);
-    variance.set_estimate(0.25f);
-    gain.set_estimate(8.0f);
+    saturationApplied
+        .compute_at(output, v_x)
+        .unroll(v_c)
+        .vectorize(v_x, 8);
 
-    input0.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
-    input1.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
-    output.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
-}
+    finalRgb
+        .compute_at(output, v_x)
+        .unroll(v_c)
+        .vectorize(v_x, 8);
 
-void TonemapGenerator::schedule() {    
+    bgrInput
+        .compute_at(output, v_x)
+        .unroll(v_c)
+        .vectorize(v_x, 8);
+
+    output
+        .compute_root()
+        .reorder(v_c, v_x, v_y)
+        .unroll(v_c)
+        .vectorize(v_x, 8)
+        .parallel(v_y);
 }
 
-class EnhanceGenerator : public Halide::Generator<EnhanceGenerator>, public PostProcessBase {
+
+class PostProcessGenerator : public Halide::Generator<PostProcessGenerator>, public PostProcessBase {
 public:
-    Input<Func> input{"input", 3 };
-    Input<Func> chromaDenoiseEps{"chromaDenoiseEps", 2 };
+    Input<Buffer<uint16_t>> in0{"in0", 2 };
+    Input<Buffer<uint16_t>> in1{"in1", 2 };
+    Input<Buffer<uint16_t>> in2{"in2", 2 };
+    Input<Buffer<uint16_t>> in3{"in3", 2 };
 
-    Output<Func> output{ "enhanceOutput", 3 };
+    Input<Buffer<uint8_t>> blueNoise{"blueNoise", 3 };
+    Input<Buffer<uint16_t>> hdrInput{"hdrInput", 3 };
+    Input<Buffer<uint8_t>> hdrMask{"hdrMask", 2 };
 
-    GeneratorParam<int> popRadius{"popRadius", 25};
+    Input<bool> useHdr{"useHdr"};
 
-    GeneratorParam<bool> denoiseChroma{"denoiseChroma", true};
-    GeneratorParam<bool> enableSharpen{"enableSharpen", true};
+    Input<float[3]> asShotVector{"asShotVector"};
 
-    Input<int> width{"width"};
-    Input<int> height{"height"};
+    Input<Buffer<float>> cameraToSrgb{"cameraToSrgb", 2};
+
+    Input<Buffer<float>> inShadingMap0{"inShadingMap0", 2 };
+    Input<Buffer<float>> inShadingMap1{"inShadingMap1", 2 };
+    Input<Buffer<float>> inShadingMap2{"inShadingMap2", 2 };
+    Input<Buffer<float>> inShadingMap3{"inShadingMap3", 2 };
 
+    Input<uint16_t> range{"range"};
+    Input<int> sensorArrangement{"sensorArrangement"};
+    
+    Input<float> shadows{"shadows"};
+    Input<float> hdrInputGain{"hdrInputGain"};
+    Input<float> hdrScale{"hdrScale"};
+    Input<float> tonemapVariance{"tonemapVariance"};
     Input<float> blackPoint{"blackPoint"};
+    Input<float> exposure{"exposure"};
     Input<float> whitePoint{"whitePoint"};
     Input<float> contrast{"contrast"};
     Input<float> brightness{"brightness"};
@@ -1829,336 +2391,443 @@ public:
     Input<float> sharpen0{"sharpen0"};
     Input<float> sharpen1{"sharpen1"};
     Input<float> pop{"pop"};
+    Input<float> chromaEps0{"chromaEps0"};
+    Input<float> chromaEps1{"chromaEps1"};
+    Input<float> chromaEps3{"chromaEps3"};
 
-    Func linearRgb{"linearRgb"};
-    Func sharpenInput{"sharpenInput"};
-    Func gammaCorrected{"gammaCorrected"};
-    Func gammaCorrectedLut{"gammaCorrectedLut"};
-    Func contrastCurve{"contrastCurve"};
-    Func sharpened{"sharpened"};
-    Func finalTonemap{"finalTonemap"};
-    Func bgrInput{"bgrInput"};
-    Func hsvInput{"hsvInput"};
-    Func hsvOutput{"hsvOutput"};
-    Func hsv{"hsv"};
-    Func estimateInput{"estimateInput"};    
-    Func saturationApplied{"saturationApplied"};
-    Func finalRgb{"finalRgb"};
-    Func contrastLut{"contrastLut"};
-    Func gaussianDiff0{"gaussianDiff0"}, gaussianDiff1{"gaussianDiff1"}, gaussianDiff2{"gaussianDiff2"};
-    Func m{"m"};
-    Func M{"M"};
-    Func N{"N"};
-    Func S{"S"};
-    Func blurOutput{"blurOutput"};
-    Func blurOutputTmp{"blurOutputTmp"};
-    Func blurOutput2{"blurOutput2"};
-    Func blurOutput2Tmp{"blurOutput2Tmp"};    
-    Func finalOutput{"finalOutput"};
-    Func blackPointAdjusted{"blackPointAdjusted"};
-    Func blackPointLut{"blackPointLut"};
-    Func estimates{"estimates"};
-    Func presetBlackPoint{"presetBlackPoint"};
-    Func presetWhitePoint{"presetWhitePoint"};
-    Func downsampledTmp{"downsampledTmp"};
-    Func downsampled{"downsampled"};
-    Func upsampleTmp{"upsampleTmp"};
-    Func upsampled{"upsampled"};
-    Func localContrast{"localContrast"};
-    Func inverseGammaLut{"inverseGammaLut"};
+    Output<Buffer<uint8_t>> output{"output", 3};
+    
+    Func chromaEpsMap{"chromaEpsMap"}, chromaEps{"chromaEps"};
+
+    Func hdrTonemapInput{"hdrTonemapInput"};
+    Func tonemapInput{"tonemapInput"};
+    Func gammaLut{"gammaLut"};
 
+    std::unique_ptr<Demosaic> demosaic;
+    std::unique_ptr<TonemapGenerator> tonemap;
+    std::unique_ptr<EnhanceGenerator> enhance;
+    
     void generate();
+    void schedule_for_gpu();
     void schedule_for_cpu();
-
-private:
-    void sharpen(Func& output, Func input);
 };
 
-void EnhanceGenerator::sharpen(Func& output, Func input) {
-    if(popRadius < 11) {
-        blur(blurOutput, blurOutputTmp, input);
-        blur(blurOutput2, blurOutput2Tmp, blurOutput);
-    }
-    else {
-        blur2(blurOutput, blurOutputTmp, input);
-        blur3(blurOutput2, blurOutput2Tmp, blurOutput);
-    }
+void PostProcessGenerator::generate()
+{
+    std::vector<Expr> asShot{ asShotVector[0], asShotVector[1], asShotVector[2] };
 
-    gaussianDiff0(v_x, v_y) = cast<int32_t>(input(v_x, v_y)) - blurOutput(v_x, v_y);
-    gaussianDiff1(v_x, v_y) = cast<int32_t>(blurOutput(v_x, v_y))  - blurOutput2(v_x, v_y);
+    Expr WIDTH = in0.width();
+    Expr HEIGHT = in0.height();
 
-    output(v_x, v_y) = saturating_cast<uint16_t>(
-        blurOutput2(v_x, v_y) + sharpen0*gaussianDiff0(v_x, v_y) + sharpen1*gaussianDiff1(v_x, v_y) + 0.5f);
-}
+    // Demosaic image
+    Func inClamped0 = BoundaryConditions::repeat_edge(in0);
+    Func inClamped1 = BoundaryConditions::repeat_edge(in1);
+    Func inClamped2 = BoundaryConditions::repeat_edge(in2);
+    Func inClamped3 = BoundaryConditions::repeat_edge(in3);
 
-void EnhanceGenerator::generate() {
+    demosaic = create<Demosaic>();
+    demosaic->apply(
+        inClamped0, inClamped1, inClamped2, inClamped3,
+        inShadingMap0, inShadingMap1, inShadingMap2, inShadingMap3,
+        WIDTH, HEIGHT,
+        inShadingMap0.width(), inShadingMap0.height(),
+        cast<float>(range),
+        sensorArrangement,
+        asShot,
+        cameraToSrgb);
 
-    // Apply black/white point + contrast curve
-    {
+    // Calculate chroma denoising map
+    createChromaEpsMap(chromaEpsMap, demosaic->output, !auto_schedule);
+    calcChromaEps(chromaEps, chromaEpsMap, chromaEps0, chromaEps1, chromaEps3);
+
+    // Blend HDR images based on provided mask
+    tonemapInputs(
+        tonemapInput,
+        hdrTonemapInput,
+        demosaic->output,
+        BoundaryConditions::repeat_edge(hdrInput),
+        BoundaryConditions::repeat_edge(hdrMask),
+        useHdr,
+        exposure,
+        hdrInputGain,
+        hdrScale);
+
+    //
+    // Tonemap
+    //
+
+    tonemap = create<TonemapGenerator>();
+
+    tonemap->output_type.set(UInt(16));
+    tonemap->tonemap_levels.set(TONEMAP_LEVELS);
+    tonemap->apply(tonemapInput, hdrTonemapInput, WIDTH * 2, HEIGHT * 2, tonemapVariance, shadows);
+
+    // defringeVertical.define_extern("extern_defringe", { (Func) tonemap->output, WIDTH*2, HEIGHT*2 }, UInt(16), 3);
+    // defringeVertical.compute_root();
+
+    // defringeVerticalTransposed(v_x, v_y, v_c) = defringeVertical(v_y, v_x, v_c);
+
+    // defringeHorizontal.define_extern("extern_defringe", { defringeVerticalTransposed, HEIGHT*2, WIDTH*2 }, UInt(16), 3);
+    // defringeHorizontal.compute_root();
+
+    // defringe(v_x, v_y, v_c) = defringeHorizontal(v_y, v_x, v_c);
+    
+    // Finalize output
+    enhance = create<EnhanceGenerator>();
+
+    enhance->denoiseChroma.set(true);
+    enhance->enableSharpen.set(true);
+    enhance->popRadius.set(25);
+
+    enhance->apply(
+        tonemap->output,
+        chromaEps,
+        WIDTH*2,
+        HEIGHT*2,
+        blackPoint,
+        whitePoint,
+        contrast,
+        brightness,
+        blues,
+        greens,
+        saturation,
+        sharpen0,
+        sharpen1,
+        pop);
 
-        // Gamma
-        Expr i = v_i / 65535.0f;
-        Expr j = select(i < 0.0031308f, i * 12.92f, pow(i, 1.0f / 2.4f) * 1.055f - 0.055f);
+    // Finish with blue noise dithering + gamma
+    output(v_x, v_y, v_c) = dither(enhance->output, BoundaryConditions::repeat_image(blueNoise), gammaLut)(v_x, v_y, v_c);
 
-        // Midtones
-        Expr k = clamp(pow(j, 1.0f/brightness), 0.0f, 1.0f);
+    if(!auto_schedule)
+        gammaLut.compute_root().vectorize(v_i, 8);
 
-        // Contrast
-        Expr c = clamp(contrast, 0.0f, 1.0f) + 1.0f;
-        Expr s = k / max(1e-5f, 1.0f - k);
-        Expr t = 1.0f / (1 + pow(max(1e-5f, s), -c));
+    // Noise/output are interleaved
+    blueNoise
+        .dim(0).set_stride(4)
+        .dim(2).set_stride(1);
 
-        // Black/white point
-        Expr u = clamp(t - blackPoint, 0.0f, 1.0f) * (1.0f / (1.0f - blackPoint + 1e-5f));
-        Expr v = u / whitePoint;
+    output
+        .dim(0).set_stride(3)
+        .dim(2).set_stride(1);
+    
+    range.set_estimate(16384);
+    sensorArrangement.set_estimate(0);
 
-        contrastLut(v_i) = saturating_cast<uint16_t>(v*65535.0f+0.5f);
-        if(!auto_schedule)
-            contrastLut.compute_root().vectorize(v_i, 8);
-    }
+    contrast.set_estimate(1.5f);
+    shadows.set_estimate(2.0f);
+    tonemapVariance.set_estimate(0.25f);
+    blackPoint.set_estimate(0.01f);
+    exposure.set_estimate(0.0f);
+    whitePoint.set_estimate(0.95f);
+    blues.set_estimate(1.0f);
+    saturation.set_estimate(1.0f);
+    greens.set_estimate(1.0f);
+    sharpen0.set_estimate(2.0f);
+    sharpen1.set_estimate(2.0f);
+    chromaEps0.set_estimate(0.01f);
+    chromaEps1.set_estimate(0.01f);
+    
+    cameraToSrgb.set_estimates({{0, 3}, {0, 3}});
 
-    gammaCorrected(v_x, v_y, v_c) = contrastLut(input(v_x, v_y, v_c));
+    in0.set_estimates({{0, 2048}, {0, 1536}});
+    in1.set_estimates({{0, 2048}, {0, 1536}});
+    in2.set_estimates({{0, 2048}, {0, 1536}});
+    in3.set_estimates({{0, 2048}, {0, 1536}});
 
-    // Denoise chroma
-    if(denoiseChroma) {
-        Func RGBInput{"RGBInput"};
-        Func YCbCrOutput{"YCbCrOutput"};
-        Func chromaInput{"chromaInput"};
-        Func chromaDenoised{"chromaDenoised"};
+    inShadingMap0.set_estimates({{0, 17}, {0, 13}});
+    inShadingMap1.set_estimates({{0, 17}, {0, 13}});
+    inShadingMap2.set_estimates({{0, 17}, {0, 13}});
+    inShadingMap3.set_estimates({{0, 17}, {0, 13}});
 
-        RGBInput(v_x, v_y, v_c) = gammaCorrected(v_x, v_y, v_c) / 65535.0f;
+    asShotVector.set_estimate(0, 1.0f);
+    asShotVector.set_estimate(1, 1.0f);
+    asShotVector.set_estimate(2, 1.0f);
 
-        RGBToYCbCr(YCbCrOutput, RGBInput);
+    output.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
 
-        chromaInput(v_x, v_y, v_c) = saturating_cast<uint16_t>(
-            select( v_c == 0, YCbCrOutput(v_x, v_y, v_c) * 65535.0f + 0.5f,
-                    v_c == 1, (YCbCrOutput(v_x, v_y, v_c) + 0.5f) * 65535.0f + 0.5f,
-                              (YCbCrOutput(v_x, v_y, v_c) + 0.5f) * 65535.0f + 0.5f));
+    if(!auto_schedule) {
+        if(get_target().has_gpu_feature())
+            schedule_for_gpu();
+        else
+            schedule_for_cpu();
+    }
+}
 
-        chromaInput
-            .compute_root()
-            .parallel(v_y)
-            .vectorize(v_x, 8)
-            .unroll(v_c);
+void PostProcessGenerator::schedule_for_gpu() {
+}
 
-        auto gf0 = create<GuidedFilter>();
-        auto gf1 = create<GuidedFilter>();
+void PostProcessGenerator::schedule_for_cpu() { 
+    int vector_size_u8 = natural_vector_size<uint8_t>();
+    int vector_size_u16 = natural_vector_size<uint16_t>();
 
-        gf0->radius.set(15);
-        gf0->output_type.set(UInt(16));
-        gf0->apply(chromaInput, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(1));
+    // defringeVerticalTransposed
+    //     .compute_root()
+    //     .tile(v_x, v_y, v_xo, v_yo, v_x, v_y, 8, 8)
+    //     .vectorize(v_x)
+    //     .parallel(v_yo)
+    //     .parallel(v_c);
 
-        gf1->radius.set(15);
-        gf1->output_type.set(UInt(16));
-        gf1->apply(chromaInput, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(2));
+    // defringe
+    //     .compute_root()
+    //     .tile(v_x, v_y, v_xo, v_yo, v_x, v_y, 8, 8)
+    //     .vectorize(v_x)
+    //     .parallel(v_yo)
+    //     .parallel(v_c);
 
-        auto gf2 = create<GuidedFilter>();
-        auto gf3 = create<GuidedFilter>();
+    hdrTonemapInput
+        .compute_root()
+            .bound(v_c, 0, 3)
+            .reorder(v_c, v_x, v_y)
+            .parallel(v_y)
+            .unroll(v_c)
+            .vectorize(v_x, vector_size_u16);
 
-        Func secondPass{"secondPass"};
+    output
+        .compute_root()
+        .bound(v_c, 0, 3)
+        .reorder(v_c, v_x, v_y)
+        .split(v_y, v_yo, v_yi, 64)
+        .parallel(v_yo)
+        .unroll(v_c)
+        .vectorize(v_x, vector_size_u8);
+}
 
-        secondPass(v_x, v_y, v_c) = select(v_c == 0, gf0->output(v_x, v_y), gf1->output(v_x, v_y));
+//
+// Post process split into three passes so large images are never held at full resolution between the stages. The
+// tonemap pyramid depends on the whole image, but only through its coarse levels, which are small:
+//
+//   postprocess_tonemap         computes level TONEMAP_COARSE_LEVEL of the exposure and weight pyramids, in strips
+//   postprocess_tonemap_coarse  fuses the levels above it over the whole image
+//   postprocess_enhance         computes the fine levels again for a strip of the output, collapses them onto the
+//                               coarse result and finishes the strip
+//
+// All three read the image through Funcs that are defined past its edges, the same as PostProcessGenerator, so the
+// result matches it exactly as long as the stored levels cover the area the filters of the last stages reach.
+//
 
-        gf2->radius.set(15);
-        gf2->output_type.set(UInt(16));
-        gf2->apply(secondPass, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(0));
+class PostProcessTonemapGenerator : public Halide::Generator<PostProcessTonemapGenerator>, public PostProcessBase {
+public:
+    Input<Buffer<uint16_t>> in0{"in0", 2 };
+    Input<Buffer<uint16_t>> in1{"in1", 2 };
+    Input<Buffer<uint16_t>> in2{"in2", 2 };
+    Input<Buffer<uint16_t>> in3{"in3", 2 };
 
-        gf3->radius.set(15);
-        gf3->output_type.set(UInt(16));
-        gf3->apply(secondPass, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(1));
+    Input<Buffer<uint16_t>> hdrInput{"hdrInput", 3 };
+    Input<Buffer<uint8_t>> hdrMask{"hdrMask", 2 };
 
-        auto gf4 = create<GuidedFilter>();
-        auto gf5 = create<GuidedFilter>();
+    Input<bool> useHdr{"useHdr"};
 
-        Func thirdPass{"thirdPass"};
+    Input<float[3]> asShotVector{"asShotVector"};
 
-        thirdPass(v_x, v_y, v_c) = select(v_c == 0, gf2->output(v_x, v_y), gf3->output(v_x, v_y));
+    Input<Buffer<float>> cameraToSrgb{"cameraToSrgb", 2};
 
-        gf4->radius.set(25);
-        gf4->output_type.set(UInt(16));
-        gf4->apply(thirdPass, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(0));
+    Input<Buffer<float>> inShadingMap0{"inShadingMap0", 2 };
+    Input<Buffer<float>> inShadingMap1{"inShadingMap1", 2 };
+    Input<Buffer<float>> inShadingMap2{"inShadingMap2", 2 };
+    Input<Buffer<float>> inShadingMap3{"inShadingMap3", 2 };
 
-        gf5->radius.set(25);
-        gf5->output_type.set(UInt(16));
-        gf5->apply(thirdPass, chromaDenoiseEps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(1));
+    Input<uint16_t> range{"range"};
+    Input<int> sensorArrangement{"sensorArrangement"};
+    
+    Input<float> shadows{"shadows"};
+    Input<float> hdrInputGain{"hdrInputGain"};
+    Input<float> hdrScale{"hdrScale"};
+    Input<float> tonemapVariance{"tonemapVariance"};
+    Input<float> exposure{"exposure"};
 
-        chromaDenoised(v_x, v_y, v_c) = select(
-            v_c == 0, YCbCrOutput(v_x, v_y, v_c),
-            v_c == 1, gf4->output(v_x, v_y) / 65535.0f - 0.5f,
-                      gf5->output(v_x, v_y) / 65535.0f - 0.5f);
+    Output<Buffer<uint16_t>> tonemapLevel{"tonemapLevel", 4};
+    Output<Buffer<uint16_t>> weightsLevel{"weightsLevel", 3};
 
-        YCbCrToRGB(hsvInput, chromaDenoised);
-    }
-    else {
-        hsvInput(v_x, v_y, v_c) = gammaCorrected(v_x, v_y, v_c) / 65535.0f;
-    }
+    Func tonemapInput{"tonemapInput"};
+    Func hdrTonemapInput{"hdrTonemapInput"};
 
-    RGBToHSV(hsvOutput, hsvInput);
+    std::unique_ptr<Demosaic> demosaic;
 
-    //
-    // Saturation/hue
-    //
+    vector<pair<Func, Func>> tonemapPyramid;
+    vector<pair<Func, Func>> weightsPyramid;
 
-    shiftHues(saturationApplied, hsvOutput, blues, greens, saturation);
+    void generate();
+    void schedule_for_cpu();
+};
 
-    //
-    // Sharpen/Local contrast
-    //
+void PostProcessTonemapGenerator::generate()
+{
+    std::vector<Expr> asShot{ asShotVector[0], asShotVector[1], asShotVector[2] };
 
-    if(enableSharpen) {
-        sharpenInput(v_x, v_y) = saturating_cast<uint16_t>(hsvOutput(v_x, v_y, 2) * 65535.0f);
+    Expr WIDTH = in0.width();
+    Expr HEIGHT = in0.height();
 
-        sharpen(sharpened, sharpenInput);
-        
-        downsampled(v_x, v_y, v_c) = select(v_c == 0, downsample(sharpened, downsampledTmp)(v_x, v_y), 0);
+    // Demosaic image
+    Func inClamped0 = BoundaryConditions::repeat_edge(in0);
+    Func inClamped1 = BoundaryConditions::repeat_edge(in1);
+    Func inClamped2 = BoundaryConditions::repeat_edge(in2);
+    Func inClamped3 = BoundaryConditions::repeat_edge(in3);
 
-        auto gf = create<GuidedFilter>();
-        Func eps{"eps"};
+    demosaic = create<Demosaic>();
+    demosaic->apply(
+        inClamped0, inClamped1, inClamped2, inClamped3,
+        inShadingMap0, inShadingMap1, inShadingMap2, inShadingMap3,
+        WIDTH, HEIGHT,
+        inShadingMap0.width(), inShadingMap0.height(),
+        cast<float>(range),
+        sensorArrangement,
+        asShot,
+        cameraToSrgb);
 
-        eps(v_x, v_y) = 0.2f*0.2f*65535.0f*65535.0f;
+    tonemapInputs(
+        tonemapInput,
+        hdrTonemapInput,
+        demosaic->output,
+        BoundaryConditions::repeat_edge(hdrInput),
+        BoundaryConditions::repeat_edge(hdrMask),
+        useHdr,
+        exposure,
+        hdrInputGain,
+        hdrScale);
+
+    // Build the pyramids up to the coarse level
+    Func gammaLut{"gammaLut"}, inverseGammaLut{"inverseGammaLut"};
+    Func exposures{"exposures"};
+    Func weightsNormalized{"weightsNormalized"};
 
-        gf->radius.set(popRadius);
-        gf->output_type.set(UInt(16));
-        gf->apply(downsampled, eps, cast<uint16_t>(width), cast<uint16_t>(height), cast<uint16_t>(0));
+    tonemapLuts(gammaLut, inverseGammaLut, UInt(16), !auto_schedule);
+    tonemapWeights(exposures, weightsNormalized, tonemapInput, hdrTonemapInput, gammaLut, UInt(16), tonemapVariance, shadows, !auto_schedule);
 
-        upsampled = upsample(gf->output, upsampleTmp);
+    tonemapPyramid = buildPyramid(exposures, UInt(16), WIDTH * 2, HEIGHT * 2, 0, TONEMAP_COARSE_LEVEL);
+    weightsPyramid = buildPyramid(weightsNormalized, UInt(16), WIDTH * 2, HEIGHT * 2, 0, TONEMAP_COARSE_LEVEL);
 
-        localContrast(v_x, v_y) = saturating_cast<uint16_t>(0.5f + cast<float>(upsampled(v_x, v_y)) + pop*(cast<float>(sharpened(v_x, v_y)) - upsampled(v_x, v_y)));
+    tonemapLevel(v_x, v_y, v_c, v_i) = tonemapPyramid[TONEMAP_COARSE_LEVEL].second(v_x, v_y, v_c, v_i);
+    weightsLevel(v_x, v_y, v_i) = weightsPyramid[TONEMAP_COARSE_LEVEL].second(v_x, v_y, v_i);
 
-        bgrInput(v_x, v_y, v_c) = select(
-            v_c == 0, saturationApplied(v_x, v_y, v_c),
-            v_c == 1, saturationApplied(v_x, v_y, v_c),
-                      localContrast(v_x, v_y) / 65535.0f);
-    }
-    else {
-        bgrInput(v_x, v_y, v_c) = saturationApplied(v_x, v_y, v_c);
-    }
+    range.set_estimate(16384);
+    sensorArrangement.set_estimate(0);
 
-    HSVToBGR(finalRgb, bgrInput);
+    shadows.set_estimate(2.0f);
+    tonemapVariance.set_estimate(0.25f);
+    exposure.set_estimate(0.0f);
 
-    {
-        // Invert gamma
-        Expr a = v_i / 65535.0f;
-        Expr b = select(a < 0.04045f, a / 12.92f, pow((a + 0.055f) / 1.055f, 2.4f));
-    
-        inverseGammaLut(v_i) = saturating_cast<uint16_t>(b*65535.0f+0.5f);
-        
-        if(!auto_schedule)
-            inverseGammaLut.compute_root().vectorize(v_i, 8);
-    }
+    cameraToSrgb.set_estimates({{0, 3}, {0, 3}});
 
-    output(v_x, v_y, v_c) = inverseGammaLut(saturating_cast<uint16_t>(finalRgb(v_x, v_y, v_c) * 65535.0f + 0.5f));
+    in0.set_estimates({{0, 2048}, {0, 1536}});
+    in1.set_estimates({{0, 2048}, {0, 1536}});
+    in2.set_estimates({{0, 2048}, {0, 1536}});
+    in3.set_estimates({{0, 2048}, {0, 1536}});
 
-    contrast.set_estimate(1.5f);
-    blackPoint.set_estimate(0.01f);
-    whitePoint.set_estimate(0.95f);
-    blues.set_estimate(1.0f);
-    saturation.set_estimate(1.0f);
-    greens.set_estimate(1.0f);
-    sharpen0.set_estimate(2.0f);
-    width.set_estimate(4000);
-    height.set_estimate(3000);
+    inShadingMap0.set_estimates({{0, 17}, {0, 13}});
+    inShadingMap1.set_estimates({{0, 17}, {0, 13}});
+    inShadingMap2.set_estimates({{0, 17}, {0, 13}});
+    inShadingMap3.set_estimates({{0, 17}, {0, 13}});
 
-    input.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
-    output.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
+    asShotVector.set_estimate(0, 1.0f);
+    asShotVector.set_estimate(1, 1.0f);
+    asShotVector.set_estimate(2, 1.0f);
+
+    tonemapLevel.set_estimates({{0, 256}, {0, 64}, {0, 3}, {0, 3}});
+    weightsLevel.set_estimates({{0, 256}, {0, 64}, {0, 3}});
 
     if(!auto_schedule)
         schedule_for_cpu();
 }
 
-void EnhanceGenerator::schedule_for_cpu() {
-    gammaCorrected
+void PostProcessTonemapGenerator::schedule_for_cpu() {
+    int vector_size_u16 = natural_vector_size<uint16_t>();
+
+    hdrTonemapInput
         .compute_root()
+            .bound(v_c, 0, 3)
+            .reorder(v_c, v_x, v_y)
+            .parallel(v_y)
+            .unroll(v_c)
+            .vectorize(v_x, vector_size_u16);
+
+    // Levels below the coarse one, the coarse level itself is computed into the outputs
+    scheduleTonemapPyramids(tonemapPyramid, weightsPyramid, 0, TONEMAP_COARSE_LEVEL);
+
+    tonemapPyramid[TONEMAP_COARSE_LEVEL].first
+        .compute_at(tonemapLevel, v_y)
         .unroll(v_c)
-        .vectorize(v_x, 8)
-        .parallel(v_y);
+        .unroll(_0)
+        .vectorize(v_x, 8);
 
-    if(enableSharpen) {
-        blurOutputTmp
-            .compute_at(sharpened, tile_idx)
-            .vectorize(v_x, 8);
+    weightsPyramid[TONEMAP_COARSE_LEVEL].first
+        .compute_at(weightsLevel, v_y)
+        .unroll(v_c)
+        .vectorize(v_x, 8);
 
-        blurOutput
-            .compute_at(sharpened, tile_idx)
-            .vectorize(v_x, 8);
+    tonemapLevel
+        .compute_root()
+        .bound(v_c, 0, 3)
+        .bound(v_i, 0, 3)
+        .parallel(v_y)
+        .unroll(v_c)
+        .unroll(v_i)
+        .vectorize(v_x, 8);
 
-        blurOutput2Tmp
-            .compute_at(sharpened, tile_idx)
-            .vectorize(v_x, 8);
+    weightsLevel
+        .compute_root()
+        .bound(v_i, 0, 3)
+        .parallel(v_y)
+        .unroll(v_i)
+        .vectorize(v_x, 8);
+}
 
-        blurOutput2
-            .compute_at(sharpened, tile_idx)
-            .vectorize(v_x, 8);
+class PostProcessTonemapCoarseGenerator : public Halide::Generator<PostProcessTonemapCoarseGenerator>, public PostProcessBase {
+public:
+    Input<Buffer<uint16_t>> tonemapLevel{"tonemapLevel", 4};
+    Input<Buffer<uint16_t>> weightsLevel{"weightsLevel", 3};
 
-        gaussianDiff0
-            .compute_at(sharpened, tile_idx)
-            .vectorize(v_x, 8);
+    // Size of the full resolution image
+    Input<int> width{"width"};
+    Input<int> height{"height"};
 
-        gaussianDiff1
-            .compute_at(sharpened, tile_idx)
-            .vectorize(v_x, 8);
+    Output<Buffer<uint16_t>> output{"output", 3};
 
-        sharpenInput
-            .compute_at(sharpened, tile_idx)
-            .vectorize(v_x, 8);
+    vector<pair<Func, Func>> tonemapPyramid;
+    vector<pair<Func, Func>> weightsPyramid;
 
-        sharpened
-            .compute_root()
-            .reorder(v_x, v_y)
-            .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, 128, 128)
-            .fuse(v_xo, v_yo, tile_idx)
-            .parallel(tile_idx)
-            .vectorize(v_xi, 8);
+    void generate();
+};
 
-        downsampledTmp
-            .compute_at(downsampled, v_x)
-            .vectorize(v_x, 8);
+void PostProcessTonemapCoarseGenerator::generate()
+{
+    const int levels = TONEMAP_LEVELS - TONEMAP_COARSE_LEVEL;
 
-        downsampled
-            .compute_root()
-            .split(v_y, v_yo, v_yi, 64)
-            .vectorize(v_x, 8)
-            .parallel(v_yo);
+    Func tonemapInput{"tonemapInput"}, weightsInput{"weightsInput"};
 
-        upsampleTmp
-            .compute_at(localContrast, v_x)
-            .vectorize(v_x, 8);
+    tonemapInput(v_x, v_y, v_c, v_i) = tonemapLevel(v_x, v_y, v_c, v_i);
+    weightsInput(v_x, v_y, v_i) = weightsLevel(v_x, v_y, v_i);
 
-        upsampled
-            .compute_at(localContrast, v_x)
-            .vectorize(v_x, 8);
+    tonemapPyramid = buildPyramid(tonemapInput, UInt(16), width, height, TONEMAP_COARSE_LEVEL, levels);
+    weightsPyramid = buildPyramid(weightsInput, UInt(16), width, height, TONEMAP_COARSE_LEVEL, levels);
 
-        localContrast
-            .compute_root()
-            .vectorize(v_x, 8)
-            .parallel(v_y);
-    }
+    if(!auto_schedule)
+        scheduleTonemapPyramids(tonemapPyramid, weightsPyramid, TONEMAP_COARSE_LEVEL, levels);
 
-    saturationApplied
-        .compute_at(output, v_x)
-        .unroll(v_c)
-        .vectorize(v_x, 8);
+    vector<Func> combinedPyramid = fusePyramids(tonemapPyramid, weightsPyramid, TONEMAP_COARSE_LEVEL, true, !auto_schedule);
 
-    finalRgb
-        .compute_at(output, v_x)
-        .unroll(v_c)
-        .vectorize(v_x, 8);
+    Func top = combinedPyramid.back();
+    combinedPyramid.pop_back();
 
-    bgrInput
-        .compute_at(output, v_x)
-        .unroll(v_c)
-        .vectorize(v_x, 8);
+    output(v_x, v_y, v_c) = collapsePyramid(combinedPyramid, top, TONEMAP_COARSE_LEVEL, !auto_schedule)(v_x, v_y, v_c);
 
-    output
-        .compute_root()
-        .reorder(v_c, v_x, v_y)
-        .unroll(v_c)
-        .vectorize(v_x, 8)
-        .parallel(v_y);
-}
+    width.set_estimate(8192);
+    height.set_estimate(6144);
 
+    tonemapLevel.set_estimates({{0, 512}, {0, 384}, {0, 3}, {0, 3}});
+    weightsLevel.set_estimates({{0, 512}, {0, 384}, {0, 3}});
+    output.set_estimates({{0, 512}, {0, 384}, {0, 3}});
 
-class PostProcessGenerator : public Halide::Generator<PostProcessGenerator>, public PostProcessBase {
+    if(!auto_schedule) {
+        output
+            .compute_root()
+            .bound(v_c, 0, 3)
+            .parallel(v_y)
+            .unroll(v_c)
+            .vectorize(v_x, 8);
+    }
+}
+
+class PostProcessEnhanceGenerator : public Halide::Generator<PostProcessEnhanceGenerator>, public PostProcessBase {
 public:
     Input<Buffer<uint16_t>> in0{"in0", 2 };
     Input<Buffer<uint16_t>> in1{"in1", 2 };
@@ -2169,6 +2838,9 @@ public:
     Input<Buffer<uint16_t>> hdrInput{"hdrInput", 3 };
     Input<Buffer<uint8_t>> hdrMask{"hdrMask", 2 };
 
+    // Output of postprocess_tonemap_coarse
+    Input<Buffer<uint16_t>> tonemapCoarse{"tonemapCoarse", 3 };
+
     Input<bool> useHdr{"useHdr"};
 
     Input<float[3]> asShotVector{"asShotVector"};
@@ -2182,7 +2854,7 @@ public:
 
     Input<uint16_t> range{"range"};
     Input<int> sensorArrangement{"sensorArrangement"};
-    
+
     Input<float> shadows{"shadows"};
     Input<float> hdrInputGain{"hdrInputGain"};
     Input<float> hdrScale{"hdrScale"};
@@ -2203,40 +2875,25 @@ public:
     Input<float> chromaEps3{"chromaEps3"};
 
     Output<Buffer<uint8_t>> output{"output", 3};
-    
+
     Func chromaEpsMap{"chromaEpsMap"}, chromaEps{"chromaEps"};
-    Func Lmap{"Lmap"};
-    Func LmapTmp0{"LmapTmp0"}, LmapTmp1{"LmapTmp1"}, LmapTmp2{"LmapTmp2"}, LmapTmp3{"LmapTmp3"};
 
-    Func colorCorrected{"colorCorrected"};
     Func hdrTonemapInput{"hdrTonemapInput"};
-    Func highlights{"highlights"};
-    Func YCbCr{"YCbCr"};
-    Func linearRgb{"linearRgb"};
-    Func tonemapped{"tonemapped"};
     Func tonemapInput{"tonemapInput"};
-    Func hdrTonemapped{"hdrTonemapped"};
-    Func downsampleTemp{"downsampleTemp"};
-    Func upsampleTemp0{"upsampleTemp0"};
-    Func upsampleTemp1{"upsampleTemp1"};
-    Func enhanceInput{"enhanceInput"};    
-    Func noiseInput{"noiseInput"};
-    Func noise{"noise"};
+    Func tonemapped{"tonemapped"};
     Func gammaLut{"gammaLut"};
 
     std::unique_ptr<Demosaic> demosaic;
-    std::unique_ptr<TonemapGenerator> tonemap;
     std::unique_ptr<EnhanceGenerator> enhance;
-    
+
+    vector<pair<Func, Func>> tonemapPyramid;
+    vector<pair<Func, Func>> weightsPyramid;
+
     void generate();
-    void schedule_for_gpu();
     void schedule_for_cpu();
-    
-private:
-    void sharpen(Func sharpenInputY);
 };
 
-void PostProcessGenerator::generate()
+void PostProcessEnhanceGenerator::generate()
 {
     std::vector<Expr> asShot{ asShotVector[0], asShotVector[1], asShotVector[2] };
 
@@ -2261,52 +2918,46 @@ void PostProcessGenerator::generate()
         cameraToSrgb);
 
     // Calculate chroma denoising map
-    Lmap(v_x, v_y) = cast<uint8_t>(0.5f + 255.0f*pow(demosaic->output(v_x, v_y, 1)/65535.0f, 1.0f/2.2f));
-    chromaEpsMap(v_x, v_y) = cast<uint8_t>(upsample(upsample(downsample(downsample(Lmap, LmapTmp0), LmapTmp1), LmapTmp2), LmapTmp3)(v_x, v_y));
-    
-    Expr X = chromaEpsMap(v_x, v_y)/255.0f;
-    Expr W = chromaEps1*exp(-chromaEps0*(X*X)) + 1.0f;
-    Expr eps = W*chromaEps3;
-
-    chromaEps(v_x, v_y) = 65535.0f*65535.0f*eps*eps;
-
-     // Blend HDR images based on provided mask
-    tonemapInput(v_x, v_y, v_c) = saturating_cast<uint16_t>(0.5f + pow(2.0f, exposure) * demosaic->output(v_x, v_y, v_c));
-
-    Func hdrInputRepeated{"hdrInputRepeated"};
-    Func baseInput{"baseInput"};
-    Func hdrMaskInput{"hdrMaskInput"};
+    createChromaEpsMap(chromaEpsMap, demosaic->output, !auto_schedule);
+    calcChromaEps(chromaEps, chromaEpsMap, chromaEps0, chromaEps1, chromaEps3);
+
+    tonemapInputs(
+        tonemapInput,
+        hdrTonemapInput,
+        demosaic->output,
+        BoundaryConditions::repeat_edge(hdrInput),
+        BoundaryConditions::repeat_edge(hdrMask),
+        useHdr,
+        exposure,
+        hdrInputGain,
+        hdrScale);
 
-    baseInput(v_x, v_y, v_c) = demosaic->output(v_x, v_y, v_c) / 65535.0f;
-    hdrInputRepeated(v_x, v_y, v_c) = Halide::BoundaryConditions::repeat_edge(hdrInput)(v_x, v_y, v_c)/65535.0f;
-    hdrMaskInput(v_x, v_y) = Halide::BoundaryConditions::repeat_edge(hdrMask)(v_x, v_y)/255.0f;
+    //
+    // Tonemap the fine levels onto the coarse result
+    //
 
-    highlights(v_x, v_y, v_c) = (hdrMaskInput(v_x, v_y)*hdrInputRepeated(v_x, v_y, v_c)) + ((1.0f - hdrMaskInput(v_x, v_y))*hdrScale*baseInput(v_x, v_y, v_c));
+    Func tonemapGammaLut{"tonemapGammaLut"}, inverseGammaLut{"inverseGammaLut"};
+    Func exposures{"exposures"};
+    Func weightsNormalized{"weightsNormalized"};
+    Func coarseInput{"coarseInput"};
 
-    hdrTonemapInput(v_x, v_y, v_c) = select(useHdr, 
-        saturating_cast<uint16_t>(hdrInputGain * highlights(v_x, v_y, v_c) * 65535.0f),
-        tonemapInput(v_x, v_y, v_c));
+    tonemapLuts(tonemapGammaLut, inverseGammaLut, UInt(16), !auto_schedule);
+    tonemapWeights(exposures, weightsNormalized, tonemapInput, hdrTonemapInput, tonemapGammaLut, UInt(16), tonemapVariance, shadows, !auto_schedule);
 
-    //
-    // Tonemap
-    //
+    tonemapPyramid = buildPyramid(exposures, UInt(16), WIDTH * 2, HEIGHT * 2, 0, TONEMAP_COARSE_LEVEL);
+    weightsPyramid = buildPyramid(weightsNormalized, UInt(16), WIDTH * 2, HEIGHT * 2, 0, TONEMAP_COARSE_LEVEL);
 
-    tonemap = create<TonemapGenerator>();
+    if(!auto_schedule)
+        scheduleTonemapPyramids(tonemapPyramid, weightsPyramid, 0, TONEMAP_COARSE_LEVEL + 1);
 
-    tonemap->output_type.set(UInt(16));
-    tonemap->tonemap_levels.set(TONEMAP_LEVELS);
-    tonemap->apply(tonemapInput, hdrTonemapInput, WIDTH * 2, HEIGHT * 2, tonemapVariance, shadows);
+    vector<Func> combinedPyramid = fusePyramids(tonemapPyramid, weightsPyramid, 0, false, !auto_schedule);
 
-    // defringeVertical.define_extern("extern_defringe", { (Func) tonemap->output, WIDTH*2, HEIGHT*2 }, UInt(16), 3);
-    // defringeVertical.compute_root();
+    coarseInput(v_x, v_y, v_c) = tonemapCoarse(v_x, v_y, v_c);
 
-    // defringeVerticalTransposed(v_x, v_y, v_c) = defringeVertical(v_y, v_x, v_c);
+    Func fused = collapsePyramid(combinedPyramid, coarseInput, 0, !auto_schedule);
 
-    // defringeHorizontal.define_extern("extern_defringe", { defringeVerticalTransposed, HEIGHT*2, WIDTH*2 }, UInt(16), 3);
-    // defringeHorizontal.compute_root();
+    tonemapped(v_x, v_y, v_c) = inverseGammaLut(cast<uint16_t>(clamp(fused(v_x, v_y, v_c), 0, UInt(16).max())));
 
-    // defringe(v_x, v_y, v_c) = defringeHorizontal(v_y, v_x, v_c);
-    
     // Finalize output
     enhance = create<EnhanceGenerator>();
 
@@ -2315,7 +2966,7 @@ void PostProcessGenerator::generate()
     enhance->popRadius.set(25);
 
     enhance->apply(
-        tonemap->output,
+        tonemapped,
         chromaEps,
         WIDTH*2,
         HEIGHT*2,
@@ -2331,19 +2982,7 @@ void PostProcessGenerator::generate()
         pop);
 
     // Finish with blue noise dithering + gamma
-    Expr h = v_i / 255.0f;
-
-    gammaLut(v_i) = saturating_cast<uint8_t>(select(h < 0.0031308f, h * 12.92f, pow(h, 1.0f / 2.4f) * 1.055f - 0.055f) * 255.0f + 0.5f);
-    if(!auto_schedule)
-        gammaLut.compute_root().vectorize(v_i, 8);
-
-    // Dither using blue noise
-    noiseInput(v_x, v_y, v_c) = BoundaryConditions::repeat_image(blueNoise)(v_x, v_y, v_c) * 2.0f/255.0f - 1.0f;
-
-    Expr S = select(noiseInput(v_x, v_y, v_c) < 0.0f, -1.0f, 1.0f);
-    noise(v_x, v_y, v_c) = S*(1.0f - sqrt(max(0.0f, 1.0f - abs(noiseInput(v_x, v_y, v_c)))));
-
-    output(v_x, v_y, v_c) = gammaLut(saturating_cast<uint8_t>(0.5f + enhance->output(v_x, v_y, v_c) * 255.0f / 65535.0f + noise(v_x, v_y, v_c)));
+    output(v_x, v_y, v_c) = dither(enhance->output, BoundaryConditions::repeat_image(blueNoise), gammaLut)(v_x, v_y, v_c);
 
     // Noise/output are interleaved
     blueNoise
@@ -2353,7 +2992,7 @@ void PostProcessGenerator::generate()
     output
         .dim(0).set_stride(3)
         .dim(2).set_stride(1);
-    
+
     range.set_estimate(16384);
     sensorArrangement.set_estimate(0);
 
@@ -2370,7 +3009,7 @@ void PostProcessGenerator::generate()
     sharpen1.set_estimate(2.0f);
     chromaEps0.set_estimate(0.01f);
     chromaEps1.set_estimate(0.01f);
-    
+
     cameraToSrgb.set_estimates({{0, 3}, {0, 3}});
 
     in0.set_estimates({{0, 2048}, {0, 1536}});
@@ -2387,61 +3026,20 @@ void PostProcessGenerator::generate()
     asShotVector.set_estimate(1, 1.0f);
     asShotVector.set_estimate(2, 1.0f);
 
-    output.set_estimates({{0, 4096}, {0, 3072}, {0, 3}});
-
-    if(!auto_schedule) {
-        if(get_target().has_gpu_feature())
-            schedule_for_gpu();
-        else
-            schedule_for_cpu();
-    }
-}
+    tonemapCoarse.set_estimates({{0, 256}, {0, 192}, {0, 3}});
+    output.set_estimates({{0, 4096}, {0, 1024}, {0, 3}});
 
-void PostProcessGenerator::schedule_for_gpu() {
+    if(!auto_schedule)
+        schedule_for_cpu();
 }
 
-void PostProcessGenerator::schedule_for_cpu() { 
+void PostProcessEnhanceGenerator::schedule_for_cpu() {
     int vector_size_u8 = natural_vector_size<uint8_t>();
     int vector_size_u16 = natural_vector_size<uint16_t>();
 
-    Lmap
-        .compute_at(chromaEpsMap, v_y)
-        .vectorize(v_x, 8);
-
-    LmapTmp0
-        .compute_at(chromaEpsMap, v_y)
-        .vectorize(v_x, 8);
-
-    LmapTmp1
-        .compute_at(chromaEpsMap, v_y)
-        .vectorize(v_x, 8);
-
-    LmapTmp2
-        .compute_at(chromaEpsMap, v_y)
-        .vectorize(v_x, 8);
-
-    LmapTmp3
-        .compute_at(chromaEpsMap, v_y)
-        .vectorize(v_x, 8);
-
-    chromaEpsMap
+    gammaLut
         .compute_root()
-        .vectorize(v_y, 12)
-        .parallel(v_y);
-
-    // defringeVerticalTransposed
-    //     .compute_root()
-    //     .tile(v_x, v_y, v_xo, v_yo, v_x, v_y, 8, 8)
-    //     .vectorize(v_x)
-    //     .parallel(v_yo)
-    //     .parallel(v_c);
-
-    // defringe
-    //     .compute_root()
-    //     .tile(v_x, v_y, v_xo, v_yo, v_x, v_y, 8, 8)
-    //     .vectorize(v_x)
-    //     .parallel(v_yo)
-    //     .parallel(v_c);
+        .vectorize(v_i, 8);
 
     hdrTonemapInput
         .compute_root()
@@ -2451,6 +3049,13 @@ void PostProcessGenerator::schedule_for_cpu() {
             .unroll(v_c)
             .vectorize(v_x, vector_size_u16);
 
+    tonemapped
+        .compute_root()
+        .bound(v_c, 0, 3)
+        .parallel(v_y)
+        .unroll(v_c)
+        .vectorize(v_x, 8);
+
     output
         .compute_root()
         .bound(v_c, 0, 3)
@@ -2608,6 +3213,8 @@ void PreviewGenerator::generate() {
         .parallel(v_y)
         .vectorize(v_x, 4);
 
+    specializeRaw(tonemapInput, pixelFormat, sensorArrangement);
+
     tonemap = create<TonemapGenerator>();
 
     tonemap->output_type.set(UInt(16));
@@ -3012,6 +3619,8 @@ void DeinterleaveRawGenerator::schedule_for_cpu(::Halide::Pipeline pipeline, ::H
             .split(x, x_vo, x_vi, 8)
             .vectorize(x_vi)
             .parallel(y);
+
+        specializeRawFormat(bayer_1, pixelFormat);
     }
     {
         Var i = gammaLut.args()[0];
@@ -3404,6 +4013,8 @@ public:
         output.compute_root()
             .parallel(v_y)
             .vectorize(v_x, 8);
+
+        specializeRaw(output, pixelFormat, sensorArrangement);
     }
 };
 
@@ -3544,6 +4155,9 @@ void MeasureNoiseGenerator::generate() {
             .unroll(v_c)
             .parallel(v_y);
 
+        specializeRawFormat(mean, pixelFormat);
+        specializeRawFormat(output, pixelFormat);
+
         snr
             .compute_root()
             .bound(v_c, 0, 4)
@@ -3852,6 +4466,9 @@ HALIDE_REGISTER_GENERATOR(MeasureImageGenerator, measure_image_generator)
 HALIDE_REGISTER_GENERATOR(MeasureNoiseGenerator, measure_noise_generator)
 HALIDE_REGISTER_GENERATOR(DeinterleaveRawGenerator, deinterleave_raw_generator)
 HALIDE_REGISTER_GENERATOR(PostProcessGenerator, postprocess_generator)
+HALIDE_REGISTER_GENERATOR(PostProcessTonemapGenerator, postprocess_tonemap_generator)
+HALIDE_REGISTER_GENERATOR(PostProcessTonemapCoarseGenerator, postprocess_tonemap_coarse_generator)
+HALIDE_REGISTER_GENERATOR(PostProcessEnhanceGenerator, postprocess_enhance_generator)
 HALIDE_REGISTER_GENERATOR(FastPreviewGenerator, fast_preview_generator)
 HALIDE_REGISTER_GENERATOR(FastPreviewGenerator2, fast_preview_generator2)
 HALIDE_REGISTER_GENERATOR(GuidedFilter, guided_filter_generator)
@@ -24,106 +24,132 @@ mkdir -p tmp
 g++ DenoiseGenerator.cpp ${HALIDE_PATH}/share/tools/GenGen.cpp -g -o3 -std=c++17 -Wall -pedantic -I ${HALIDE_PATH}/include -L ${HALIDE_PATH}/lib -lHalide -lpthread -ldl -o ./tmp/denoise_generator
 g++ PostProcessGenerator.cpp ${HALIDE_PATH}/share/tools/GenGen.cpp -g -o3 -std=c++17 -Wall -pedantic -I ${HALIDE_PATH}/include -L ${HALIDE_PATH}/lib -lHalide -lpthread -ldl -o ./tmp/postprocess_generator
 
+# Appends the flags to each target of a comma separated list of targets
+function with_flags() {
+	local IFS=','
+	local TARGETS=()
+
+	for T in $1; do
+		TARGETS+=("${T}-$2")
+	done
+
+	echo "${TARGETS[*]}"
+}
+
 function build_denoise() {
 	TARGET=$1
 	ARCH=$2
-	FLAGS="no_runtime"
+	FLAGS=${3:-"no_runtime"}
+	TARGETS=$(with_flags "${TARGET}" "${FLAGS}")
 
 	echo "[$ARCH] Building denoise_generator_3x3"
-	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_3x3 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} window=3
+	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_3x3 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} window=3
 
 	echo "[$ARCH] Building denoise_generator_5x5"
-	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_5x5 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} window=5
+	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_5x5 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} window=5
 
 	echo "[$ARCH] Building denoise_generator_7x7"
-	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_7x7 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} window=7
+	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_7x7 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} window=7
+
+	echo "[$ARCH] Building forward_transform_raw"
+	./tmp/denoise_generator -g normalized_forward_transform_generator -f forward_transform_raw -e static_library,h -o ../halide/${ARCH} target=${TARGETS} input.type=uint16 levels=4
 
-	echo "[$ARCH] Building forward_transform_generator"
-	./tmp/denoise_generator -g forward_transform_generator -f forward_transform -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.type=uint16 levels=4
+	echo "[$ARCH] Building forward_transform_fused"
+	./tmp/denoise_generator -g normalized_forward_transform_generator -f forward_transform_fused -e static_library,h -o ../halide/${ARCH} target=${TARGETS} input.type=float32 levels=4
 
 	echo "[$ARCH] Building fuse_image_generator"
-	./tmp/denoise_generator -g fuse_image_generator -f fuse_image -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.type=uint16 reference.size=4 reference.type=float32 intermediate.size=4 intermediate.type=float32
+	./tmp/denoise_generator -g fuse_image_generator -f fuse_image -e static_library,h -o ../halide/${ARCH} target=${TARGETS} input.type=uint16 reference.size=4 reference.type=float32 intermediate.size=4 intermediate.type=float32
 
 	echo "[$ARCH] Building inverse_transform_generator"
-	./tmp/denoise_generator -g inverse_transform_generator -f inverse_transform -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.size=4
+	./tmp/denoise_generator -g inverse_transform_generator -f inverse_transform -e static_library,h -o ../halide/${ARCH} target=${TARGETS} input.size=4
 }
 
 function build_postprocess() {
 	TARGET=$1
 	ARCH=$2
-	FLAGS="no_runtime"
+	FLAGS=${3:-"no_runtime"}
+	TARGETS=$(with_flags "${TARGET}" "${FLAGS}")
 
 	echo "[$ARCH] Building stats_generator"
-	./tmp/postprocess_generator -g stats_generator -f generate_stats -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g stats_generator -f generate_stats -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
 
 	echo "[$ARCH] Building measure_noise_generator"
-	./tmp/postprocess_generator -g measure_noise_generator -f measure_noise -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g measure_noise_generator -f measure_noise -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
 
 	echo "[$ARCH] Building build_bayer_generator"
-	./tmp/postprocess_generator -g build_bayer_generator -f build_bayer -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g build_bayer_generator -f build_bayer -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
 
 	echo "[$ARCH] Building build_bayer_generator2"
-	./tmp/postprocess_generator -g build_bayer_generator2 -f build_bayer2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g build_bayer_generator2 -f build_bayer2 -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
 
 	echo "[$ARCH] Building hdr_mask_generator"
-	./tmp/postprocess_generator -g hdr_mask_generator -f hdr_mask -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g hdr_mask_generator -f hdr_mask -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
 
 	echo "[$ARCH] Building linear_image_generator"
-	./tmp/postprocess_generator -g linear_image_generator -f linear_image -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g linear_image_generator -f linear_image -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
 
 	echo "[$ARCH] Building measure_image_generator"
-	./tmp/postprocess_generator -g measure_image_generator -f measure_image -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g measure_image_generator -f measure_image -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
 
 	echo "[$ARCH] Building generate_edges_generator"
-	./tmp/postprocess_generator -g generate_edges_generator -f generate_edges -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g generate_edges_generator -f generate_edges -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
 
 	echo "[$ARCH] Building deinterleave_raw_generator"
-	./tmp/postprocess_generator -g deinterleave_raw_generator -f deinterleave_raw -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g deinterleave_raw_generator -f deinterleave_raw -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
 
 	echo "[$ARCH] Building postprocess_generator"
-	./tmp/postprocess_generator -g postprocess_generator -f postprocess -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g postprocess_generator -f postprocess -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
+
+	echo "[$ARCH] Building postprocess_tonemap_generator"
+	./tmp/postprocess_generator -g postprocess_tonemap_generator -f postprocess_tonemap -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
+
+	echo "[$ARCH] Building postprocess_tonemap_coarse_generator"
+	./tmp/postprocess_generator -g postprocess_tonemap_coarse_generator -f postprocess_tonemap_coarse -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
+
+	echo "[$ARCH] Building postprocess_enhance_generator"
+	./tmp/postprocess_generator -g postprocess_enhance_generator -f postprocess_enhance -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
 
 	echo "[$ARCH] Building fast_preview_generator"
-	./tmp/postprocess_generator -g fast_preview_generator -f fast_preview -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g fast_preview_generator -f fast_preview -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
 
 	echo "[$ARCH] Building fast_preview_generator2"
-	./tmp/postprocess_generator -g fast_preview_generator2 -f fast_preview2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g fast_preview_generator2 -f fast_preview2 -e static_library,h -o ../halide/${ARCH} target=${TARGETS}
 
 	echo "[$ARCH] Building preview_generator2 rotation=0"
-	./tmp/postprocess_generator -g preview_generator -f preview_landscape2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=0 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
+	./tmp/postprocess_generator -g preview_generator -f preview_landscape2 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} rotation=0 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
 
 	echo "[$ARCH] Building preview_generator2 rotation=90"
-	./tmp/postprocess_generator -g preview_generator -f preview_reverse_portrait2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=90 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
+	./tmp/postprocess_generator -g preview_generator -f preview_reverse_portrait2 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} rotation=90 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
 
 	echo "[$ARCH] Building preview_generator2 rotation=-90"
-	./tmp/postprocess_generator -g preview_generator -f preview_portrait2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=-90 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
+	./tmp/postprocess_generator -g preview_generator -f preview_portrait2 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} rotation=-90 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
 
 	echo "[$ARCH] Building preview_generator2 rotation=180"
-	./tmp/postprocess_generator -g preview_generator -f preview_reverse_landscape2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=180 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
+	./tmp/postprocess_generator -g preview_generator -f preview_reverse_landscape2 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} rotation=180 tonemap_levels=9 downscale_factor=2 enable_sharpen=true pop_radius=7
 
 	echo "[$ARCH] Building preview_generator4 rotation=0"
-	./tmp/postprocess_generator -g preview_generator -f preview_landscape4 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=0 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
+	./tmp/postprocess_generator -g preview_generator -f preview_landscape4 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} rotation=0 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
 
 	echo "[$ARCH] Building preview_generator4 rotation=90"
-	./tmp/postprocess_generator -g preview_generator -f preview_reverse_portrait4 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=90 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
+	./tmp/postprocess_generator -g preview_generator -f preview_reverse_portrait4 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} rotation=90 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
 
 	echo "[$ARCH] Building preview_generator4 rotation=-90"
-	./tmp/postprocess_generator -g preview_generator -f preview_portrait4 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=-90 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
+	./tmp/postprocess_generator -g preview_generator -f preview_portrait4 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} rotation=-90 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
 
 	echo "[$ARCH] Building preview_generator4 rotation=180"
-	./tmp/postprocess_generator -g preview_generator -f preview_reverse_landscape4 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=180 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
+	./tmp/postprocess_generator -g preview_generator -f preview_reverse_landscape4 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} rotation=180 tonemap_levels=8 downscale_factor=4 enable_sharpen=true pop_radius=3
 
 	echo "[$ARCH] Building preview_generator8 rotation=0"
-	./tmp/postprocess_generator -g preview_generator -f preview_landscape8 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=0 tonemap_levels=7 downscale_factor=8 enable_sharpen=false pop_radius=3
+	./tmp/postprocess_generator -g preview_generator -f preview_landscape8 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} rotation=0 tonemap_levels=7 downscale_factor=8 enable_sharpen=false pop_radius=3
 
 	echo "[$ARCH] Building preview_generator8 rotation=90"
-	./tmp/postprocess_generator -g preview_generator -f preview_reverse_portrait8 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=90 tonemap_levels=7 downscale_factor=8 enable_sharpen=false pop_radius=3
+	./tmp/postprocess_generator -g preview_generator -f preview_reverse_portrait8 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} rotation=90 tonemap_levels=7 downscale_factor=8 enable_sharpen=false pop_radius=3
 
 	echo "[$ARCH] Building preview_generator8 rotation=-90"
-	./tmp/postprocess_generator -g preview_generator -f preview_portrait8 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=-90 tonemap_levels=7 downscale_factor=8 enable_sharpen=false
+	./tmp/postprocess_generator -g preview_generator -f preview_portrait8 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} rotation=-90 tonemap_levels=7 downscale_factor=8 enable_sharpen=false
 
 	echo "[$ARCH] Building preview_generator8 rotation=180"
-	./tmp/postprocess_generator -g preview_generator -f preview_reverse_landscape8 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=180 tonemap_levels=7 downscale_factor=8 enable_sharpen=false
+	./tmp/postprocess_generator -g preview_generator -f preview_reverse_landscape8 -e static_library,h -o ../halide/${ARCH} target=${TARGETS} rotation=180 tonemap_levels=7 downscale_factor=8 enable_sharpen=false
 }
 
 function build_runtime() {
@@ -141,11 +167,68 @@ function build_runtime() {
 	# mv ../halide/${ARCH}/halide_runtime.a ../halide/${ARCH}/halide_runtime_opencl.a
 }
 
+# On x86-64 each pipeline is built for AVX-512, AVX2 and SSE4.1. The best variant the CPU supports is picked when
+# the pipeline runs. The runtime is built for the lowest of them so it runs everywhere.
+if [[ "$(uname -m)" == "x86_64" ]]; then
+	if [[ "$OSTYPE" == "darwin"* ]]; then
+		HOST_OS="osx"
+	else
+		HOST_OS="linux"
+	fi
+
+	HOST_TARGETS="x86-64-${HOST_OS}-avx-avx2-avx512-avx512_skylake-f16c-fma-sse41,x86-64-${HOST_OS}-avx-avx2-f16c-fma-sse41,x86-64-${HOST_OS}-sse41"
+	HOST_RUNTIME="x86-64-${HOST_OS}-sse41"
+else
+	HOST_TARGETS="host"
+	HOST_RUNTIME="host"
+fi
+
 mkdir -p ../halide/host
 
-build_denoise host host
-build_postprocess host host
-build_runtime host host
+build_denoise ${HOST_TARGETS} host
+build_postprocess ${HOST_TARGETS} host
+build_runtime ${HOST_RUNTIME} host
+
+# Profiling build of the host pipelines, linked when configuring with -DMOTIONCAM_HALIDE_PROFILE=ON
+if [ "${MOTIONCAM_HALIDE_PROFILE:-0}" == "1" ]; then
+	mkdir -p ../halide/host-profile
+
+	build_denoise ${HOST_TARGETS} host-profile no_runtime-profile
+	build_postprocess ${HOST_TARGETS} host-profile no_runtime-profile
+	build_runtime ${HOST_RUNTIME}-profile host-profile
+fi
+
+# Hand and autoscheduled builds of standalone generators, compared by schedule-comparison-benchmark. Configure
+# with -DMOTIONCAM_BUILD_BENCHMARKS=ON -DMOTIONCAM_BUILD_SCHEDULE_BENCHMARK=ON to build it.
+if [ "${MOTIONCAM_SCHEDULE_BENCHMARK:-0}" == "1" ]; then
+	if [[ "$OSTYPE" == "darwin"* ]]; then
+		PLUGIN_EXT="dylib"
+	else
+		PLUGIN_EXT="so"
+	fi
+
+	mkdir -p ../halide/host-schedules
+
+	SCHEDULE_TARGETS=$(with_flags "${HOST_TARGETS}" "no_runtime")
+
+	for SCHEDULER in hand Adams2019 Mullapudi2016; do
+		SUFFIX=$(echo "${SCHEDULER}" | tr '[:upper:]' '[:lower:]')
+
+		if [ "${SCHEDULER}" == "hand" ]; then
+			SCHEDULE_ARGS=""
+			SCHEDULE_PARAMS=""
+		else
+			SCHEDULE_ARGS="-p ${HALIDE_PATH}/lib/libautoschedule_${SUFFIX}.${PLUGIN_EXT} -s ${SCHEDULER}"
+			SCHEDULE_PARAMS="auto_schedule=true"
+		fi
+
+		echo "[host-schedules] Building guided_filter_${SUFFIX}"
+		./tmp/postprocess_generator -g guided_filter_generator -f guided_filter_${SUFFIX} ${SCHEDULE_ARGS} -e static_library,h -o ../halide/host-schedules target=${SCHEDULE_TARGETS} input.type=uint16 eps.type=float32 ${SCHEDULE_PARAMS}
+
+		echo "[host-schedules] Building tonemap_${SUFFIX}"
+		./tmp/postprocess_generator -g tonemap_generator -f tonemap_${SUFFIX} ${SCHEDULE_ARGS} -e static_library,h -o ../halide/host-schedules target=${SCHEDULE_TARGETS} input0.type=uint16 input1.type=uint16 tonemap_levels=9 ${SCHEDULE_PARAMS}
+	done
+fi
 
 mkdir -p ../halide/arm64-v8a
 
@@ -0,0 +1,69 @@
+#ifndef BatchProcessor_hpp
+#define BatchProcessor_hpp
+
+#include <string>
+#include <vector>
+
+namespace motioncam {
+
+    struct BatchJobReport {
+        int jobId;
+        std::string containerPath;
+        std::string outputPath;
+        int priority;
+        size_t memoryEstimate;
+        bool succeeded;
+        std::string error;
+        double queuedMs;
+        double processingMs;
+    };
+
+    class BatchProcessorListener {
+    public:
+        virtual ~BatchProcessorListener() = default;
+
+        virtual void onJobStarted(const BatchJobReport& report) const {}
+        virtual void onJobProgress(int jobId, int progress) const {}
+        virtual void onJobCompleted(const BatchJobReport& report) const = 0;
+    };
+
+    //
+    // Processes a queue of still captures. Several jobs run concurrently as long as their estimated memory use fits
+    // within the budget. All of them run on the shared thread pool and each job uses at most numThreads of its
+    // threads, or all of them when numThreads is zero. Jobs with a higher priority are started first, otherwise they
+    // start in the order they were added.
+    //
+    // Listener callbacks are made on the thread that called run().
+    //
+
+    class BatchProcessor {
+    public:
+        BatchProcessor(int maxConcurrentJobs, size_t memoryLimitBytes, int numThreads=0);
+
+        // Not copyable
+        BatchProcessor(const BatchProcessor&) = delete;
+        BatchProcessor& operator=(const BatchProcessor&) = delete;
+
+        int add(const std::string& containerPath, const std::string& outputPath, int priority=0);
+
+        // Processes all queued jobs and blocks until they are done. A failed job does not stop the others.
+        std::vector<BatchJobReport> run(const BatchProcessorListener& listener);
+
+    private:
+        struct Job {
+            int id;
+            std::string containerPath;
+            std::string outputPath;
+            int priority;
+        };
+
+    private:
+        const int mMaxConcurrentJobs;
+        const size_t mMemoryLimit;
+        const int mNumThreads;
+
+        std::vector<Job> mJobs;
+    };
+}
+
+#endif /* BatchProcessor_hpp */
@@ -0,0 +1,34 @@
+#ifndef CpuFeatures_hpp
+#define CpuFeatures_hpp
+
+#include <string>
+
+namespace motioncam {
+    namespace cpu {
+        //
+        // Host builds of the Halide pipelines contain an AVX-512, AVX2 and SSE4.1 variant and the runtime picks the
+        // best one the CPU supports on every call. The level can be capped to compare the variants or to work around
+        // a problem with one of them.
+        //
+
+        enum class IsaLevel : int {
+            BASELINE = 0,
+            SSE41,
+            AVX2,
+            AVX512
+        };
+
+        // Best level supported by the CPU
+        IsaLevel detectIsaLevel();
+
+        // Level of the variants the pipelines currently run
+        IsaLevel getIsaLevel();
+
+        // Stops the pipelines from using variants above the given level
+        void setMaxIsaLevel(IsaLevel level);
+
+        std::string toString(IsaLevel level);
+    }
+}
+
+#endif /* CpuFeatures_hpp */
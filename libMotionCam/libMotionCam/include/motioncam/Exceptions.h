@@ -2,6 +2,7 @@
 #define Exceptions_hpp
 
 #include <exception>
+#include <stdexcept>
 #include <string>
 
 namespace motioncam {
@@ -9,8 +9,17 @@
 
 namespace motioncam {
     
+    // Highest quantile estimateNoise() uses. The histogram range grows with 1 / (1 - p), so higher values are
+    // clamped to this.
+    const float MAX_NOISE_QUANTILE = 0.99f;
+
+    // Median absolute deviation noise estimate. Uses a histogram so the input is not copied or sorted. p must be in
+    // [0, 1) and is clamped to MAX_NOISE_QUANTILE, InvalidState is thrown otherwise. Non-finite values are ignored.
     float estimateNoise(cv::Mat& input, float p=0.5f);
     
+    // Reference implementation of estimateNoise() using an exact median
+    float estimateNoiseExact(cv::Mat& input, float p=0.5f);
+    
     float findMedian(cv::Mat& input, float p=0.5f);
     float findMedian(std::vector<float> nums);
     
@@ -3,6 +3,7 @@
 
 #include "motioncam/ImageProcessorProgress.h"
 #include "motioncam/RawImageMetadata.h"
+#include "motioncam/NoiseModel.h"
 
 #include <string>
 #include <vector>
@@ -15,6 +16,15 @@ namespace motioncam {
     const int WAVELET_LEVELS        = 4;
     const int EXTEND_EDGE_AMOUNT    = 6;
 
+    // Scratch wavelet pyramids kept by a DenoiseContext, and so the number of channels denoised at once
+    const int DEFAULT_DENOISE_PYRAMIDS = 2;
+
+    // Default memory budget for the tasks that run concurrently when processing a capture
+    const size_t DEFAULT_PROCESS_MEMORY_LIMIT = static_cast<size_t>(1024) * 1024 * 1024;
+
+    // Outputs at least this large are post processed in strips of rows to bound memory use
+    const size_t TILED_POSTPROCESS_MIN_PIXELS = 24 * 1000 * 1000;
+
     class RawImage;
     class RawContainer;
     class Temperature;
@@ -31,14 +41,44 @@ namespace motioncam {
         RawImageMetadata metadata;
     };
 
+    //
+    // State kept across frames when denoising a sequence. Holds the scratch wavelet pyramids for the spatial
+    // denoise and the noise model. The Bayer channels share the pyramids, so as many channels are processed
+    // concurrently as there are pyramids. Each pyramid takes about 2.7 times the size of the 16-bit RAW frame, see
+    // pyramidBytes(). The buffers are only reallocated when the frame size changes.
+    //
+
+    class DenoiseContext {
+    public:
+        explicit DenoiseContext(int numPyramids=DEFAULT_DENOISE_PYRAMIDS);
+
+        void prepare(int width, int height);
+        int numPyramids() const;
+        std::vector<Halide::Runtime::Buffer<float>>& wavelet(int pyramid);
+        NoiseModel& noiseModel();
+
+        // Bytes used by one pyramid for a channel of the given size
+        static size_t pyramidBytes(int width, int height);
+
+    private:
+        int mWidth;
+        int mHeight;
+        std::vector<std::vector<Halide::Runtime::Buffer<float>>> mWavelet;
+        NoiseModel mNoiseModel;
+    };
+
     class ImageProgressHelper {
     public:
         ImageProgressHelper(const ImageProcessorProgress& progressListener, int numImages, int start);
 
         void nextFusedImage();        
+        void frameAccepted(const std::string& frame, float alignmentError);
+        void frameRejected(const std::string& frame, float alignmentError);
         void denoiseCompleted();
         void postProcessCompleted();
         void imageSaved();
+
+        const ImageProcessorProgress& listener() const { return mProgressListener; }
         
     private:
         const ImageProcessorProgress& mProgressListener;
@@ -52,9 +92,13 @@ namespace motioncam {
     public:
         static void process(const std::string& inputPath,
                             const std::string& outputPath,
-                            const ImageProcessorProgress& progressListener);
+                            const ImageProcessorProgress& progressListener,
+                            const size_t memoryLimitBytes=DEFAULT_PROCESS_MEMORY_LIMIT);
 
-        static void process(RawContainer& rawContainer, const std::string& outputPath, const ImageProcessorProgress& progressListener);
+        static void process(RawContainer& rawContainer,
+                            const std::string& outputPath,
+                            const ImageProcessorProgress& progressListener,
+                            const size_t memoryLimitBytes=DEFAULT_PROCESS_MEMORY_LIMIT);
 
         static Halide::Runtime::Buffer<uint8_t> createPreview(const RawImageBuffer& rawBuffer,
                                                               const int downscaleFactor,
@@ -104,6 +148,12 @@ namespace motioncam {
         static const std::vector<float>& estimateDenoiseWeights(const float noise);
         
         static double measureSharpness(const RawCameraMetadata& cameraMetadata, const RawImageBuffer& rawBuffer);
+        static double measurePreviewSharpness(const RawCameraMetadata& cameraMetadata,
+                                              const RawImageBuffer& rawBuffer,
+                                              const int downscale);
+
+        static std::string selectReference(RawContainer& rawContainer, const float minRelativeSharpness);
+
         static void measureNoise(const RawCameraMetadata& cameraMetadata,
                                  const RawImageBuffer& rawBuffer,
                                  std::vector<float>& outNoise,
@@ -139,7 +189,8 @@ namespace motioncam {
             std::shared_ptr<RawImageBuffer> referenceRawBuffer,
             std::vector<std::shared_ptr<RawImageBuffer>> buffers,
             const std::vector<float>& denoiseWeights,
-            const RawCameraMetadata& cameraMetadata);
+            const RawCameraMetadata& cameraMetadata,
+            DenoiseContext& context);
 
         static Halide::Runtime::Buffer<float> denoise(
             std::shared_ptr<RawImageBuffer> referenceRawBuffer,
@@ -151,7 +202,8 @@ namespace motioncam {
             RawData& reference,
             RawContainer& rawContainer,
             float* outNoise,
-            ImageProgressHelper& progressHelper);
+            ImageProgressHelper& progressHelper,
+            const size_t memoryBudgetBytes=0);
 
         static void addExifMetadata(const RawImageMetadata& metadata,
                                     const cv::Mat& thumbnail,
@@ -159,6 +211,15 @@ namespace motioncam {
                                     const PostProcessSettings& settings,
                                     const std::string& inputOutput);
 
+        // Encodes the image and adds the EXIF metadata in memory, then writes the file once
+        static void writeJpeg(const cv::Mat& image,
+                              const cv::Mat& thumbnail,
+                              const int quality,
+                              const RawImageMetadata& metadata,
+                              const RawCameraMetadata& cameraMetadata,
+                              const PostProcessSettings& settings,
+                              const std::string& outputPath);
+
         static cv::Mat postProcess(std::vector<Halide::Runtime::Buffer<uint16_t>>& inputBuffers,
                                    const std::shared_ptr<HdrMetadata>& hdrMetadata,
                                    int offsetX,
@@ -166,7 +227,8 @@ namespace motioncam {
                                    const float noiseEstimate,
                                    const RawImageMetadata& metadata,
                                    const RawCameraMetadata& cameraMetadata,
-                                   const PostProcessSettings& settings);
+                                   const PostProcessSettings& settings,
+                                   const size_t tiledMinPixels=TILED_POSTPROCESS_MIN_PIXELS);
 
         static float testAlignment(std::shared_ptr<RawData> refImage,
                                    std::shared_ptr<RawData> underexposedImage,
@@ -177,11 +239,14 @@ namespace motioncam {
         static std::shared_ptr<HdrMetadata> prepareHdr(const RawCameraMetadata& cameraMetadata,
                                                        const PostProcessSettings& settings,
                                                        const RawImageBuffer& reference,
-                                                       const RawImageBuffer& underexposed);
+                                                       const std::vector<std::shared_ptr<RawImageBuffer>>& underexposed);
 
         static double calcEv(const RawCameraMetadata& cameraMetadata, const RawImageMetadata& metadata);
 
         static double getMinEv(RawContainer& container);
+
+        // Rough peak memory use of process() for the container, without loading any frame data
+        static size_t estimateProcessMemory(RawContainer& rawContainer);
         
         static float adjustShadowsForFaces(cv::Mat input, PreviewMetadata& metadata);
         
@@ -1,6 +1,7 @@
 #ifndef ImageProcessorProgress_h
 #define ImageProcessorProgress_h
 
+#include <cstddef>
 #include <string>
 
 namespace motioncam {
@@ -10,6 +11,12 @@ namespace motioncam {
         virtual bool onProgressUpdate(int progress) const = 0;
         virtual void onCompleted() const = 0;
         virtual void onError(const std::string& error) const = 0;
+        
+        // Called for each burst frame with whether it was merged and how well it aligned to the reference
+        virtual void onFrameFused(const std::string& frame, bool accepted, float alignmentError) const {}
+
+        // Called when a processing stage finishes with the highest and current number of bytes in use
+        virtual void onMemoryUsage(const std::string& stage, size_t peakBytes, size_t bytesInUse) const {}
     };
 }
 
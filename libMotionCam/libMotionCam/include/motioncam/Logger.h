@@ -5,8 +5,40 @@
 
 namespace motioncam {
     namespace logger {
+        //
+        // Messages are queued and written by a background thread, so logging never blocks the caller. This matters
+        // for the streamer IO threads, which run at real time priority. Each thread may log a limited number of
+        // messages below Error per second and messages are dropped when the queue is full. The number of dropped
+        // messages is logged once there is room again.
+        //
+
+        enum class Level : int {
+            Debug = 0,
+            Info,
+            Warning,
+            Error
+        };
+
+        // Starts the thread writing the messages at normal priority. Call it once at startup, otherwise the first
+        // message starts the thread.
+        void start();
+
         void log(const std::string& str);
         void debug(const std::string& str);
+        void warning(const std::string& str);
+        void error(const std::string& str);
+
+        void log(Level level, const std::string& str);
+
+        // Messages below the level are discarded. Defaults to Debug.
+        void setLevel(Level level);
+        Level getLevel();
+
+        // Messages each thread may log per second before the rest are dropped. 0 disables the limit.
+        void setRateLimit(int messagesPerSecond);
+
+        // Blocks until all queued messages have been written, for at most a second
+        void flush();
     }
 }
 
@@ -2,18 +2,74 @@
 #define Measure_hpp
 
 #include <chrono>
+#include <cstdint>
 #include <string>
 
 namespace motioncam {
-    
+
+    namespace trace {
+        //
+        // Spans and counters recorded into a ring buffer per thread while tracing is enabled, and exported in the
+        // Chrome trace event format (chrome://tracing, ui.perfetto.dev). Only the newest events of each thread are
+        // kept. Tracing is off by default and a disabled span costs one atomic load.
+        //
+
+        void setEnabled(bool enabled);
+        bool isEnabled();
+
+        // Drops all recorded events
+        void clear();
+
+        // Name shown for the calling thread in the trace. Also allocates the event buffer of the thread, so threads
+        // that can't wait on an allocation later should call it when they start.
+        void setThreadName(const std::string& name);
+
+        // Records the value of a counter at the current time
+        void counter(const char* name, int64_t value);
+
+        // Events of all threads as Chrome trace JSON
+        std::string toJson();
+
+        // Writes the JSON to a file. Throws IOException on failure.
+        void write(const std::string& outputPath);
+    }
+
+    //
+    // Records the scope as a span while tracing is enabled. Spans on the same thread nest. Never logs, so it can be
+    // used in per frame code.
+    //
+
+    class ScopedTrace {
+    public:
+        explicit ScopedTrace(const char* name);
+        explicit ScopedTrace(const std::string& name);
+        ~ScopedTrace();
+
+        ScopedTrace(const ScopedTrace&) = delete;
+        ScopedTrace& operator=(const ScopedTrace&) = delete;
+
+    private:
+        void begin(const char* name);
+
+    private:
+        std::string mName;
+        int64_t mStartNs;
+        bool mActive;
+    };
+
+    //
+    // Logs the time taken by the scope and records it as a span while tracing is enabled
+    //
+
     class Measure {
     public:
-        Measure(std::string  reference);
+        Measure(std::string reference);
         virtual ~Measure();
-        
+
     private:
         std::string mReference;
         std::chrono::steady_clock::time_point mTimestamp;
+        ScopedTrace mTrace;
     };
 }
 
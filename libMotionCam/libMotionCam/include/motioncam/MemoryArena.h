@@ -0,0 +1,86 @@
+#ifndef MemoryArena_hpp
+#define MemoryArena_hpp
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <HalideBuffer.h>
+
+namespace motioncam {
+
+    // Cached bytes kept by the arena when the application installs it
+    const size_t DEFAULT_ARENA_MAX_CACHED_BYTES = static_cast<size_t>(512) * 1024 * 1024;
+
+    struct MemoryStats {
+        size_t numAllocations;      // Calls to allocate()
+        size_t numReused;           // Allocations served from the cache
+        size_t bytesAllocated;      // Bytes requested by allocate()
+        size_t bytesFromSystem;     // Bytes newly allocated from the system
+        size_t bytesInUse;
+        size_t peakBytesInUse;
+        size_t bytesCached;
+    };
+
+    //
+    // Size bucketed cache of large allocations. Freed blocks are kept and handed out again to requests of the same
+    // bucket, so repeated processing of frames of the same size stops going to the system allocator. Buckets are a
+    // quarter of a power of two apart, which wastes at most 25% of a block. Allocations smaller than 4KB all use
+    // the smallest bucket.
+    //
+    // Blocks are only cached once the arena has been installed, which also routes the internal allocations of the
+    // Halide pipelines through it. Install it once when the application starts, blocks the Halide runtime allocated
+    // before are still handed back to the previous allocator. The statistics are collected either way and are shared
+    // by all threads.
+    //
+
+    class MemoryArena {
+    public:
+        static MemoryArena& get();
+
+        // Installs the arena as the Halide runtime's malloc/free. Must not be called while pipelines run.
+        static void install(size_t maxCachedBytes);
+
+        // Puts the previous malloc/free back. Only when no pipeline runs and none holds blocks of the arena, such as
+        // when the application shuts down.
+        static void uninstall();
+        static bool isInstalled();
+
+        // Whether the block was allocated by the arena
+        static bool owns(void* ptr);
+
+        void* allocate(size_t size);
+        void free(void* ptr);
+
+        // Releases all cached blocks back to the system
+        void trim();
+
+        MemoryStats stats() const;
+        void resetStats();
+
+        // Buffer whose memory comes from the arena
+        template<typename T, typename ...Args>
+        static Halide::Runtime::Buffer<T> buffer(int first, Args... rest) {
+            Halide::Runtime::Buffer<T> result(static_cast<T*>(nullptr), first, rest...);
+            result.allocate(&allocateBuffer, &freeBuffer);
+
+            return result;
+        }
+
+    private:
+        MemoryArena();
+
+        void setMaxCachedBytes(size_t maxCachedBytes);
+
+        static void* allocateBuffer(size_t size);
+        static void freeBuffer(void* ptr);
+
+    private:
+        mutable std::mutex mMutex;
+        std::map<size_t, std::vector<void*>> mFreeBlocks;
+        size_t mMaxCachedBytes;
+        MemoryStats mStats;
+    };
+}
+
+#endif /* MemoryArena_hpp */
@@ -0,0 +1,121 @@
+#ifndef MemoryUsage_hpp
+#define MemoryUsage_hpp
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace motioncam {
+    class ImageProcessorProgress;
+
+    enum class MemoryType : int {
+        HALIDE = 0,     // Buffers from the memory arena, and the pipelines' own allocations once it is installed
+        OPENCV,         // cv::Mat data, once the counting allocator is installed
+        RAW             // RawImageBuffer payloads held on the host
+    };
+
+    const int NUM_MEMORY_TYPES = 3;
+
+    struct StageMemoryUsage {
+        StageMemoryUsage();
+
+        std::string stage;
+        size_t bytesInUseStart;
+        size_t bytesInUseEnd;
+
+        // Highest use while the stage ran. Includes anything running at the same time, such as other tasks of
+        // ImageProcessor::process.
+        size_t peakBytesInUse;
+        size_t peakBytesInUseByType[NUM_MEMORY_TYPES];
+    };
+
+    //
+    // Live and peak bytes of the large allocations made while processing, by type. The counts are shared by all
+    // threads. Allocations made before counting started, such as cv::Mat data allocated before the OpenCV
+    // allocator was installed, are not seen.
+    //
+    // Counting an allocation only updates atomics. Allocations raise the peak since the last stage began or ended,
+    // which is folded into the active stages when the next one begins or ends.
+    //
+
+    class MemoryUsage {
+    public:
+        static MemoryUsage& get();
+
+        // Counts the data of all cv::Mat allocated from now on
+        static void installOpenCVAllocator();
+
+        void allocated(MemoryType type, size_t bytes);
+        void freed(MemoryType type, size_t bytes);
+
+        size_t bytesInUse() const;
+        size_t bytesInUse(MemoryType type) const;
+        size_t peakBytesInUse() const;
+
+        // Most recently finished stages, oldest first
+        std::vector<StageMemoryUsage> stages() const;
+
+        // Clears the finished stages and resets the peak to the current use
+        void reset();
+
+    private:
+        friend class MemoryStage;
+
+        MemoryUsage();
+
+        int beginStage(const std::string& name);
+        StageMemoryUsage endStage(int id);
+
+        void updateStagePeaks();
+
+    private:
+        struct ActiveStage {
+            int id;
+            StageMemoryUsage usage;
+        };
+
+        std::atomic<size_t> mBytesInUse[NUM_MEMORY_TYPES];
+        std::atomic<size_t> mTotalBytesInUse;
+
+        // Peaks since the stage peaks were last updated
+        std::atomic<size_t> mRecentPeakBytesInUse[NUM_MEMORY_TYPES];
+        std::atomic<size_t> mRecentPeakTotalBytesInUse;
+
+        // Guards the members below
+        mutable std::mutex mMutex;
+        size_t mPeakBytesInUse;
+        int mNextStageId;
+        std::vector<ActiveStage> mActiveStages;
+        std::vector<StageMemoryUsage> mStages;
+    };
+
+    //
+    // Records the peak memory use while in scope, or until end() is called. When the stage ends, the usage is passed
+    // to the progress listener and recorded as a trace counter, and a warning is logged when the peak went over the
+    // budget.
+    //
+
+    class MemoryStage {
+    public:
+        MemoryStage(const std::string& name,
+                    const ImageProcessorProgress* progressListener=nullptr,
+                    size_t budgetBytes=0);
+        ~MemoryStage();
+
+        MemoryStage(const MemoryStage&) = delete;
+        MemoryStage& operator=(const MemoryStage&) = delete;
+
+        // Ends the stage before the end of the scope
+        void end();
+
+    private:
+        const int mId;
+        const ImageProcessorProgress* mProgressListener;
+        const size_t mBudgetBytes;
+        bool mEnded;
+    };
+}
+
+#endif /* MemoryUsage_hpp */
@@ -1,6 +1,8 @@
 #ifndef NativeBuffer_h
 #define NativeBuffer_h
 
+#include "motioncam/MemoryUsage.h"
+
 #include <vector>
 #include <stdint.h>
 
@@ -45,24 +47,37 @@ namespace motioncam {
 
     class NativeHostBuffer : public NativeBuffer {
     public:
-        NativeHostBuffer()
+        NativeHostBuffer() : mTrackedBytes(0)
         {
         }
 
-        NativeHostBuffer(size_t length) : data(length)
+        NativeHostBuffer(size_t length) : data(length), mTrackedBytes(0)
         {
+            updateUsage();
         }
 
-        NativeHostBuffer(const std::vector<uint8_t>& other) : data(other)
+        NativeHostBuffer(const std::vector<uint8_t>& other) : data(other), mTrackedBytes(0)
         {
+            updateUsage();
         }
 
-        NativeHostBuffer(const uint8_t* other, size_t len)
+        NativeHostBuffer(const uint8_t* other, size_t len) : mTrackedBytes(0)
         {
             data.resize(len);
             data.assign(other, other + len);
+
+            updateUsage();
+        }
+
+        ~NativeHostBuffer()
+        {
+            MemoryUsage::get().freed(MemoryType::RAW, mTrackedBytes);
         }
 
+        // A copy would free the tracked bytes twice, clone() copies the data
+        NativeHostBuffer(const NativeHostBuffer&) = delete;
+        NativeHostBuffer& operator=(const NativeHostBuffer&) = delete;
+
         std::unique_ptr<NativeBuffer> clone() {
             return std::unique_ptr<NativeHostBuffer>(new NativeHostBuffer(data));
         }
@@ -84,6 +99,7 @@ namespace motioncam {
         
         void allocate(size_t len) {
             data.resize(len);
+            updateUsage();
         }
         
         const std::vector<uint8_t>& hostData()
@@ -94,21 +110,36 @@ namespace motioncam {
         void copyHostData(const std::vector<uint8_t>& other)
         {
             data = std::move(other);
+            updateUsage();
         }
         
         void release()
         {
             data.resize(0);
             data.shrink_to_fit();
+            updateUsage();
         }
 
         void shrink(size_t newSize)
         {
             data.resize(newSize);
+            updateUsage();
+        }
+
+    private:
+        void updateUsage()
+        {
+            if(data.size() > mTrackedBytes)
+                MemoryUsage::get().allocated(MemoryType::RAW, data.size() - mTrackedBytes);
+            else if(data.size() < mTrackedBytes)
+                MemoryUsage::get().freed(MemoryType::RAW, mTrackedBytes - data.size());
+
+            mTrackedBytes = data.size();
         }
 
     private:
         std::vector<uint8_t> data;
+        size_t mTrackedBytes;
     };
 
 } // namespace motioncam
@@ -0,0 +1,54 @@
+#ifndef NoiseModel_hpp
+#define NoiseModel_hpp
+
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include <HalideBuffer.h>
+
+namespace motioncam {
+    struct RawImageBuffer;
+    struct RawCameraMetadata;
+    struct RawImageMetadata;
+
+    //
+    // Per channel noise thresholds for the temporal denoise. Thresholds are derived from the sensor noise profile
+    // (pairs of S, O where variance = S * x + O for a signal x normalised to [0, 1]) and only measured from the image
+    // when the profile is missing or implausible.
+    //
+
+    class NoiseModel {
+    public:
+        NoiseModel();
+
+        // Returns the noise threshold (in raw units) of each channel, evaluated at the median signal level of the
+        // deinterleaved frame. Falls back to measuring the noise of rawBuffer when the profile is not usable. The
+        // result is cached by ISO, exposure time and signal level.
+        void estimate(const RawCameraMetadata& cameraMetadata,
+                      const RawImageBuffer& rawBuffer,
+                      const Halide::Runtime::Buffer<uint16_t>& deinterleaved,
+                      const int patchSize,
+                      std::vector<float>& outNoise);
+
+        // Evaluates the noise profile at the given per channel signal level (in raw units). When signal is empty,
+        // the noise is evaluated at 18% grey. Returns false if the profile is missing or implausible.
+        static bool fromNoiseProfile(const RawCameraMetadata& cameraMetadata,
+                                     const RawImageMetadata& metadata,
+                                     const std::vector<float>& signal,
+                                     std::vector<float>& outNoise);
+
+        // Median signal level (in raw units) of each channel of a deinterleaved RAW image. Only a subset of the
+        // pixels is sampled.
+        static void measureSignal(const Halide::Runtime::Buffer<uint16_t>& rawBuffer, std::vector<float>& outSignal);
+
+        void clear();
+
+    private:
+        std::mutex mMutex;
+        std::map<std::tuple<int32_t, int64_t, int>, std::vector<float>> mCache;
+    };
+}
+
+#endif /* NoiseModel_hpp */
@@ -0,0 +1,51 @@
+#ifndef Profiler_hpp
+#define Profiler_hpp
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace motioncam {
+
+    struct FuncTiming {
+        std::string name;
+        double timeMs;
+        double percent;         // Of the pipeline's total time
+        uint64_t memoryPeak;
+        int numAllocations;
+    };
+
+    struct PipelineTiming {
+        std::string name;
+        int runs;
+        double timeMs;
+        std::vector<FuncTiming> funcs;  // Slowest first
+    };
+
+    namespace profiler {
+        //
+        // Per Func timings of the Halide pipelines. Timings are only collected when linking the profiling build of
+        // the pipelines (generate.sh with MOTIONCAM_HALIDE_PROFILE=1, CMake with -DMOTIONCAM_HALIDE_PROFILE=ON).
+        // Otherwise the functions below return no timings. The Halide profiler samples which Func is running, so
+        // short runs give noisy results.
+        //
+
+        bool isEnabled();
+
+        // Clears the timings of all pipelines
+        void reset();
+
+        // Timings of every pipeline that ran since the last reset
+        std::vector<PipelineTiming> collect();
+
+        // Resets the timings, calls f and returns the timings of the pipelines it ran. The timings are shared by all
+        // threads, so don't use it while other pipelines run.
+        std::vector<PipelineTiming> run(const std::function<void()>& f);
+
+        // Human readable table of the timings
+        std::string toString(const std::vector<PipelineTiming>& timings);
+    }
+}
+
+#endif /* Profiler_hpp */
@@ -42,6 +42,7 @@ namespace motioncam {
         void addBuffer(std::shared_ptr<RawImageBuffer>& buffer);
         bool removeBuffer();
         void recordingStats(size_t& outMemoryUseBytes, float& outFps, size_t& outOutputSizeBytes);
+        StreamingStats streamingStats();
         size_t memoryUseBytes() const;
         int numBuffers() const;
         void reset();
@@ -102,6 +103,9 @@ namespace motioncam {
         moodycamel::ConcurrentQueue<std::unique_ptr<RawContainer>> mPendingContainers;
         
         std::shared_ptr<RawBufferStreamer> mStreamer;
+
+        // Stats of the last recording once it has ended
+        StreamingStats mLastStreamingStats;
     };
 
 } // namespace motioncam
@@ -13,8 +13,36 @@
 namespace motioncam {
     struct RawCameraMetadata;
     struct RawImageBuffer;
+    class RawContainer;
     class AudioInterface;
 
+    struct StreamingStats {
+        StreamingStats() :
+            fps(0),
+            writtenFrames(0),
+            writtenBytes(0),
+            droppedFrames(0),
+            unprocessedQueueDepth(0),
+            readyQueueDepth(0),
+            averageWriteTimeMs(0),
+            maxWriteTimeMs(0)
+        {
+        }
+
+        float fps;
+        int writtenFrames;
+        size_t writtenBytes;
+        int droppedFrames;
+
+        // Buffers waiting to be compressed and waiting to be written
+        size_t unprocessedQueueDepth;
+        size_t readyQueueDepth;
+
+        // Time taken to add a frame to the container
+        float averageWriteTimeMs;
+        float maxWriteTimeMs;
+    };
+
     class RawBufferStreamer {
     public:
         RawBufferStreamer();
@@ -28,6 +56,9 @@ namespace motioncam {
         
         void add(const std::shared_ptr<RawImageBuffer>& frame);
         void stop();
+
+        // Counts a frame that was lost because no buffer was free for it
+        void frameDropped();
         
         void setCropAmount(int width, int height);
         void setBin(bool bin);
@@ -35,6 +66,7 @@ namespace motioncam {
         float estimateFps() const;
         size_t writenOutputBytes() const;
         int droppedFrames() const;
+        StreamingStats stats() const;
 
         void cropAndBin(RawImageBuffer& buffer) const;
         void crop(RawImageBuffer& buffer) const;
@@ -44,6 +76,7 @@ namespace motioncam {
         void doStream(const int fd, const RawCameraMetadata& cameraMetadata, const int numContainers);
         
         void processBuffer(const std::shared_ptr<RawImageBuffer>& buffer) const;
+        void writeBuffer(RawContainer& container, const std::shared_ptr<RawImageBuffer>& buffer);
         
     private:
         std::shared_ptr<AudioInterface> mAudioInterface;
@@ -61,6 +94,8 @@ namespace motioncam {
         std::atomic<int> mAcceptedFrames;
         std::atomic<size_t> mWrittenBytes;
         std::atomic<int> mDroppedFrames;
+        std::atomic<int64_t> mTotalWriteTimeNs;
+        std::atomic<int64_t> mMaxWriteTimeNs;
         std::chrono::steady_clock::time_point mStartTime;
         
         moodycamel::BlockingConcurrentQueue<std::shared_ptr<RawImageBuffer>> mUnprocessedBuffers;
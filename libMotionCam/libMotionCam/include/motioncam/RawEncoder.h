@@ -12,6 +12,12 @@ namespace motioncam {
             ANDROID_RAW16
         };
 
+        //
+        // Encodes the area of the frame and writes the stream over the data, returning its length. Returns 0 and
+        // leaves the data unchanged if the frame can't be encoded without loss, the caller should then store it
+        // uncompressed.
+        //
+
         size_t encode(uint8_t* data,
                       PixelFormat pixelFormat,
                       const int xstart,
@@ -28,6 +34,7 @@ namespace motioncam {
                             const int yend,
                             const int rowStride);
     
+        // Returns the number of pixels decoded
         size_t decode(uint16_t* output, const int width, const int height, const uint8_t* input, const size_t len);
     }
 }
@@ -0,0 +1,29 @@
+#ifndef Resources_hpp
+#define Resources_hpp
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <HalideBuffer.h>
+
+namespace motioncam {
+    namespace resources {
+        //
+        // Constant inputs shared by the processing pipelines. Each resource is created on first use and then kept
+        // for the lifetime of the process. The returned buffers share their memory with the cache and must not be
+        // modified.
+        //
+
+        // Blue noise texture used for dithering (interleaved RGBA)
+        Halide::Runtime::Buffer<uint8_t> blueNoise();
+
+        // Flat shading map used for frames that don't have one
+        const std::vector<cv::Mat>& emptyShadingMap();
+
+        // Placeholder inputs for the post process when there is no HDR image
+        Halide::Runtime::Buffer<uint16_t> emptyHdrInput();
+        Halide::Runtime::Buffer<uint8_t> emptyHdrMask();
+    }
+}
+
+#endif /* Resources_hpp */
@@ -0,0 +1,78 @@
+#ifndef SyntheticRaw_hpp
+#define SyntheticRaw_hpp
+
+#include "motioncam/Types.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace motioncam {
+    struct RawImageBuffer;
+    struct RawCameraMetadata;
+
+    struct SyntheticRawSettings {
+        SyntheticRawSettings();
+
+        int width;
+        int height;
+
+        ColorFilterArrangment sensorArrangment;
+        PixelFormat pixelFormat;
+
+        std::vector<float> blackLevel;
+        float whiteLevel;
+
+        // Pairs of S, O (variance = S * x + O for a signal x normalised to [0, 1]). Either a single pair for all
+        // channels or one per channel. Written to the frames as their noise profile.
+        std::vector<double> noiseProfile;
+
+        // Global motion between consecutive frames, in pixels and degrees around the centre of the frame
+        float motionX;
+        float motionY;
+        float rotation;
+
+        // Lens shading gain in the corners. The frames are darkened by the inverse of the written shading map.
+        float vignetting;
+        int shadingMapWidth;
+        int shadingMapHeight;
+
+        int numFrames;
+        int64_t frameIntervalNs;
+        int64_t exposureTime;
+        int32_t iso;
+
+        uint32_t seed;
+    };
+
+    //
+    // Generates RAW frames of a fixed test scene with the noise, lens shading and motion described by the settings,
+    // so the pipelines can be run and benchmarked without captures from a device. The same settings and seed always
+    // produce the same frames.
+    //
+
+    class SyntheticRaw {
+    public:
+        SyntheticRaw(const SyntheticRawSettings& settings);
+
+        RawCameraMetadata cameraMetadata() const;
+
+        // Frame i of the burst. Frame 0 is unshifted and later frames move by the configured motion.
+        std::shared_ptr<RawImageBuffer> createFrame(int i) const;
+
+        // Writes all frames into a container. The middle frame is used as the reference.
+        void writeContainer(const std::string& outputPath) const;
+
+        // Parses "rggb", "grbg", "gbrg" or "bggr" and "raw10", "raw12" or "raw16"
+        static ColorFilterArrangment parseSensorArrangment(const std::string& value);
+        static PixelFormat parsePixelFormat(const std::string& value);
+
+    private:
+        void pack(const std::vector<uint16_t>& bayer, uint8_t* output, int rowStride) const;
+
+    private:
+        const SyntheticRawSettings mSettings;
+    };
+}
+
+#endif /* SyntheticRaw_hpp */
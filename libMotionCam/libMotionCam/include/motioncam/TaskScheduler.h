@@ -0,0 +1,101 @@
+#ifndef TaskScheduler_hpp
+#define TaskScheduler_hpp
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <queue>
+
+namespace motioncam {
+
+    //
+    // Runs a small graph of tasks on the shared thread pool. A task starts once its dependencies have completed and
+    // its estimated memory use fits within the limit alongside the tasks already running. A task is always allowed
+    // to start when nothing else is running so the graph can't stall on a single large task. At most numThreads
+    // tasks run at once, and loops started by the tasks inherit the concurrency limit of the thread calling run().
+    //
+    // Each ready task is submitted to the pool on its own once it has been admitted, so pool threads are never held
+    // waiting on dependencies or memory. Completing a task submits the tasks it made ready.
+    //
+    // The thread calling run() services callbacks that tasks post with runOnCallingThread(), for listeners that are
+    // bound to the calling thread. It only runs submitted tasks itself when none are running, so the graph still
+    // completes when all pool workers are busy.
+    //
+
+    class TaskScheduler {
+    public:
+        typedef int TaskId;
+
+        TaskScheduler(int numThreads, size_t memoryLimitBytes);
+
+        // Not copyable
+        TaskScheduler(const TaskScheduler&) = delete;
+        TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+        TaskId add(const std::string& name,
+                   size_t memoryEstimateBytes,
+                   std::function<void()> task,
+                   const std::vector<TaskId>& dependencies=std::vector<TaskId>());
+
+        // Runs all tasks and blocks until they are done. Rethrows the first error raised by a task, in which case
+        // tasks that have not started yet are skipped.
+        void run();
+
+        // Runs the function on the thread that called run() and waits for it to complete. Runs the function
+        // directly when called outside of run().
+        void runOnCallingThread(const std::function<void()>& f);
+
+    private:
+        enum class State { PENDING, QUEUED, RUNNING, DONE };
+
+        struct Task {
+            std::string name;
+            size_t memoryEstimate;
+            std::function<void()> task;
+            std::vector<TaskId> dependencies;
+            State state;
+        };
+
+        //
+        // Shared with the tasks submitted to the pool, which may only get to run after run() has returned
+        //
+
+        struct Graph {
+            Graph(int maxTasks, size_t memoryLimit);
+
+            const int maxTasks;
+            const size_t memoryLimit;
+
+            std::mutex mutex;
+            std::condition_variable condition;
+
+            std::vector<Task> tasks;
+            size_t memoryInUse;         // Of the queued and running tasks
+            int numQueued;
+            int numRunning;
+            bool running;
+            int maxConcurrency;
+            std::thread::id callingThread;
+            std::exception_ptr error;
+
+            std::queue<std::function<void()>> callbacks;
+        };
+
+        static void submitReadyTasks(const std::shared_ptr<Graph>& graph);
+        static void runQueuedTask(const std::shared_ptr<Graph>& graph, int index);
+        static void runTask(const std::shared_ptr<Graph>& graph, int index, std::unique_lock<std::mutex>& lock);
+        static int nextReadyTask(const Graph& graph);
+        static int nextQueuedTask(const Graph& graph);
+        static bool finished(const Graph& graph);
+
+    private:
+        std::shared_ptr<Graph> mGraph;
+    };
+}
+
+#endif /* TaskScheduler_hpp */
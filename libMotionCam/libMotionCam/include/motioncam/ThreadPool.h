@@ -0,0 +1,99 @@
+#ifndef ThreadPool_hpp
+#define ThreadPool_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace motioncam {
+
+    //
+    // Work stealing thread pool. Each worker has its own queue and takes work from the others when it runs out.
+    // The thread calling parallelFor() takes part in the loop, so loops can be nested without deadlocking.
+    //
+    // The application installs the shared pool as the Halide runtime's do_par_for/do_task with installHalide() when
+    // it starts, so the generated pipelines and our own threads run on the same set of cores instead of each
+    // creating their own threads. Until then the pipelines use the Halide runtime's threads.
+    //
+
+    class ThreadPool {
+    public:
+        explicit ThreadPool(int numThreads);
+        ~ThreadPool();
+
+        // Not copyable
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        int numThreads() const;
+
+        // Queues the task on a worker without waiting for it. Tasks must not block waiting on work queued after them.
+        void submit(std::function<void()> task);
+
+        // Calls f for each index in [begin, end) and blocks until all calls are done. At most maxConcurrency threads,
+        // including the calling thread, work on the loop. When zero the limit set by ScopedConcurrencyLimit is used.
+        // Rethrows the first exception raised by f.
+        void parallelFor(int begin, int end, const std::function<void(int)>& f, int maxConcurrency=0);
+
+        // Limits the number of threads used by loops, including Halide pipelines, started on this thread while in
+        // scope. Nested loops inherit the limit.
+        class ScopedConcurrencyLimit {
+        public:
+            explicit ScopedConcurrencyLimit(int maxConcurrency);
+            ~ScopedConcurrencyLimit();
+
+            // Limit of the current thread, zero when there is none
+            static int current();
+
+        private:
+            int mPrevious;
+        };
+
+        // Creates the shared pool and installs it in the Halide runtime. When numThreads is zero, a thread is used
+        // per core. Must be called before the shared pool is first used and not while pipelines run.
+        static void installHalide(int numThreads=0);
+
+        // Puts the Halide runtime's own do_par_for/do_task back. The shared pool is kept.
+        static void uninstallHalide();
+
+        // The shared pool, created with the default size if installHalide() hasn't been called
+        static ThreadPool& get();
+
+        // The shared pool or null when it hasn't been created yet
+        static ThreadPool* shared();
+
+        // Runs the loop on the shared pool
+        static void run(int begin, int end, const std::function<void(int)>& f);
+
+    private:
+        struct Loop;
+
+        struct Worker {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        void push(std::function<void()> task);
+        bool pop(int worker, std::function<void()>& outTask);
+        void workerLoop(int worker);
+
+        static void runLoop(const std::shared_ptr<Loop>& loop);
+
+    private:
+        std::vector<std::unique_ptr<Worker>> mWorkers;
+        std::vector<std::unique_ptr<std::thread>> mThreads;
+
+        std::mutex mSleepMutex;
+        std::condition_variable mSleepCondition;
+        std::atomic<int> mPending;
+        std::atomic<unsigned int> mNextWorker;
+        bool mStopping;
+    };
+}
+
+#endif /* ThreadPool_hpp */
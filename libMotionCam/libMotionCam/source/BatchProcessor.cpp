@@ -0,0 +1,251 @@
+#include "motioncam/BatchProcessor.h"
+#include "motioncam/ImageProcessor.h"
+#include "motioncam/ImageProcessorProgress.h"
+#include "motioncam/RawContainer.h"
+#include "motioncam/ThreadPool.h"
+#include "motioncam/Logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+namespace motioncam {
+
+    namespace {
+        double elapsedMs(std::chrono::steady_clock::time_point from) {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - from).count();
+        }
+
+        //
+        // State shared between run() and the job threads
+        //
+
+        struct BatchState {
+            BatchState() : memoryInUse(0), numRunning(0) {
+            }
+
+            // Queues a listener callback for the thread that called run()
+            void post(std::function<void()> f) {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                callbacks.push(std::move(f));
+                condition.notify_all();
+            }
+
+            std::mutex mutex;
+            std::condition_variable condition;
+            std::queue<std::function<void()>> callbacks;
+
+            size_t memoryInUse;
+            int numRunning;
+        };
+
+        //
+        // Collects the error of a job and forwards its progress to the batch listener on the thread that called run()
+        //
+
+        class JobProgress : public ImageProcessorProgress {
+        public:
+            JobProgress(int jobId, const BatchProcessorListener& listener, BatchState& state) :
+                mJobId(jobId), mListener(listener), mState(state) {
+            }
+
+            std::string onPreviewSaved(const std::string& outputPath) const override {
+                return outputPath;
+            }
+
+            bool onProgressUpdate(int progress) const override {
+                const int jobId = mJobId;
+                const BatchProcessorListener& listener = mListener;
+
+                mState.post([&listener, jobId, progress]() { listener.onJobProgress(jobId, progress); });
+                return true;
+            }
+
+            void onCompleted() const override {
+            }
+
+            void onError(const std::string& error) const override {
+                mError = error;
+            }
+
+            const std::string& error() const {
+                return mError;
+            }
+
+        private:
+            const int mJobId;
+            const BatchProcessorListener& mListener;
+            BatchState& mState;
+            mutable std::string mError;
+        };
+    }
+
+    BatchProcessor::BatchProcessor(int maxConcurrentJobs, size_t memoryLimitBytes, int numThreads) :
+        mMaxConcurrentJobs((std::max)(1, maxConcurrentJobs)),
+        mMemoryLimit(memoryLimitBytes),
+        mNumThreads(numThreads)
+    {
+    }
+
+    int BatchProcessor::add(const std::string& containerPath, const std::string& outputPath, int priority) {
+        const int id = static_cast<int>(mJobs.size());
+
+        mJobs.push_back({ id, containerPath, outputPath, priority });
+
+        return id;
+    }
+
+    std::vector<BatchJobReport> BatchProcessor::run(const BatchProcessorListener& listener) {
+        const auto batchStart = std::chrono::steady_clock::now();
+
+        std::vector<BatchJobReport> reports;
+        reports.reserve(mJobs.size());
+
+        for(const auto& job : mJobs)
+            reports.push_back({ job.id, job.containerPath, job.outputPath, job.priority, 0, false, "", 0, 0 });
+
+        // The first pending job that fits is started, so keep them in priority order
+        std::vector<Job> jobs = mJobs;
+
+        std::stable_sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) {
+            return a.priority > b.priority;
+        });
+
+        std::vector<Job> pending;
+
+        for(const auto& job : jobs) {
+            auto& report = reports[job.id];
+
+            try {
+                auto container = RawContainer::Open(job.containerPath);
+                report.memoryEstimate = ImageProcessor::estimateProcessMemory(*container);
+
+                // Nothing is known about the job's memory use, so have it take the whole budget and run on its own
+                if(report.memoryEstimate == 0) {
+                    logger::warning("No memory estimate for " + job.containerPath + ", running it on its own");
+                    report.memoryEstimate = mMemoryLimit;
+                }
+            }
+            catch(std::exception& e) {
+                report.error = e.what();
+                listener.onJobCompleted(report);
+                continue;
+            }
+
+            pending.push_back(job);
+        }
+
+        //
+        // Each job runs on its own thread, which only drives it. The work of the job is done on the shared thread
+        // pool by the job's own scheduler, and its loops are limited to numThreads threads. This thread admits
+        // the jobs while they fit in the memory budget and makes the listener callbacks.
+        //
+
+        BatchState state;
+        std::vector<std::thread> threads;
+        std::exception_ptr error;
+
+        auto runJob = [&](const Job& job) {
+            auto& report = reports[job.id];
+
+            report.queuedMs = elapsedMs(batchStart);
+
+            const BatchJobReport started = report;
+            state.post([&listener, started]() { listener.onJobStarted(started); });
+
+            const auto jobStart = std::chrono::steady_clock::now();
+            JobProgress progress(job.id, listener, state);
+
+            try {
+                ThreadPool::ScopedConcurrencyLimit concurrencyLimit(mNumThreads);
+
+                // Give the job as much memory as it was admitted with so its own tasks stay within the budget
+                ImageProcessor::process(job.containerPath,
+                                        job.outputPath,
+                                        progress,
+                                        (std::min)(report.memoryEstimate, mMemoryLimit));
+
+                report.error = progress.error();
+            }
+            catch(std::exception& e) {
+                report.error = e.what();
+            }
+
+            report.processingMs = elapsedMs(jobStart);
+            report.succeeded = report.error.empty();
+
+            if(!report.succeeded)
+                logger::error("Job " + job.containerPath + " failed: " + report.error);
+
+            const BatchJobReport completed = report;
+
+            std::lock_guard<std::mutex> lock(state.mutex);
+
+            state.memoryInUse -= report.memoryEstimate;
+            state.numRunning--;
+
+            state.callbacks.push([&listener, completed]() { listener.onJobCompleted(completed); });
+            state.condition.notify_all();
+        };
+
+        std::unique_lock<std::mutex> lock(state.mutex);
+
+        while(true) {
+            // Start the pending jobs that fit. A job is always started when nothing else runs, so a job larger than
+            // the budget can't stall the batch.
+            for(auto it = pending.begin(); !error && it != pending.end() && state.numRunning < mMaxConcurrentJobs;) {
+                const size_t memoryEstimate = reports[it->id].memoryEstimate;
+
+                if(state.numRunning > 0 && state.memoryInUse + memoryEstimate > mMemoryLimit) {
+                    ++it;
+                    continue;
+                }
+
+                state.memoryInUse += memoryEstimate;
+                state.numRunning++;
+
+                threads.emplace_back(runJob, *it);
+                it = pending.erase(it);
+            }
+
+            if(!state.callbacks.empty()) {
+                auto callback = std::move(state.callbacks.front());
+                state.callbacks.pop();
+
+                lock.unlock();
+
+                // Stop starting jobs when the listener fails, but let the running ones finish
+                try {
+                    if(!error)
+                        callback();
+                }
+                catch(...) {
+                    error = std::current_exception();
+                }
+
+                lock.lock();
+                continue;
+            }
+
+            if(state.numRunning == 0 && (pending.empty() || error))
+                break;
+
+            state.condition.wait(lock);
+        }
+
+        lock.unlock();
+
+        for(auto& thread : threads)
+            thread.join();
+
+        if(error)
+            std::rethrow_exception(error);
+
+        return reports;
+    }
+}
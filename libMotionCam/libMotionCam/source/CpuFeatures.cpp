@@ -0,0 +1,121 @@
+#include "motioncam/CpuFeatures.h"
+#include "motioncam/Logger.h"
+
+#include <HalideRuntime.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace motioncam {
+    namespace cpu {
+        namespace {
+            std::atomic<int> gMaxIsaLevel(static_cast<int>(IsaLevel::AVX512));
+            std::once_flag gInstallFlag;
+
+            const int NUM_FEATURE_WORDS = (halide_target_feature_end + 63) / 64;
+
+            void setFeature(std::vector<uint64_t>& features, int feature) {
+                features[feature / 64] |= static_cast<uint64_t>(1) << (feature % 64);
+            }
+
+            bool hasFeature(int count, const uint64_t* features, int feature) {
+                if(feature / 64 >= count)
+                    return false;
+
+                return (features[feature / 64] >> (feature % 64)) & 1;
+            }
+
+            // Features that a variant above the given level requires
+            std::vector<int> excludedFeatures(IsaLevel level) {
+                std::vector<int> excluded = {
+                    halide_target_feature_avx512,
+                    halide_target_feature_avx512_knl,
+                    halide_target_feature_avx512_skylake,
+                    halide_target_feature_avx512_cannonlake
+                };
+
+                if(level < IsaLevel::AVX2) {
+                    excluded.push_back(halide_target_feature_avx);
+                    excluded.push_back(halide_target_feature_avx2);
+                    excluded.push_back(halide_target_feature_fma);
+                    excluded.push_back(halide_target_feature_f16c);
+                }
+
+                if(level < IsaLevel::SSE41)
+                    excluded.push_back(halide_target_feature_sse41);
+
+                return excluded;
+            }
+
+            int canUseTargetFeatures(int count, const uint64_t* features) {
+                const auto level = static_cast<IsaLevel>(gMaxIsaLevel.load());
+
+                if(level < IsaLevel::AVX512) {
+                    for(auto feature : excludedFeatures(level)) {
+                        if(hasFeature(count, features, feature))
+                            return 0;
+                    }
+                }
+
+                return halide_default_can_use_target_features(count, features);
+            }
+
+            bool supports(const std::vector<int>& required) {
+                std::vector<uint64_t> features(NUM_FEATURE_WORDS, 0);
+
+                for(auto feature : required)
+                    setFeature(features, feature);
+
+                return halide_default_can_use_target_features(NUM_FEATURE_WORDS, features.data()) != 0;
+            }
+        }
+
+        IsaLevel detectIsaLevel() {
+#if defined(__x86_64__) || defined(_M_X64)
+            if(supports({ halide_target_feature_avx512, halide_target_feature_avx512_skylake }))
+                return IsaLevel::AVX512;
+
+            if(supports({ halide_target_feature_avx, halide_target_feature_avx2, halide_target_feature_fma, halide_target_feature_f16c }))
+                return IsaLevel::AVX2;
+
+            if(supports({ halide_target_feature_sse41 }))
+                return IsaLevel::SSE41;
+#endif
+            return IsaLevel::BASELINE;
+        }
+
+        IsaLevel getIsaLevel() {
+            return (std::min)(detectIsaLevel(), static_cast<IsaLevel>(gMaxIsaLevel.load()));
+        }
+
+        void setMaxIsaLevel(IsaLevel level) {
+            std::call_once(gInstallFlag, []() {
+                halide_set_custom_can_use_target_features(&canUseTargetFeatures);
+            });
+
+            gMaxIsaLevel = static_cast<int>(level);
+
+            logger::log("Using " + toString(getIsaLevel()) + " pipelines (detected " + toString(detectIsaLevel()) + ")");
+        }
+
+        std::string toString(IsaLevel level) {
+            switch(level) {
+                case IsaLevel::SSE41:
+                    return "SSE4.1";
+
+                case IsaLevel::AVX2:
+                    return "AVX2";
+
+                case IsaLevel::AVX512:
+                    return "AVX-512";
+
+                case IsaLevel::BASELINE:
+                default:
+                    return "baseline";
+            }
+        }
+    }
+}
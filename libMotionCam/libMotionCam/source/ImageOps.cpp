@@ -1,5 +1,8 @@
 #include "motioncam/ImageOps.h"
 #include "motioncam/Measure.h"
+#include "motioncam/Exceptions.h"
+
+#include <cmath>
 
 using std::vector;
 
@@ -27,7 +30,96 @@ namespace motioncam {
         return nums[nums.size()*p];
     }
     
+    //
+    // Finds the value with rank k of f(x) over the input using a single histogram pass over [0, maxValue) and
+    // interpolating within the bin. The caller picks maxValue such that the quantile is known to be below it.
+    // Non-finite values are skipped, k is the rank among the finite ones.
+    //
+
+    template<typename T>
+    static float histogramSelect(const cv::Mat& input, const size_t k, const float maxValue, T f) {
+        const int BINS = 2048;
+        
+        // Last bin collects everything above maxValue
+        uint32_t hist[BINS + 1];
+        std::fill(hist, hist + BINS + 1, 0);
+        
+        const float scale = BINS / maxValue;
+        
+        for(int y = 0; y < input.rows; y++) {
+            const float* row = input.ptr<float>(y);
+            
+            for(int x = 0; x < input.cols; x++) {
+                if(!std::isfinite(row[x]))
+                    continue;
+                
+                float bin = (std::min)(f(row[x]) * scale, static_cast<float>(BINS));
+                
+                ++hist[static_cast<int>(bin)];
+            }
+        }
+        
+        size_t count = 0;
+        
+        for(int bin = 0; bin < BINS; bin++) {
+            if(count + hist[bin] > k) {
+                float a = (k - count + 0.5f) / hist[bin];
+                
+                return (bin + a) / scale;
+            }
+            
+            count += hist[bin];
+        }
+        
+        return maxValue;
+    }
+
     float estimateNoise(cv::Mat& input, float p) {
+        // Also rejects NaN
+        if(!(p >= 0.0f && p < 1.0f))
+            throw InvalidState("Invalid noise quantile " + std::to_string(p));
+        
+        p = (std::min)(p, MAX_NOISE_QUANTILE);
+        
+        double sum = 0;
+        size_t n = 0;
+        
+        for(int y = 0; y < input.rows; y++) {
+            const float* row = input.ptr<float>(y);
+            float rowSum = 0;
+            
+            for(int x = 0; x < input.cols; x++) {
+                if(!std::isfinite(row[x]))
+                    continue;
+                
+                rowSum += std::abs(row[x]);
+                ++n;
+            }
+            
+            sum += rowSum;
+        }
+        
+        if(n == 0)
+            return 0.0f;
+        
+        // By Markov's inequality the p quantile of |x| is at most mean(|x|) / (1 - p), which bounds the histogram range
+        // independently of any outliers in the subband.
+        const float mean = static_cast<float>(sum / n);
+        const size_t k = (std::min)(n - 1, static_cast<size_t>(n * p));
+        
+        float median = histogramSelect(input, k, mean / (1.0f - p) + 1e-6f, [](float v) {
+            return std::abs(v);
+        });
+        
+        // Likewise, mean(||x| - median|) <= mean + median
+        float mad = histogramSelect(input, n / 2, 2.0f * (mean + median) + 1e-6f, [median](float v) {
+            return std::abs(std::abs(v) - median);
+        });
+        
+        return mad / 0.6745f;
+    }
+
+    float estimateNoiseExact(cv::Mat& input, float p) {
         cv::Mat d = cv::abs(input);
                 
         float median = findMedian(d, p);
@@ -8,18 +8,24 @@
 #include "motioncam/Measure.h"
 #include "motioncam/Settings.h"
 #include "motioncam/ImageOps.h"
-#include "motioncam/BlueNoiseLUT.h"
+#include "motioncam/Resources.h"
 #include "motioncam/FaceClassifier.h"
 #include "motioncam/RawBufferStreamer.h"
 #include "motioncam/RawImageBuffer.h"
 #include "motioncam/RawCameraMetadata.h"
+#include "motioncam/TaskScheduler.h"
+#include "motioncam/ThreadPool.h"
+#include "motioncam/MemoryArena.h"
+#include "motioncam/MemoryUsage.h"
+#include "motioncam/Profiler.h"
 
 // Halide
 #include "generate_stats.h"
 #include "generate_edges.h"
 #include "measure_image.h"
 #include "deinterleave_raw.h"
-#include "forward_transform.h"
+#include "forward_transform_raw.h"
+#include "forward_transform_fused.h"
 #include "inverse_transform.h"
 #include "fuse_image.h"
 #include "fuse_denoise_3x3.h"
@@ -46,12 +52,18 @@
 #include "preview_reverse_landscape8.h"
 
 #include "postprocess.h"
+#include "postprocess_tonemap.h"
+#include "postprocess_tonemap_coarse.h"
+#include "postprocess_enhance.h"
 
 #include <iostream>
 #include <fstream>
 #include <algorithm>
 #include <memory>
 #include <numeric>
+#include <mutex>
+#include <thread>
+#include <exception>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <exiv2/exiv2.hpp>
@@ -92,22 +104,90 @@ extern "C" int extern_defringe(halide_buffer_t *in, int32_t width, int32_t heigh
     return 0;
 }
 
-static std::vector<Halide::Runtime::Buffer<float>> createWaveletBuffers(int width, int height) {
-    std::vector<Halide::Runtime::Buffer<float>> buffers;
-    
-    for(int level = 0; level < motioncam::WAVELET_LEVELS; level++) {
-        width = width / 2;
-        height = height / 2;
-        
-        buffers.emplace_back(width, height, 4, 4);
+//
+// Normalises the RAW reference (or the sum of the fused frames) to the expanded range as part of the forward transform
+// so the intermediate image is never materialised.
+//
+
+static void forwardTransform(Halide::Runtime::Buffer<uint16_t>& reference,
+                             Halide::Runtime::Buffer<float>& fuseOutput,
+                             const int fusedFrames,
+                             const int channel,
+                             const std::vector<float>& blackLevel,
+                             const float whiteLevel,
+                             std::vector<Halide::Runtime::Buffer<float>>& wavelet)
+{
+    if(fusedFrames <= 0) {
+        forward_transform_raw(reference,
+                              reference.width(),
+                              reference.height(),
+                              channel,
+                              blackLevel[0],
+                              blackLevel[1],
+                              blackLevel[2],
+                              blackLevel[3],
+                              whiteLevel,
+                              1.0f,
+                              motioncam::EXPANDED_RANGE,
+                              wavelet[0],
+                              wavelet[1],
+                              wavelet[2],
+                              wavelet[3]);
+    }
+    else {
+        forward_transform_fused(fuseOutput,
+                                fuseOutput.width(),
+                                fuseOutput.height(),
+                                channel,
+                                blackLevel[0],
+                                blackLevel[1],
+                                blackLevel[2],
+                                blackLevel[3],
+                                whiteLevel,
+                                1.0f / fusedFrames,
+                                motioncam::EXPANDED_RANGE,
+                                wavelet[0],
+                                wavelet[1],
+                                wavelet[2],
+                                wavelet[3]);
     }
-    
-    return buffers;
 }
 
 namespace motioncam {
     const float MAX_HDR_ERROR           = 0.0001f;
     const float SHADOW_BIAS             = 6.0f;
+    const float MIN_RELATIVE_SHARPNESS  = 0.5f;
+    const int SHARPNESS_DOWNSCALE       = 6;
+
+    // Candidate frames loaded to measure their sharpness are kept up to this size so fusing does not read them again
+    const size_t MAX_KEPT_CANDIDATE_BYTES = static_cast<size_t>(256) * 1024 * 1024;
+    const float MIN_ALIGNMENT_ERROR     = 0.05f;
+    const float MAX_ALIGNMENT_ERROR     = 0.25f;
+    const float MIN_FUSE_WEIGHT_SCALE   = 0.25f;
+
+    // Rough memory use of each processing task relative to the size of the reference RAW frame. The denoise task
+    // includes 8/3 per scratch pyramid of its DenoiseContext, rounded up.
+    const int NUM_PROCESS_TASK_THREADS  = 3;
+    const size_t PREVIEW_TASK_MEMORY    = 1;
+    const size_t HDR_TASK_MEMORY        = 4;
+    const size_t DENOISE_TASK_MEMORY    = 4 + (8 * DEFAULT_DENOISE_PYRAMIDS + 2) / 3;
+    const size_t BRACKET_TASK_MEMORY    = 2;
+    const size_t REFERENCE_MEMORY       = 2;
+    const size_t POSTPROCESS_MEMORY     = 4;
+    
+    // Underexposed brackets within this many EV of each other are fused together
+    const float MAX_BRACKET_EV_DIFFERENCE = 0.5f;
+
+    // Patch size used to measure noise and for the optical flow when fusing
+    const int NOISE_PATCH_SIZE          = 16;
+
+    // Rows of the output post processed at a time when tiled
+    const int TILED_POSTPROCESS_ROWS        = 1024;
+
+    // Level of the tonemap pyramid kept for the whole image when tiled, same as in generators/Common.h. The level is
+    // stored past the edges of the image, as far as the filters of the last stages reach.
+    const int TONEMAP_COARSE_LEVEL          = 4;
+    const int TONEMAP_COARSE_MARGIN         = 16;
 
     typedef Halide::Runtime::Buffer<float> WaveletBuffer;
 
@@ -149,6 +229,52 @@ namespace motioncam {
         }
     };
 
+    //
+    // Spans the process() calls that run at the same time. The first call starts the statistics of the memory arena
+    // and the Halide profiler over. The arena itself is installed by the application when it starts, since pipelines
+    // also run outside of process(). The counting OpenCV allocator is installed once and kept, matrices it allocated
+    // may outlive the calls.
+    //
+
+    class ProcessSession {
+    public:
+        ProcessSession() {
+            std::lock_guard<std::mutex> lock(gMutex);
+
+            if(gNumActive++ > 0)
+                return;
+
+            if(!gInstalledOpenCVAllocator) {
+                MemoryUsage::installOpenCVAllocator();
+                gInstalledOpenCVAllocator = true;
+            }
+
+            MemoryArena::get().resetStats();
+
+            // Resetting while other calls run would lose their timings
+            profiler::reset();
+        }
+
+        ~ProcessSession() {
+            std::lock_guard<std::mutex> lock(gMutex);
+
+            gNumActive--;
+        }
+
+        // Not copyable
+        ProcessSession(const ProcessSession&) = delete;
+        ProcessSession& operator=(const ProcessSession&) = delete;
+
+    private:
+        static std::mutex gMutex;
+        static int gNumActive;
+        static bool gInstalledOpenCVAllocator;
+    };
+
+    std::mutex ProcessSession::gMutex;
+    int ProcessSession::gNumActive = 0;
+    bool ProcessSession::gInstalledOpenCVAllocator = false;
+
     // https://exiv2.org/doc/geotag_8cpp-example.html
     static std::string toExifString(double d, bool isRational, bool isLatitude)
     {
@@ -214,6 +340,206 @@ namespace motioncam {
         uint8_t* nativeBufferData;
     };
 
+    DenoiseContext::DenoiseContext(int numPyramids) :
+        mWidth(-1), mHeight(-1), mWavelet((std::max)(1, (std::min)(4, numPyramids)))
+    {
+    }
+
+    void DenoiseContext::prepare(int width, int height) {
+        if(width == mWidth && height == mHeight)
+            return;
+
+        mWidth = width;
+        mHeight = height;
+
+        for(auto& buffers : mWavelet) {
+            buffers.clear();
+
+            int w = width;
+            int h = height;
+
+            for(int level = 0; level < WAVELET_LEVELS; level++) {
+                w = w / 2;
+                h = h / 2;
+
+                buffers.emplace_back(w, h, 4, 4);
+            }
+        }
+    }
+
+    int DenoiseContext::numPyramids() const {
+        return static_cast<int>(mWavelet.size());
+    }
+
+    std::vector<Halide::Runtime::Buffer<float>>& DenoiseContext::wavelet(int pyramid) {
+        return mWavelet[pyramid];
+    }
+
+    size_t DenoiseContext::pyramidBytes(int width, int height) {
+        size_t bytes = 0;
+
+        for(int level = 0; level < WAVELET_LEVELS; level++) {
+            width = width / 2;
+            height = height / 2;
+
+            bytes += static_cast<size_t>(width) * height * 4 * 4 * sizeof(float);
+        }
+
+        return bytes;
+    }
+
+    NoiseModel& DenoiseContext::noiseModel() {
+        return mNoiseModel;
+    }
+
+    //
+    // Runs the wavelet denoise on the four channels, as many at once as the context has scratch pyramids.
+    // outNormalisedNoise is optional.
+    //
+
+    static std::vector<Halide::Runtime::Buffer<uint16_t>> spatialDenoise(Halide::Runtime::Buffer<uint16_t>& reference,
+                                                                         Halide::Runtime::Buffer<float>& fuseOutput,
+                                                                         const int fusedFrames,
+                                                                         const std::vector<float>& blackLevel,
+                                                                         const float whiteLevel,
+                                                                         std::vector<float>& weights,
+                                                                         DenoiseContext& context,
+                                                                         std::vector<float>* outNormalisedNoise)
+    {
+        const int width = reference.width();
+        const int height = reference.height();
+
+        context.prepare(width, height);
+
+        auto weightsBuffer = Halide::Runtime::Buffer<float>(&weights[0], WAVELET_LEVELS);
+
+        std::vector<Halide::Runtime::Buffer<uint16_t>> denoiseOutput;
+        std::vector<float> normalisedNoise(4);
+        std::vector<std::exception_ptr> errors(4);
+
+        for(int c = 0; c < 4; c++)
+            denoiseOutput.push_back(MemoryArena::buffer<uint16_t>(width, height));
+
+        const int numPyramids = context.numPyramids();
+
+        auto denoiseChannel = [&](int c, int pyramid) {
+            try {
+                auto& wavelet = context.wavelet(pyramid);
+
+                forwardTransform(reference, fuseOutput, fusedFrames, c, blackLevel, whiteLevel, wavelet);
+
+                int offset = wavelet[0].stride(2);
+
+                cv::Mat ll(wavelet[0].height(), wavelet[0].width(), CV_32F, wavelet[0].data() + 4);
+                cv::Mat hh(wavelet[0].height(), wavelet[0].width(), CV_32F, wavelet[0].data() + offset*7);
+
+                float noiseSigma = estimateNoise(hh);
+
+                normalisedNoise[c] = noiseSigma / (1e-5f + cv::mean(ll)[0]);
+
+                inverse_transform(wavelet[0],
+                                  wavelet[1],
+                                  wavelet[2],
+                                  wavelet[3],
+                                  noiseSigma,
+                                  false,
+                                  weightsBuffer,
+                                  denoiseOutput[c]);
+            }
+            catch(...) {
+                errors[c] = std::current_exception();
+            }
+        };
+
+        // Each pyramid is used by one channel at a time
+        ThreadPool::run(0, numPyramids, [&](int pyramid) {
+            for(int c = pyramid; c < 4; c += numPyramids)
+                denoiseChannel(c, pyramid);
+        });
+
+        for(auto& error : errors) {
+            if(error)
+                std::rethrow_exception(error);
+        }
+
+        if(outNormalisedNoise)
+            *outNormalisedNoise = normalisedNoise;
+
+        return denoiseOutput;
+    }
+
+    //
+    // Fraction of the preview that is still misaligned after warping the current frame to the reference with the
+    // optical flow. Both images are blurred first so the noise does not count as misalignment.
+    //
+
+    static float measureAlignmentError(const cv::Mat& referenceBlurred, const cv::Mat& current, const cv::Mat& flow) {
+        const int MISALIGNED_THRESHOLD = 16;
+        
+        cv::Mat map(flow.size(), CV_32FC2);
+        
+        for(int y = 0; y < flow.rows; y++) {
+            const cv::Vec2f* f = flow.ptr<cv::Vec2f>(y);
+            cv::Vec2f* m = map.ptr<cv::Vec2f>(y);
+            
+            for(int x = 0; x < flow.cols; x++)
+                m[x] = cv::Vec2f(x + f[x][0], y + f[x][1]);
+        }
+        
+        cv::Mat warped, residual;
+        
+        cv::remap(current, warped, map, cv::noArray(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+        cv::GaussianBlur(warped, warped, cv::Size(5, 5), 2.0);
+        cv::absdiff(referenceBlurred, warped, residual);
+        
+        return cv::countNonZero(residual > MISALIGNED_THRESHOLD) / static_cast<float>(residual.total());
+    }
+
+    //
+    // Forwards listener callbacks from scheduled tasks to the thread processing the image. Listeners such as the JNI
+    // one are only valid on the thread they were created on.
+    //
+
+    class CallingThreadProgress : public ImageProcessorProgress {
+    public:
+        CallingThreadProgress(const ImageProcessorProgress& listener, TaskScheduler& scheduler) :
+            mListener(listener), mScheduler(scheduler)
+        {
+        }
+
+        std::string onPreviewSaved(const std::string& outputPath) const override {
+            std::string result;
+            mScheduler.runOnCallingThread([&]() { result = mListener.onPreviewSaved(outputPath); });
+            return result;
+        }
+
+        bool onProgressUpdate(int progress) const override {
+            bool result = true;
+            mScheduler.runOnCallingThread([&]() { result = mListener.onProgressUpdate(progress); });
+            return result;
+        }
+
+        void onCompleted() const override {
+            mScheduler.runOnCallingThread([&]() { mListener.onCompleted(); });
+        }
+
+        void onError(const std::string& error) const override {
+            mScheduler.runOnCallingThread([&]() { mListener.onError(error); });
+        }
+
+        void onFrameFused(const std::string& frame, bool accepted, float alignmentError) const override {
+            mScheduler.runOnCallingThread([&]() { mListener.onFrameFused(frame, accepted, alignmentError); });
+        }
+
+        void onMemoryUsage(const std::string& stage, size_t peakBytes, size_t bytesInUse) const override {
+            mScheduler.runOnCallingThread([&]() { mListener.onMemoryUsage(stage, peakBytes, bytesInUse); });
+        }
+
+    private:
+        const ImageProcessorProgress& mListener;
+        TaskScheduler& mScheduler;
+    };
+
     ImageProgressHelper::ImageProgressHelper(const ImageProcessorProgress& progressListener, int numImages, int start) :
         mStart(start), mProgressListener(progressListener), mNumImages(numImages), mCurImage(0)
     {
@@ -235,6 +561,16 @@ namespace motioncam {
         mProgressListener.onProgressUpdate(static_cast<int>(mStart + (mPerImageIncrement * mCurImage)));
     }
 
+    void ImageProgressHelper::frameAccepted(const std::string& frame, float alignmentError) {
+        mProgressListener.onFrameFused(frame, true, alignmentError);
+        nextFusedImage();
+    }
+
+    void ImageProgressHelper::frameRejected(const std::string& frame, float alignmentError) {
+        mProgressListener.onFrameFused(frame, false, alignmentError);
+        nextFusedImage();
+    }
+
     void ImageProgressHelper::imageSaved() {
         mProgressListener.onProgressUpdate(100);
         mProgressListener.onCompleted();
@@ -254,6 +590,9 @@ namespace motioncam {
         
         for(const auto& name : container.getFrames()) {
             auto frame = container.getFrame(name);
+            if(!frame)
+                continue;
+
             auto ev = calcEv(container.getCameraMetadata(), frame->metadata);
             
             if(ev < minEv)
@@ -263,6 +602,42 @@ namespace motioncam {
         return minEv;
     }
 
+    size_t ImageProcessor::estimateProcessMemory(RawContainer& rawContainer) {
+        const auto frames = rawContainer.getFrames();
+        if(frames.empty())
+            return 0;
+
+        auto frame = rawContainer.getFrame(frames[0]);
+        if(!frame)
+            return 0;
+
+        const size_t frameBytes = static_cast<size_t>(frame->width) * frame->height * sizeof(uint16_t);
+
+        // Same split as process(), where the preview, HDR and denoise tasks can all be running at once
+        size_t memory = REFERENCE_MEMORY + PREVIEW_TASK_MEMORY + DENOISE_TASK_MEMORY + POSTPROCESS_MEMORY;
+
+        if(rawContainer.isHdr()) {
+            const double refEv = getMinEv(rawContainer);
+            size_t numUnderexposed = 0;
+
+            for(const auto& name : frames) {
+                auto bracket = rawContainer.getFrame(name);
+                if(!bracket)
+                    continue;
+
+                auto ev = calcEv(rawContainer.getCameraMetadata(), bracket->metadata);
+                if(ev - refEv > 1.0f)
+                    numUnderexposed++;
+            }
+
+            // The underexposed frames are kept loaded until the HDR task completes
+            if(numUnderexposed > 0)
+                memory += HDR_TASK_MEMORY + BRACKET_TASK_MEMORY * (numUnderexposed - 1) + numUnderexposed;
+        }
+
+        return memory * frameBytes;
+    }
+
 //    void ImageProcessor::getNormalisedShadingMap(const RawImageMetadata& metadata,
 //                                                 const float shadingMapCorrection,
 //                                                 std::vector<Halide::Runtime::Buffer<float>>& outShadingMapBuffer,
@@ -312,7 +687,8 @@ namespace motioncam {
                                         const float noiseEstimate,
                                         const RawImageMetadata& metadata,
                                         const RawCameraMetadata& cameraMetadata,
-                                        const PostProcessSettings& settings)
+                                        const PostProcessSettings& settings,
+                                        const size_t tiledMinPixels)
     {
         Measure measure("postProcess");
         
@@ -330,10 +706,7 @@ namespace motioncam {
         }
 
         // Get blue noise buffer
-        auto noise = cv::imdecode(BLUE_NOISE_PNG, cv::IMREAD_UNCHANGED);
-        
-        Halide::Runtime::Buffer<uint8_t> noiseBuffer =
-            Halide::Runtime::Buffer<uint8_t>::make_interleaved((uint8_t*) noise.data, noise.cols, noise.rows, 4);
+        Halide::Runtime::Buffer<uint8_t> noiseBuffer = resources::blueNoise();
         
         cv::Mat cameraToSrgb = pcsToSrgb * cameraToPcs;
         
@@ -376,49 +749,152 @@ namespace motioncam {
             // Don't apply underexposed image when error is too high
             logger::log("Not using HDR image");
             
-            hdrInput = Halide::Runtime::Buffer<uint16_t>(32, 32, 3);
-            hdrMask = Halide::Runtime::Buffer<uint8_t>(32, 32);
+            hdrInput = resources::emptyHdrInput();
+            hdrMask = resources::emptyHdrMask();
             
             useHdr = false;
         }
                 
-        postprocess(inputBuffers[0],
-                    inputBuffers[1],
-                    inputBuffers[2],
-                    inputBuffers[3],
-                    noiseBuffer,
-                    hdrInput,
-                    hdrMask,
-                    useHdr,
-                    metadata.asShot[0],
-                    metadata.asShot[1],
-                    metadata.asShot[2],
-                    cameraToSrgbBuffer,
-                    shadingMapBuffer[0],
-                    shadingMapBuffer[1],
-                    shadingMapBuffer[2],
-                    shadingMapBuffer[3],
-                    EXPANDED_RANGE,
-                    static_cast<int>(cameraMetadata.sensorArrangment),
-                    shadows,
-                    hdrInputGain,
-                    hdrScale,
-                    tonemapVariance,
-                    settings.blacks,
-                    settings.exposure,
-                    settings.whitePoint,
-                    settings.contrast,
-                    settings.brightness,
-                    settings.blues,
-                    settings.greens,
-                    settings.saturation,
-                    settings.sharpen0,
-                    settings.sharpen1,
-                    settings.pop,
-                    128.0f,
-                    7.0f,
-                    (std::min)(0.015f, (std::max)(0.005f, noiseEstimate / 2.0f)),
-                    outputBuffer);
+        const float chromaEps3 = (std::min)(0.015f, (std::max)(0.005f, noiseEstimate / 2.0f));
+        
+        if(static_cast<size_t>(output.cols) * output.rows < tiledMinPixels) {
+            postprocess(inputBuffers[0],
+                        inputBuffers[1],
+                        inputBuffers[2],
+                        inputBuffers[3],
+                        noiseBuffer,
+                        hdrInput,
+                        hdrMask,
+                        useHdr,
+                        metadata.asShot[0],
+                        metadata.asShot[1],
+                        metadata.asShot[2],
+                        cameraToSrgbBuffer,
+                        shadingMapBuffer[0],
+                        shadingMapBuffer[1],
+                        shadingMapBuffer[2],
+                        shadingMapBuffer[3],
+                        EXPANDED_RANGE,
+                        static_cast<int>(cameraMetadata.sensorArrangment),
+                        shadows,
+                        hdrInputGain,
+                        hdrScale,
+                        tonemapVariance,
+                        settings.blacks,
+                        settings.exposure,
+                        settings.whitePoint,
+                        settings.contrast,
+                        settings.brightness,
+                        settings.blues,
+                        settings.greens,
+                        settings.saturation,
+                        settings.sharpen0,
+                        settings.sharpen1,
+                        settings.pop,
+                        128.0f,
+                        7.0f,
+                        chromaEps3,
+                        outputBuffer);
+        }
+        else {
+            // Only the coarse levels of the tonemap need the whole image. Compute the coarse level of its pyramids in
+            // strips, fuse the levels above it, then finish the output in strips, computing the fine levels again.
+            const int width  = inputBuffers[0].width() * 2;
+            const int height = inputBuffers[0].height() * 2;
+
+            const int coarseWidth  = width >> TONEMAP_COARSE_LEVEL;
+            const int coarseHeight = height >> TONEMAP_COARSE_LEVEL;
+            const int coarseRows   = TILED_POSTPROCESS_ROWS >> TONEMAP_COARSE_LEVEL;
+            const int margin       = TONEMAP_COARSE_MARGIN;
+
+            auto tonemapLevel   = MemoryArena::buffer<uint16_t>(coarseWidth + 2*margin, coarseHeight + 2*margin, 3, 3);
+            auto weightsLevel   = MemoryArena::buffer<uint16_t>(coarseWidth + 2*margin, coarseHeight + 2*margin, 3);
+            auto tonemapCoarse  = MemoryArena::buffer<uint16_t>(coarseWidth + 2*margin, coarseHeight + 2*margin, 3);
+
+            tonemapLevel.set_min(-margin, -margin);
+            weightsLevel.set_min(-margin, -margin);
+            tonemapCoarse.set_min(-margin, -margin);
+
+            for(int y = -margin; y < coarseHeight + margin; y += coarseRows) {
+                const int rows = (std::min)(coarseRows, coarseHeight + margin - y);
+
+                auto tonemapStrip = tonemapLevel.cropped(1, y, rows);
+                auto weightsStrip = weightsLevel.cropped(1, y, rows);
+
+                postprocess_tonemap(inputBuffers[0],
+                                    inputBuffers[1],
+                                    inputBuffers[2],
+                                    inputBuffers[3],
+                                    hdrInput,
+                                    hdrMask,
+                                    useHdr,
+                                    metadata.asShot[0],
+                                    metadata.asShot[1],
+                                    metadata.asShot[2],
+                                    cameraToSrgbBuffer,
+                                    shadingMapBuffer[0],
+                                    shadingMapBuffer[1],
+                                    shadingMapBuffer[2],
+                                    shadingMapBuffer[3],
+                                    EXPANDED_RANGE,
+                                    static_cast<int>(cameraMetadata.sensorArrangment),
+                                    shadows,
+                                    hdrInputGain,
+                                    hdrScale,
+                                    tonemapVariance,
+                                    settings.exposure,
+                                    tonemapStrip,
+                                    weightsStrip);
+            }
+
+            postprocess_tonemap_coarse(tonemapLevel, weightsLevel, width, height, tonemapCoarse);
+
+            const int startY = outputBuffer.dim(1).min();
+            const int endY = startY + outputBuffer.dim(1).extent();
+            
+            for(int y = startY; y < endY; y += TILED_POSTPROCESS_ROWS) {
+                auto strip = outputBuffer.cropped(1, y, (std::min)(TILED_POSTPROCESS_ROWS, endY - y));
+                
+                postprocess_enhance(inputBuffers[0],
+                                    inputBuffers[1],
+                                    inputBuffers[2],
+                                    inputBuffers[3],
+                                    noiseBuffer,
+                                    hdrInput,
+                                    hdrMask,
+                                    tonemapCoarse,
+                                    useHdr,
+                                    metadata.asShot[0],
+                                    metadata.asShot[1],
+                                    metadata.asShot[2],
+                                    cameraToSrgbBuffer,
+                                    shadingMapBuffer[0],
+                                    shadingMapBuffer[1],
+                                    shadingMapBuffer[2],
+                                    shadingMapBuffer[3],
+                                    EXPANDED_RANGE,
+                                    static_cast<int>(cameraMetadata.sensorArrangment),
+                                    shadows,
+                                    hdrInputGain,
+                                    hdrScale,
+                                    tonemapVariance,
+                                    settings.blacks,
+                                    settings.exposure,
+                                    settings.whitePoint,
+                                    settings.contrast,
+                                    settings.brightness,
+                                    settings.blues,
+                                    settings.greens,
+                                    settings.saturation,
+                                    settings.sharpen0,
+                                    settings.sharpen1,
+                                    settings.pop,
+                                    128.0f,
+                                    7.0f,
+                                    chromaEps3,
+                                    strip);
+            }
+        }
         
         return output;
     }
@@ -565,7 +1041,7 @@ namespace motioncam {
                                           const RawCameraMetadata& cameraMetadata,
                                           PostProcessSettings& outSettings)
     {
-        //Measure measure("estimateSettings()");
+        ScopedTrace trace("estimateSettings()");
         
         float ev = calcEv(cameraMetadata, rawBuffer.metadata);
         float keyValue = getShadowKeyValue(ev, false);
@@ -647,7 +1123,7 @@ namespace motioncam {
                                        Halide::Runtime::Buffer<uint8_t>& whiteLevelClipping,
                                        Halide::Runtime::Buffer<uint8_t>& blackLevelClipping)
     {
-        //Measure measure("generateStats()");
+        ScopedTrace trace("generateStats()");
         
         NativeBufferContext inputBufferContext(*rawBuffer.data, false);
 
@@ -687,7 +1163,7 @@ namespace motioncam {
                                                                        const int sy,
                                                                        const RawCameraMetadata& cameraMetadata)
     {
-        //Measure measure("fastPreview()");
+        ScopedTrace trace("fastPreview()");
         
         cv::Mat cameraToPcs;
         cv::Mat pcsToSrgb;
@@ -792,7 +1268,7 @@ namespace motioncam {
                                                                    const RawCameraMetadata& cameraMetadata,
                                                                    const PostProcessSettings& settings)
     {
-        //Measure measure("createPreview()");
+        ScopedTrace trace("createPreview()");
         
         if(downscaleFactor != 2 && downscaleFactor != 4 && downscaleFactor != 8) {
             throw InvalidState("Invalid downscale factor");
@@ -946,8 +1422,8 @@ namespace motioncam {
 
         NativeBufferContext inputBufferContext(*rawBuffer.data, false);
         
-        rawData->previewBuffer  = Halide::Runtime::Buffer<uint8_t>(halfWidth + extendX, halfHeight + extendY);
-        rawData->rawBuffer      = Halide::Runtime::Buffer<uint16_t>(halfWidth + extendX, halfHeight + extendY, 4);
+        rawData->previewBuffer  = MemoryArena::buffer<uint8_t>(halfWidth + extendX, halfHeight + extendY);
+        rawData->rawBuffer      = MemoryArena::buffer<uint16_t>(halfWidth + extendX, halfHeight + extendY, 4);
         rawData->metadata       = rawBuffer.metadata;
         
         deinterleave_raw(inputBufferContext.getHalideBuffer(),
@@ -1054,54 +1530,104 @@ namespace motioncam {
     cv::Mat ImageProcessor::registerImage(
         const Halide::Runtime::Buffer<uint8_t>& referenceBuffer, const Halide::Runtime::Buffer<uint8_t>& toAlignBuffer)
     {
-        //Measure measure("registerImage()");
+        Measure measure("registerImage()");
 
-//        cv::Mat referenceImage(referenceBuffer.height(), referenceBuffer.width(), CV_8U, (void*) referenceBuffer.data());
-//        cv::Mat toAlignImage(toAlignBuffer.height(), toAlignBuffer.width(), CV_8U, (void*) toAlignBuffer.data());
-//
-//        auto detector = cv::ORB::create();
-//
-//        std::vector<cv::KeyPoint> keypoints1, keypoints2;
-//        cv::Mat descriptors1, descriptors2;
-//        auto extractor = cv::xfeatures2d::BriefDescriptorExtractor::create();
-//
-//        detector->detect(referenceImage, keypoints1);
-//        detector->detect(toAlignImage, keypoints2);
-//
-//        extractor->compute(referenceImage, keypoints1, descriptors1);
-//        extractor->compute(toAlignImage, keypoints2, descriptors2);
-//
-//        auto matcher = cv::BFMatcher::create(cv::NORM_HAMMING, false);
-//        std::vector< std::vector<cv::DMatch> > knn_matches;
-//
-//        matcher->knnMatch( descriptors1, descriptors2, knn_matches, 2 );
-//
-//        // Filter matches using the Lowe's ratio test
-//        const float ratioThresh = 0.75f;
-//        std::vector<cv::DMatch> goodMatches;
-//
-//        for (auto& m : knn_matches)
-//        {
-//            if (m[0].distance < ratioThresh * m[1].distance)
-//                goodMatches.push_back(m[0]);
-//        }
-//
-//        std::vector<cv::Point2f> obj;
-//        std::vector<cv::Point2f> scene;
-//
-//        for(auto& m : goodMatches)
-//        {
-//            obj.push_back( keypoints1[ m.queryIdx ].pt );
-//            scene.push_back( keypoints2[ m.trainIdx ].pt );
-//        }
-//
-//        if(obj.size() < 4 || scene.size() < 4) {
-//            return cv::Mat();
-//        }
-//
-//        return findHomography( scene, obj, cv::RANSAC );
-        
-        return cv::Mat();
+        // Most of the motion is found at the top of the pyramid so only a few iterations are needed per level
+        static const cv::TermCriteria translationCriteria =
+            cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 20, 0.001f);
+
+        static const cv::TermCriteria homographyCriteria =
+            cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 15, 0.001f);
+
+        static const float scaleWarpMatrix[] = {
+           1,   1,   2,
+           1,   1,   2,
+           0.5, 0.5, 1 };
+
+        static const cv::Mat s(3, 3, CV_32F, (void*) &scaleWarpMatrix);
+
+        const int ALIGN_MAX_TOP_SIZE = 256;
+        const double MIN_TRANSLATION_CORRELATION = 0.97;
+
+        cv::Mat referenceImage(referenceBuffer.height(), referenceBuffer.width(), CV_8U, (void*) referenceBuffer.data());
+        cv::Mat toAlignImage(toAlignBuffer.height(), toAlignBuffer.width(), CV_8U, (void*) toAlignBuffer.data());
+
+        // Downscale until the top level is small enough, regardless of the input size
+        vector<cv::Mat> refPyramid = { referenceImage };
+        vector<cv::Mat> curPyramid = { toAlignImage };
+
+        while((std::max)(refPyramid.back().cols, refPyramid.back().rows) > ALIGN_MAX_TOP_SIZE) {
+            cv::Mat ref, cur;
+
+            cv::pyrDown(refPyramid.back(), ref);
+            cv::pyrDown(curPyramid.back(), cur);
+
+            refPyramid.push_back(ref);
+            curPyramid.push_back(cur);
+        }
+
+        // Skip the original size image as in registerImage2()
+        const int topLevel = static_cast<int>(refPyramid.size()) - 1;
+        const int lastLevel = (std::min)(1, topLevel);
+
+        //
+        // Estimate translation from coarse to fine
+        //
+
+        cv::Mat translation = cv::Mat::eye(2, 3, CV_32F);
+        double correlation = 0;
+
+        for(int i = topLevel; i >= lastLevel; i--) {
+            try {
+                correlation = cv::findTransformECC(curPyramid[i], refPyramid[i], translation, cv::MOTION_TRANSLATION, translationCriteria);
+            }
+            catch(cv::Exception& e) {
+                return cv::Mat();
+            }
+
+            if(i > lastLevel) {
+                translation.at<float>(0, 2) *= 2;
+                translation.at<float>(1, 2) *= 2;
+            }
+        }
+
+        const float tx = translation.at<float>(0, 2);
+        const float ty = translation.at<float>(1, 2);
+
+        cv::Mat warpMatrix = cv::Mat::eye(3, 3, CV_32F);
+
+        //
+        // Only estimate a homography when a translation does not explain the motion
+        //
+
+        if(correlation < MIN_TRANSLATION_CORRELATION) {
+            const float scale = 1.0f / (1 << (topLevel - lastLevel));
+
+            warpMatrix.at<float>(0, 2) = tx * scale;
+            warpMatrix.at<float>(1, 2) = ty * scale;
+
+            for(int i = topLevel; i >= lastLevel; i--) {
+                try {
+                    cv::findTransformECC(curPyramid[i], refPyramid[i], warpMatrix, cv::MOTION_HOMOGRAPHY, homographyCriteria);
+                }
+                catch(cv::Exception& e) {
+                    return cv::Mat();
+                }
+
+                if(i > lastLevel)
+                    warpMatrix = warpMatrix.mul(s);
+            }
+        }
+        else {
+            warpMatrix.at<float>(0, 2) = tx;
+            warpMatrix.at<float>(1, 2) = ty;
+        }
+
+        // Scale to the original size
+        for(int i = lastLevel; i > 0; i--)
+            warpMatrix = warpMatrix.mul(s);
+
+        return warpMatrix;
     }
 
     cv::Mat ImageProcessor::calcHistogram(const RawCameraMetadata& cameraMetadata,
@@ -1109,7 +1635,7 @@ namespace motioncam {
                                           const bool cumulative,
                                           const int downscale)
     {
-        //Measure measure("calcHistogram()");
+        ScopedTrace trace("calcHistogram()");
         const int SCALE = downscale;
         
         const int width = buffer.width/2/SCALE;
@@ -1185,10 +1711,16 @@ namespace motioncam {
         return histogram;
     }
 
-    void ImageProcessor::process(RawContainer& rawContainer, const std::string& outputPath, const ImageProcessorProgress& progressListener)
+    void ImageProcessor::process(RawContainer& rawContainer,
+                                 const std::string& outputPath,
+                                 const ImageProcessorProgress& progressListener,
+                                 const size_t memoryLimitBytes)
     {
         cv::ocl::setUseOpenCL(false);
         
+        ProcessSession session;
+        
+        const MemoryStats memoryStart = MemoryArena::get().stats();
         
         // If this is a HDR capture then find the underexposed images.
         std::vector<std::shared_ptr<RawImageBuffer>> underexposedImages;
@@ -1208,7 +1740,7 @@ namespace motioncam {
                     // Load the frame since we intend to remove it from the container
                     auto raw = rawContainer.loadFrame(frameName);
                     if(!raw) {
-                        logger::log("Invalid frame " + frameName);
+                        logger::warning("Invalid frame " + frameName);
                         continue;
                     }
 
@@ -1226,8 +1758,8 @@ namespace motioncam {
             return;
         }
 
-        // Use oldest frame as reference (TODO: Pick sharpest)
-        auto referenceFrame = rawContainer.getFrames()[0];
+        // Use the sharpest frame as reference and drop any frames that are much blurrier
+        auto referenceFrame = selectReference(rawContainer, MIN_RELATIVE_SHARPNESS);
         auto referenceRawBuffer = rawContainer.loadFrame(referenceFrame);
 
         if(!referenceRawBuffer) {
@@ -1239,7 +1771,13 @@ namespace motioncam {
         // Remove the reference
         rawContainer.removeFrame(referenceFrame);
 
-        auto referenceBayer = loadRawImage(*referenceRawBuffer, rawContainer.getCameraMetadata());
+        std::shared_ptr<RawData> referenceBayer;
+
+        {
+            MemoryStage memoryStage("loadRawImage", &progressListener, memoryLimitBytes);
+            referenceBayer = loadRawImage(*referenceRawBuffer, rawContainer.getCameraMetadata());
+        }
+
         PostProcessSettings settings = rawContainer.getPostProcessSettings();
         
         // Estimate shadows if not set
@@ -1257,55 +1795,76 @@ namespace motioncam {
         }
                 
         //
-        // Save preview
+        // Create the preview, register the HDR image and denoise the burst concurrently. None of them modify the
+        // reference and only the denoise reads from the container. Listener callbacks are forwarded back to this
+        // thread.
         //
-        
-        Halide::Runtime::Buffer<uint8_t> preview;
-        PostProcessSettings previewSettings = settings;
-        
-        preview = createPreview(*referenceRawBuffer, 2, rawContainer.getCameraMetadata(), previewSettings);
-        
-        std::string basePath, filename;
 
-        cv::Mat previewImage(preview.height(), preview.width(), CV_8UC4, preview.data());
-                
-        util::GetBasePath(outputPath, basePath, filename);
-        std::string previewPath = basePath + "/PREVIEW_" + filename;
-        
-        cv::cvtColor(previewImage, previewImage, cv::COLOR_RGBA2BGR);
-        cv::imwrite(previewPath, previewImage);
-        
-        // Parse the returned metadata
-        std::string metadataJson = progressListener.onPreviewSaved(previewPath);
-        previewImage.release();
+        TaskScheduler scheduler(NUM_PROCESS_TASK_THREADS, memoryLimitBytes);
+        CallingThreadProgress taskProgress(progressListener, scheduler);
+
+        const size_t frameBytes = static_cast<size_t>(referenceRawBuffer->width) * referenceRawBuffer->height * sizeof(uint16_t);
+
+        // Save preview
+        scheduler.add("preview", PREVIEW_TASK_MEMORY * frameBytes, [&]() {
+            MemoryStage memoryStage("preview", &taskProgress, memoryLimitBytes);
+
+            PostProcessSettings previewSettings = settings;
+
+            auto preview = createPreview(*referenceRawBuffer, 2, rawContainer.getCameraMetadata(), previewSettings);
+
+            std::string basePath, filename;
+
+            cv::Mat previewImage(preview.height(), preview.width(), CV_8UC4, preview.data());
+
+            util::GetBasePath(outputPath, basePath, filename);
+            std::string previewPath = basePath + "/PREVIEW_" + filename;
+
+            cv::cvtColor(previewImage, previewImage, cv::COLOR_RGBA2BGR);
+
+            // Encode in memory and write the file in one go, like the JPEG
+            const size_t extension = filename.find_last_of('.');
+            std::vector<uint8_t> previewData;
+
+            if(!cv::imencode(extension != std::string::npos ? filename.substr(extension) : ".jpg", previewImage, previewData))
+                throw IOException("Failed to encode " + previewPath);
+
+            util::WriteFile(previewData.data(), previewData.size(), previewPath);
+
+            taskProgress.onPreviewSaved(previewPath);
+        });
 
-        //
         // HDR
-        //
-        
         shared_ptr<HdrMetadata> hdrMetadata;
-  
-        if(!underexposedImages.empty()){
-            hdrMetadata = prepareHdr(rawContainer.getCameraMetadata(),
-                       settings,
-                       *referenceRawBuffer,
-                       *underexposedImages[0]);
+
+        if(!underexposedImages.empty()) {
+            const size_t hdrMemory = (HDR_TASK_MEMORY + BRACKET_TASK_MEMORY * (underexposedImages.size() - 1)) * frameBytes;
+
+            scheduler.add("hdr", hdrMemory, [&]() {
+                MemoryStage memoryStage("HDR", &taskProgress, memoryLimitBytes);
+
+                hdrMetadata = prepareHdr(rawContainer.getCameraMetadata(),
+                                         settings,
+                                         *referenceRawBuffer,
+                                         underexposedImages);
+            });
         }
-        
-        underexposedImages.clear();
-        
-        //
+
         // Denoise
-        //
-        
-        ImageProgressHelper progressHelper(progressListener, static_cast<int>(rawContainer.getFrames().size()), 0);
-        
+        ImageProgressHelper progressHelper(taskProgress, static_cast<int>(rawContainer.getFrames().size()), 0);
+
         std::vector<Halide::Runtime::Buffer<uint16_t>> denoiseOutput;
         float noise = 0.0f;
-        
-        denoiseOutput = denoise(*referenceRawBuffer, *referenceBayer, rawContainer, &noise, progressHelper);
-        
-        // Release RAW data
+
+        scheduler.add("denoise", DENOISE_TASK_MEMORY * frameBytes, [&]() {
+            denoiseOutput = denoise(*referenceRawBuffer, *referenceBayer, rawContainer, &noise, progressHelper, memoryLimitBytes);
+        });
+
+        scheduler.run();
+
+        underexposedImages.clear();
+
+        // Release RAW data
         referenceRawBuffer->data.reset();
         referenceBayer = nullptr;
 
@@ -1325,6 +1884,8 @@ namespace motioncam {
 
         // Check if we should write a DNG file
         if(rawContainer.getPostProcessSettings().dng) {
+            MemoryStage memoryStage("DNG", &progressListener, memoryLimitBytes);
+
             std::vector<cv::Mat> rawChannels;
             rawChannels.reserve(4);
 
@@ -1362,45 +1923,60 @@ namespace motioncam {
             }
         }
         
-        cv::Mat outputImage = postProcess(
-            denoiseOutput,
-            hdrMetadata,
-            offsetX,
-            offsetY,
-            noise,
-            referenceRawBuffer->metadata,
-            rawContainer.getCameraMetadata(),
-            settings);
+        cv::Mat outputImage;
+
+        {
+            MemoryStage memoryStage("postprocess", &progressListener, memoryLimitBytes);
+
+            outputImage = postProcess(
+                denoiseOutput,
+                hdrMetadata,
+                offsetX,
+                offsetY,
+                noise,
+                referenceRawBuffer->metadata,
+                rawContainer.getCameraMetadata(),
+                settings);
+        }
         
         progressHelper.postProcessCompleted();
          
-        // Write image
-        std::vector<int> writeParams = { cv::IMWRITE_JPEG_QUALITY, rawContainer.getPostProcessSettings().jpegQuality };
-        cv::imwrite(outputPath, outputImage, writeParams);
-
-        // Create thumbnail
-        cv::Mat thumbnail;
+        // Create thumbnail and write image with exif data
+        {
+            MemoryStage memoryStage("JPEG", &progressListener, memoryLimitBytes);
 
-        int width = 320;
-        int height = (int) std::lround((outputImage.rows / (double) outputImage.cols) * width);
+            cv::Mat thumbnail;
 
-        cv::resize(outputImage, thumbnail, cv::Size(width, height));
+            int width = 320;
+            int height = (int) std::lround((outputImage.rows / (double) outputImage.cols) * width);
 
-        // Add exif data to the output image
-        auto exifMetadata = referenceRawBuffer->metadata;
+            cv::resize(outputImage, thumbnail, cv::Size(width, height));
 
-        addExifMetadata(exifMetadata,
-                        thumbnail,
-                        rawContainer.getCameraMetadata(),
-                        rawContainer.getPostProcessSettings(),
-                        outputPath);
+            writeJpeg(outputImage,
+                      thumbnail,
+                      rawContainer.getPostProcessSettings().jpegQuality,
+                      referenceRawBuffer->metadata,
+                      rawContainer.getCameraMetadata(),
+                      rawContainer.getPostProcessSettings(),
+                      outputPath);
+        }
         
         progressHelper.imageSaved();
+
+        // Counters are shared with the other captures processed at the same time
+        const MemoryStats memoryEnd = MemoryArena::get().stats();
+
+        logger::log("Memory: " + to_string(memoryEnd.numAllocations - memoryStart.numAllocations) + " allocations (" +
+                    to_string(memoryEnd.numReused - memoryStart.numReused) + " reused), " +
+                    to_string((memoryEnd.bytesAllocated - memoryStart.bytesAllocated) / (1024*1024)) + " MB allocated, " +
+                    to_string((memoryEnd.bytesFromSystem - memoryStart.bytesFromSystem) / (1024*1024)) + " MB from system, peak " +
+                    to_string(memoryEnd.peakBytesInUse / (1024*1024)) + " MB");
     }
 
     void ImageProcessor::process(const std::string& inputPath,
                                  const std::string& outputPath,
-                                 const ImageProcessorProgress& progressListener)
+                                 const ImageProcessorProgress& progressListener,
+                                 const size_t memoryLimitBytes)
     {
         Measure measure("process()");
 
@@ -1412,7 +1988,17 @@ namespace motioncam {
             return;
         }
         
-        process(*container, outputPath, progressListener);
+        if(profiler::isEnabled()) {
+            // Timings cover every call that overlaps this one
+            ProcessSession session;
+
+            process(*container, outputPath, progressListener, memoryLimitBytes);
+
+            logger::log(profiler::toString(profiler::collect()));
+            return;
+        }
+
+        process(*container, outputPath, progressListener, memoryLimitBytes);
     }
 
     float ImageProcessor::adjustShadowsForFaces(cv::Mat input, PreviewMetadata& metadata) {
@@ -1445,20 +2031,12 @@ namespace motioncam {
 //        return std::min(4.0f, std::max(1.0f, 128.0f / L));
     }
     
-    void ImageProcessor::addExifMetadata(const RawImageMetadata& metadata,
-                                         const cv::Mat& thumbnail,
-                                         const RawCameraMetadata& cameraMetadata,
-                                         const PostProcessSettings& settings,
-                                         const std::string& inputOutput)
+    static void setExifData(Exiv2::ExifData& exifData,
+                            const RawImageMetadata& metadata,
+                            const cv::Mat& thumbnail,
+                            const RawCameraMetadata& cameraMetadata,
+                            const PostProcessSettings& settings)
     {
-        auto image = Exiv2::ImageFactory::open(inputOutput);
-        if(image.get() == nullptr)
-            return;
-        
-        image->readMetadata();
-        
-        Exiv2::ExifData& exifData = image->exifData();
-        
         // sRGB color space
         exifData["Exif.Photo.ColorSpace"]       = uint16_t(1);
         
@@ -1528,12 +2106,69 @@ namespace motioncam {
             
             exifThumb.setJpegThumbnail(thumbnailBuffer.data(), thumbnailBuffer.size());
         }
+    }
+
+    void ImageProcessor::addExifMetadata(const RawImageMetadata& metadata,
+                                         const cv::Mat& thumbnail,
+                                         const RawCameraMetadata& cameraMetadata,
+                                         const PostProcessSettings& settings,
+                                         const std::string& inputOutput)
+    {
+        auto image = Exiv2::ImageFactory::open(inputOutput);
+        if(image.get() == nullptr)
+            return;
+        
+        image->readMetadata();
+        
+        setExifData(image->exifData(), metadata, thumbnail, cameraMetadata, settings);
         
         image->writeMetadata();
     }
 
+    void ImageProcessor::writeJpeg(const cv::Mat& image,
+                                   const cv::Mat& thumbnail,
+                                   const int quality,
+                                   const RawImageMetadata& metadata,
+                                   const RawCameraMetadata& cameraMetadata,
+                                   const PostProcessSettings& settings,
+                                   const std::string& outputPath)
+    {
+        Measure measure("writeJpeg()");
+        
+        std::vector<uint8_t> jpegData;
+        std::vector<int> writeParams = { cv::IMWRITE_JPEG_QUALITY, quality };
+        
+        if(!cv::imencode(".jpg", image, jpegData, writeParams))
+            throw IOException("Failed to encode " + outputPath);
+        
+        // Add the EXIF segment in memory
+        auto jpeg = Exiv2::ImageFactory::open(jpegData.data(), jpegData.size());
+        if(jpeg.get() == nullptr)
+            throw IOException("Failed to add metadata to " + outputPath);
+        
+        jpeg->readMetadata();
+        
+        setExifData(jpeg->exifData(), metadata, thumbnail, cameraMetadata, settings);
+        
+        jpeg->writeMetadata();
+        
+        auto& io = jpeg->io();
+        
+        jpegData.resize(io.size());
+        
+        io.open();
+        io.seek(0, Exiv2::BasicIo::beg);
+        
+        if(static_cast<size_t>(io.read(jpegData.data(), jpegData.size())) != jpegData.size())
+            throw IOException("Failed to add metadata to " + outputPath);
+        
+        io.close();
+        
+        util::WriteFile(jpegData.data(), jpegData.size(), outputPath);
+    }
+
     double ImageProcessor::measureSharpness(const RawCameraMetadata& cameraMetadata, const RawImageBuffer& rawBuffer) {
-        //Measure measure("measureSharpness()");
+        ScopedTrace trace("measureSharpness()");
         
         int halfWidth  = rawBuffer.width / 2;
         int halfHeight = rawBuffer.height / 2;
@@ -1560,23 +2195,130 @@ namespace motioncam {
         return m[0];
     }
 
+    double ImageProcessor::measurePreviewSharpness(const RawCameraMetadata& cameraMetadata,
+                                                   const RawImageBuffer& rawBuffer,
+                                                   const int downscale)
+    {
+        auto preview = createFastPreview(rawBuffer, downscale, downscale, cameraMetadata);
+        
+        cv::Mat previewImage(preview.height(), preview.width(), CV_8UC4, preview.data());
+        cv::Mat gray, laplacian;
+        
+        cv::cvtColor(previewImage, gray, cv::COLOR_RGBA2GRAY);
+        cv::Laplacian(gray, laplacian, CV_16S);
+        
+        // Variance of the laplacian drops quickly with motion blur or missed focus
+        cv::Scalar m, stddev;
+        cv::meanStdDev(laplacian, m, stddev);
+        
+        return stddev[0] * stddev[0];
+    }
+
+    std::string ImageProcessor::selectReference(RawContainer& rawContainer, const float minRelativeSharpness) {
+        Measure measure("selectReference()");
+        
+        auto frames = rawContainer.getFrames();
+        if(frames.size() <= 1)
+            return frames.empty() ? std::string() : frames[0];
+        
+        const size_t batchSize = (std::max)(1u, (std::min)(4u, std::thread::hardware_concurrency()));
+        std::vector<double> sharpness(frames.size(), -1.0);
+        
+        size_t bestIdx = frames.size();
+        size_t keptBytes = 0;
+        
+        // Sharpest frame so far, when it is kept outside of the budget
+        std::shared_ptr<RawImageBuffer> bestBuffer;
+        
+        for(size_t start = 0; start < frames.size(); start += batchSize) {
+            const size_t end = (std::min)(frames.size(), start + batchSize);
+            
+            // Reading from the container is not thread safe, load the batch before scoring it in parallel
+            std::vector<std::shared_ptr<RawImageBuffer>> buffers;
+            
+            for(size_t i = start; i < end; i++)
+                buffers.push_back(rawContainer.loadFrame(frames[i]));
+            
+            ThreadPool::run(static_cast<int>(start), static_cast<int>(end), [&](int i) {
+                auto buffer = buffers[i - start];
+                if(!buffer)
+                    return;
+                
+                try {
+                    sharpness[i] = measurePreviewSharpness(rawContainer.getCameraMetadata(), *buffer, SHARPNESS_DOWNSCALE);
+                }
+                catch(std::exception& e) {
+                    logger::warning(std::string("Failed to measure sharpness: ") + e.what());
+                }
+            });
+            
+            if(rawContainer.isInMemory())
+                continue;
+            
+            // Keep the frames loaded while they fit so they are not read again when fusing. The sharpest frame is
+            // always kept since it is loaded again as the reference.
+            for(size_t i = start; i < end; i++) {
+                auto& buffer = buffers[i - start];
+                if(!buffer)
+                    continue;
+                
+                const bool best = bestIdx == frames.size() || sharpness[i] > sharpness[bestIdx];
+                const size_t bytes = buffer->data->len();
+                
+                if(best) {
+                    if(bestBuffer)
+                        bestBuffer->data->release();
+                    
+                    bestBuffer = nullptr;
+                    bestIdx = i;
+                }
+                
+                if(keptBytes + bytes <= MAX_KEPT_CANDIDATE_BYTES)
+                    keptBytes += bytes;
+                else if(best)
+                    bestBuffer = buffer;
+                else
+                    buffer->data->release();
+            }
+        }
+        
+        size_t referenceIdx = std::distance(sharpness.begin(), std::max_element(sharpness.begin(), sharpness.end()));
+        
+        const double minSharpness = sharpness[referenceIdx] * minRelativeSharpness;
+        
+        for(size_t i = 0; i < frames.size(); i++) {
+            if(i == referenceIdx)
+                continue;
+            
+            if(sharpness[i] < minSharpness) {
+                logger::log("Rejecting frame " + frames[i] + " (sharpness " + std::to_string(sharpness[i]) + ")");
+                rawContainer.removeFrame(frames[i]);
+            }
+        }
+        
+        logger::log("Using frame " + frames[referenceIdx] + " as reference (sharpness " + std::to_string(sharpness[referenceIdx]) + ")");
+        
+        return frames[referenceIdx];
+    }
+
     std::vector<Halide::Runtime::Buffer<uint16_t>> ImageProcessor::denoise(
         std::shared_ptr<RawImageBuffer> referenceRawBuffer,
         std::vector<std::shared_ptr<RawImageBuffer>> buffers,
         const std::vector<float>& denoiseWeights,
-        const RawCameraMetadata& cameraMetadata)
+        const RawCameraMetadata& cameraMetadata,
+        DenoiseContext& context)
     {
-        const int patchSize = 16;
-        std::vector<float> noise, signal;
-
-        // Measure noise in reference
-        measureNoise(cameraMetadata, *referenceRawBuffer, noise, signal, patchSize);
+        const int patchSize = NOISE_PATCH_SIZE;
+        std::vector<float> noise;
 
         auto reference = loadRawImage(*referenceRawBuffer, cameraMetadata, true);
+
+        // Get noise of reference
+        context.noiseModel().estimate(cameraMetadata, *referenceRawBuffer, reference->rawBuffer, patchSize, noise);
                 
         cv::Mat referenceFlowImage(reference->previewBuffer.height(), reference->previewBuffer.width(), CV_8U, reference->previewBuffer.data());
         
-        Halide::Runtime::Buffer<float> fuseOutput(reference->rawBuffer.width(), reference->rawBuffer.height(), 4);
+        auto fuseOutput = MemoryArena::buffer<float>(reference->rawBuffer.width(), reference->rawBuffer.height(), 4);
         Halide::Runtime::Buffer<float> thresholdBuffer(&noise[0], 4);
         
         fuseOutput.fill(0);
@@ -1623,75 +2365,27 @@ namespace motioncam {
                 fuseOutput);
         }
         
-        const int width = reference->rawBuffer.width();
-        const int height = reference->rawBuffer.height();
-
-        Halide::Runtime::Buffer<uint16_t> denoiseInput(width, height, 4);
-        
         auto whiteLevel = cameraMetadata.getWhiteLevel(reference->metadata);
         const auto& blackLevel = cameraMetadata.getBlackLevel(reference->metadata);
 
-        if(buffers.empty())
-            denoiseInput.for_each_element([&](int x, int y, int c) {
-                float p = reference->rawBuffer(x, y, c) - blackLevel[c];
-                float s = EXPANDED_RANGE / (float) (whiteLevel-blackLevel[c]);
-                
-                denoiseInput(x, y, c) = static_cast<uint16_t>( (std::max)(0.0f, (std::min)(p * s + 0.5f, (float) EXPANDED_RANGE) )) ;
-            });
-        else {
-            const float n = static_cast<float>(buffers.size());
-
-            denoiseInput.for_each_element([&](int x, int y, int c) {
-                float p = fuseOutput(x, y, c) / n - blackLevel[c];
-                float s = EXPANDED_RANGE / (float) (whiteLevel-blackLevel[c]);
-                
-                denoiseInput(x, y, c) = static_cast<uint16_t>( (std::max)(0.0f, (std::min)(p * s + 0.5f, (float) EXPANDED_RANGE) ) ) ;
-            });
-        }
-        
-        // Don't need this anymore
-        reference->rawBuffer = Halide::Runtime::Buffer<uint16_t>();
-
         //
         // Spatial denoising
         //
 
-        std::vector<Halide::Runtime::Buffer<uint16_t>> denoiseOutput;
         std::vector<float> weights = denoiseWeights;
-        
-        auto wavelet = createWaveletBuffers(denoiseInput.width(), denoiseInput.height());
-        auto weightsBuffer = Halide::Runtime::Buffer<float>(&weights[0], WAVELET_LEVELS);
-
-        for(int c = 0; c < 4; c++) {
-            forward_transform(denoiseInput,
-                              denoiseInput.width(),
-                              denoiseInput.height(),
-                              c,
-                              wavelet[0],
-                              wavelet[1],
-                              wavelet[2],
-                              wavelet[3]);
-
-            int offset = wavelet[0].stride(2);
 
-            cv::Mat hh(wavelet[0].height(), wavelet[0].width(), CV_32F, wavelet[0].data() + offset*7);
-            
-            float noiseSigma = estimateNoise(hh);
-            
-            Halide::Runtime::Buffer<uint16_t> outputBuffer(width, height);
+        auto denoiseOutput = spatialDenoise(reference->rawBuffer,
+                                            fuseOutput,
+                                            static_cast<int>(buffers.size()),
+                                            blackLevel,
+                                            whiteLevel,
+                                            weights,
+                                            context,
+                                            nullptr);
 
-            inverse_transform(wavelet[0],
-                              wavelet[1],
-                              wavelet[2],
-                              wavelet[3],
-                              noiseSigma,
-                              false,
-                              weightsBuffer,
-                              outputBuffer);
+        // Don't need this anymore
+        reference->rawBuffer = Halide::Runtime::Buffer<uint16_t>();
 
-            denoiseOutput.push_back(outputBuffer);
-        }
-        
         return denoiseOutput;
     }
 
@@ -1700,17 +2394,18 @@ namespace motioncam {
         std::vector<std::shared_ptr<RawImageBuffer>> buffers,
         const RawCameraMetadata& cameraMetadata)
     {
-        const int patchSize = 16;
-        std::vector<float> noise, signal;
-
-        // Measure noise in reference
-        measureNoise(cameraMetadata, *referenceRawBuffer, noise, signal, patchSize);
+        const int patchSize = NOISE_PATCH_SIZE;
+        std::vector<float> noise;
 
         auto reference = loadRawImage(*referenceRawBuffer, cameraMetadata, true);
+
+        // Get noise of reference
+        NoiseModel noiseModel;
+        noiseModel.estimate(cameraMetadata, *referenceRawBuffer, reference->rawBuffer, patchSize, noise);
                 
         cv::Mat referenceFlowImage(reference->previewBuffer.height(), reference->previewBuffer.width(), CV_8U, reference->previewBuffer.data());
         
-        Halide::Runtime::Buffer<float> fuseOutput(reference->rawBuffer.width(), reference->rawBuffer.height(), 4);
+        auto fuseOutput = MemoryArena::buffer<float>(reference->rawBuffer.width(), reference->rawBuffer.height(), 4);
         Halide::Runtime::Buffer<float> thresholdBuffer(&noise[0], 4);
         
         fuseOutput.fill(0);
@@ -1765,7 +2460,8 @@ namespace motioncam {
         RawData& reference,
         RawContainer& rawContainer,
         float* outNoise,
-        ImageProgressHelper& progressHelper)
+        ImageProgressHelper& progressHelper,
+        const size_t memoryBudgetBytes)
     {
         Measure measure("denoise()");
         
@@ -1781,7 +2477,21 @@ namespace motioncam {
         
         std::vector<float> noise, signal;
         
-        measureNoise(rawContainer.getCameraMetadata(), referenceRawBuffer, noise, signal, patchSize);
+        NoiseModel::measureSignal(reference.rawBuffer, signal);
+        
+        if(NoiseModel::fromNoiseProfile(rawContainer.getCameraMetadata(), referenceRawBuffer.metadata, signal, noise)) {
+            // Normalise to ISO 100 to match measureNoise()
+            const float isoScale = referenceRawBuffer.metadata.iso > 0 ? referenceRawBuffer.metadata.iso / 100.0f : 1.0f;
+            
+            for(auto& s : signal)
+                s /= isoScale;
+        }
+        else {
+            noise.clear();
+            signal.clear();
+            
+            measureNoise(rawContainer.getCameraMetadata(), referenceRawBuffer, noise, signal, patchSize);
+        }
         
         float signalAverage = std::accumulate(signal.begin(), signal.end(), 0.0f) / signal.size();
         signalAverage /= whiteLevel;
@@ -1795,12 +2505,17 @@ namespace motioncam {
         std::vector<Halide::Runtime::Buffer<uint16_t>> result;
         
         cv::Mat referenceFlowImage(reference.previewBuffer.height(), reference.previewBuffer.width(), CV_8U, reference.previewBuffer.data());
-        Halide::Runtime::Buffer<float> fuseOutput(reference.rawBuffer.width(), reference.rawBuffer.height(), 4);
+        cv::Mat referenceBlurred;
+        
+        cv::GaussianBlur(referenceFlowImage, referenceBlurred, cv::Size(5, 5), 2.0);
+        
+        auto fuseOutput = MemoryArena::buffer<float>(reference.rawBuffer.width(), reference.rawBuffer.height(), 4);
         
         fuseOutput.fill(0);
                 
         auto processFrames = rawContainer.getFrames();
         auto it = processFrames.begin();
+        int fusedFrames = 0;
 
         float w = 1.0f/(2.0f*sqrt(2.0f));
         auto method = &fuse_denoise_3x3;
@@ -1819,7 +2534,11 @@ namespace motioncam {
         // Fuse
         //
         
+        MemoryStage fuseStage("fuse", &progressHelper.listener(), memoryBudgetBytes);
+
         while(it != processFrames.end()) {
+            ScopedTrace frameTrace("fuse frame");
+
             auto frame = rawContainer.loadFrame(*it);
             auto current = loadRawImage(*frame, rawContainer.getCameraMetadata());
             
@@ -1838,65 +2557,71 @@ namespace motioncam {
             opticalFlow->setUseMeanNormalization(true);
             opticalFlow->setUseSpatialPropagation(true);
             
-            opticalFlow->calc(referenceFlowImage, currentFlowImage, flow);
+            {
+                ScopedTrace trace("optical flow");
+                opticalFlow->calc(referenceFlowImage, currentFlowImage, flow);
+            }
+            
+            // Skip frames that can't be aligned and merge partially aligned frames with less weight
+            float alignmentError = measureAlignmentError(referenceBlurred, currentFlowImage, flow);
+            
+            if(alignmentError > MAX_ALIGNMENT_ERROR) {
+                logger::log("Rejecting frame " + *it + " (alignment error " + std::to_string(alignmentError) + ")");
+                
+                progressHelper.frameRejected(*it, alignmentError);
+                
+                frame->data->release();
+                
+                ++it;
+                continue;
+            }
+            
+            float a = (alignmentError - MIN_ALIGNMENT_ERROR) / (MAX_ALIGNMENT_ERROR - MIN_ALIGNMENT_ERROR);
+            float weightScale = 1.0f - (1.0f - MIN_FUSE_WEIGHT_SCALE) * (std::max)(0.0f, (std::min)(1.0f, a));
             
             Halide::Runtime::Buffer<float> flowBuffer =
                 Halide::Runtime::Buffer<float>::make_interleaved((float*) flow.data, flow.cols, flow.rows, 2);
             
             auto flowMean = cv::mean(flow);
             
-            method(
-                reference.rawBuffer,
-                current->rawBuffer,
-                fuseOutput,
-                flowBuffer,
-                thresholdBuffer,
-                reference.rawBuffer.width(),
-                reference.rawBuffer.height(),
-                w,
-                4.0f,
-                flowMean[0],
-                flowMean[1],
-                fuseOutput);
+            {
+                ScopedTrace trace("fuse_denoise");
+
+                method(
+                    reference.rawBuffer,
+                    current->rawBuffer,
+                    fuseOutput,
+                    flowBuffer,
+                    thresholdBuffer,
+                    reference.rawBuffer.width(),
+                    reference.rawBuffer.height(),
+                    w * weightScale,
+                    4.0f,
+                    flowMean[0],
+                    flowMean[1],
+                    fuseOutput);
+            }
             
-            progressHelper.nextFusedImage();
+            ++fusedFrames;
+            trace::counter("fused frames", fusedFrames);
+            
+            progressHelper.frameAccepted(*it, alignmentError);
 
             frame->data->release();
             
             ++it;
         }
-                
-        const int width = reference.rawBuffer.width();
-        const int height = reference.rawBuffer.height();
 
-        Halide::Runtime::Buffer<uint16_t> denoiseInput(width, height, 4);
-        
-        if(processFrames.size() <= 1)
-            denoiseInput.for_each_element([&](int x, int y, int c) {
-                float p = reference.rawBuffer(x, y, c) - blackLevel[c];
-                float s = EXPANDED_RANGE / (float) (whiteLevel-blackLevel[c]);
+        fuseStage.end();
                 
-                denoiseInput(x, y, c) = static_cast<uint16_t>( (std::max)(0.0f, (std::min)(p * s + 0.5f, (float) EXPANDED_RANGE) )) ;
-            });
-        else {
-            const float n = (float) processFrames.size();
-
-            denoiseInput.for_each_element([&](int x, int y, int c) {
-                float p = fuseOutput(x, y, c) / n - blackLevel[c];
-                float s = EXPANDED_RANGE / (float) (whiteLevel-blackLevel[c]);
-                
-                denoiseInput(x, y, c) = static_cast<uint16_t>( (std::max)(0.0f, (std::min)(p * s + 0.5f, (float) EXPANDED_RANGE) ) ) ;
-            });
-        }
+        // Use the reference directly when nothing was fused
+        if(fusedFrames <= 1)
+            fusedFrames = 0;
 
         //
         // Spatial denoising
         //
 
-        std::vector<Halide::Runtime::Buffer<uint16_t>> denoiseOutput;
-        
-        auto wavelet = createWaveletBuffers(denoiseInput.width(), denoiseInput.height());
-
         std::vector<float> normalisedNoise;
         std::vector<float> weights;
         
@@ -1919,42 +2644,23 @@ namespace motioncam {
             weights = WEIGHTS[WEIGHTS.size() - i];
         }
         
-        auto weightsBuffer = Halide::Runtime::Buffer<float>(&weights[0], WAVELET_LEVELS);
-
-        for(int c = 0; c < 4; c++) {
-            forward_transform(denoiseInput,
-                              denoiseInput.width(),
-                              denoiseInput.height(),
-                              c,
-                              wavelet[0],
-                              wavelet[1],
-                              wavelet[2],
-                              wavelet[3]);
-
-            int offset = wavelet[0].stride(2);
-
-            cv::Mat ll(wavelet[0].height(), wavelet[0].width(), CV_32F, wavelet[0].data() + 4);
-            cv::Mat hh(wavelet[0].height(), wavelet[0].width(), CV_32F, wavelet[0].data() + offset*7);
-            
-            float noiseSigma = estimateNoise(hh);
-            float n = noiseSigma / (1e-5f + cv::mean(ll)[0]);
-        
-            normalisedNoise.push_back(n);
-            
-            Halide::Runtime::Buffer<uint16_t> outputBuffer(width, height);
-
-            inverse_transform(wavelet[0],
-                              wavelet[1],
-                              wavelet[2],
-                              wavelet[3],
-                              noiseSigma,
-                              false,
-                              weightsBuffer,
-                              outputBuffer);
+        DenoiseContext context;
+        std::vector<Halide::Runtime::Buffer<uint16_t>> denoiseOutput;
 
-            denoiseOutput.push_back(outputBuffer);
+        {
+            ScopedTrace spatialDenoiseTrace("spatial denoise");
+            MemoryStage memoryStage("wavelet", &progressHelper.listener(), memoryBudgetBytes);
+
+            denoiseOutput = spatialDenoise(reference.rawBuffer,
+                                           fuseOutput,
+                                           fusedFrames,
+                                           blackLevel,
+                                           whiteLevel,
+                                           weights,
+                                           context,
+                                           &normalisedNoise);
         }
-                
+
         *outNoise = *std::max_element(normalisedNoise.begin(), normalisedNoise.end());
         
         return denoiseOutput;
@@ -1973,10 +2679,50 @@ namespace motioncam {
     std::shared_ptr<HdrMetadata> ImageProcessor::prepareHdr(const RawCameraMetadata& cameraMetadata,
                                                             const PostProcessSettings& settings,
                                                             const RawImageBuffer& reference,
-                                                            const RawImageBuffer& underexposed)
+                                                            const std::vector<std::shared_ptr<RawImageBuffer>>& brackets)
     {
         Measure measure("prepareHdr()");
         
+        if(brackets.empty())
+            return nullptr;
+        
+        //
+        // Use the largest group of brackets within MAX_BRACKET_EV_DIFFERENCE of each other. The first bracket of the
+        // group is the base, the others are fused into it.
+        //
+        
+        std::vector<std::pair<double, size_t>> bracketEv;
+        
+        for(size_t i = 0; i < brackets.size(); i++)
+            bracketEv.emplace_back(calcEv(cameraMetadata, brackets[i]->metadata), i);
+        
+        std::sort(bracketEv.begin(), bracketEv.end());
+        
+        size_t groupStart = 0;
+        size_t groupEnd = 1;
+        
+        for(size_t start = 0, end = 0; start < bracketEv.size(); start++) {
+            while(end < bracketEv.size() && bracketEv[end].first - bracketEv[start].first <= MAX_BRACKET_EV_DIFFERENCE)
+                end++;
+            
+            if(end - start > groupEnd - groupStart) {
+                groupStart = start;
+                groupEnd = end;
+            }
+        }
+        
+        std::vector<size_t> group;
+        
+        for(size_t i = groupStart; i < groupEnd; i++)
+            group.push_back(bracketEv[i].second);
+        
+        std::sort(group.begin(), group.end());
+        
+        if(group.size() < brackets.size())
+            logger::log("Skipping " + std::to_string(brackets.size() - group.size()) + " HDR brackets with different exposure");
+        
+        const RawImageBuffer& underexposed = *brackets[group[0]];
+        
         // Match exposures
         float exposureScale;
                         
@@ -1997,11 +2743,138 @@ namespace motioncam {
         auto refImage = loadRawImage(reference, cameraMetadata, extendEdges, 1.0);
         auto underexposedImage = loadRawImage(underexposed, cameraMetadata, extendEdges, exposureScale);
 
-        // Try to register the image two different ways
-        auto warpMatrix = registerImage2(refImage->previewBuffer, underexposedImage->previewBuffer);
+        // Load and align the other brackets to the base while it is registered to the reference
+        std::vector<std::shared_ptr<RawData>> bracketImages;
+        std::vector<cv::Mat> bracketFlow;
+        std::vector<float> bracketError;
+
+        cv::Mat baseFlowImage(underexposedImage->previewBuffer.height(),
+                              underexposedImage->previewBuffer.width(),
+                              CV_8U,
+                              underexposedImage->previewBuffer.data());
+        cv::Mat baseBlurred;
+        
+        cv::GaussianBlur(baseFlowImage, baseBlurred, cv::Size(5, 5), 2.0);
+        
+        std::vector<std::shared_ptr<RawImageBuffer>> sameExposure;
+        
+        for(size_t i = 1; i < group.size(); i++)
+            sameExposure.push_back(brackets[group[i]]);
+
+        bracketImages.resize(sameExposure.size());
+        bracketFlow.resize(sameExposure.size());
+        bracketError.resize(sameExposure.size(), 1.0f);
+
+        auto alignBracket = [&](size_t n) {
+            ScopedTrace trace("align HDR bracket");
+
+            auto bracket = loadRawImage(*sameExposure[n], cameraMetadata, extendEdges, exposureScale);
+            
+            cv::Mat flowImage(bracket->previewBuffer.height(), bracket->previewBuffer.width(), CV_8U, bracket->previewBuffer.data());
+            
+            cv::Ptr<cv::DISOpticalFlow> opticalFlow =
+                cv::DISOpticalFlow::create(cv::DISOpticalFlow::PRESET_ULTRAFAST);
+            
+            opticalFlow->setPatchSize(NOISE_PATCH_SIZE);
+            opticalFlow->setPatchStride(NOISE_PATCH_SIZE/2);
+            opticalFlow->setGradientDescentIterations(16);
+            opticalFlow->setUseMeanNormalization(true);
+            opticalFlow->setUseSpatialPropagation(true);
+            
+            opticalFlow->calc(baseFlowImage, flowImage, bracketFlow[n]);
+            
+            bracketError[n] = measureAlignmentError(baseBlurred, flowImage, bracketFlow[n]);
+            bracketImages[n] = bracket;
+        };
+
+        // Register the base to the reference while the other brackets are aligned to the base
+        cv::Mat warpMatrix;
+        
+        ThreadPool::run(0, static_cast<int>(sameExposure.size()) + 1, [&](int i) {
+            if(i > 0) {
+                alignBracket(i - 1);
+                return;
+            }
+            
+            ScopedTrace trace("register HDR");
+
+            // Try to register the image two different ways
+            warpMatrix = registerImage(refImage->previewBuffer, underexposedImage->previewBuffer);
+            
+            if(warpMatrix.empty())
+                warpMatrix = registerImage2(refImage->previewBuffer, underexposedImage->previewBuffer);
+        });
         
         if(warpMatrix.empty())
             return nullptr;
+        
+        //
+        // Fuse the brackets to reduce noise in the shadows
+        //
+        
+        if(!bracketImages.empty()) {
+            Measure fuseMeasure("prepareHdr() fuse brackets");
+            
+            std::vector<float> noise;
+            NoiseModel noiseModel;
+            
+            noiseModel.estimate(cameraMetadata, underexposed, underexposedImage->rawBuffer, NOISE_PATCH_SIZE, noise);
+
+            Halide::Runtime::Buffer<float> thresholdBuffer(&noise[0], 4);
+            auto fuseOutput = MemoryArena::buffer<float>(underexposedImage->rawBuffer.width(), underexposedImage->rawBuffer.height(), 4);
+
+            fuseOutput.fill(0);
+            
+            const float w = 1.0f / (2.0f*sqrt(2.0f));
+            int fusedBrackets = 0;
+            
+            for(size_t i = 0; i < bracketImages.size(); i++) {
+                if(bracketError[i] > MAX_ALIGNMENT_ERROR) {
+                    logger::log("Rejecting HDR bracket (alignment error " + std::to_string(bracketError[i]) + ")");
+                    continue;
+                }
+                
+                Halide::Runtime::Buffer<float> flowBuffer =
+                    Halide::Runtime::Buffer<float>::make_interleaved((float*) bracketFlow[i].data, bracketFlow[i].cols, bracketFlow[i].rows, 2);
+                
+                auto flowMean = cv::mean(bracketFlow[i]);
+                
+                fuse_denoise_3x3(underexposedImage->rawBuffer,
+                                 bracketImages[i]->rawBuffer,
+                                 fuseOutput,
+                                 flowBuffer,
+                                 thresholdBuffer,
+                                 underexposedImage->rawBuffer.width(),
+                                 underexposedImage->rawBuffer.height(),
+                                 w,
+                                 4.0f,
+                                 flowMean[0],
+                                 flowMean[1],
+                                 fuseOutput);
+                
+                ++fusedBrackets;
+                
+                // Free memory as we go
+                bracketImages[i] = nullptr;
+            }
+            
+            // Average the base with the fused brackets
+            if(fusedBrackets > 0) {
+                cv::Mat base(underexposedImage->rawBuffer.height() * 4,
+                             underexposedImage->rawBuffer.width(),
+                             CV_16U,
+                             underexposedImage->rawBuffer.data());
+
+                cv::Mat fused(fuseOutput.height() * 4, fuseOutput.width(), CV_32F, fuseOutput.data());
+                cv::Mat sum;
+                
+                base.convertTo(sum, CV_32F);
+                sum += fused;
+                sum.convertTo(base, CV_16U, 1.0 / (fusedBrackets + 1));
+            }
+            
+            logger::log("Fused " + std::to_string(fusedBrackets) + " HDR brackets");
+        }
 
         warpMatrix = warpMatrix.inv();
         warpMatrix.convertTo(warpMatrix, CV_32F);
@@ -2010,24 +2883,28 @@ namespace motioncam {
         // Test aligment
         //
         
-        Halide::Runtime::Buffer<uint8_t> ghostMapBuffer(refImage->rawBuffer.width(), refImage->rawBuffer.height());
-        Halide::Runtime::Buffer<uint8_t> maskBuffer(refImage->rawBuffer.width(), refImage->rawBuffer.height());
+        auto ghostMapBuffer = MemoryArena::buffer<uint8_t>(refImage->rawBuffer.width(), refImage->rawBuffer.height());
+        auto maskBuffer = MemoryArena::buffer<uint8_t>(refImage->rawBuffer.width(), refImage->rawBuffer.height());
         
         Halide::Runtime::Buffer<float> warpBuffer = ToHalideBuffer<float>(warpMatrix);
 
-        hdr_mask(refImage->rawBuffer,
-                 underexposedImage->rawBuffer,
-                 warpBuffer,
-                 blackLevel[0],
-                 blackLevel[1],
-                 blackLevel[2],
-                 blackLevel[3],
-                 whiteLevel,
-                 1.0f,
-                 exposureScale,
-                 16.0f,
-                 ghostMapBuffer,
-                 maskBuffer);
+        {
+            ScopedTrace trace("hdr_mask");
+
+            hdr_mask(refImage->rawBuffer,
+                     underexposedImage->rawBuffer,
+                     warpBuffer,
+                     blackLevel[0],
+                     blackLevel[1],
+                     blackLevel[2],
+                     blackLevel[3],
+                     whiteLevel,
+                     1.0f,
+                     exposureScale,
+                     16.0f,
+                     ghostMapBuffer,
+                     maskBuffer);
+        }
 
         // Calculate error
         cv::Mat ghostMap(ghostMapBuffer.height(), ghostMapBuffer.width(), CV_8U, ghostMapBuffer.data());
@@ -2072,28 +2949,32 @@ namespace motioncam {
         }
 
         Halide::Runtime::Buffer<float> colorTransformBuffer = ToHalideBuffer<float>(cameraToSrgb);
-        Halide::Runtime::Buffer<uint16_t> outputBuffer(underexposedImage->rawBuffer.width()*2, underexposedImage->rawBuffer.height()*2, 3);
+        auto outputBuffer = MemoryArena::buffer<uint16_t>(underexposedImage->rawBuffer.width()*2, underexposedImage->rawBuffer.height()*2, 3);
         
-        linear_image(underexposedImage->rawBuffer,
-                     warpBuffer,
-                     shadingMapBuffer[0],
-                     shadingMapBuffer[1],
-                     shadingMapBuffer[2],
-                     shadingMapBuffer[3],
-                     cameraWhite[0],
-                     cameraWhite[1],
-                     cameraWhite[2],
-                     colorTransformBuffer,
-                     underexposedImage->rawBuffer.width(),
-                     underexposedImage->rawBuffer.height(),
-                     static_cast<int>(cameraMetadata.sensorArrangment),
-                     blackLevel[0],
-                     blackLevel[1],
-                     blackLevel[2],
-                     blackLevel[3],
-                     whiteLevel,
-                     EXPANDED_RANGE,
-                     outputBuffer);
+        {
+            ScopedTrace trace("linear_image");
+
+            linear_image(underexposedImage->rawBuffer,
+                         warpBuffer,
+                         shadingMapBuffer[0],
+                         shadingMapBuffer[1],
+                         shadingMapBuffer[2],
+                         shadingMapBuffer[3],
+                         cameraWhite[0],
+                         cameraWhite[1],
+                         cameraWhite[2],
+                         colorTransformBuffer,
+                         underexposedImage->rawBuffer.width(),
+                         underexposedImage->rawBuffer.height(),
+                         static_cast<int>(cameraMetadata.sensorArrangment),
+                         blackLevel[0],
+                         blackLevel[1],
+                         blackLevel[2],
+                         blackLevel[3],
+                         whiteLevel,
+                         EXPANDED_RANGE,
+                         outputBuffer);
+        }
         
         //
         // Shift image to the right if we've underexposed too much
@@ -1,31 +1,199 @@
 #include "motioncam/Logger.h"
 
+#include <queue/blockingconcurrentqueue.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <thread>
 
 #ifdef __ANDROID__
     #include <android/log.h>
 #endif
 
+#if defined(__APPLE__) || defined(__ANDROID__) || defined(__linux__)
+    #include <pthread.h>
+#endif
+
 namespace motioncam {
     #ifdef __ANDROID__
         static const char* ANDROID_TAG = "libMotionCam";
     #endif
-    
+
     namespace logger {
-        void log(const std::string& str) {
+        namespace {
+            const size_t MAX_QUEUED_MESSAGES    = 4096;
+            const int DEFAULT_RATE_LIMIT        = 200;
+
+            struct Message {
+                Level level;
+                std::string text;
+            };
+
+            void write(Level level, const std::string& str) {
 #ifdef __ANDROID__
-            __android_log_print(ANDROID_LOG_INFO, ANDROID_TAG, "%s", str.c_str());
+                int priority = ANDROID_LOG_INFO;
+
+                switch(level) {
+                    case Level::Debug:      priority = ANDROID_LOG_DEBUG; break;
+                    case Level::Info:       priority = ANDROID_LOG_INFO; break;
+                    case Level::Warning:    priority = ANDROID_LOG_WARN; break;
+                    case Level::Error:      priority = ANDROID_LOG_ERROR; break;
+                }
+
+                __android_log_print(priority, ANDROID_TAG, "%s", str.c_str());
 #else
-            std::cout << str << std::endl;
+                if(level >= Level::Warning)
+                    std::cerr << str << std::endl;
+                else
+                    std::cout << str << std::endl;
 #endif
+            }
+
+            //
+            // The queue keeps a lock free sub-queue per producing thread. Never destroyed, so threads can still log
+            // while static objects are destroyed at exit.
+            //
+
+            class Backend {
+            public:
+                static Backend& get() {
+                    static Backend* backend = new Backend();
+                    return *backend;
+                }
+
+                void enqueue(Level level, const std::string& str) {
+                    if(mQueue.size_approx() >= MAX_QUEUED_MESSAGES || !mQueue.try_enqueue(Message{ level, str })) {
+                        mDropped++;
+                        return;
+                    }
+
+                    mEnqueued++;
+                }
+
+                void dropped() {
+                    mDropped++;
+                }
+
+                void flush() {
+                    const uint64_t enqueued = mEnqueued;
+                    const auto timeout = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+
+                    while(mWritten < enqueued && std::chrono::steady_clock::now() < timeout)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+
+            private:
+                Backend() : mQueue(MAX_QUEUED_MESSAGES), mEnqueued(0), mWritten(0), mDropped(0) {
+                    std::thread(&Backend::run, this).detach();
+
+                    // Write whatever is still queued when the process exits normally
+                    std::atexit([]() { logger::flush(); });
+                }
+
+                void run() {
+                #if defined(__APPLE__) || defined(__ANDROID__) || defined(__linux__)
+                    // Don't keep the real time policy of a streamer thread that happened to log first
+                    sched_param priority{};
+                    priority.sched_priority = 0;
+
+                    pthread_setschedparam(pthread_self(), SCHED_OTHER, &priority);
+                #endif
+
+                    Message message;
+
+                    while(true) {
+                        if(mQueue.wait_dequeue_timed(message, std::chrono::milliseconds(100))) {
+                            write(message.level, message.text);
+                            mWritten++;
+                        }
+
+                        const int dropped = mDropped.exchange(0);
+                        if(dropped > 0)
+                            write(Level::Warning, std::to_string(dropped) + " log messages dropped");
+                    }
+                }
+
+            private:
+                moodycamel::BlockingConcurrentQueue<Message> mQueue;
+                std::atomic<uint64_t> mEnqueued;
+                std::atomic<uint64_t> mWritten;
+                std::atomic<int> mDropped;
+            };
+
+            std::atomic<int> gLevel(static_cast<int>(Level::Debug));
+            std::atomic<int> gRateLimit(DEFAULT_RATE_LIMIT);
+
+            // Fixed one second windows per thread
+            bool withinRateLimit() {
+                const int rateLimit = gRateLimit.load(std::memory_order_relaxed);
+                if(rateLimit <= 0)
+                    return true;
+
+                thread_local std::chrono::steady_clock::time_point windowStart;
+                thread_local int windowMessages = 0;
+
+                auto now = std::chrono::steady_clock::now();
+
+                if(now - windowStart >= std::chrono::seconds(1)) {
+                    windowStart = now;
+                    windowMessages = 0;
+                }
+
+                return ++windowMessages <= rateLimit;
+            }
+        }
+
+        void log(Level level, const std::string& str) {
+            if(static_cast<int>(level) < gLevel.load(std::memory_order_relaxed))
+                return;
+
+            auto& backend = Backend::get();
+
+            // Errors are never rate limited
+            if(level < Level::Error && !withinRateLimit()) {
+                backend.dropped();
+                return;
+            }
+
+            backend.enqueue(level, str);
         }
-    
+
+        void log(const std::string& str) {
+            log(Level::Info, str);
+        }
+
         void debug(const std::string& str) {
-    #ifdef __ANDROID__
-            __android_log_print(ANDROID_LOG_DEBUG, ANDROID_TAG, "%s", str.c_str());
-    #else
-            std::cout << str << std::endl;
-    #endif
+            log(Level::Debug, str);
+        }
+
+        void warning(const std::string& str) {
+            log(Level::Warning, str);
+        }
+
+        void error(const std::string& str) {
+            log(Level::Error, str);
+        }
+
+        void start() {
+            Backend::get();
+        }
+
+        void setLevel(Level level) {
+            gLevel = static_cast<int>(level);
+        }
+
+        Level getLevel() {
+            return static_cast<Level>(gLevel.load());
+        }
+
+        void setRateLimit(int messagesPerSecond) {
+            gRateLimit = messagesPerSecond;
+        }
+
+        void flush() {
+            Backend::get().flush();
         }
     }
 }
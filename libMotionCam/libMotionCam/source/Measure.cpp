@@ -1,14 +1,296 @@
 #include "motioncam/Measure.h"
 #include "motioncam/Logger.h"
+#include "motioncam/Exceptions.h"
+
+#include <json11/json11.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace motioncam {
+    namespace {
+        const size_t EVENTS_PER_THREAD = 8192;
+        const size_t MAX_NAME_LENGTH = 47;
+
+        enum class EventType : char {
+            Span,
+            Counter
+        };
+
+        struct Event {
+            EventType type;
+            char name[MAX_NAME_LENGTH];
+            int64_t timestampNs;
+            int64_t value;          // Duration of a span, value of a counter
+        };
+
+        //
+        // Events of one thread. Only the owning thread writes and it takes no lock to do so. The events are published
+        // by the count of events written, and an export drops the events that were overwritten while it copied them,
+        // like the reader of a seqlock.
+        //
+
+        struct ThreadEvents {
+            ThreadEvents(int threadId) :
+                threadId(threadId), events(new Event[EVENTS_PER_THREAD]), written(0), first(0) {
+            }
+
+            void add(EventType type, const char* name, int64_t timestampNs, int64_t value) {
+                const size_t n = written.load(std::memory_order_relaxed);
+                Event& event = events[n % EVENTS_PER_THREAD];
+
+                // A reader that sees any of the writes below also sees the count of the events before this one
+                std::atomic_thread_fence(std::memory_order_release);
+
+                event.type = type;
+                event.timestampNs = timestampNs;
+                event.value = value;
+
+                std::strncpy(event.name, name, MAX_NAME_LENGTH - 1);
+                event.name[MAX_NAME_LENGTH - 1] = '\0';
+
+                written.store(n + 1, std::memory_order_release);
+            }
+
+            // Drops the events recorded so far
+            void clear() {
+                first = written.load(std::memory_order_acquire);
+            }
+
+            // Copies the events still in the buffer, oldest first
+            std::vector<Event> copy() const {
+                const size_t end = written.load(std::memory_order_acquire);
+                const size_t begin = (std::max)(
+                    first.load(std::memory_order_acquire), end > EVENTS_PER_THREAD ? end - EVENTS_PER_THREAD : 0);
+
+                std::vector<Event> result;
+                result.reserve(end - begin);
+
+                for(size_t i = begin; i < end; i++)
+                    result.push_back(events[i % EVENTS_PER_THREAD]);
+
+                // Keeps the reads of the events above from moving past the count read below
+                std::atomic_thread_fence(std::memory_order_acquire);
+
+                // The thread may have wrapped around onto the oldest events in the meantime, and may be writing one more
+                const size_t next = written.load(std::memory_order_relaxed) + 1;
+                const size_t oldestValid = next > EVENTS_PER_THREAD ? next - EVENTS_PER_THREAD : 0;
+                const size_t overwritten = oldestValid > begin ? (std::min)(oldestValid - begin, result.size()) : 0;
+
+                result.erase(result.begin(), result.begin() + overwritten);
+
+                return result;
+            }
+
+            int threadId;
+            std::string threadName;     // Guarded by gThreadsLock
+            std::unique_ptr<Event[]> events;
+            std::atomic<size_t> written;
+            std::atomic<size_t> first;
+        };
+
+        std::atomic<bool> gEnabled(false);
+
+        const std::chrono::steady_clock::time_point gEpoch = std::chrono::steady_clock::now();
+
+        //
+        // The events of a thread are kept after it exits so they are still exported. Only the most recent exited
+        // threads are kept, after that a new thread takes over the buffer of the oldest one.
+        //
+
+        const size_t MAX_EXITED_THREADS = 16;
+
+        std::mutex gThreadsLock;
+        std::vector<std::shared_ptr<ThreadEvents>> gThreads;
+        std::deque<std::shared_ptr<ThreadEvents>> gExitedThreads;
+        std::atomic<int> gNextThreadId(1);
+
+        struct ThreadEventsOwner {
+            ~ThreadEventsOwner() {
+                if(!events)
+                    return;
+
+                std::lock_guard<std::mutex> guard(gThreadsLock);
+                gExitedThreads.push_back(std::move(events));
+            }
+
+            std::shared_ptr<ThreadEvents> events;
+        };
+
+        //
+        // The buffer of a new thread is allocated without holding the lock, so threads that are tracing or exporting
+        // don't wait on it.
+        //
+
+        std::shared_ptr<ThreadEvents> createThreadEvents() {
+            {
+                std::lock_guard<std::mutex> guard(gThreadsLock);
+
+                if(gExitedThreads.size() >= MAX_EXITED_THREADS) {
+                    auto events = std::move(gExitedThreads.front());
+                    gExitedThreads.pop_front();
+
+                    events->threadId = gNextThreadId++;
+                    events->threadName.clear();
+                    events->clear();
+
+                    return events;
+                }
+            }
+
+            auto events = std::make_shared<ThreadEvents>(gNextThreadId++);
+
+            std::lock_guard<std::mutex> guard(gThreadsLock);
+            gThreads.push_back(events);
+
+            return events;
+        }
+
+        ThreadEvents& threadEvents() {
+            thread_local ThreadEventsOwner owner;
+
+            if(!owner.events)
+                owner.events = createThreadEvents();
+
+            return *owner.events;
+        }
+
+        int64_t nowNs() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - gEpoch).count();
+        }
+    }
+
+    namespace trace {
+        void setEnabled(bool enabled) {
+            gEnabled = enabled;
+        }
+
+        bool isEnabled() {
+            return gEnabled.load(std::memory_order_relaxed);
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> guard(gThreadsLock);
+
+            for(auto& thread : gThreads)
+                thread->clear();
+        }
+
+        void setThreadName(const std::string& name) {
+            auto& events = threadEvents();
+
+            std::lock_guard<std::mutex> guard(gThreadsLock);
+            events.threadName = name;
+        }
+
+        void counter(const char* name, int64_t value) {
+            if(!isEnabled())
+                return;
+
+            threadEvents().add(EventType::Counter, name, nowNs(), value);
+        }
+
+        std::string toJson() {
+            json11::Json::array traceEvents;
+
+            std::lock_guard<std::mutex> guard(gThreadsLock);
+
+            for(auto& thread : gThreads) {
+                if(!thread->threadName.empty()) {
+                    traceEvents.push_back(json11::Json::object {
+                        { "name", "thread_name" },
+                        { "ph", "M" },
+                        { "pid", 1 },
+                        { "tid", thread->threadId },
+                        { "args", json11::Json::object { { "name", thread->threadName } } }
+                    });
+                }
+
+                for(const Event& event : thread->copy()) {
+
+                    // Microseconds
+                    const double timestamp = event.timestampNs / 1000.0;
+
+                    if(event.type == EventType::Span) {
+                        traceEvents.push_back(json11::Json::object {
+                            { "name", event.name },
+                            { "ph", "X" },
+                            { "pid", 1 },
+                            { "tid", thread->threadId },
+                            { "ts", timestamp },
+                            { "dur", event.value / 1000.0 }
+                        });
+                    }
+                    else {
+                        traceEvents.push_back(json11::Json::object {
+                            { "name", event.name },
+                            { "ph", "C" },
+                            { "pid", 1 },
+                            { "tid", thread->threadId },
+                            { "ts", timestamp },
+                            { "args", json11::Json::object { { "value", static_cast<double>(event.value) } } }
+                        });
+                    }
+                }
+            }
+
+            return json11::Json(json11::Json::object {
+                { "traceEvents", traceEvents },
+                { "displayTimeUnit", "ms" }
+            }).dump();
+        }
+
+        void write(const std::string& outputPath) {
+            std::ofstream file(outputPath, std::ios::out | std::ios::trunc);
+            if(!file.is_open())
+                throw IOException("Cannot open " + outputPath);
+
+            file << toJson();
+
+            if(file.fail())
+                throw IOException("Failed to write " + outputPath);
+        }
+    }
+
+    ScopedTrace::ScopedTrace(const char* name) : mStartNs(0), mActive(false) {
+        if(trace::isEnabled())
+            begin(name);
+    }
+
+    ScopedTrace::ScopedTrace(const std::string& name) : mStartNs(0), mActive(false) {
+        if(trace::isEnabled())
+            begin(name.c_str());
+    }
+
+    void ScopedTrace::begin(const char* name) {
+        mName = name;
+        mStartNs = nowNs();
+        mActive = true;
+    }
+
+    ScopedTrace::~ScopedTrace() {
+        if(!mActive)
+            return;
+
+        const int64_t endNs = nowNs();
+
+        threadEvents().add(EventType::Span, mName.c_str(), mStartNs, endNs - mStartNs);
+    }
+
     Measure::Measure(std::string reference) :
         mReference(std::move(reference)),
-        mTimestamp(std::chrono::steady_clock::now()) {
-            
+        mTimestamp(std::chrono::steady_clock::now()),
+        mTrace(mReference) {
+
         logger::log(mReference);
     }
-    
+
     Measure::~Measure() {
         auto now = std::chrono::steady_clock::now();
         double durationMs = std::chrono::duration <double, std::milli>(now - mTimestamp).count();
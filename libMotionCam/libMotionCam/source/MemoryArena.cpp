@@ -0,0 +1,229 @@
+#include "motioncam/MemoryArena.h"
+#include "motioncam/Exceptions.h"
+#include "motioncam/Logger.h"
+#include "motioncam/MemoryUsage.h"
+
+#include <HalideRuntime.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+
+namespace motioncam {
+    // Matches the alignment the Halide runtime expects from halide_malloc()
+    const size_t ARENA_ALIGNMENT    = 128;
+
+    // Smaller allocations are rounded up to this size
+    const size_t MIN_BUCKET_SIZE    = 4096;
+
+    // Tags the blocks of the arena. Odd, so it never matches the pointer the default Halide allocator keeps in the
+    // same place.
+    const uint64_t BLOCK_MAGIC      = 0x4D434152454E4121ULL;
+
+    namespace {
+        // Placed right before each block, the magic last
+        struct BlockHeader {
+            void* base;
+            size_t bucketSize;
+            uint64_t magic;
+        };
+
+        halide_malloc_t gPrevMalloc = nullptr;
+        halide_free_t gPrevFree = nullptr;
+        std::atomic<bool> gInstalled(false);
+
+        size_t bucketSize(size_t size) {
+            if(size <= MIN_BUCKET_SIZE)
+                return MIN_BUCKET_SIZE;
+
+            // Round up to a quarter of the highest power of two
+            size_t step = MIN_BUCKET_SIZE / 4;
+
+            while(step * 8 <= size)
+                step *= 2;
+
+            return ((size + step - 1) / step) * step;
+        }
+
+        BlockHeader* header(void* ptr) {
+            return reinterpret_cast<BlockHeader*>(ptr) - 1;
+        }
+
+        void* halideMalloc(void* userContext, size_t size) {
+            return MemoryArena::get().allocate(size);
+        }
+
+        void halideFree(void* userContext, void* ptr) {
+            // Blocks allocated before the arena was installed go back to the allocator they came from
+            if(ptr && !MemoryArena::owns(ptr)) {
+                gPrevFree(userContext, ptr);
+                return;
+            }
+
+            MemoryArena::get().free(ptr);
+        }
+    }
+
+    MemoryArena& MemoryArena::get() {
+        static MemoryArena arena;
+        return arena;
+    }
+
+    MemoryArena::MemoryArena() : mMaxCachedBytes(0), mStats() {
+    }
+
+    void MemoryArena::install(size_t maxCachedBytes) {
+        if(gInstalled.exchange(true))
+            throw InvalidState("Memory arena already installed");
+
+        get().setMaxCachedBytes(maxCachedBytes);
+
+        gPrevFree = halide_set_custom_free(&halideFree);
+        gPrevMalloc = halide_set_custom_malloc(&halideMalloc);
+    }
+
+    void MemoryArena::uninstall() {
+        if(!gInstalled.exchange(false))
+            return;
+
+        halide_set_custom_malloc(gPrevMalloc);
+        halide_set_custom_free(gPrevFree);
+
+        get().setMaxCachedBytes(0);
+    }
+
+    bool MemoryArena::isInstalled() {
+        return gInstalled.load();
+    }
+
+    bool MemoryArena::owns(void* ptr) {
+        // Any block of the default Halide allocator has the pointer it was allocated at in this slot
+        return reinterpret_cast<const uint64_t*>(ptr)[-1] == BLOCK_MAGIC;
+    }
+
+    void MemoryArena::setMaxCachedBytes(size_t maxCachedBytes) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mMaxCachedBytes = maxCachedBytes;
+        }
+
+        if(maxCachedBytes == 0)
+            trim();
+    }
+
+    void* MemoryArena::allocate(size_t size) {
+        const size_t bucket = bucketSize(size);
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            mStats.numAllocations++;
+            mStats.bytesAllocated += size;
+            mStats.bytesInUse += bucket;
+            mStats.peakBytesInUse = (std::max)(mStats.peakBytesInUse, mStats.bytesInUse);
+
+            auto it = mFreeBlocks.find(bucket);
+            if(it != mFreeBlocks.end() && !it->second.empty()) {
+                void* ptr = it->second.back();
+                it->second.pop_back();
+
+                mStats.numReused++;
+                mStats.bytesCached -= bucket;
+
+                MemoryUsage::get().allocated(MemoryType::HALIDE, bucket);
+
+                return ptr;
+            }
+
+            mStats.bytesFromSystem += bucket;
+        }
+
+        // Leave room for the header and to align the block
+        void* base = std::malloc(bucket + sizeof(BlockHeader) + ARENA_ALIGNMENT);
+        if(!base) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStats.bytesInUse -= bucket;
+
+            return nullptr;
+        }
+
+        uintptr_t start = reinterpret_cast<uintptr_t>(base) + sizeof(BlockHeader);
+        uintptr_t aligned = (start + ARENA_ALIGNMENT - 1) & ~(static_cast<uintptr_t>(ARENA_ALIGNMENT) - 1);
+
+        void* ptr = reinterpret_cast<void*>(aligned);
+
+        header(ptr)->base = base;
+        header(ptr)->bucketSize = bucket;
+        header(ptr)->magic = BLOCK_MAGIC;
+
+        MemoryUsage::get().allocated(MemoryType::HALIDE, bucket);
+
+        return ptr;
+    }
+
+    void MemoryArena::free(void* ptr) {
+        if(!ptr)
+            return;
+
+        const size_t bucket = header(ptr)->bucketSize;
+
+        MemoryUsage::get().freed(MemoryType::HALIDE, bucket);
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            mStats.bytesInUse -= bucket;
+
+            if(mStats.bytesCached + bucket <= mMaxCachedBytes) {
+                mFreeBlocks[bucket].push_back(ptr);
+                mStats.bytesCached += bucket;
+
+                return;
+            }
+        }
+
+        std::free(header(ptr)->base);
+    }
+
+    void MemoryArena::trim() {
+        std::map<size_t, std::vector<void*>> freeBlocks;
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            freeBlocks.swap(mFreeBlocks);
+            mStats.bytesCached = 0;
+        }
+
+        for(auto& bucket : freeBlocks) {
+            for(auto ptr : bucket.second)
+                std::free(header(ptr)->base);
+        }
+    }
+
+    MemoryStats MemoryArena::stats() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mStats;
+    }
+
+    void MemoryArena::resetStats() {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        const size_t bytesInUse = mStats.bytesInUse;
+        const size_t bytesCached = mStats.bytesCached;
+
+        mStats = MemoryStats();
+        mStats.bytesInUse = bytesInUse;
+        mStats.peakBytesInUse = bytesInUse;
+        mStats.bytesCached = bytesCached;
+    }
+
+    void* MemoryArena::allocateBuffer(size_t size) {
+        return get().allocate(size);
+    }
+
+    void MemoryArena::freeBuffer(void* ptr) {
+        get().free(ptr);
+    }
+}
@@ -0,0 +1,278 @@
+#include "motioncam/MemoryUsage.h"
+#include "motioncam/ImageProcessorProgress.h"
+#include "motioncam/Logger.h"
+#include "motioncam/Measure.h"
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+
+namespace motioncam {
+    // Finished stages kept for stages()
+    const size_t MAX_FINISHED_STAGES = 256;
+
+    namespace {
+        void updateMax(std::atomic<size_t>& value, size_t newValue) {
+            size_t current = value.load(std::memory_order_relaxed);
+
+            while(newValue > current && !value.compare_exchange_weak(current, newValue, std::memory_order_relaxed)) {
+            }
+        }
+
+        const char* COUNTER_NAMES[NUM_MEMORY_TYPES] = {
+            "memory halide",
+            "memory opencv",
+            "memory raw"
+        };
+
+        //
+        // Wraps the standard allocator and counts the data of the matrices. Matrices allocated by it are freed by it,
+        // so the counts stay balanced.
+        //
+
+        class CountingMatAllocator : public cv::MatAllocator {
+        public:
+            CountingMatAllocator() : mAllocator(cv::Mat::getStdAllocator()) {
+            }
+
+            cv::UMatData* allocate(int dims,
+                                   const int* sizes,
+                                   int type,
+                                   void* data,
+                                   size_t* step,
+                                   cv::AccessFlag flags,
+                                   cv::UMatUsageFlags usageFlags) const override
+            {
+                cv::UMatData* u = mAllocator->allocate(dims, sizes, type, data, step, flags, usageFlags);
+
+                if(u) {
+                    u->currAllocator = this;
+
+                    if(!data)
+                        MemoryUsage::get().allocated(MemoryType::OPENCV, u->size);
+                }
+
+                return u;
+            }
+
+            bool allocate(cv::UMatData* u, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const override {
+                return mAllocator->allocate(u, accessFlags, usageFlags);
+            }
+
+            void deallocate(cv::UMatData* u) const override {
+                if(!u)
+                    return;
+
+                if(!(u->flags & cv::UMatData::USER_ALLOCATED))
+                    MemoryUsage::get().freed(MemoryType::OPENCV, u->size);
+
+                u->currAllocator = mAllocator;
+                mAllocator->deallocate(u);
+            }
+
+        private:
+            cv::MatAllocator* mAllocator;
+        };
+    }
+
+    StageMemoryUsage::StageMemoryUsage() :
+        bytesInUseStart(0),
+        bytesInUseEnd(0),
+        peakBytesInUse(0),
+        peakBytesInUseByType()
+    {
+    }
+
+    MemoryUsage& MemoryUsage::get() {
+        static MemoryUsage memoryUsage;
+        return memoryUsage;
+    }
+
+    MemoryUsage::MemoryUsage() :
+        mTotalBytesInUse(0),
+        mRecentPeakTotalBytesInUse(0),
+        mPeakBytesInUse(0),
+        mNextStageId(0)
+    {
+        for(int t = 0; t < NUM_MEMORY_TYPES; t++) {
+            mBytesInUse[t] = 0;
+            mRecentPeakBytesInUse[t] = 0;
+        }
+    }
+
+    void MemoryUsage::installOpenCVAllocator() {
+        // Never freed, matrices may outlive any owner
+        static CountingMatAllocator* allocator = new CountingMatAllocator();
+
+        cv::Mat::setDefaultAllocator(allocator);
+    }
+
+    void MemoryUsage::allocated(MemoryType type, size_t bytes) {
+        const int t = static_cast<int>(type);
+
+        const size_t bytesInUse = mBytesInUse[t].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        const size_t totalBytesInUse = mTotalBytesInUse.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+
+        updateMax(mRecentPeakBytesInUse[t], bytesInUse);
+        updateMax(mRecentPeakTotalBytesInUse, totalBytesInUse);
+
+        if(trace::isEnabled())
+            trace::counter(COUNTER_NAMES[t], static_cast<int64_t>(bytesInUse));
+    }
+
+    void MemoryUsage::freed(MemoryType type, size_t bytes) {
+        const int t = static_cast<int>(type);
+
+        // Allocations from before counting started aren't known
+        size_t bytesInUse = mBytesInUse[t].load(std::memory_order_relaxed);
+        size_t freedBytes;
+
+        do {
+            freedBytes = (std::min)(bytes, bytesInUse);
+        } while(!mBytesInUse[t].compare_exchange_weak(bytesInUse, bytesInUse - freedBytes, std::memory_order_relaxed));
+
+        mTotalBytesInUse.fetch_sub(freedBytes, std::memory_order_relaxed);
+
+        if(trace::isEnabled())
+            trace::counter(COUNTER_NAMES[t], static_cast<int64_t>(bytesInUse - freedBytes));
+    }
+
+    size_t MemoryUsage::bytesInUse() const {
+        return mTotalBytesInUse.load(std::memory_order_relaxed);
+    }
+
+    size_t MemoryUsage::bytesInUse(MemoryType type) const {
+        return mBytesInUse[static_cast<int>(type)].load(std::memory_order_relaxed);
+    }
+
+    size_t MemoryUsage::peakBytesInUse() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return (std::max)(mPeakBytesInUse, mRecentPeakTotalBytesInUse.load(std::memory_order_relaxed));
+    }
+
+    std::vector<StageMemoryUsage> MemoryUsage::stages() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mStages;
+    }
+
+    void MemoryUsage::reset() {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        // Keep the peaks of the stages still running
+        updateStagePeaks();
+
+        mStages.clear();
+        mPeakBytesInUse = mTotalBytesInUse.load(std::memory_order_relaxed);
+    }
+
+    //
+    // Folds the peaks since the last update into the active stages and starts over from the current use. Every
+    // active stage began before the last update, so the peaks are within all of them. Called with the lock held.
+    //
+
+    void MemoryUsage::updateStagePeaks() {
+        const size_t peak = mRecentPeakTotalBytesInUse.exchange(
+            mTotalBytesInUse.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+        size_t peakByType[NUM_MEMORY_TYPES];
+
+        for(int t = 0; t < NUM_MEMORY_TYPES; t++) {
+            peakByType[t] = mRecentPeakBytesInUse[t].exchange(
+                mBytesInUse[t].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+
+        mPeakBytesInUse = (std::max)(mPeakBytesInUse, peak);
+
+        for(auto& stage : mActiveStages) {
+            stage.usage.peakBytesInUse = (std::max)(stage.usage.peakBytesInUse, peak);
+
+            for(int t = 0; t < NUM_MEMORY_TYPES; t++)
+                stage.usage.peakBytesInUseByType[t] = (std::max)(stage.usage.peakBytesInUseByType[t], peakByType[t]);
+        }
+    }
+
+    int MemoryUsage::beginStage(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        updateStagePeaks();
+
+        ActiveStage stage;
+
+        stage.id = mNextStageId++;
+        stage.usage.stage = name;
+        stage.usage.bytesInUseStart = mTotalBytesInUse.load(std::memory_order_relaxed);
+        stage.usage.peakBytesInUse = stage.usage.bytesInUseStart;
+
+        for(int t = 0; t < NUM_MEMORY_TYPES; t++)
+            stage.usage.peakBytesInUseByType[t] = mBytesInUse[t].load(std::memory_order_relaxed);
+
+        mActiveStages.push_back(stage);
+
+        return stage.id;
+    }
+
+    StageMemoryUsage MemoryUsage::endStage(int id) {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        auto it = std::find_if(mActiveStages.begin(), mActiveStages.end(), [id](const ActiveStage& stage) {
+            return stage.id == id;
+        });
+
+        if(it == mActiveStages.end())
+            return StageMemoryUsage();
+
+        updateStagePeaks();
+
+        StageMemoryUsage usage = it->usage;
+        usage.bytesInUseEnd = mTotalBytesInUse.load(std::memory_order_relaxed);
+
+        mActiveStages.erase(it);
+
+        mStages.push_back(usage);
+        if(mStages.size() > MAX_FINISHED_STAGES)
+            mStages.erase(mStages.begin());
+
+        return usage;
+    }
+
+    MemoryStage::MemoryStage(const std::string& name,
+                             const ImageProcessorProgress* progressListener,
+                             size_t budgetBytes) :
+        mId(MemoryUsage::get().beginStage(name)),
+        mProgressListener(progressListener),
+        mBudgetBytes(budgetBytes),
+        mEnded(false)
+    {
+    }
+
+    MemoryStage::~MemoryStage() {
+        end();
+    }
+
+    void MemoryStage::end() {
+        if(mEnded)
+            return;
+
+        mEnded = true;
+
+        const StageMemoryUsage usage = MemoryUsage::get().endStage(mId);
+
+        const std::string counterName = "memory peak " + usage.stage;
+        trace::counter(counterName.c_str(), static_cast<int64_t>(usage.peakBytesInUse));
+
+        logger::debug(
+            "Memory " + usage.stage + ": peak " + std::to_string(usage.peakBytesInUse / (1024*1024)) + " MB (" +
+            "halide " + std::to_string(usage.peakBytesInUseByType[static_cast<int>(MemoryType::HALIDE)] / (1024*1024)) + " MB, " +
+            "opencv " + std::to_string(usage.peakBytesInUseByType[static_cast<int>(MemoryType::OPENCV)] / (1024*1024)) + " MB, " +
+            "raw " + std::to_string(usage.peakBytesInUseByType[static_cast<int>(MemoryType::RAW)] / (1024*1024)) + " MB)");
+
+        if(mBudgetBytes > 0 && usage.peakBytesInUse > mBudgetBytes) {
+            logger::warning(
+                "Memory " + usage.stage + " peaked at " + std::to_string(usage.peakBytesInUse / (1024*1024)) +
+                " MB, over the budget of " + std::to_string(mBudgetBytes / (1024*1024)) + " MB");
+        }
+
+        if(mProgressListener)
+            mProgressListener->onMemoryUsage(usage.stage, usage.peakBytesInUse, usage.bytesInUseEnd);
+    }
+}
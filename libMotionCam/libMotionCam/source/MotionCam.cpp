@@ -6,6 +6,7 @@
 #include "motioncam/RawImageBuffer.h"
 #include "motioncam/RawCameraMetadata.h"
 #include "motioncam/Measure.h"
+#include "motioncam/ThreadPool.h"
 
 #include "motioncam/RawEncoder.h"
 
@@ -67,6 +68,8 @@ namespace motioncam {
     }
 
     void MotionCam::writeDNG() {
+        trace::setThreadName("DNG writer");
+
         while(mImpl->running) {
             std::shared_ptr<Job> job;
 
@@ -74,6 +77,8 @@ namespace motioncam {
             if(!job)
                 continue;
             
+            ScopedTrace trace("DNG job");
+
             try {
 #if defined(__APPLE__) || defined(__ANDROID__) || defined(__linux__)
                 util::WriteDng(job->bayerImage,
@@ -95,7 +100,7 @@ namespace motioncam {
             }
             catch(std::runtime_error& e) {
                 job->error = e.what();
-                logger::log(std::string("WriteDNG error: ") + e.what());
+                logger::error(std::string("WriteDNG error: ") + e.what());
             }
         }
     }
@@ -175,13 +180,18 @@ namespace motioncam {
                                               const int mergeFrames,
                                               const bool enableCompression,
                                               const bool applyShadingMap,
-                                              const bool noClipShadingMap)
+                                              const bool noClipShadingMap,
+                                              DenoiseContext& denoiseContext)
     {
+        ScopedTrace trace("create DNG job");
+
         std::shared_ptr<RawImageBuffer> frame;
         
         auto& container = containers[orderedFrames[frameIdx].containerIndex];
         
         try {
+            ScopedTrace loadTrace("loadFrame");
+
             frame = container->loadFrame(orderedFrames[frameIdx].frameName);
         }
         catch(const std::runtime_error& e) {
@@ -248,7 +258,9 @@ namespace motioncam {
             }
             
             if(weightSum > 1e-5f) {
-                auto denoiseBuffers = ImageProcessor::denoise(frame, nearestBuffers, denoiseWeights, container->getCameraMetadata());
+                ScopedTrace denoiseTrace("denoise frame");
+
+                auto denoiseBuffers = ImageProcessor::denoise(frame, nearestBuffers, denoiseWeights, container->getCameraMetadata(), denoiseContext);
                 bayerBuffer = Halide::Runtime::Buffer<uint16_t>(denoiseBuffers[0].width() * 2, denoiseBuffers[0].height() * 2);
                 
                 build_bayer2(denoiseBuffers[0],
@@ -264,6 +276,8 @@ namespace motioncam {
                              bayerBuffer);
             }
             else {
+                ScopedTrace bayerTrace("build_bayer");
+
                 bayerBuffer = Halide::Runtime::Buffer<uint16_t>(frame->width, frame->height);
                 
                 build_bayer(inputBuffer,
@@ -288,10 +302,12 @@ namespace motioncam {
             bayerImage = cv::Mat(bayerBuffer.height(), bayerBuffer.width(), CV_16U, bayerBuffer.data());
         }
         else {
+            ScopedTrace mergeTrace("merge frames");
+
             // Get number of nearest buffers
             util::GetNearestBuffers(containers, orderedFrames, frameIdx, mergeFrames, nearestBuffers);
             
-            auto denoiseBuffers = ImageProcessor::denoise(frame, nearestBuffers, denoiseWeights, container->getCameraMetadata());
+            auto denoiseBuffers = ImageProcessor::denoise(frame, nearestBuffers, denoiseWeights, container->getCameraMetadata(), denoiseContext);
             bayerBuffer = Halide::Runtime::Buffer<uint16_t>(denoiseBuffers[0].width() * 2, denoiseBuffers[0].height() * 2);
             
             build_bayer2(denoiseBuffers[0],
@@ -387,6 +403,8 @@ namespace motioncam {
         if(autoRecover) {
             for(auto& container : containers) {
                 if(container->isCorrupted()) {
+                    ScopedTrace trace("recover container");
+
                     progress.onAttemptingRecovery();
                     container->recover();
                 }
@@ -411,7 +429,11 @@ namespace motioncam {
         if(orderedFrames.empty())
             return;
         
-        // Create processing threads
+        //
+        // The DNG writers stay on their own threads. They block on the job queue and on file IO, which would hold
+        // up pool workers that the Halide loops need. Their pipelines still run on the pool.
+        //
+
         mImpl->running = true;
         
         std::vector<std::unique_ptr<std::thread>> threads;
@@ -442,6 +464,9 @@ namespace motioncam {
         
         ScreenOrientation orientation = firstFrame->metadata.screenOrientation;
         
+        // Reuse the denoise scratch buffers across frames
+        DenoiseContext denoiseContext;
+        
         for(int frameIdx = startIdx; frameIdx <= endIdx; frameIdx++) {
             std::shared_ptr<Job> newJob;
 
@@ -455,10 +480,11 @@ namespace motioncam {
                                               mergeFrames,
                                               enableCompression,
                                               applyShadingMap,
-                                              noClipShadingMap);
+                                              noClipShadingMap,
+                                              denoiseContext);
             }
             catch(std::runtime_error& e) {
-                logger::log(std::string("convert error: ") + e.what());
+                logger::error(std::string("convert error: ") + e.what());
                 continue;
             }
 
@@ -471,10 +497,16 @@ namespace motioncam {
             {
                 std::this_thread::sleep_for(std::chrono::milliseconds(100));
             }
-                        
+            
+            trace::counter("DNG queue depth", static_cast<int64_t>(mImpl->jobQueue.size_approx()));
+            
             // Wait until jobs are completed
-            while(mImpl->jobQueue.size_approx() > numThreads) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            {
+                ScopedTrace waitTrace("wait for DNG writers");
+
+                while(mImpl->jobQueue.size_approx() > numThreads) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
             }
             
             int p = (frameIdx*100) / orderedFrames.size();
@@ -503,7 +535,7 @@ namespace motioncam {
         std::shared_ptr<Job> job;
         
         while(mImpl->jobQueue.try_dequeue(job)) {
-            logger::log("Discarding video frame!");
+            logger::warning("Discarding video frame!");
         }
 
         progress.onCompleted();
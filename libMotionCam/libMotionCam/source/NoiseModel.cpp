@@ -0,0 +1,141 @@
+#include "motioncam/NoiseModel.h"
+#include "motioncam/ImageProcessor.h"
+#include "motioncam/ImageOps.h"
+#include "motioncam/RawImageBuffer.h"
+#include "motioncam/RawCameraMetadata.h"
+#include "motioncam/Logger.h"
+
+#include <cmath>
+
+namespace motioncam {
+    const float NOISE_PROFILE_SIGNAL    = 0.18f;
+    const float MAX_NOISE_PROFILE_SIGMA = 0.25f;
+    const int SIGNAL_SAMPLE_STEP        = 8;
+
+    // Frames of the same exposure share cached thresholds if their signal levels fall in the same step
+    const int SIGNAL_CACHE_STEPS        = 64;
+
+    NoiseModel::NoiseModel() {
+    }
+
+    void NoiseModel::estimate(const RawCameraMetadata& cameraMetadata,
+                              const RawImageBuffer& rawBuffer,
+                              const Halide::Runtime::Buffer<uint16_t>& deinterleaved,
+                              const int patchSize,
+                              std::vector<float>& outNoise)
+    {
+        std::vector<float> signal;
+
+        measureSignal(deinterleaved, signal);
+
+        const float whiteLevel = cameraMetadata.getWhiteLevel(rawBuffer.metadata);
+        const auto& blackLevel = cameraMetadata.getBlackLevel(rawBuffer.metadata);
+
+        float signalLevel = 0;
+
+        for(int c = 0; c < 4; c++)
+            signalLevel += (signal[c] - blackLevel[c]) / (std::max)(1.0f, whiteLevel - blackLevel[c]);
+
+        const int signalStep = static_cast<int>((std::max)(0.0f, (std::min)(1.0f, signalLevel / 4)) * SIGNAL_CACHE_STEPS);
+        const auto key = std::make_tuple(rawBuffer.metadata.iso, rawBuffer.metadata.exposureTime, signalStep);
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            auto it = mCache.find(key);
+            if(it != mCache.end()) {
+                outNoise = it->second;
+                return;
+            }
+        }
+
+        std::vector<float> noise;
+
+        if(!fromNoiseProfile(cameraMetadata, rawBuffer.metadata, signal, noise)) {
+            std::vector<float> measuredSignal;
+
+            logger::debug("No usable noise profile, measuring noise");
+
+            noise.clear();
+            ImageProcessor::measureNoise(cameraMetadata, rawBuffer, noise, measuredSignal, patchSize);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mCache[key] = noise;
+        }
+
+        outNoise = noise;
+    }
+
+    bool NoiseModel::fromNoiseProfile(const RawCameraMetadata& cameraMetadata,
+                                      const RawImageMetadata& metadata,
+                                      const std::vector<float>& signal,
+                                      std::vector<float>& outNoise)
+    {
+        const auto& profile = metadata.noiseProfile;
+
+        // Either a single (S, O) pair for all channels or one per channel
+        if(profile.size() != 2 && profile.size() != 8)
+            return false;
+
+        const float whiteLevel = cameraMetadata.getWhiteLevel(metadata);
+        const auto& blackLevel = cameraMetadata.getBlackLevel(metadata);
+
+        std::vector<float> noise;
+
+        for(int c = 0; c < 4; c++) {
+            const int i = profile.size() == 2 ? 0 : c*2;
+
+            const double S = profile[i];
+            const double O = profile[i + 1];
+
+            const float range = whiteLevel - blackLevel[c];
+            if(range <= 0)
+                return false;
+
+            float x = NOISE_PROFILE_SIGNAL;
+
+            if(!signal.empty())
+                x = (std::max)(0.0f, (std::min)(1.0f, (signal[c] - blackLevel[c]) / range));
+
+            const double variance = S*x + O;
+            if(!std::isfinite(variance) || S < 0 || variance <= 0)
+                return false;
+
+            const float sigma = static_cast<float>(std::sqrt(variance));
+            if(sigma > MAX_NOISE_PROFILE_SIGMA)
+                return false;
+
+            noise.push_back(sigma * range);
+        }
+
+        outNoise = noise;
+
+        return true;
+    }
+
+    void NoiseModel::measureSignal(const Halide::Runtime::Buffer<uint16_t>& rawBuffer, std::vector<float>& outSignal) {
+        std::vector<float> samples;
+        samples.reserve((rawBuffer.width() / SIGNAL_SAMPLE_STEP + 1) * (rawBuffer.height() / SIGNAL_SAMPLE_STEP + 1));
+
+        outSignal.clear();
+
+        for(int c = 0; c < 4; c++) {
+            samples.clear();
+
+            for(int y = 0; y < rawBuffer.height(); y += SIGNAL_SAMPLE_STEP) {
+                for(int x = 0; x < rawBuffer.width(); x += SIGNAL_SAMPLE_STEP) {
+                    samples.push_back(rawBuffer(x, y, c));
+                }
+            }
+
+            outSignal.push_back(samples.empty() ? 0.0f : findMedian(samples));
+        }
+    }
+
+    void NoiseModel::clear() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCache.clear();
+    }
+}
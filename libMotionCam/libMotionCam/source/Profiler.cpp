@@ -0,0 +1,107 @@
+#include "motioncam/Profiler.h"
+
+#include <HalideRuntime.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+namespace motioncam {
+    namespace profiler {
+
+        bool isEnabled() {
+#ifdef MOTIONCAM_HALIDE_PROFILE
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        void reset() {
+#ifdef MOTIONCAM_HALIDE_PROFILE
+            halide_profiler_reset();
+#endif
+        }
+
+        std::vector<PipelineTiming> collect() {
+            std::vector<PipelineTiming> timings;
+
+#ifdef MOTIONCAM_HALIDE_PROFILE
+            halide_profiler_state* state = halide_profiler_get_state();
+
+            halide_mutex_lock(&state->lock);
+
+            for(auto* p = state->pipelines; p; p = static_cast<halide_profiler_pipeline_stats*>(p->next)) {
+                if(p->runs == 0)
+                    continue;
+
+                PipelineTiming pipeline;
+
+                pipeline.name = p->name;
+                pipeline.runs = p->runs;
+                pipeline.timeMs = p->time / 1e6;
+
+                for(int i = 0; i < p->num_funcs; i++) {
+                    const auto& f = p->funcs[i];
+                    if(f.time == 0)
+                        continue;
+
+                    FuncTiming func;
+
+                    func.name = f.name;
+                    func.timeMs = f.time / 1e6;
+                    func.percent = p->time > 0 ? 100.0 * f.time / p->time : 0.0;
+                    func.memoryPeak = f.memory_peak;
+                    func.numAllocations = f.num_allocs;
+
+                    pipeline.funcs.push_back(func);
+                }
+
+                std::sort(pipeline.funcs.begin(), pipeline.funcs.end(), [](const FuncTiming& a, const FuncTiming& b) {
+                    return a.timeMs > b.timeMs;
+                });
+
+                timings.push_back(pipeline);
+            }
+
+            halide_mutex_unlock(&state->lock);
+
+            std::sort(timings.begin(), timings.end(), [](const PipelineTiming& a, const PipelineTiming& b) {
+                return a.timeMs > b.timeMs;
+            });
+#endif
+
+            return timings;
+        }
+
+        std::vector<PipelineTiming> run(const std::function<void()>& f) {
+            reset();
+            f();
+
+            return collect();
+        }
+
+        std::string toString(const std::vector<PipelineTiming>& timings) {
+            std::stringstream ss;
+
+            ss << std::fixed << std::setprecision(2);
+
+            for(const auto& pipeline : timings) {
+                ss << pipeline.name << ": " << pipeline.timeMs << " ms over " << pipeline.runs << " runs" << std::endl;
+
+                for(const auto& func : pipeline.funcs) {
+                    ss << "  " << std::left << std::setw(40) << func.name << std::right
+                       << std::setw(10) << func.timeMs << " ms "
+                       << std::setw(6) << func.percent << "%";
+
+                    if(func.numAllocations > 0)
+                        ss << "  peak " << func.memoryPeak / 1024 << " KB";
+
+                    ss << std::endl;
+                }
+            }
+
+            return ss.str();
+        }
+    }
+}
@@ -53,6 +53,12 @@ namespace motioncam {
         outOutputSizeBytes = mStreamer ? mStreamer->writenOutputBytes() : 0;
     }
 
+    StreamingStats RawBufferManager::streamingStats() {
+        Lock lock(mMutex, "streamingStats()");
+
+        return mStreamer ? mStreamer->stats() : mLastStreamingStats;
+    }
+
     size_t RawBufferManager::memoryUseBytes() const {
         return mMemoryUseBytes;
     }
@@ -102,6 +108,10 @@ namespace motioncam {
 
                 return buffer;
             }
+
+            // The camera has to drop the frame
+            if(mStreamer && mStreamer->isRunning())
+                mStreamer->frameDropped();
         }
                 
         return nullptr;
@@ -434,7 +444,7 @@ namespace motioncam {
         Lock lock(mMutex, "enableStreaming()");
         
         if(mStreamer) {
-            logger::log("Failed to start streaming, already in progress");
+            logger::error("Failed to start streaming, already in progress");
             return;
         }
         
@@ -472,8 +482,10 @@ namespace motioncam {
     void RawBufferManager::endStreaming() {
         Lock lock(mMutex, "endStreaming()");
         
-        if(mStreamer)
+        if(mStreamer) {
             mStreamer->stop();
+            mLastStreamingStats = mStreamer->stats();
+        }
         
         mStreamer = nullptr;
     }
@@ -28,7 +28,10 @@ namespace motioncam {
         mBin(false),
         mWrittenFrames(0),
         mAcceptedFrames(0),
-        mWrittenBytes(0)
+        mWrittenBytes(0),
+        mDroppedFrames(0),
+        mTotalWriteTimeNs(0),
+        mMaxWriteTimeNs(0)
     {
     }
 
@@ -44,7 +47,7 @@ namespace motioncam {
         stop();
         
         if(fds.empty()) {
-            logger::log("No file descriptors found");
+            logger::error("No file descriptors found");
             return;
         }
         
@@ -52,6 +55,9 @@ namespace motioncam {
         mWrittenFrames = 0;
         mWrittenBytes = 0;
         mAcceptedFrames = 0;
+        mDroppedFrames = 0;
+        mTotalWriteTimeNs = 0;
+        mMaxWriteTimeNs = 0;
         
         // Start audio interface
         if(audioInterface && audioFd >= 0) {
@@ -62,7 +68,16 @@ namespace motioncam {
         }
 
         mStartTime = std::chrono::steady_clock::now();
+
+        // Start the log writer here rather than from an IO thread
+        logger::start();
         
+        //
+        // The IO and process threads are not run on the shared thread pool. The IO threads need real time priority,
+        // and both loop for the whole recording blocking on their queues, which would take pool workers away from
+        // the pipelines for as long as the recording runs.
+        //
+
         // Create IO threads with maximum priority
         for(int i = 0; i < fds.size(); i++) {
             auto ioThread = std::unique_ptr<std::thread>(new std::thread(&RawBufferStreamer::doStream, this, fds[i], cameraMetadata, (int)fds.size()));
@@ -91,6 +106,14 @@ namespace motioncam {
     void RawBufferStreamer::add(const std::shared_ptr<RawImageBuffer>& frame) {
         mUnprocessedBuffers.enqueue(frame);
         mAcceptedFrames++;
+
+        trace::counter("streamer unprocessed buffers", static_cast<int64_t>(mUnprocessedBuffers.size_approx()));
+    }
+
+    void RawBufferStreamer::frameDropped() {
+        mDroppedFrames++;
+
+        trace::counter("streamer dropped frames", static_cast<int64_t>(mDroppedFrames));
     }
 
     void RawBufferStreamer::stop() {
@@ -156,7 +179,7 @@ namespace motioncam {
     }
 
     void RawBufferStreamer::cropAndBin(RawImageBuffer& buffer) const {
-        //Measure m("cropAndBin");
+        ScopedTrace trace("cropAndBin");
         
         const int horizontalCrop = static_cast<const int>(4 * (lround(0.5f * (mCropWidth/100.0 * buffer.width)) / 4));
 
@@ -192,6 +215,12 @@ namespace motioncam {
 
         buffer.data->unlock();
 
+        // Keep the frame uncompressed if the encoder can't store it without loss
+        if(end == 0) {
+            logger::warning("Frame can't be encoded losslessly, writing it uncompressed");
+            return;
+        }
+
         buffer.width = croppedWidth / 2;
         buffer.height = croppedHeight / 2;
         buffer.isBinned = true;
@@ -205,7 +234,7 @@ namespace motioncam {
     }
 
     void RawBufferStreamer::crop(RawImageBuffer& buffer) const {
-        //Measure m("crop");
+        ScopedTrace trace("crop");
 
         const int horizontalCrop = static_cast<const int>(4 * (lround(0.5 * (mCropWidth/100.0 * buffer.width)) / 4));
 
@@ -242,6 +271,11 @@ namespace motioncam {
 
         buffer.data->unlock();
 
+        if(end == 0) {
+            logger::warning("Frame can't be encoded losslessly, writing it uncompressed");
+            return;
+        }
+
         // Update buffer
         buffer.pixelFormat = PixelFormat::RAW16;
         buffer.rowStride = croppedWidth*2;
@@ -263,6 +297,8 @@ namespace motioncam {
     }
 
     void RawBufferStreamer::doProcess() {
+        trace::setThreadName("RawBufferStreamer process");
+
         std::shared_ptr<RawImageBuffer> buffer;
         
         while(mRunning) {
@@ -274,13 +310,43 @@ namespace motioncam {
             
             // Add to the ready list
             mReadyBuffers.enqueue(buffer);
+
+            trace::counter("streamer ready buffers", static_cast<int64_t>(mReadyBuffers.size_approx()));
+        }
+
+    }
+
+    void RawBufferStreamer::writeBuffer(RawContainer& container, const std::shared_ptr<RawImageBuffer>& buffer) {
+        ScopedTrace trace("write frame");
+
+        size_t start = 0, end = 0;
+
+        auto writeStart = std::chrono::steady_clock::now();
+
+        container.add(*buffer, true);
+
+        int64_t writeTimeNs =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - writeStart).count();
+
+        mTotalWriteTimeNs += writeTimeNs;
+
+        int64_t maxWriteTimeNs = mMaxWriteTimeNs;
+        while(writeTimeNs > maxWriteTimeNs && !mMaxWriteTimeNs.compare_exchange_weak(maxWriteTimeNs, writeTimeNs)) {
         }
 
+        buffer->data->getValidRange(start, end);
+
+        mWrittenBytes += (end - start);
+        mWrittenFrames++;
+
+        // Return the buffer after it has been written
+        RawBufferManager::get().discardBuffer(buffer);
     }
 
     void RawBufferStreamer::doStream(const int fd, const RawCameraMetadata& cameraMetadata, const int numContainers) {
+        trace::setThreadName("RawBufferStreamer IO");
+
         std::shared_ptr<RawImageBuffer> buffer;
-        size_t start, end;
 
         auto container = RawContainer::Create(fd, cameraMetadata, numContainers);
 
@@ -289,16 +355,7 @@ namespace motioncam {
                 continue;
             }
 
-            container->add(*buffer, true);
-
-            start = end = 0;
-            buffer->data->getValidRange(start, end);
-
-            // Return the buffer after it has been written
-            RawBufferManager::get().discardBuffer(buffer);
-
-            mWrittenBytes += (end - start);
-            mWrittenFrames++;
+            writeBuffer(*container, buffer);
         }
 
         //
@@ -307,28 +364,18 @@ namespace motioncam {
 
         // Ready buffers
         while(mReadyBuffers.try_dequeue(buffer)) {
-            container->add(*buffer, true);
-            
-            buffer->data->getValidRange(start, end);
-            mWrittenBytes += (end - start);
-            mWrittenFrames++;
-
-            RawBufferManager::get().discardBuffer(buffer);
+            writeBuffer(*container, buffer);
         }
 
         // Unprocessed buffers
         while(mUnprocessedBuffers.try_dequeue(buffer)) {
             processBuffer(buffer);
             
-            container->add(*buffer, true);
-
-            buffer->data->getValidRange(start, end);
-            mWrittenBytes += (end - start);
-            mWrittenFrames++;
-
-            RawBufferManager::get().discardBuffer(buffer);
+            writeBuffer(*container, buffer);
         }
 
+        ScopedTrace commitTrace("commit container");
+
         container->commit();
     }
 
@@ -350,4 +397,24 @@ namespace motioncam {
     int RawBufferStreamer::droppedFrames() const {
         return mDroppedFrames;
     }
+
+    StreamingStats RawBufferStreamer::stats() const {
+        StreamingStats stats;
+
+        stats.fps = estimateFps();
+        stats.writtenFrames = mWrittenFrames;
+        stats.writtenBytes = mWrittenBytes;
+        stats.droppedFrames = mDroppedFrames;
+        stats.unprocessedQueueDepth = mUnprocessedBuffers.size_approx();
+        stats.readyQueueDepth = mReadyBuffers.size_approx();
+
+        const int writtenFrames = mWrittenFrames;
+
+        if(writtenFrames > 0)
+            stats.averageWriteTimeMs = static_cast<float>(mTotalWriteTimeNs / 1e6 / writtenFrames);
+
+        stats.maxWriteTimeMs = static_cast<float>(mMaxWriteTimeNs / 1e6);
+
+        return stats;
+    }
 }
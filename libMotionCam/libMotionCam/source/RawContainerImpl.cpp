@@ -4,6 +4,7 @@
 #include "motioncam/Exceptions.h"
 #include "motioncam/Util.h"
 #include "motioncam/RawEncoder.h"
+#include "motioncam/Resources.h"
 
 #include <utility>
 
@@ -394,11 +395,14 @@ namespace motioncam {
         if(dst->compressionType != CompressionType::MOTIONCAM)
             throw IOException("Invalid compression type");
 
-        encoder::decode(reinterpret_cast<uint16_t*>(uncompressedBuffer.data()),
-                        dst->width,
-                        dst->height,
-                        compressedBuffer.data(),
-                        compressedBuffer.size());
+        const size_t decoded = encoder::decode(reinterpret_cast<uint16_t*>(uncompressedBuffer.data()),
+                                               dst->width,
+                                               dst->height,
+                                               compressedBuffer.data(),
+                                               compressedBuffer.size());
+
+        if(decoded != static_cast<size_t>(dst->width) * dst->height)
+            throw IOException("Truncated frame");
                 
         dst->data->copyHostData(uncompressedBuffer);
     }
@@ -484,13 +488,7 @@ namespace motioncam {
         auto shadingMap = buffer->metadata.shadingMap();
 
         if(shadingMap.empty()) {
-            std::vector<cv::Mat> emptyShadingMap;
-            cv::Mat m(24, 18, CV_32F, cv::Scalar(1.0f));
-
-            for(int i = 0; i < 4; i++)
-                emptyShadingMap.push_back(m.clone());
-
-            buffer->metadata.updateShadingMap(emptyShadingMap);
+            buffer->metadata.updateShadingMap(resources::emptyShadingMap());
         }
         else {
             util::CropShadingMap(shadingMap,
@@ -0,0 +1,234 @@
+#include "motioncam/RawEncoder.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+//
+// Portable build of the encoder for hosts other than the device. The device links the NEON build from
+// libs/libmotioncam-encoder.a, both write the same stream.
+//
+// Each row is padded to a multiple of 32 pixels and stored in blocks of 16 pixels of the same column parity, the
+// even columns of a run of 32 pixels first. A block starts with two bytes holding the number of bits per pixel in
+// the top four bits and a 12 bit reference below them, followed by the differences to the reference packed most
+// significant bit first.
+//
+
+namespace motioncam {
+    namespace encoder {
+        namespace {
+            const int ENCODING_BLOCK        = 16;
+            const int ENCODING_RUN          = 2 * ENCODING_BLOCK;
+            const int MAX_ENCODING_BITS     = 10;
+            const int MAX_REFERENCE         = 0x0FFF;
+
+            int paddedWidth(int width) {
+                return ((width + ENCODING_RUN - 1) / ENCODING_RUN) * ENCODING_RUN;
+            }
+
+            int bitsNeeded(uint16_t range) {
+                int bits = 0;
+
+                while((range >> bits) != 0)
+                    bits++;
+
+                return bits;
+            }
+
+            uint16_t readPixel(const uint8_t* row, PixelFormat pixelFormat, int x) {
+                switch(pixelFormat) {
+                    case ANDROID_RAW10: {
+                        const uint8_t* p = row + (x / 4) * 5;
+                        const int i = x % 4;
+
+                        return static_cast<uint16_t>((p[i] << 2) | ((p[4] >> (2 * i)) & 0x03));
+                    }
+
+                    case ANDROID_RAW12: {
+                        const uint8_t* p = row + (x / 2) * 3;
+                        const int i = x % 2;
+
+                        return static_cast<uint16_t>((p[i] << 4) | ((p[2] >> (4 * i)) & 0x0F));
+                    }
+
+                    default:
+                    case ANDROID_RAW16:
+                        return static_cast<uint16_t>(row[2*x] | (row[2*x + 1] << 8));
+                }
+            }
+
+            //
+            // Appends the block of every second value of the run, starting at the given column parity. Returns false
+            // if the reference doesn't fit in 12 bits or the differences don't fit in MAX_ENCODING_BITS.
+            //
+
+            bool encodeBlock(const uint16_t* run, int parity, std::vector<uint8_t>& output) {
+                uint16_t minValue = run[parity];
+                uint16_t maxValue = run[parity];
+
+                for(int i = 1; i < ENCODING_BLOCK; i++) {
+                    minValue = (std::min)(minValue, run[2*i + parity]);
+                    maxValue = (std::max)(maxValue, run[2*i + parity]);
+                }
+
+                const uint16_t reference = minValue;
+                const uint16_t range = static_cast<uint16_t>(maxValue - reference);
+
+                if(reference > MAX_REFERENCE || (range >> MAX_ENCODING_BITS) != 0)
+                    return false;
+
+                const int bits = bitsNeeded(range);
+
+                output.push_back(static_cast<uint8_t>((bits << 4) | (reference >> 8)));
+                output.push_back(static_cast<uint8_t>(reference & 0xFF));
+
+                uint32_t acc = 0;
+                int accBits = 0;
+
+                for(int i = 0; i < ENCODING_BLOCK && bits > 0; i++) {
+                    acc = (acc << bits) | static_cast<uint32_t>(run[2*i + parity] - reference);
+                    accBits += bits;
+
+                    while(accBits >= 8) {
+                        accBits -= 8;
+                        output.push_back(static_cast<uint8_t>(acc >> accBits));
+                    }
+                }
+
+                return true;
+            }
+
+            bool encodeRow(std::vector<uint16_t>& row, int width, std::vector<uint8_t>& output) {
+                // Pad with the last value of the same parity so the padding doesn't widen the last blocks
+                for(int x = width; x < static_cast<int>(row.size()); x++)
+                    row[x] = x >= 2 ? row[x - 2] : row[0];
+
+                for(size_t x = 0; x < row.size(); x += ENCODING_RUN) {
+                    if(!encodeBlock(&row[x], 0, output) || !encodeBlock(&row[x], 1, output))
+                        return false;
+                }
+
+                return true;
+            }
+
+            //
+            // Encodes the rows and writes the stream over the input. The data is left as it was and 0 is returned if
+            // a value can't be stored losslessly, such as RAW16 values above 12 bits, or if the stream doesn't fit
+            // in the rows of the frame, which can happen with very noisy RAW10 rows.
+            //
+
+            template<typename ReadRow>
+            size_t encodeRows(uint8_t* data, size_t capacity, int width, int height, ReadRow readRow) {
+                std::vector<uint16_t> row(paddedWidth(width));
+                std::vector<uint8_t> output;
+
+                output.reserve(capacity);
+
+                for(int y = 0; y < height; y++) {
+                    readRow(y, row.data());
+
+                    if(!encodeRow(row, width, output) || output.size() > capacity)
+                        return 0;
+                }
+
+                std::memcpy(data, output.data(), output.size());
+
+                return output.size();
+            }
+        }
+
+        size_t encode(uint8_t* data,
+                      PixelFormat pixelFormat,
+                      const int xstart,
+                      const int xend,
+                      const int ystart,
+                      const int yend,
+                      const int rowStride)
+        {
+            const int width = xend - xstart;
+            const int height = yend - ystart;
+
+            return encodeRows(data, static_cast<size_t>(rowStride) * yend, width, height, [&](int y, uint16_t* row) {
+                const uint8_t* in = data + static_cast<size_t>(ystart + y) * rowStride;
+
+                for(int x = 0; x < width; x++)
+                    row[x] = readPixel(in, pixelFormat, xstart + x);
+            });
+        }
+
+        size_t encodeAndBin(uint8_t* data,
+                            PixelFormat pixelFormat,
+                            const int xstart,
+                            const int xend,
+                            const int ystart,
+                            const int yend,
+                            const int rowStride)
+        {
+            // Averages the four pixels of the same colour in each 4x4 tile of the bayer pattern
+            const int width = (xend - xstart) / 2;
+            const int height = (yend - ystart) / 2;
+
+            return encodeRows(data, static_cast<size_t>(rowStride) * yend, width, height, [&](int y, uint16_t* row) {
+                const int srcY = ystart + (y / 2) * 4 + (y % 2);
+
+                const uint8_t* in0 = data + static_cast<size_t>(srcY) * rowStride;
+                const uint8_t* in1 = data + static_cast<size_t>(srcY + 2) * rowStride;
+
+                for(int x = 0; x < width; x++) {
+                    const int srcX = xstart + (x / 2) * 4 + (x % 2);
+
+                    const uint32_t sum =
+                        readPixel(in0, pixelFormat, srcX) + readPixel(in0, pixelFormat, srcX + 2) +
+                        readPixel(in1, pixelFormat, srcX) + readPixel(in1, pixelFormat, srcX + 2);
+
+                    row[x] = static_cast<uint16_t>((sum + 2) / 4);
+                }
+            });
+        }
+
+        size_t decode(uint16_t* output, const int width, const int height, const uint8_t* input, const size_t len) {
+            std::vector<uint16_t> row(paddedWidth(width));
+            size_t offset = 0;
+
+            for(int y = 0; y < height; y++) {
+                for(size_t x = 0; x < row.size(); x += ENCODING_RUN) {
+                    for(int parity = 0; parity < 2; parity++) {
+                        if(offset + 2 > len)
+                            return static_cast<size_t>(y) * width;
+
+                        const int bits = input[offset] >> 4;
+                        const uint16_t reference = static_cast<uint16_t>(((input[offset] & 0x0F) << 8) | input[offset + 1]);
+
+                        // Blocks always take two bytes per bit, wider blocks than the largest are read as the largest
+                        const int unpackBits = (std::min)(bits, MAX_ENCODING_BITS);
+                        const uint8_t* p = input + offset + 2;
+
+                        offset += 2 + 2 * bits;
+                        if(offset > len)
+                            return static_cast<size_t>(y) * width;
+
+                        uint32_t acc = 0;
+                        int accBits = 0;
+
+                        for(int i = 0; i < ENCODING_BLOCK; i++) {
+                            while(accBits < unpackBits) {
+                                acc = (acc << 8) | *p++;
+                                accBits += 8;
+                            }
+
+                            accBits -= unpackBits;
+
+                            const uint32_t difference = unpackBits > 0 ? (acc >> accBits) & ((1U << unpackBits) - 1) : 0;
+
+                            row[x + 2*i + parity] = static_cast<uint16_t>(reference + difference);
+                        }
+                    }
+                }
+
+                std::memcpy(output + static_cast<size_t>(y) * width, row.data(), width * sizeof(uint16_t));
+            }
+
+            return static_cast<size_t>(width) * height;
+        }
+    }
+}
@@ -183,6 +183,14 @@ namespace motioncam {
             }
         }
         
+        if(metadata["noiseProfile"].is_array()) {
+            auto arr = metadata["noiseProfile"].array_items();
+            
+            this->metadata.noiseProfile.resize(arr.size());
+            for(size_t i = 0; i < arr.size(); i++)
+                this->metadata.noiseProfile[i] = arr[i].number_value();
+        }
+        
         // Store shading map
         this->metadata.updateShadingMap(GetLensShadingMap(metadata));
     }
@@ -246,6 +254,10 @@ namespace motioncam {
             metadata["dynamicBlackLevel"] = this->metadata.dynamicBlackLevel;
         }
         
+        if(!this->metadata.noiseProfile.empty()) {
+            metadata["noiseProfile"] = this->metadata.noiseProfile;
+        }
+        
         if(!this->metadata.shadingMap().empty()) {
             const auto& shadingMap = this->metadata.shadingMap();
             
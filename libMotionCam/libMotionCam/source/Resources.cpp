@@ -0,0 +1,65 @@
+#include "motioncam/Resources.h"
+#include "motioncam/BlueNoiseLUT.h"
+#include "motioncam/Exceptions.h"
+
+#include <algorithm>
+
+namespace motioncam {
+    namespace resources {
+        const int EMPTY_SHADING_MAP_WIDTH   = 18;
+        const int EMPTY_SHADING_MAP_HEIGHT  = 24;
+        const int EMPTY_HDR_SIZE            = 32;
+
+        // Function local statics are initialised once even when called from several threads
+
+        Halide::Runtime::Buffer<uint8_t> blueNoise() {
+            static const Halide::Runtime::Buffer<uint8_t> buffer = []() {
+                cv::Mat noise = cv::imdecode(BLUE_NOISE_PNG, cv::IMREAD_UNCHANGED);
+                if(noise.empty() || noise.channels() != 4 || !noise.isContinuous())
+                    throw InvalidState("Failed to decode blue noise texture");
+
+                auto result = Halide::Runtime::Buffer<uint8_t>::make_interleaved(noise.cols, noise.rows, 4);
+                std::copy(noise.data, noise.data + noise.total() * noise.elemSize(), result.data());
+
+                return result;
+            }();
+
+            return buffer;
+        }
+
+        const std::vector<cv::Mat>& emptyShadingMap() {
+            static const std::vector<cv::Mat> shadingMap = []() {
+                std::vector<cv::Mat> result;
+
+                for(int i = 0; i < 4; i++)
+                    result.emplace_back(EMPTY_SHADING_MAP_HEIGHT, EMPTY_SHADING_MAP_WIDTH, CV_32F, cv::Scalar(1.0f));
+
+                return result;
+            }();
+
+            return shadingMap;
+        }
+
+        Halide::Runtime::Buffer<uint16_t> emptyHdrInput() {
+            static const Halide::Runtime::Buffer<uint16_t> buffer = []() {
+                Halide::Runtime::Buffer<uint16_t> result(EMPTY_HDR_SIZE, EMPTY_HDR_SIZE, 3);
+                result.fill(0);
+
+                return result;
+            }();
+
+            return buffer;
+        }
+
+        Halide::Runtime::Buffer<uint8_t> emptyHdrMask() {
+            static const Halide::Runtime::Buffer<uint8_t> buffer = []() {
+                Halide::Runtime::Buffer<uint8_t> result(EMPTY_HDR_SIZE, EMPTY_HDR_SIZE);
+                result.fill(0);
+
+                return result;
+            }();
+
+            return buffer;
+        }
+    }
+}
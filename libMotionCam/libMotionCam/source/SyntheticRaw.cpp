@@ -0,0 +1,353 @@
+#include "motioncam/SyntheticRaw.h"
+#include "motioncam/RawImageBuffer.h"
+#include "motioncam/RawCameraMetadata.h"
+#include "motioncam/RawContainer.h"
+#include "motioncam/Settings.h"
+#include "motioncam/ThreadPool.h"
+#include "motioncam/Exceptions.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace motioncam {
+
+    namespace {
+        const int ROWS_PER_TASK = 64;
+        const int SCENE_CELL_SIZE = 128;
+        const float PI = 3.14159265358979f;
+
+        // Bayer position (0 = top left, 1 = top right, 2 = bottom left, 3 = bottom right) to colour (0 = R, 1 = G, 2 = B)
+        int colorAt(ColorFilterArrangment arrangment, int position) {
+            static const int COLORS[4][4] = {
+                { 0, 1, 1, 2 },     // RGGB
+                { 1, 0, 2, 1 },     // GRBG
+                { 1, 2, 0, 1 },     // GBRG
+                { 2, 1, 1, 0 }      // BGGR
+            };
+
+            return COLORS[static_cast<int>(arrangment)][position];
+        }
+
+        uint32_t hash(uint32_t x, uint32_t y, uint32_t c) {
+            uint32_t h = x * 0x8da6b343u ^ y * 0xd8163841u ^ c * 0xcb1ab31fu;
+
+            h ^= h >> 13;
+            h *= 0x5bd1e995u;
+            h ^= h >> 15;
+
+            return h;
+        }
+
+        //
+        // Linear radiance of the test scene in [0, 1]. Flat coloured cells give edges and uniform areas for the noise
+        // estimate, a fine texture gives the alignment something to lock on to and a zone plate in the centre covers
+        // all frequencies.
+        //
+
+        float scene(float x, float y, int color, float centreX, float centreY, float zoneRadius) {
+            const int cellX = static_cast<int>(std::floor(x / SCENE_CELL_SIZE));
+            const int cellY = static_cast<int>(std::floor(y / SCENE_CELL_SIZE));
+
+            const float cell = 0.05f + 0.75f * (hash(cellX, cellY, color) & 0xFFFF) / 65535.0f;
+            const float texture = 0.08f * std::sin(x * 0.7f) * std::sin(y * 0.5f);
+
+            const float dx = x - centreX;
+            const float dy = y - centreY;
+            const float r2 = dx*dx + dy*dy;
+
+            if(r2 < zoneRadius*zoneRadius)
+                return 0.5f + 0.4f * std::cos(PI * r2 / (2.0f * zoneRadius));
+
+            return (std::max)(0.0f, (std::min)(1.0f, cell + cell*texture));
+        }
+
+        int bitsPerPixel(PixelFormat format) {
+            switch(format) {
+                case PixelFormat::RAW10:
+                    return 10;
+
+                case PixelFormat::RAW12:
+                    return 12;
+
+                default:
+                    return 16;
+            }
+        }
+    }
+
+    SyntheticRawSettings::SyntheticRawSettings() :
+        width(4000),
+        height(3000),
+        sensorArrangment(ColorFilterArrangment::RGGB),
+        pixelFormat(PixelFormat::RAW10),
+        blackLevel({ 64, 64, 64, 64 }),
+        whiteLevel(1023),
+        noiseProfile({ 4e-4, 4e-6 }),
+        motionX(3.0f),
+        motionY(2.0f),
+        rotation(0.05f),
+        vignetting(2.0f),
+        shadingMapWidth(17),
+        shadingMapHeight(13),
+        numFrames(8),
+        frameIntervalNs(33333333),
+        exposureTime(10000000),
+        iso(400),
+        seed(0x5eed)
+    {
+    }
+
+    SyntheticRaw::SyntheticRaw(const SyntheticRawSettings& settings) : mSettings(settings) {
+        const int pixelsPerGroup = settings.pixelFormat == PixelFormat::RAW10 ? 4 : 2;
+
+        if(settings.width <= 0 || settings.height <= 0 || settings.width % pixelsPerGroup != 0 || settings.height % 2 != 0)
+            throw InvalidState("Invalid synthetic frame size " + std::to_string(settings.width) + "x" + std::to_string(settings.height));
+
+        if(static_cast<int>(settings.sensorArrangment) > static_cast<int>(ColorFilterArrangment::BGGR))
+            throw InvalidState("Synthetic frames only support bayer sensors");
+
+        if(settings.pixelFormat == PixelFormat::YUV_420_888 || settings.pixelFormat == PixelFormat::INVALID)
+            throw InvalidState("Synthetic frames only support RAW10, RAW12 and RAW16");
+
+        if(settings.whiteLevel > (1 << bitsPerPixel(settings.pixelFormat)) - 1)
+            throw InvalidState("White level does not fit the pixel format");
+
+        if(settings.blackLevel.size() != 4)
+            throw InvalidState("Expected a black level for each of the four bayer channels");
+
+        if(settings.noiseProfile.size() != 2 && settings.noiseProfile.size() != 8)
+            throw InvalidState("Expected one or four noise profile pairs");
+
+        if(settings.numFrames <= 0)
+            throw InvalidState("Expected at least one frame");
+    }
+
+    RawCameraMetadata SyntheticRaw::cameraMetadata() const {
+        RawCameraMetadata metadata;
+
+        metadata.sensorArrangment = mSettings.sensorArrangment;
+        metadata.updateBayerOffsets(mSettings.blackLevel, mSettings.whiteLevel);
+
+        // The scene is rendered directly in linear sRGB, so the camera behaves like an sRGB sensor
+        const float xyzToSrgb[9] = {
+             3.2404542f, -1.5371385f, -0.4985314f,
+            -0.9692660f,  1.8760108f,  0.0415560f,
+             0.0556434f, -0.2040259f,  1.0572252f
+        };
+
+        const float srgbToXyzD50[9] = {
+            0.4360747f, 0.3850649f, 0.1430804f,
+            0.2225045f, 0.7168786f, 0.0606169f,
+            0.0139322f, 0.0971045f, 0.7141733f
+        };
+
+        metadata.colorMatrix1 = cv::Mat(3, 3, CV_32F, const_cast<float*>(xyzToSrgb)).clone();
+        metadata.colorMatrix2 = metadata.colorMatrix1.clone();
+
+        metadata.forwardMatrix1 = cv::Mat(3, 3, CV_32F, const_cast<float*>(srgbToXyzD50)).clone();
+        metadata.forwardMatrix2 = metadata.forwardMatrix1.clone();
+
+        metadata.calibrationMatrix1 = cv::Mat::eye(3, 3, CV_32F);
+        metadata.calibrationMatrix2 = cv::Mat::eye(3, 3, CV_32F);
+
+        metadata.colorIlluminant1 = color::D65;
+        metadata.colorIlluminant2 = color::D65;
+
+        metadata.apertures = { 1.8f };
+        metadata.focalLengths = { 4.7f };
+
+        return metadata;
+    }
+
+    std::shared_ptr<RawImageBuffer> SyntheticRaw::createFrame(int i) const {
+        const int width = mSettings.width;
+        const int height = mSettings.height;
+
+        const float centreX = width / 2.0f;
+        const float centreY = height / 2.0f;
+        const float halfDiagonal = std::sqrt(centreX*centreX + centreY*centreY);
+        const float zoneRadius = (std::min)(width, height) / 8.0f;
+
+        // The camera moves, so the scene is sampled at the inverse transform
+        const float angle = -i * mSettings.rotation * PI / 180.0f;
+        const float cosAngle = std::cos(angle);
+        const float sinAngle = std::sin(angle);
+        const float shiftX = i * mSettings.motionX;
+        const float shiftY = i * mSettings.motionY;
+
+        std::vector<int> colors(4);
+        std::vector<float> range(4);
+        std::vector<double> S(4), O(4);
+
+        for(int c = 0; c < 4; c++) {
+            const int p = mSettings.noiseProfile.size() == 2 ? 0 : c*2;
+
+            colors[c] = colorAt(mSettings.sensorArrangment, c);
+            range[c] = mSettings.whiteLevel - mSettings.blackLevel[c];
+            S[c] = mSettings.noiseProfile[p];
+            O[c] = mSettings.noiseProfile[p + 1];
+        }
+
+        std::vector<uint16_t> bayer(static_cast<size_t>(width) * height);
+        const int numTasks = (height + ROWS_PER_TASK - 1) / ROWS_PER_TASK;
+
+        ThreadPool::run(0, numTasks, [&](int task) {
+            const int yStart = task * ROWS_PER_TASK;
+            const int yEnd = (std::min)(height, yStart + ROWS_PER_TASK);
+
+            // Seeded per row so the frame does not depend on how the rows are split between threads
+            for(int y = yStart; y < yEnd; y++) {
+                std::seed_seq seq{ mSettings.seed, static_cast<uint32_t>(i), static_cast<uint32_t>(y) };
+                std::mt19937 rng(seq);
+                std::normal_distribution<float> gaussian(0.0f, 1.0f);
+
+                uint16_t* row = bayer.data() + static_cast<size_t>(y) * width;
+
+                for(int x = 0; x < width; x++) {
+                    const int c = (y & 1) * 2 + (x & 1);
+
+                    const float dx = x - centreX;
+                    const float dy = y - centreY;
+
+                    const float sx = cosAngle*dx - sinAngle*dy + centreX + shiftX;
+                    const float sy = sinAngle*dx + cosAngle*dy + centreY + shiftY;
+
+                    const float r = std::sqrt(dx*dx + dy*dy) / halfDiagonal;
+                    const float shading = 1.0f / (1.0f + mSettings.vignetting * r * r);
+
+                    const float signal = scene(sx, sy, colors[c], centreX, centreY, zoneRadius) * shading;
+                    const float sigma = static_cast<float>(std::sqrt((std::max)(0.0, S[c]*signal + O[c])));
+
+                    const float value = mSettings.blackLevel[c] + (signal + sigma*gaussian(rng)) * range[c];
+
+                    row[x] = static_cast<uint16_t>((std::max)(0.0f, (std::min)(mSettings.whiteLevel, std::round(value))));
+                }
+            }
+        });
+
+        const int rowStride = width * bitsPerPixel(mSettings.pixelFormat) / 8;
+
+        std::unique_ptr<NativeBuffer> data(new NativeHostBuffer(static_cast<size_t>(rowStride) * height));
+        pack(bayer, data->lock(true), rowStride);
+        data->unlock();
+
+        auto frame = std::make_shared<RawImageBuffer>(std::move(data));
+
+        frame->pixelFormat = mSettings.pixelFormat;
+        frame->width = width;
+        frame->height = height;
+        frame->originalWidth = width;
+        frame->originalHeight = height;
+        frame->rowStride = rowStride;
+
+        frame->metadata.timestampNs = (i + 1) * mSettings.frameIntervalNs;
+        frame->metadata.exposureTime = mSettings.exposureTime;
+        frame->metadata.iso = mSettings.iso;
+        frame->metadata.asShot = cv::Vec3f(1.0f, 1.0f, 1.0f);
+        frame->metadata.screenOrientation = ScreenOrientation::LANDSCAPE;
+        frame->metadata.rawType = RawType::ZSL;
+        frame->metadata.noiseProfile = mSettings.noiseProfile;
+
+        // Gain that undoes the shading, the same for all four channels
+        const int mapWidth = mSettings.shadingMapWidth;
+        const int mapHeight = mSettings.shadingMapHeight;
+
+        if(mapWidth > 1 && mapHeight > 1) {
+            cv::Mat shadingMap(mapHeight, mapWidth, CV_32F);
+
+            for(int y = 0; y < mapHeight; y++) {
+                for(int x = 0; x < mapWidth; x++) {
+                    const float dx = x / (mapWidth - 1.0f) * width - centreX;
+                    const float dy = y / (mapHeight - 1.0f) * height - centreY;
+                    const float r = std::sqrt(dx*dx + dy*dy) / halfDiagonal;
+
+                    shadingMap.at<float>(y, x) = 1.0f + mSettings.vignetting * r * r;
+                }
+            }
+
+            frame->metadata.updateShadingMap({ shadingMap, shadingMap.clone(), shadingMap.clone(), shadingMap.clone() });
+        }
+
+        return frame;
+    }
+
+    void SyntheticRaw::pack(const std::vector<uint16_t>& bayer, uint8_t* output, int rowStride) const {
+        const int width = mSettings.width;
+        const int height = mSettings.height;
+
+        for(int y = 0; y < height; y++) {
+            const uint16_t* in = bayer.data() + static_cast<size_t>(y) * width;
+            uint8_t* out = output + static_cast<size_t>(y) * rowStride;
+
+            if(mSettings.pixelFormat == PixelFormat::RAW10) {
+                // 4 pixels in 5 bytes, the last byte holds the two low bits of each pixel
+                for(int x = 0; x < width; x += 4, out += 5) {
+                    out[0] = in[x]     >> 2;
+                    out[1] = in[x + 1] >> 2;
+                    out[2] = in[x + 2] >> 2;
+                    out[3] = in[x + 3] >> 2;
+                    out[4] = (in[x] & 0x03) | ((in[x + 1] & 0x03) << 2) | ((in[x + 2] & 0x03) << 4) | ((in[x + 3] & 0x03) << 6);
+                }
+            }
+            else if(mSettings.pixelFormat == PixelFormat::RAW12) {
+                // 2 pixels in 3 bytes, the last byte holds the four low bits of each pixel
+                for(int x = 0; x < width; x += 2, out += 3) {
+                    out[0] = in[x]     >> 4;
+                    out[1] = in[x + 1] >> 4;
+                    out[2] = (in[x] & 0x0F) | ((in[x + 1] & 0x0F) << 4);
+                }
+            }
+            else {
+                for(int x = 0; x < width; x++, out += 2) {
+                    out[0] = in[x] & 0xFF;
+                    out[1] = in[x] >> 8;
+                }
+            }
+        }
+    }
+
+    void SyntheticRaw::writeContainer(const std::string& outputPath) const {
+        const int referenceFrame = mSettings.numFrames / 2;
+
+        json11::Json::object postProcessSettings;
+        PostProcessSettings().toJson(postProcessSettings);
+
+        json11::Json::object extraData = {
+            { "referenceTimestamp", std::to_string((referenceFrame + 1) * mSettings.frameIntervalNs) },
+            { "isHdr",  false },
+            { "postProcessSettings", postProcessSettings }
+        };
+
+        auto container = RawContainer::Create(cameraMetadata(), 1, extraData);
+
+        for(int i = 0; i < mSettings.numFrames; i++)
+            container->add(*createFrame(i), false);
+
+        container->commit(outputPath);
+    }
+
+    ColorFilterArrangment SyntheticRaw::parseSensorArrangment(const std::string& value) {
+        if(value == "rggb")
+            return ColorFilterArrangment::RGGB;
+        else if(value == "grbg")
+            return ColorFilterArrangment::GRBG;
+        else if(value == "gbrg")
+            return ColorFilterArrangment::GBRG;
+        else if(value == "bggr")
+            return ColorFilterArrangment::BGGR;
+
+        throw InvalidState("Invalid sensor arrangement " + value);
+    }
+
+    PixelFormat SyntheticRaw::parsePixelFormat(const std::string& value) {
+        if(value == "raw10")
+            return PixelFormat::RAW10;
+        else if(value == "raw12")
+            return PixelFormat::RAW12;
+        else if(value == "raw16")
+            return PixelFormat::RAW16;
+
+        throw InvalidState("Invalid pixel format " + value);
+    }
+}
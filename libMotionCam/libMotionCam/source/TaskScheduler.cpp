@@ -0,0 +1,291 @@
+#include "motioncam/TaskScheduler.h"
+#include "motioncam/ThreadPool.h"
+#include "motioncam/Exceptions.h"
+#include "motioncam/Logger.h"
+#include "motioncam/Measure.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace motioncam {
+    // How long the calling thread leaves a ready task for the pool before running it itself
+    const std::chrono::milliseconds CALLING_THREAD_GRACE(5);
+
+    TaskScheduler::Graph::Graph(int maxTasks, size_t memoryLimit) :
+        maxTasks(maxTasks),
+        memoryLimit(memoryLimit),
+        memoryInUse(0),
+        numQueued(0),
+        numRunning(0),
+        running(false),
+        maxConcurrency(0)
+    {
+    }
+
+    TaskScheduler::TaskScheduler(int numThreads, size_t memoryLimitBytes) :
+        mGraph(std::make_shared<Graph>((std::max)(1, numThreads), memoryLimitBytes))
+    {
+    }
+
+    TaskScheduler::TaskId TaskScheduler::add(const std::string& name,
+                                             size_t memoryEstimateBytes,
+                                             std::function<void()> task,
+                                             const std::vector<TaskId>& dependencies)
+    {
+        std::lock_guard<std::mutex> lock(mGraph->mutex);
+
+        if(mGraph->running)
+            throw InvalidState("Can't add tasks while running");
+
+        const TaskId id = static_cast<TaskId>(mGraph->tasks.size());
+
+        // Only allow dependencies on existing tasks so the graph can't contain cycles
+        for(auto dependency : dependencies) {
+            if(dependency < 0 || dependency >= id)
+                throw InvalidState("Invalid dependency for task " + name);
+        }
+
+        mGraph->tasks.push_back({ name, memoryEstimateBytes, std::move(task), dependencies, State::PENDING });
+
+        return id;
+    }
+
+    void TaskScheduler::run() {
+        auto graph = mGraph;
+
+        {
+            std::lock_guard<std::mutex> lock(graph->mutex);
+
+            if(graph->running)
+                throw InvalidState("Scheduler already running");
+
+            graph->running = true;
+            graph->callingThread = std::this_thread::get_id();
+            graph->maxConcurrency = ThreadPool::ScopedConcurrencyLimit::current();
+            graph->error = nullptr;
+        }
+
+        submitReadyTasks(graph);
+
+        // Service callbacks from the tasks until they have all completed
+        {
+            std::unique_lock<std::mutex> lock(graph->mutex);
+            bool idle = false;
+
+            while(true) {
+                while(!graph->callbacks.empty()) {
+                    auto callback = std::move(graph->callbacks.front());
+                    graph->callbacks.pop();
+
+                    lock.unlock();
+                    callback();
+                    lock.lock();
+
+                    graph->condition.notify_all();
+                    idle = false;
+                }
+
+                if(finished(*graph))
+                    break;
+
+                // The pool hasn't picked up any task, it may be busy with other work
+                if(idle && graph->numRunning == 0) {
+                    const int next = nextQueuedTask(*graph);
+
+                    if(next >= 0) {
+                        runTask(graph, next, lock);
+
+                        lock.unlock();
+                        submitReadyTasks(graph);
+                        lock.lock();
+
+                        idle = false;
+
+                        continue;
+                    }
+                }
+
+                idle = graph->condition.wait_for(lock, CALLING_THREAD_GRACE) == std::cv_status::timeout;
+            }
+
+            graph->running = false;
+        }
+
+        if(graph->error)
+            std::rethrow_exception(graph->error);
+    }
+
+    void TaskScheduler::runOnCallingThread(const std::function<void()>& f) {
+        auto& graph = *mGraph;
+        std::unique_lock<std::mutex> lock(graph.mutex);
+
+        if(!graph.running || std::this_thread::get_id() == graph.callingThread) {
+            lock.unlock();
+            f();
+            return;
+        }
+
+        bool done = false;
+        std::exception_ptr error;
+
+        graph.callbacks.push([&]() {
+            try {
+                f();
+            }
+            catch(...) {
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> guard(graph.mutex);
+            done = true;
+        });
+
+        graph.condition.notify_all();
+        graph.condition.wait(lock, [&]() { return done; });
+
+        lock.unlock();
+
+        if(error)
+            std::rethrow_exception(error);
+    }
+
+    void TaskScheduler::submitReadyTasks(const std::shared_ptr<Graph>& graph) {
+        std::vector<int> ready;
+
+        {
+            std::lock_guard<std::mutex> lock(graph->mutex);
+
+            while(graph->numQueued + graph->numRunning < graph->maxTasks) {
+                const int next = nextReadyTask(*graph);
+                if(next < 0)
+                    break;
+
+                // Reserve the memory now so the tasks submitted after it are admitted against it
+                graph->tasks[next].state = State::QUEUED;
+                graph->memoryInUse += graph->tasks[next].memoryEstimate;
+                graph->numQueued++;
+
+                ready.push_back(next);
+            }
+        }
+
+        // Tasks that find they were taken by the calling thread return straight away, so it's fine if they run late
+        auto& pool = ThreadPool::get();
+
+        for(auto index : ready)
+            pool.submit([graph, index]() { runQueuedTask(graph, index); });
+    }
+
+    void TaskScheduler::runQueuedTask(const std::shared_ptr<Graph>& graph, int index) {
+        {
+            std::unique_lock<std::mutex> lock(graph->mutex);
+
+            if(graph->tasks[index].state != State::QUEUED)
+                return;
+
+            runTask(graph, index, lock);
+        }
+
+        submitReadyTasks(graph);
+    }
+
+    void TaskScheduler::runTask(const std::shared_ptr<Graph>& graph, int index, std::unique_lock<std::mutex>& lock) {
+        auto& task = graph->tasks[index];
+
+        task.state = State::RUNNING;
+        graph->numQueued--;
+        graph->numRunning++;
+
+        logger::debug("Starting task " + task.name + " (memory in use " + std::to_string(graph->memoryInUse / (1024*1024)) + " MB)");
+        trace::counter("scheduler memory in use", static_cast<int64_t>(graph->memoryInUse));
+
+        const int maxConcurrency = graph->maxConcurrency;
+
+        lock.unlock();
+
+        std::exception_ptr error;
+
+        try {
+            ThreadPool::ScopedConcurrencyLimit limit(maxConcurrency);
+            ScopedTrace trace(task.name);
+
+            task.task();
+        }
+        catch(...) {
+            error = std::current_exception();
+        }
+
+        lock.lock();
+
+        task.state = State::DONE;
+        graph->memoryInUse -= task.memoryEstimate;
+        graph->numRunning--;
+
+        if(error && !graph->error) {
+            logger::error("Task " + task.name + " failed");
+            graph->error = error;
+
+            // Tasks that have not started yet are skipped
+            for(auto& t : graph->tasks) {
+                if(t.state != State::QUEUED)
+                    continue;
+
+                t.state = State::PENDING;
+                graph->memoryInUse -= t.memoryEstimate;
+                graph->numQueued--;
+            }
+        }
+
+        graph->condition.notify_all();
+    }
+
+    int TaskScheduler::nextReadyTask(const Graph& graph) {
+        // Don't start anything new once a task has failed
+        if(graph.error)
+            return -1;
+
+        for(size_t i = 0; i < graph.tasks.size(); i++) {
+            const auto& task = graph.tasks[i];
+            if(task.state != State::PENDING)
+                continue;
+
+            bool ready = true;
+
+            for(auto dependency : task.dependencies) {
+                if(graph.tasks[dependency].state != State::DONE) {
+                    ready = false;
+                    break;
+                }
+            }
+
+            if(!ready)
+                continue;
+
+            if(graph.numQueued + graph.numRunning == 0 || graph.memoryInUse + task.memoryEstimate <= graph.memoryLimit)
+                return static_cast<int>(i);
+        }
+
+        return -1;
+    }
+
+    int TaskScheduler::nextQueuedTask(const Graph& graph) {
+        for(size_t i = 0; i < graph.tasks.size(); i++) {
+            if(graph.tasks[i].state == State::QUEUED)
+                return static_cast<int>(i);
+        }
+
+        return -1;
+    }
+
+    bool TaskScheduler::finished(const Graph& graph) {
+        if(graph.error)
+            return graph.numRunning == 0;
+
+        for(const auto& task : graph.tasks) {
+            if(task.state != State::DONE)
+                return false;
+        }
+
+        return true;
+    }
+}
@@ -0,0 +1,287 @@
+#include "motioncam/ThreadPool.h"
+#include "motioncam/Exceptions.h"
+#include "motioncam/Logger.h"
+
+#include <HalideRuntime.h>
+
+#include <algorithm>
+#include <exception>
+
+namespace motioncam {
+
+    namespace {
+        // Worker index of the current thread within its pool
+        thread_local const ThreadPool* tPool = nullptr;
+        thread_local int tWorker = -1;
+
+        // Concurrency limit for loops started on the current thread
+        thread_local int tMaxConcurrency = 0;
+
+        std::mutex gSharedPoolMutex;
+        std::unique_ptr<ThreadPool> gSharedPool;
+        bool gHalideInstalled = false;
+        halide_do_par_for_t gPrevDoParFor = nullptr;
+        halide_do_task_t gPrevDoTask = nullptr;
+
+        int halideDoTask(void* userContext, halide_task_t f, int idx, uint8_t* closure) {
+            return f(userContext, idx, closure);
+        }
+
+        int halideDoParFor(void* userContext, halide_task_t f, int min, int size, uint8_t* closure) {
+            std::atomic<int> result(0);
+
+            gSharedPool->parallelFor(min, min + size, [&](int idx) {
+                // Skip the remaining iterations once one has failed
+                if(result != 0)
+                    return;
+
+                int error = halide_do_task(userContext, f, idx, closure);
+                if(error != 0) {
+                    int expected = 0;
+                    result.compare_exchange_strong(expected, error);
+                }
+            });
+
+            return result;
+        }
+    }
+
+    struct ThreadPool::Loop {
+        const std::function<void(int)>* f;
+        int end;
+        int maxConcurrency;
+
+        std::atomic<int> next;
+        std::atomic<int> remaining;
+
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::exception_ptr error;
+        bool done;
+    };
+
+    ThreadPool::ThreadPool(int numThreads) : mPending(0), mNextWorker(0), mStopping(false) {
+        numThreads = (std::max)(1, numThreads);
+
+        for(int i = 0; i < numThreads; i++)
+            mWorkers.push_back(std::unique_ptr<Worker>(new Worker()));
+
+        for(int i = 0; i < numThreads; i++)
+            mThreads.push_back(std::unique_ptr<std::thread>(new std::thread(&ThreadPool::workerLoop, this, i)));
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mSleepMutex);
+            mStopping = true;
+        }
+
+        mSleepCondition.notify_all();
+
+        for(auto& thread : mThreads)
+            thread->join();
+    }
+
+    int ThreadPool::numThreads() const {
+        return static_cast<int>(mWorkers.size());
+    }
+
+    void ThreadPool::parallelFor(int begin, int end, const std::function<void(int)>& f, int maxConcurrency) {
+        const int count = end - begin;
+        if(count <= 0)
+            return;
+
+        if(maxConcurrency <= 0)
+            maxConcurrency = tMaxConcurrency > 0 ? tMaxConcurrency : numThreads() + 1;
+
+        auto loop = std::make_shared<Loop>();
+
+        loop->f = &f;
+        loop->end = end;
+        loop->maxConcurrency = maxConcurrency;
+        loop->next = begin;
+        loop->remaining = count;
+        loop->done = false;
+
+        // Helpers that find the loop already finished return straight away, so it's fine if they run late
+        const int numHelpers = (std::min)({ maxConcurrency - 1, count - 1, numThreads() });
+
+        for(int i = 0; i < numHelpers; i++)
+            push([loop]() { runLoop(loop); });
+
+        runLoop(loop);
+
+        // Only wait for iterations already running on other threads
+        {
+            std::unique_lock<std::mutex> lock(loop->mutex);
+            loop->condition.wait(lock, [&]() { return loop->done; });
+        }
+
+        if(loop->error)
+            std::rethrow_exception(loop->error);
+    }
+
+    void ThreadPool::runLoop(const std::shared_ptr<Loop>& loop) {
+        const int prevMaxConcurrency = tMaxConcurrency;
+        tMaxConcurrency = loop->maxConcurrency;
+
+        while(true) {
+            const int idx = loop->next.fetch_add(1);
+            if(idx >= loop->end)
+                break;
+
+            try {
+                (*loop->f)(idx);
+            }
+            catch(...) {
+                std::lock_guard<std::mutex> lock(loop->mutex);
+                if(!loop->error)
+                    loop->error = std::current_exception();
+            }
+
+            if(loop->remaining.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(loop->mutex);
+
+                loop->done = true;
+                loop->condition.notify_all();
+            }
+        }
+
+        tMaxConcurrency = prevMaxConcurrency;
+    }
+
+    void ThreadPool::submit(std::function<void()> task) {
+        push(std::move(task));
+    }
+
+    void ThreadPool::push(std::function<void()> task) {
+        // Workers queue on their own deque, other threads spread work across the workers
+        const int worker = tPool == this ? tWorker : static_cast<int>(mNextWorker++ % mWorkers.size());
+
+        {
+            std::lock_guard<std::mutex> lock(mWorkers[worker]->mutex);
+            mWorkers[worker]->tasks.push_back(std::move(task));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mSleepMutex);
+            mPending++;
+        }
+
+        mSleepCondition.notify_one();
+    }
+
+    bool ThreadPool::pop(int worker, std::function<void()>& outTask) {
+        const int numWorkers = static_cast<int>(mWorkers.size());
+
+        // Newest task from our own queue first, then steal the oldest from the others
+        for(int i = 0; i < numWorkers; i++) {
+            auto& w = *mWorkers[(worker + i) % numWorkers];
+            std::lock_guard<std::mutex> lock(w.mutex);
+
+            if(w.tasks.empty())
+                continue;
+
+            if(i == 0) {
+                outTask = std::move(w.tasks.back());
+                w.tasks.pop_back();
+            }
+            else {
+                outTask = std::move(w.tasks.front());
+                w.tasks.pop_front();
+            }
+
+            mPending--;
+            return true;
+        }
+
+        return false;
+    }
+
+    void ThreadPool::workerLoop(int worker) {
+        tPool = this;
+        tWorker = worker;
+
+        std::function<void()> task;
+
+        while(true) {
+            if(pop(worker, task)) {
+                task();
+                task = nullptr;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mSleepMutex);
+            mSleepCondition.wait(lock, [&]() { return mPending > 0 || mStopping; });
+
+            if(mStopping)
+                break;
+        }
+    }
+
+    ThreadPool::ScopedConcurrencyLimit::ScopedConcurrencyLimit(int maxConcurrency) : mPrevious(tMaxConcurrency) {
+        tMaxConcurrency = maxConcurrency;
+    }
+
+    ThreadPool::ScopedConcurrencyLimit::~ScopedConcurrencyLimit() {
+        tMaxConcurrency = mPrevious;
+    }
+
+    int ThreadPool::ScopedConcurrencyLimit::current() {
+        return tMaxConcurrency;
+    }
+
+    namespace {
+        int defaultNumThreads() {
+            // The calling thread takes part in loops too
+            return static_cast<int>(std::thread::hardware_concurrency()) - 1;
+        }
+    }
+
+    void ThreadPool::installHalide(int numThreads) {
+        std::lock_guard<std::mutex> lock(gSharedPoolMutex);
+
+        if(gHalideInstalled)
+            throw InvalidState("Halide thread pool already installed");
+
+        if(!gSharedPool)
+            gSharedPool = std::unique_ptr<ThreadPool>(new ThreadPool(numThreads > 0 ? numThreads : defaultNumThreads()));
+        else if(numThreads > 0 && numThreads != gSharedPool->numThreads())
+            throw InvalidState("Shared thread pool already created with " + std::to_string(gSharedPool->numThreads()) + " threads");
+
+        gPrevDoTask = halide_set_custom_do_task(&halideDoTask);
+        gPrevDoParFor = halide_set_custom_do_par_for(&halideDoParFor);
+        gHalideInstalled = true;
+
+        logger::log("Installed Halide thread pool with " + std::to_string(gSharedPool->numThreads()) + " threads");
+    }
+
+    void ThreadPool::uninstallHalide() {
+        std::lock_guard<std::mutex> lock(gSharedPoolMutex);
+
+        if(!gHalideInstalled)
+            return;
+
+        halide_set_custom_do_par_for(gPrevDoParFor);
+        halide_set_custom_do_task(gPrevDoTask);
+        gHalideInstalled = false;
+    }
+
+    ThreadPool& ThreadPool::get() {
+        std::lock_guard<std::mutex> lock(gSharedPoolMutex);
+
+        if(!gSharedPool)
+            gSharedPool = std::unique_ptr<ThreadPool>(new ThreadPool(defaultNumThreads()));
+
+        return *gSharedPool;
+    }
+
+    ThreadPool* ThreadPool::shared() {
+        std::lock_guard<std::mutex> lock(gSharedPoolMutex);
+        return gSharedPool.get();
+    }
+
+    void ThreadPool::run(int begin, int end, const std::function<void(int)>& f) {
+        get().parallelFor(begin, end, f);
+    }
+}
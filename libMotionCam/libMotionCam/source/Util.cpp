@@ -482,7 +482,7 @@ namespace motioncam {
                       const bool saveShadingMap,
                       dng_stream& dngStream)
         {
-            //Measure m{"WriteDng"};
+            ScopedTrace trace("WriteDng");
             
             const int width  = rawImage.cols;
             const int height = rawImage.rows;
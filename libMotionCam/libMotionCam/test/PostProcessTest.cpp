@@ -0,0 +1,183 @@
+//
+// Checks that the tiled post process gives the same image as the whole image pipeline on synthetic frames. With
+// --reference the whole image output is also compared with PNGs written earlier with --write-reference, so changes
+// to the generators can be checked against the output from before them.
+//
+// Usage: postprocess-test [--reference directory] [--write-reference directory]
+//
+
+#include "motioncam/ImageProcessor.h"
+#include "motioncam/MotionCam.h"
+#include "motioncam/RawCameraMetadata.h"
+#include "motioncam/RawImageBuffer.h"
+#include "motioncam/SyntheticRaw.h"
+#include "motioncam/ThreadPool.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+using namespace motioncam;
+
+namespace {
+    // The tiled schedule may round a value of the 8 bit output the other way where it fuses differently
+    const double MAX_TILED_DIFF             = 1;
+    const double MAX_TILED_DIFF_FRACTION    = 1e-4;
+
+    struct Size {
+        int width;
+        int height;
+    };
+
+    struct Diff {
+        double maxDiff;
+        double fraction;
+    };
+
+    Diff compare(const cv::Mat& a, const cv::Mat& b) {
+        cv::Mat diff;
+        double maxDiff = 0;
+
+        cv::absdiff(a, b, diff);
+        diff = diff.reshape(1);
+
+        cv::minMaxLoc(diff, nullptr, &maxDiff);
+
+        return { maxDiff, cv::countNonZero(diff) / static_cast<double>(diff.total()) };
+    }
+
+    cv::Mat postProcess(const RawCameraMetadata& cameraMetadata,
+                        const PostProcessSettings& settings,
+                        const std::vector<std::shared_ptr<RawImageBuffer>>& frames,
+                        size_t tiledMinPixels)
+    {
+        const auto& frame = *frames[0];
+
+        std::vector<std::shared_ptr<RawImageBuffer>> buffers(frames.begin() + 1, frames.end());
+        DenoiseContext context;
+
+        auto denoiseOutput = ImageProcessor::denoise(frames[0], buffers, NO_DENOISE_WEIGHTS, cameraMetadata, context);
+
+        const int rawWidth  = frame.width / 2;
+        const int rawHeight = frame.height / 2;
+
+        const int T = static_cast<int>(std::pow(2, EXTEND_EDGE_AMOUNT));
+
+        const int offsetX = static_cast<int>(T * std::ceil(rawWidth / (double) T) - rawWidth);
+        const int offsetY = static_cast<int>(T * std::ceil(rawHeight / (double) T) - rawHeight);
+
+        return ImageProcessor::postProcess(
+            denoiseOutput, nullptr, offsetX, offsetY, 0.01f, frame.metadata, cameraMetadata, settings, tiledMinPixels);
+    }
+
+    bool runTest(const Size& size, const std::string& referenceDir, const std::string& writeReferenceDir) {
+        const std::string name = std::to_string(size.width) + "x" + std::to_string(size.height);
+
+        SyntheticRawSettings rawSettings;
+
+        rawSettings.width = size.width;
+        rawSettings.height = size.height;
+        rawSettings.numFrames = 3;
+
+        SyntheticRaw synthetic(rawSettings);
+
+        auto cameraMetadata = synthetic.cameraMetadata();
+        std::vector<std::shared_ptr<RawImageBuffer>> frames;
+
+        for(int i = 0; i < rawSettings.numFrames; i++)
+            frames.push_back(synthetic.createFrame(i));
+
+        PostProcessSettings settings;
+        ImageProcessor::estimateSettings(*frames[0], cameraMetadata, settings);
+
+        cv::Mat whole = postProcess(cameraMetadata, settings, frames, std::numeric_limits<size_t>::max());
+        cv::Mat tiled = postProcess(cameraMetadata, settings, frames, 0);
+
+        bool passed = true;
+
+        const Diff tiledDiff = compare(tiled, whole);
+
+        if(tiledDiff.maxDiff > MAX_TILED_DIFF || tiledDiff.fraction > MAX_TILED_DIFF_FRACTION) {
+            std::cerr << name << ": tiled output differs from the whole image by up to " << tiledDiff.maxDiff
+                      << " in " << tiledDiff.fraction * 100 << "% of the values" << std::endl;
+            passed = false;
+        }
+
+        if(!writeReferenceDir.empty()) {
+            const std::string path = writeReferenceDir + "/postprocess_" + name + ".png";
+
+            if(!cv::imwrite(path, whole)) {
+                std::cerr << name << ": failed to write " << path << std::endl;
+                passed = false;
+            }
+        }
+
+        if(!referenceDir.empty()) {
+            const std::string path = referenceDir + "/postprocess_" + name + ".png";
+            cv::Mat reference = cv::imread(path, cv::IMREAD_COLOR);
+
+            if(reference.empty() || reference.size() != whole.size()) {
+                std::cerr << name << ": missing or mismatched reference " << path << std::endl;
+                passed = false;
+            }
+            else {
+                // The whole image pipeline must not change at all
+                const Diff referenceDiff = compare(whole, reference);
+
+                if(referenceDiff.maxDiff > 0) {
+                    std::cerr << name << ": output differs from the reference by up to " << referenceDiff.maxDiff
+                              << " in " << referenceDiff.fraction * 100 << "% of the values" << std::endl;
+                    passed = false;
+                }
+            }
+        }
+
+        std::cout << name << (passed ? ": passed" : ": FAILED") << std::endl;
+
+        return passed;
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    std::string referenceDir;
+    std::string writeReferenceDir;
+
+    for(int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+
+        if(i + 1 >= argc) {
+            std::cerr << "Missing value for option " << arg << std::endl;
+            return 1;
+        }
+
+        const std::string value = argv[++i];
+
+        if(arg == "--reference")
+            referenceDir = value;
+        else if(arg == "--write-reference")
+            writeReferenceDir = value;
+        else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    ThreadPool::installHalide();
+
+    // A size that splits into whole strips and one that leaves a partial strip and padded edges
+    const std::vector<Size> sizes = {
+        { 4096, 3072 },
+        { 4032, 2268 }
+    };
+
+    bool passed = true;
+
+    for(const auto& size : sizes)
+        passed = runTest(size, referenceDir, writeReferenceDir) && passed;
+
+    return passed ? 0 : 1;
+}
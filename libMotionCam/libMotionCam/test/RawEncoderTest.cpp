@@ -0,0 +1,185 @@
+//
+// Encodes synthetic RAW10, RAW12 and RAW16 frames and checks that they decode to the same values, or that frames the
+// encoder can't store without loss are rejected and left unchanged.
+//
+// Usage: raw-encoder-test
+//
+
+#include "motioncam/RawEncoder.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace motioncam;
+
+namespace {
+    const int WIDTH     = 4000;
+    const int HEIGHT    = 300;
+
+    struct Frame {
+        encoder::PixelFormat pixelFormat;
+        int width;
+        int height;
+        int rowStride;
+        std::vector<uint16_t> values;
+        std::vector<uint8_t> data;
+    };
+
+    void writePixel(uint8_t* row, encoder::PixelFormat pixelFormat, int x, uint16_t value) {
+        switch(pixelFormat) {
+            case encoder::ANDROID_RAW10: {
+                uint8_t* p = row + (x / 4) * 5;
+                const int i = x % 4;
+
+                p[i] = static_cast<uint8_t>(value >> 2);
+                p[4] = static_cast<uint8_t>((p[4] & ~(0x03 << (2 * i))) | ((value & 0x03) << (2 * i)));
+                break;
+            }
+
+            case encoder::ANDROID_RAW12: {
+                uint8_t* p = row + (x / 2) * 3;
+                const int i = x % 2;
+
+                p[i] = static_cast<uint8_t>(value >> 4);
+                p[2] = static_cast<uint8_t>((p[2] & ~(0x0F << (4 * i))) | ((value & 0x0F) << (4 * i)));
+                break;
+            }
+
+            case encoder::ANDROID_RAW16:
+                row[2*x] = static_cast<uint8_t>(value & 0xFF);
+                row[2*x + 1] = static_cast<uint8_t>(value >> 8);
+                break;
+        }
+    }
+
+    int bytesPerRow(encoder::PixelFormat pixelFormat, int width) {
+        switch(pixelFormat) {
+            case encoder::ANDROID_RAW10:
+                return width * 5 / 4;
+
+            case encoder::ANDROID_RAW12:
+                return width * 3 / 2;
+
+            default:
+            case encoder::ANDROID_RAW16:
+                return width * 2;
+        }
+    }
+
+    Frame createFrame(encoder::PixelFormat pixelFormat, float mean, float sigma, uint16_t whiteLevel, uint32_t seed) {
+        Frame frame;
+
+        frame.pixelFormat = pixelFormat;
+        frame.width = WIDTH;
+        frame.height = HEIGHT;
+
+        // Padded rows like the camera buffers
+        frame.rowStride = bytesPerRow(pixelFormat, WIDTH) + 64;
+        frame.values.resize(static_cast<size_t>(WIDTH) * HEIGHT);
+        frame.data.resize(static_cast<size_t>(frame.rowStride) * HEIGHT);
+
+        std::mt19937 rng(seed);
+        std::normal_distribution<float> dist(mean, sigma);
+
+        for(int y = 0; y < HEIGHT; y++) {
+            for(int x = 0; x < WIDTH; x++) {
+                const float v = (std::min)((std::max)(dist(rng), 0.0f), static_cast<float>(whiteLevel));
+                const uint16_t value = static_cast<uint16_t>(v + 0.5f);
+
+                frame.values[static_cast<size_t>(y) * WIDTH + x] = value;
+                writePixel(frame.data.data() + static_cast<size_t>(y) * frame.rowStride, pixelFormat, x, value);
+            }
+        }
+
+        return frame;
+    }
+
+    bool expectRoundTrip(const std::string& name, const Frame& frame, int xstart, int xend, int ystart, int yend) {
+        std::vector<uint8_t> data(frame.data);
+
+        const size_t len = encoder::encode(
+            data.data(), frame.pixelFormat, xstart, xend, ystart, yend, frame.rowStride);
+
+        if(len == 0) {
+            std::cerr << name << ": frame was rejected" << std::endl;
+            return false;
+        }
+
+        const int width = xend - xstart;
+        const int height = yend - ystart;
+
+        std::vector<uint16_t> output(static_cast<size_t>(width) * height);
+
+        if(encoder::decode(output.data(), width, height, data.data(), len) != output.size()) {
+            std::cerr << name << ": stream is truncated" << std::endl;
+            return false;
+        }
+
+        for(int y = 0; y < height; y++) {
+            for(int x = 0; x < width; x++) {
+                const uint16_t expected = frame.values[static_cast<size_t>(ystart + y) * frame.width + xstart + x];
+                const uint16_t actual = output[static_cast<size_t>(y) * width + x];
+
+                if(expected != actual) {
+                    std::cerr << name << ": (" << x << ", " << y << ") decoded as " << actual
+                              << " instead of " << expected << std::endl;
+                    return false;
+                }
+            }
+        }
+
+        std::cout << name << ": passed, " << len << " of " << data.size() << " bytes" << std::endl;
+
+        return true;
+    }
+
+    bool expectRejected(const std::string& name, const Frame& frame) {
+        std::vector<uint8_t> data(frame.data);
+
+        const size_t len = encoder::encode(
+            data.data(), frame.pixelFormat, 0, frame.width, 0, frame.height, frame.rowStride);
+
+        if(len != 0) {
+            std::cerr << name << ": frame was encoded with loss into " << len << " bytes" << std::endl;
+            return false;
+        }
+
+        if(data != frame.data) {
+            std::cerr << name << ": rejected frame was modified" << std::endl;
+            return false;
+        }
+
+        std::cout << name << ": passed, rejected" << std::endl;
+
+        return true;
+    }
+}
+
+int main() {
+    bool passed = true;
+
+    // Typical noise around mid grey
+    const Frame raw10 = createFrame(encoder::ANDROID_RAW10, 512.0f, 16.0f, 1023, 1);
+    const Frame raw12 = createFrame(encoder::ANDROID_RAW12, 2048.0f, 64.0f, 4095, 2);
+    const Frame raw16 = createFrame(encoder::ANDROID_RAW16, 2048.0f, 64.0f, 4095, 3);
+
+    passed = expectRoundTrip("raw10", raw10, 0, WIDTH, 0, HEIGHT) && passed;
+    passed = expectRoundTrip("raw10 cropped", raw10, 100, WIDTH - 100, 20, HEIGHT - 20) && passed;
+    passed = expectRoundTrip("raw12", raw12, 0, WIDTH, 0, HEIGHT) && passed;
+    passed = expectRoundTrip("raw16", raw16, 0, WIDTH, 0, HEIGHT) && passed;
+
+    // Noise over the whole range needs all ten bits, the stream would be larger than the RAW10 rows
+    passed = expectRejected("raw10 noisy", createFrame(encoder::ANDROID_RAW10, 512.0f, 400.0f, 1023, 4)) && passed;
+
+    // Values above 12 bits can't be stored in the reference
+    passed = expectRejected("raw16 high white level", createFrame(encoder::ANDROID_RAW16, 12000.0f, 16.0f, 16383, 5)) && passed;
+
+    // Differences of more than ten bits within a block
+    passed = expectRejected("raw12 full range", createFrame(encoder::ANDROID_RAW12, 2048.0f, 1200.0f, 4095, 6)) && passed;
+
+    return passed ? 0 : 1;
+}